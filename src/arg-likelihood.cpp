@@ -96,7 +96,7 @@ public:
                     "outfile for likelihoods (bed format; default=likelihood.bed)"));
         config.add(new ConfigParam<string>
                    ("-a", "--arg", "<SMC file>", &arg_file, "",
-                    "initial ARG file (*.smc) for resampling"));
+                    "initial ARG file (*.smc, *.smcb) for resampling"));
         config.add(new ConfigParam<string>
                    ("", "--region", "<start>-<end>",
                     &region, "",
@@ -4,10 +4,12 @@
 #endif
 #include <time.h>
 #include <memory>
+#include <thread>
 #include <sys/stat.h>
 #include <unistd.h>
 
 // arghmm includes
+#include "argweaver/checkpoint.h"
 #include "argweaver/compress.h"
 #include "argweaver/ConfigParam.h"
 #include "argweaver/emit.h"
@@ -41,6 +43,7 @@ const char *SITES_SUFFIX = ".sites";
 const char *STATS_SUFFIX = ".stats";
 const char *LOG_SUFFIX = ".log";
 const char *COAL_RECORDS_SUFFIX = ".cr";
+const char *CHECKPOINT_SUFFIX = ".checkpoint";
 
 // help categories
 const int ADVANCED_OPT = 1;
@@ -56,7 +59,8 @@ class Config
 {
 public:
 
-    Config()
+    Config() :
+        writer(NULL)
     {
         make_parser();
 
@@ -83,9 +87,8 @@ public:
                    ("", "--vcf", "<.vcf.gz file>", &vcf_file,
                     "sequence alignment in gzipped vcf format. Must also supply"
                     " --region in format chr:start-end, and tabix index file"
-                    " (.vcf.gz.tbi) must also be present. tabix program needs to"
-                    " be installed and in PATH or path must be provided with"
-                    " --tabix-dir. Assumes samples are diploid and unphased;"
+                    " (.vcf.gz.tbi or .vcf.gz.csi) must also be present."
+                    " Assumes samples are diploid and unphased;"
                     " each individual will have _1 and _2 appended to its name for its"
                     " two haploid lineages. Indel-type variants are skipped."
                     " Any positions not specified in VCF are assumed to be"
@@ -105,8 +108,8 @@ public:
                     " names not matching the current sequence set will be ignored."));
         config.add(new ConfigParam<string>
                    ("", "--tabix-dir", "<directory>", &tabix_dir,
-                    " path to tabix executable. May be required if using --vcf"
-                    " and tabix is not in PATH"));
+                    " path to tabix executable (no longer used; indexes are"
+                    " read directly)"));
 	config.add(new ConfigParam<string>
 		   ("", "--age-file", "<age file>", &age_file,
 		    " file giving age for any ancient samples (two-columns, "
@@ -137,7 +140,7 @@ public:
                     " ind_1 and ind_2)"));
         config.add(new ConfigParam<string>
                    ("-a", "--arg", "<SMC file>", &arg_file, "",
-                    "initial ARG file (*.smc) for resampling (optional)"));
+                    "initial ARG file (*.smc, *.smcb) for resampling (optional)"));
         /*        config.add(new ConfigParam<string>
                    ("", "--cr", "<CR file>", &cr_file, "",
                    "initial ARGfile (*.cf) for resampling (optional)"));*/
@@ -334,6 +337,13 @@ public:
                     "sample population size using Hamiltonian Monte Carlo every"
                     "<num> threading operations (default=0 means do not sample)",
                     EXPERIMENTAL_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--popsize-prior-check", "<num>", &popsize_prior_check,
+                    100,
+                    "(for use with --sample-popsize) check the cached ARG prior"
+                    " against a full recomputation every <num> population size"
+                    " proposals and abort if they differ (0 means never check)",
+                    EXPERIMENTAL_OPT));
 	config.add(new ConfigParam<int>
 		   ("", "--popsize-em", "<n>", &popsize_em, 0,
 		    "Do EM update of popsizes after every n threading operations",
@@ -380,11 +390,17 @@ public:
                    ("", "--mcmcmc", "<int>", &mcmcmc_numgroup,
                     1, "number of mcmcmc threads",
                     EXPERIMENTAL_OPT));
+#endif
+        config.add(new ConfigParam<int>
+                   ("", "--mcmcmc-threads", "<int>", &mcmcmc_threads,
+                    1, "number of (MC)^3 chains, each sampled by its own"
+                    " thread of this process (heated chains write to"
+                    " <output prefix>.<group>.*)",
+                    EXPERIMENTAL_OPT));
         config.add(new ConfigParam<double>
                    ("", "--mcmcmc-heat", "<val>", &mcmcmc_heat,
                     0.05, "heat interval for each thread in (MC)^3 group",
                     EXPERIMENTAL_OPT));
-#endif
         config.add(new ConfigSwitch
                    ("", "--init-popsize-random", &init_popsize_random,
                     "(for use with --sample-popsize). Initialize each"
@@ -403,6 +419,12 @@ public:
                     "region to resample of input ARG (optional)"));
         config.add(new ConfigSwitch
                    ("", "--resume", &resume, "resume a previous run"));
+        config.add(new ConfigParam<int>
+                   ("", "--checkpoint-step", "<iterations>", &checkpoint_step,
+                    0, "write the complete sampler state to"
+                    " <output prefix>.checkpoint every <iterations>"
+                    " iterations, so that --resume continues the exact"
+                    " chain (default=0, no checkpoints)"));
         config.add(new ConfigSwitch
                    ("", "--overwrite", &overwrite,
                     "force an overwrite of a previous run"));
@@ -469,6 +491,64 @@ public:
                     &resample_window_iters, 10,
                     "number of iterations per sliding window for resampling"
                     " (default=10)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--resample-window-threads", "<threads>",
+                    &resample_window_threads, 1,
+                    "resample non-overlapping windows concurrently on"
+                    " <threads> threads, alternating between even and odd"
+                    " windows.  Results for any <threads> > 1 are the"
+                    " same for a given seed but differ from those with"
+                    " 1 (1=slide one window at a time, default=1)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--chunk-size", "<chunk size>", &chunk_size, 0,
+                    "sample the initial ARG in overlapping chunks of about"
+                    " this many bases and stitch them into one ARG"
+                    " (default=0, no chunks)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--chunk-flank", "<flank size>", &chunk_flank, 50000,
+                    "bases by which chunks extend into their neighbors;"
+                    " chunks are stitched within this overlap"
+                    " (default=50000)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--chunk-iters", "<iterations>", &chunk_iters, 10,
+                    "resampling iterations for each chunk before stitching"
+                    " (default=10)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--chunk-threads", "<threads>", &chunk_threads, 1,
+                    "sample chunks concurrently on <threads> threads"
+                    " (default=1)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--forward-checkpoint", "<interval>",
+                    &model.hmm_options.forward_checkpoint, 0,
+                    "store only every <interval>-th column of the forward"
+                    " table and recompute the rest during traceback, which"
+                    " reduces memory at the cost of extra computation"
+                    " (0=store all columns, -1=sqrt(region length),"
+                    " default=0)", ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--no-forward-runs",
+                    &model.hmm_options.forward_runs,
+                    "compute every column of the forward table instead of"
+                    " jumping over runs of invariant or masked sites",
+                    ADVANCED_OPT, true));
+        config.add(new ConfigParam<int>
+                   ("", "--matrix-cache", "<MB>",
+                    &model.hmm_options.matrix_cache_size, 256,
+                    "memory for reusing transition matrices between the"
+                    " forward and backward passes when threading"
+                    " (0=recompute, default=256)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--matrix-lookahead", "<blocks>",
+                    &model.hmm_options.matrix_lookahead, 0,
+                    "compute the matrices of up to <blocks> blocks ahead of"
+                    " the forward algorithm on background threads"
+                    " (0=no lookahead, default=0)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--matrix-threads", "<threads>",
+                    &model.hmm_options.matrix_threads, 1,
+                    "number of threads used by --matrix-lookahead"
+                    " (default=1)", ADVANCED_OPT));
 
 
         // help information
@@ -532,7 +612,48 @@ public:
             printf(VERSION_INFO);
             return EXIT_ERROR;
         }
+
+        if (mcmcmc_threads < 1) {
+            printError("--mcmcmc-threads must be at least 1");
+            return EXIT_ERROR;
+        }
+        if (mcmcmc_threads > 1 && resample_region_str != "") {
+            printError("--mcmcmc-threads cannot be used with --resample-region");
+            return EXIT_ERROR;
+        }
+        if (chunk_size < 0 || chunk_flank < 0 || chunk_iters < 0 ||
+            chunk_threads < 1) {
+            printError("invalid --chunk-size, --chunk-flank, --chunk-iters"
+                       " or --chunk-threads");
+            return EXIT_ERROR;
+        }
+        if (chunk_size > 0 && chunk_size <= 2 * chunk_flank) {
+            printError("--chunk-size must be more than twice --chunk-flank");
+            return EXIT_ERROR;
+        }
+        if (chunk_size > 0 && pop_tree_file != "") {
+            printError("--chunk-size cannot be used with --pop-tree-file");
+            return EXIT_ERROR;
+        }
+        if (chunk_size > 0 && arg_file != "") {
+            printError("--chunk-size cannot be used with --arg");
+            return EXIT_ERROR;
+        }
+        if (checkpoint_step < 0) {
+            printError("--checkpoint-step must be at least 0");
+            return EXIT_ERROR;
+        }
+        if (checkpoint_step > 0 &&
+            (mcmcmc_threads > 1 || resample_region_str != "")) {
+            printError("--checkpoint-step cannot be used with"
+                       " --mcmcmc-threads or --resample-region");
+            return EXIT_ERROR;
+        }
 #ifdef ARGWEAVER_MPI
+        if (mcmcmc_threads > 1 && mcmcmc_numgroup > 1) {
+            printError("--mcmcmc-threads cannot be used with --mcmcmc");
+            return EXIT_ERROR;
+        }
         mcmcmc_group = 0;
         int groupsize = MPI::COMM_WORLD.Get_size() / mcmcmc_numgroup;
         mcmcmc_group = MPI::COMM_WORLD.Get_rank() / groupsize;
@@ -598,13 +719,15 @@ public:
     int popsize_config;
     string popsize_config_file;
     int sample_popsize_num;
+    int popsize_prior_check;
     bool sample_popsize_const;
     bool invisible_recombs;
     double epsilon;
     double pseudocount;
 
-#ifdef ARGWEAVER_MPI
     double mcmcmc_heat;
+    int mcmcmc_threads;
+#ifdef ARGWEAVER_MPI
     int mcmcmc_group;
     int mcmcmc_numgroup;
     bool mpi;
@@ -624,8 +747,14 @@ public:
     bool overwrite;
     string resume_stage;
     int resume_iter;
+    int checkpoint_step;
     int resample_window;
     int resample_window_iters;
+    int resample_window_threads;
+    int chunk_size;
+    int chunk_flank;
+    int chunk_iters;
+    int chunk_threads;
     bool gibbs;
 
     // misc
@@ -658,6 +787,15 @@ public:
 
     // logging
     FILE *stats_file;
+
+    // cached prior and likelihood terms of the current ARG
+    ArgProbCache prob_cache;
+
+    // background writer for samples (NULL: write in the sampling thread)
+    AsyncFileWriter *writer;
+
+    // sampler state read from a checkpoint when resuming
+    SamplerState resume_state;
 };
 
 
@@ -754,7 +892,7 @@ void print_stats_header(Config *config) {
 void print_stats(FILE *stats_file, const char *stage, int iter,
                  ArgModel *model,
                  const Sequences *sequences, LocalTrees *trees,
-                 const SitesMapping* sites_mapping, const Config *config,
+                 const SitesMapping* sites_mapping, Config *config,
                  const TrackNullValue *maskmap_uncompressed,
                  const vector<int> &invisible_recomb_pos0=vector<int>(),
                  const vector<Spr> &invisible_recombs=vector<Spr>())
@@ -783,13 +921,12 @@ void print_stats(FILE *stats_file, const char *stage, int iter,
         sites_mapping->uncompress(invisible_recomb_pos0, invisible_recomb_pos);
     }
 
-    double prior = calc_arg_prior(model, trees, NULL, NULL, -1, -1,
-                                  invisible_recomb_pos, invisible_recombs);
-    double prior2 = calc_arg_prior_recomb_integrate(model, trees, NULL, NULL, NULL);
-    double likelihood = config->all_masked ? 0.0 :
-        calc_arg_likelihood(model, sequences, trees,
-                            sites_mapping,
-                            maskmap_uncompressed);
+    // only blocks changed since the last call are recomputed
+    double prior, prior2, likelihood = 0.0;
+    config->prob_cache.calc(model, sequences, trees, sites_mapping,
+                            maskmap_uncompressed, &prior, &prior2,
+                            config->all_masked ? NULL : &likelihood,
+                            invisible_recomb_pos, invisible_recombs);
     double joint = prior + likelihood;
     double arglen = get_arglen(trees, model->times);
 
@@ -883,17 +1020,27 @@ string get_out_sites_file(const Config &config, int iter)
 bool log_sequences(string chrom, const Sequences *sequences,
                    const Config *config,
                    const SitesMapping *sites_mapping, int iter) {
-    Sites sites(chrom);
+    shared_ptr<Sites> sites(new Sites(chrom));
     string out_sites_file = get_out_sites_file(*config, iter);
-    make_sites_from_sequences(sequences, &sites);
+    make_sites_from_sequences(sequences, sites.get());
     if (sites_mapping)
-        uncompress_sites(&sites, sites_mapping);
+        uncompress_sites(sites.get(), sites_mapping);
+
+    if (config->writer) {
+        const bool write_masked = config->write_masked_sites;
+        config->writer->write(out_sites_file, [=](FILE *out) {
+                write_sites(out, sites.get(), write_masked);
+                return true;
+            });
+        return true;
+    }
+
     CompressStream stream(out_sites_file.c_str(), "w");
     if (!stream.stream) {
         printError("cannot write '%s'", out_sites_file.c_str());
         return false;
     }
-    write_sites(stream.stream, &sites, config->write_masked_sites);
+    write_sites(stream.stream, sites.get(), config->write_masked_sites);
     return true;
 }
 
@@ -916,6 +1063,26 @@ bool log_local_trees(const ArgModel *model, const Sequences *sequences,
         self_recomb_ptr = &self_recomb_pos1;
     } else self_recomb_ptr = &self_recomb_pos0;
 
+    if (config->writer) {
+        // format and compress a snapshot of the trees in the background
+        shared_ptr<LocalTrees> snapshot(new LocalTrees());
+        snapshot->copy(*trees);
+        if (sites_mapping)
+            compress_local_trees(trees, sites_mapping);
+
+        shared_ptr<Sequences> names(new Sequences());
+        names->names = sequences->names;
+        const vector<double> times(model->times, model->times + model->ntimes);
+        const bool pop_model = (model->pop_tree != NULL);
+        const vector<int> recomb_pos = *self_recomb_ptr;
+        config->writer->write(out_arg_file, [=](FILE *out) {
+                write_local_trees(out, snapshot.get(), *names, &times[0],
+                                  pop_model, recomb_pos, self_recombs);
+                return true;
+            });
+        return true;
+    }
+
     // setup output stream
     CompressStream stream(out_arg_file.c_str(), "w");
     if (!stream.stream) {
@@ -947,6 +1114,51 @@ bool log_local_trees(const ArgModel *model, const Sequences *sequences,
 }
 
 
+string get_checkpoint_file(const Config &config)
+{
+    return config.out_prefix + config.mcmcmc_prefix + CHECKPOINT_SUFFIX;
+}
+
+// Write a checkpoint of the sampler after iteration 'iter'.  There is a
+// single checkpoint file, which is replaced as a whole, so an interrupted
+// write leaves the previous checkpoint.
+bool log_checkpoint(const ArgModel *model, const Sequences *sequences,
+                    const LocalTrees *trees,
+                    const SitesMapping* sites_mapping,
+                    const Config *config, int iter,
+                    const vector<int> &invisible_recomb_pos,
+                    const vector<Spr> &invisible_recombs)
+{
+    SamplerState state;
+    state.iter = iter;
+    state.rand_state = g_rand_stream->state;
+    state.have_rand_norm_spare = g_rand_norm_have_spare;
+    state.rand_norm_spare = g_rand_norm_spare;
+    state.invisible_recomb_pos = invisible_recomb_pos;
+    state.invisible_recombs = invisible_recombs;
+
+    shared_ptr<vector<char> > data(new vector<char>());
+    save_checkpoint(*data, trees, model, sequences, sites_mapping, state);
+
+    auto write = [=](FILE *out) {
+        return fwrite(&(*data)[0], 1, data->size(), out) == data->size();
+    };
+    string filename = get_checkpoint_file(*config);
+    if (config->writer) {
+        config->writer->write(filename, write);
+        return true;
+    }
+
+    AsyncFileWriter writer;
+    writer.write(filename, write);
+    if (!writer.flush()) {
+        printError("cannot write '%s'", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+
 //=============================================================================
 
 
@@ -1005,7 +1217,17 @@ bool seq_sample_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
         printLog(LOG_LOW, "Sequentially Sample Initial ARG (%d sequences)\n",
                  sequences->get_num_seqs());
         printLog(LOG_LOW, "------------------------------------------------\n");
-        sample_arg_seq(model, sequences, trees, true, config->num_buildup);
+        if (config->chunk_size > 0)
+            sample_arg_seq_chunks(
+                model, sequences, trees,
+                config->chunk_size / config->compress_seq,
+                config->chunk_flank / config->compress_seq,
+                config->chunk_iters,
+                config->resample_window / config->compress_seq,
+                config->resample_window_iters, config->chunk_threads,
+                config->num_buildup);
+        else
+            sample_arg_seq(model, sequences, trees, true, config->num_buildup);
         print_stats(config->stats_file, "seq", trees->get_num_leaves(),
                     model, sequences, trees, sites_mapping, config,
                     maskmap_orig);
@@ -1034,8 +1256,32 @@ void climb_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
     printLog(LOG_LOW, "\n");
 }
 
+// Returns the joint probability of the ARG (prior and likelihood) used for
+// swapping heats between chains
+double calc_mcmcmc_joint(Config *config, ArgModel *model,
+                         const Sequences *sequences, LocalTrees *trees,
+                         const SitesMapping *sites_mapping,
+                         const TrackNullValue *maskmap_uncompressed)
+{
+    double prior, prior2, likelihood;
+    if (sites_mapping) {
+        uncompress_local_trees(trees, sites_mapping);
+        uncompress_model(model, sites_mapping, config->compress_seq);
+    }
+    config->prob_cache.calc(model, sequences, trees, sites_mapping,
+                            maskmap_uncompressed, &prior, &prior2,
+                            &likelihood);
+    if (sites_mapping) {
+        compress_local_trees(trees, sites_mapping);
+        compress_model(model, sites_mapping, config->compress_seq);
+    }
+    return prior + likelihood;
+}
+
+
 void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
-                 const LocalTrees *trees, const SitesMapping *sites_mapping) {
+                 LocalTrees *trees, const SitesMapping *sites_mapping,
+                 const TrackNullValue *maskmap_uncompressed) {
 #ifdef ARGWEAVER_MPI
     printLog(LOG_LOW, "mcmcmc_swap model->mc3.max_group=%i\n", model->mc3.max_group);
     if (model->mc3.max_group == 0) return;
@@ -1056,8 +1302,8 @@ void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
     MPI::COMM_WORLD.Bcast(swap, 2, MPI::INT, 0);
     if (mc3->group == swap[0] || mc3->group == swap[1]) {
         double vals[2];
-        vals[0] = calc_arg_prior(model, trees) +
-            calc_arg_likelihood(model, sequences, trees, sites_mapping);
+        vals[0] = calc_mcmcmc_joint(config, model, sequences, trees,
+                                    sites_mapping, maskmap_uncompressed);
         vals[1] = mc3->heat;
         if (mc3->group_comm->Get_rank()==0)
             mc3->group_comm->Reduce(MPI_IN_PLACE, vals, 1, MPI::DOUBLE, MPI_SUM,
@@ -1134,20 +1380,260 @@ void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
 }
 
 
+// a chain of (MC)^3 within this process
+struct McmcmcChain
+{
+    int index;                   // chain index for the exchange
+    ReplicaExchange *exchange;
+    vector<FILE*> *stats_files;  // stats file of each group
+    int log_offset;              // log level offset of the cold chain
+};
+
+
+// output prefix of a (MC)^3 group
+string get_mcmcmc_prefix(int group)
+{
+    if (group == 0)
+        return "";
+    char tmp[20];
+    snprintf(tmp, 20, ".%d", group);
+    return string(tmp);
+}
+
+
+// Only the cold chain logs, so the log reads like that of a single chain
+void set_mcmcmc_log_level(const McmcmcChain *chain, int group)
+{
+    setLogLevelOffset(group == 0 ? chain->log_offset :
+                      chain->log_offset - LOG_HIGH - 1);
+}
+
+
+// Exchange heats with the other chains of this process.  The output of the
+// chain follows its new group by switching to the group's open stats file
+// and prefix.
+void mcmcmc_exchange(Config *config, ArgModel *model,
+                     const Sequences *sequences, LocalTrees *trees,
+                     const SitesMapping *sites_mapping,
+                     const TrackNullValue *maskmap_uncompressed,
+                     McmcmcChain *chain)
+{
+    ReplicaExchange *exchange = chain->exchange;
+    exchange->exchange(chain->index,
+                       calc_mcmcmc_joint(config, model, sequences, trees,
+                                         sites_mapping, maskmap_uncompressed));
+
+    const int group = exchange->get_group(chain->index);
+    if (group != model->mc3.group) {
+        model->mc3.group = group;
+        model->mc3.heat = exchange->get_heat(group);
+        config->stats_file = (*chain->stats_files)[group];
+        config->mcmcmc_prefix = get_mcmcmc_prefix(group);
+    }
+    set_mcmcmc_log_level(chain, group);
+    printLog(LOG_LOW, "swap\t%i\t%i\t%f\t%f\t%f\t%s\n",
+             exchange->swap[0], exchange->swap[1],
+             exchange->get_heat(exchange->swap[0]),
+             exchange->get_heat(exchange->swap[1]), exchange->swap_ratio,
+             exchange->swap_accept ? "accept" : "reject");
+}
+
+
+// one iteration of resampling all branches
+void resample_arg_iter(ArgModel *model, Sequences *sequences,
+                       LocalTrees *trees, SitesMapping* sites_mapping,
+                       Config *config, const TrackNullValue *maskmap_orig,
+                       int i, bool do_leaf,
+                       vector<int> &invisible_recomb_pos,
+                       vector<Spr> &invisible_recombs,
+                       McmcmcChain *chain=NULL)
+{
+    int window = config->resample_window / config->compress_seq;
+    int niters = config->resample_window_iters;
+
+    printLog(LOG_LOW, "sample %d\n", i);
+    Timer timer;
+    double heat = model->mc3.heat;
+    if (model->pop_tree != NULL && i >= config->start_mig_iter) {
+        if (model->pop_tree->max_migrations != config->max_migrations)
+            printLog(LOG_LOW, "Changing max_migrations to %i\n", config->max_migrations);
+        model->pop_tree->max_migrations = config->max_migrations;
+    }
+
+    if ( ! config->no_sample_arg) {
+        if (config->gibbs)
+            resample_arg(model, sequences, trees);
+        else
+            resample_arg_mcmc_all(model, sequences, trees, do_leaf,
+                                  window, niters, heat,
+                                  config->no_resample_mig,
+                                  config->resample_window_threads);
+    }
+
+
+
+        // TODO: implement popsize updates
+        /*	if (config->popsize_em > 0 && i % config->popsize_em == 0)
+        mle_popsize(model, trees, config->popsize_em_min_event);
+        else */
+    if (model->popsize_config.sample > 0 && i % model->popsize_config.sample == 0) {
+        resample_popsizes_mh(model, trees, heat);
+        //	    update_popsize_hmc(model, trees);
+    } /*else {
+        printError("Have not implemented popsize update for multipop yet\n");
+        //no_update_popsize(model, trees);
+        }*/
+
+    printTimerLog(timer, LOG_LOW, "sample time:");
+
+    if (chain)
+        mcmcmc_exchange(config, model, sequences, trees, sites_mapping,
+                        maskmap_orig, chain);
+    else
+        mcmcmc_swap(config, model, sequences, trees, sites_mapping,
+                    maskmap_orig);
+
+    if (model->smc_prime && config->invisible_recombs) {
+        sample_invisible_recombinations(model, trees,
+                                        invisible_recomb_pos,
+                                        invisible_recombs);
+    }
+
+    if (model->pop_tree != NULL) {
+        resample_migrates(model, trees,
+                          invisible_recombs);
+    }
+
+
+    // logging
+    print_stats(config->stats_file, "resample", i, model, sequences, trees,
+                sites_mapping, config, maskmap_orig,
+                invisible_recomb_pos, invisible_recombs);
+
+    // sample saving
+    if (i % config->sample_step == 0 && ! config->no_sample_arg)
+        log_local_trees(model, sequences, trees, sites_mapping, config, i,
+                        invisible_recomb_pos, invisible_recombs);
+
+    if (config->sample_phase_step > 0 && i%config->sample_phase_step == 0)
+        log_sequences(trees->chrom, sequences, config, sites_mapping, i);
+
+    if (config->checkpoint_step > 0 && i % config->checkpoint_step == 0)
+        log_checkpoint(model, sequences, trees, sites_mapping, config, i,
+                       invisible_recomb_pos, invisible_recombs);
+}
+
+
+// Resample all branches with one (MC)^3 chain per thread.  Chain 0
+// continues with the given ARG and the heated chains start from copies of
+// it.  Chains only exchange heats; each group keeps its stats file open
+// for the whole run.
+void resample_arg_all_mcmcmc(ArgModel *model, Sequences *sequences,
+                             LocalTrees *trees, SitesMapping* sites_mapping,
+                             Config *config,
+                             const TrackNullValue *maskmap_orig,
+                             int iter, double frac_leaf)
+{
+    const int nchains = config->mcmcmc_threads;
+    ReplicaExchange exchange(nchains, config->mcmcmc_heat, rand_int());
+    vector<FILE*> stats_files(nchains, config->stats_file);
+    vector<Config*> configs(nchains, config);
+    vector<ArgModel*> models(nchains, model);
+    vector<Sequences*> seqs(nchains, sequences);
+    vector<LocalTrees*> chain_trees(nchains, trees);
+    vector<RandStream> streams;
+
+    model->mc3.group = 0;
+    model->mc3.heat = exchange.get_heat(0);
+    for (int i=1; i<nchains; i++) {
+        configs[i] = new Config(*config);
+        configs[i]->mcmcmc_prefix = get_mcmcmc_prefix(i);
+        string stats_filename = config->out_prefix +
+            configs[i]->mcmcmc_prefix + STATS_SUFFIX;
+        if (!(stats_files[i] = fopen(stats_filename.c_str(),
+                                     config->resume ? "a" : "w"))) {
+            printError("could not open stats file '%s'",
+                       stats_filename.c_str());
+            abort();
+        }
+        configs[i]->stats_file = stats_files[i];
+        if (!config->resume)
+            print_stats_header(configs[i]);
+
+        models[i] = new ArgModel(*model);
+        models[i]->mc3.group = i;
+        models[i]->mc3.heat = exchange.get_heat(i);
+        if (model->unphased) {
+            // phase is sampled per chain
+            seqs[i] = new Sequences();
+            seqs[i]->copy(*sequences);
+        }
+        chain_trees[i] = new LocalTrees();
+        chain_trees[i]->copy(*trees);
+    }
+    for (int i=0; i<nchains; i++)
+        streams.push_back(RandStream(rand_int()));
+
+    auto run_chain = [&](int i) {
+        McmcmcChain chain = {i, &exchange, &stats_files, getLogLevelOffset()};
+        set_thread_rand_stream(&streams[i]);
+        set_mcmcmc_log_level(&chain, i);
+
+        vector<int> invisible_recomb_pos;
+        vector<Spr> invisible_recombs;
+        if (i > 0 && !config->resume) {
+            print_stats(stats_files[i], "resample", 0, models[i], seqs[i],
+                        chain_trees[i], sites_mapping, configs[i],
+                        maskmap_orig);
+            log_local_trees(models[i], seqs[i], chain_trees[i],
+                            sites_mapping, configs[i], 0);
+            if (config->sample_phase_step > 0)
+                log_sequences(trees->chrom, seqs[i], configs[i],
+                              sites_mapping, 0);
+        }
+        for (int j=iter; j<=config->niters; j++)
+            resample_arg_iter(models[i], seqs[i], chain_trees[i],
+                              sites_mapping, configs[i], maskmap_orig, j,
+                              frand() < frac_leaf, invisible_recomb_pos,
+                              invisible_recombs, &chain);
+        set_thread_rand_stream(NULL);
+    };
+
+    const int log_offset = getLogLevelOffset();
+    vector<thread> threads;
+    for (int i=1; i<nchains; i++)
+        threads.push_back(thread([&, i]() {
+            setLogLevelOffset(log_offset);
+            run_chain(i);
+        }));
+    run_chain(0);
+    for (unsigned int i=0; i<threads.size(); i++)
+        threads[i].join();
+    setLogLevelOffset(log_offset);
+
+    // the main stats file belongs to group 0
+    config->stats_file = stats_files[0];
+    config->mcmcmc_prefix = get_mcmcmc_prefix(0);
+    for (int i=1; i<nchains; i++) {
+        fclose(stats_files[i]);
+        delete configs[i];
+        delete models[i];
+        if (seqs[i] != sequences)
+            delete seqs[i];
+        delete chain_trees[i];
+    }
+}
+
+
 void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
                       SitesMapping* sites_mapping, Config *config,
                       const TrackNullValue *maskmap_orig)
 {
     // setup search options
     bool do_leaf[config->niters+1];
-    //int window = 100000;
-    //int niters = 10;
-    int window = config->resample_window;
-    int niters = config->resample_window_iters;
-    window /= config->compress_seq;
 
-    vector<int> invisible_recomb_pos;
-    vector<Spr> invisible_recombs;
+    vector<int> invisible_recomb_pos = config->resume_state.invisible_recomb_pos;
+    vector<Spr> invisible_recombs = config->resume_state.invisible_recombs;
     assert_trees(trees, model->pop_tree);
 
     // set iteration counter
@@ -1171,76 +1657,25 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 
     double frac_leaf = 0.5;
 
+    if (config->mcmcmc_threads > 1) {
+        resample_arg_all_mcmcmc(model, sequences, trees, sites_mapping,
+                                config, maskmap_orig, iter, frac_leaf);
+        printLog(LOG_LOW, "\n");
+        return;
+    }
+
 #ifdef ARGWEAVER_MPI
     for (int i=0; i <= config->niters; i++) do_leaf[i] = (frand() < frac_leaf);
     MPI::COMM_WORLD.Bcast(do_leaf, config->niters+1, MPI::BOOL, 0);
 #endif
 
     for (int i=iter; i<=config->niters; i++) {
-        printLog(LOG_LOW, "sample %d\n", i);
-        Timer timer;
-        double heat = model->mc3.heat;
-        if (model->pop_tree != NULL && i >= config->start_mig_iter) {
-            if (model->pop_tree->max_migrations != config->max_migrations)
-                printLog(LOG_LOW, "Changing max_migrations to %i\n", config->max_migrations);
-            model->pop_tree->max_migrations = config->max_migrations;
-        }
-
 #ifndef ARGWEAVER_MPI
         do_leaf[i] = ( frand() < frac_leaf );
 #endif
-
-	if ( ! config->no_sample_arg) {
-	    if (config->gibbs)
-		resample_arg(model, sequences, trees);
-	    else
-		resample_arg_mcmc_all(model, sequences, trees, do_leaf[i],
-				      window, niters, heat,
-                                      config->no_resample_mig);
-	}
-
-
-
-            // TODO: implement popsize updates
-            /*	if (config->popsize_em > 0 && i % config->popsize_em == 0)
-	    mle_popsize(model, trees, config->popsize_em_min_event);
-            else */
-        if (model->popsize_config.sample > 0 && i % model->popsize_config.sample == 0) {
-            resample_popsizes_mh(model, trees, true, heat);
-            //	    update_popsize_hmc(model, trees);
-        } /*else {
-            printError("Have not implemented popsize update for multipop yet\n");
-            //no_update_popsize(model, trees);
-            }*/
-
-        printTimerLog(timer, LOG_LOW, "sample time:");
-
-        mcmcmc_swap(config, model, sequences, trees, sites_mapping);
-
-        if (model->smc_prime && config->invisible_recombs) {
-            sample_invisible_recombinations(model, trees,
-                                            invisible_recomb_pos,
-                                            invisible_recombs);
-        }
-
-        if (model->pop_tree != NULL) {
-            resample_migrates(model, trees,
-                              invisible_recombs);
-        }
-
-
-        // logging
-        print_stats(config->stats_file, "resample", i, model, sequences, trees,
-                    sites_mapping, config, maskmap_orig,
-                    invisible_recomb_pos, invisible_recombs);
-
-        // sample saving
-        if (i % config->sample_step == 0 && ! config->no_sample_arg)
-            log_local_trees(model, sequences, trees, sites_mapping, config, i,
-                            invisible_recomb_pos, invisible_recombs);
-
-        if (config->sample_phase_step > 0 && i%config->sample_phase_step == 0)
-            log_sequences(trees->chrom, sequences, config, sites_mapping, i);
+        resample_arg_iter(model, sequences, trees, sites_mapping, config,
+                          maskmap_orig, i, do_leaf[i], invisible_recomb_pos,
+                          invisible_recombs);
     }
     printLog(LOG_LOW, "\n");
 }
@@ -1453,6 +1888,62 @@ bool setup_resume(Config &config)
 }
 
 
+// Remove the output that a previous run wrote for resample iterations
+// after 'iter', the iteration of the checkpoint being resumed: their lines
+// in the stats file and their ARG and sites samples.  The resumed chain
+// samples these iterations again.
+bool truncate_resumed_output(const Config &config, int iter)
+{
+    string stats_filename = config.out_prefix + config.mcmcmc_prefix
+        + STATS_SUFFIX;
+    FILE *stats_file;
+    if (!(stats_file = fopen(stats_filename.c_str(), "r"))) {
+        printError("could not open stats file '%s'", stats_filename.c_str());
+        return false;
+    }
+
+    // find the first line of a later iteration; lines are in order
+    long offset = -1;
+    vector<int> later_iters;
+    vector<string> tokens;
+    while (true) {
+        const long pos = ftell(stats_file);
+        char *line = fgetline(stats_file);
+        if (!line)
+            break;
+        chomp(line);
+        split(line, "\t", tokens);
+        delete [] line;
+
+        int iter2;
+        if (tokens.size() < 2 || tokens[0] != "resample" ||
+            sscanf(tokens[1].c_str(), "%d", &iter2) != 1 || iter2 <= iter)
+            continue;
+        if (offset == -1)
+            offset = pos;
+        later_iters.push_back(iter2);
+    }
+    fclose(stats_file);
+
+    if (offset == -1)
+        return true;
+    printLog(LOG_LOW, "removing output of %d iterations after checkpoint"
+             " (iter=%d)\n", (int) later_iters.size(), iter);
+    if (truncate(stats_filename.c_str(), offset) != 0) {
+        printError("could not truncate stats file '%s'",
+                   stats_filename.c_str());
+        return false;
+    }
+    for (unsigned int i=0; i<later_iters.size(); i++) {
+        string arg_file = get_out_arg_file(config, later_iters[i]);
+        unlink(arg_file.c_str());
+        unlink((arg_file + ".gz").c_str());
+        unlink(get_out_sites_file(config, later_iters[i]).c_str());
+    }
+    return true;
+}
+
+
 bool check_overwrite(Config &config)
 {
     // check for stats file
@@ -1575,6 +2066,11 @@ int main(int argc, char **argv)
     srand(c.randseed);
     printLog(LOG_LOW, "random seed: %d\n", c.randseed);
 
+    // checkpoints need random numbers from a stream whose state can be saved
+    RandStream rand_stream(c.randseed);
+    if (c.checkpoint_step > 0)
+        set_thread_rand_stream(&rand_stream);
+
     // read sequences
     Sites sites;
     Sequences sequences;
@@ -1915,6 +2411,7 @@ int main(int argc, char **argv)
             return 1;
         }
         c.model.popsize_config.numsample = c.sample_popsize_num;
+        c.model.popsize_config.prior_check = c.popsize_prior_check;
         c.model.popsize_config.neighbor_prior = c.popsize_prior_neighbor;
 	c.model.popsize_config.epsilon = c.epsilon;
 	c.model.popsize_config.pseudocount = c.pseudocount;
@@ -1962,7 +2459,34 @@ int main(int argc, char **argv)
     // setup init ARG
     LocalTrees *trees = NULL;
     unique_ptr<LocalTrees> trees_ptr;
-    if (c.arg_file != "") { // || c.cr_file != "") {
+    string checkpoint_file = get_checkpoint_file(c);
+    if (c.resume && c.checkpoint_step > 0 &&
+        !access(checkpoint_file.c_str(), F_OK)) {
+        // continue the chain from its last checkpoint
+        trees = new LocalTrees();
+        trees_ptr = unique_ptr<LocalTrees>(trees);
+        if (!read_checkpoint(checkpoint_file.c_str(), trees, &model,
+                             &sequences, sites_mapping, &c.resume_state)) {
+            printError("could not read checkpoint");
+            return EXIT_ERROR;
+        }
+        if (trees->get_num_leaves() != sequences.get_num_seqs()) {
+            printError("checkpoint does not match the input sequences");
+            return EXIT_ERROR;
+        }
+        c.resume_iter = c.resume_state.iter;
+        rand_stream.state = c.resume_state.rand_state;
+        g_rand_norm_have_spare = c.resume_state.have_rand_norm_spare;
+        g_rand_norm_spare = c.resume_state.rand_norm_spare;
+
+        printLog(LOG_LOW, "read checkpoint %s (iter=%d)\n",
+                 checkpoint_file.c_str(), c.resume_iter);
+
+        // samples written after the checkpoint are sampled again
+        if (!truncate_resumed_output(c, c.resume_iter))
+            return EXIT_ERROR;
+
+    } else if (c.arg_file != "") { // || c.cr_file != "") {
         // init ARG from file
 
         trees = new LocalTrees();
@@ -2048,10 +2572,26 @@ int main(int argc, char **argv)
     double maxrss = get_max_memory_usage() / 1000.0;
     printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
 
+    // stitching chunks needs room for one SPR per sequence in the overlap
+    if (c.chunk_size > 0 &&
+        c.chunk_flank / c.compress_seq < sequences.get_num_seqs()) {
+        printError("--chunk-flank is too small to stitch %d sequences",
+                   sequences.get_num_seqs());
+        return EXIT_ERROR;
+    }
+
     // sample ARG
     printLog(LOG_LOW, "\n");
+    AsyncFileWriter writer;
+    c.writer = &writer;
     sample_arg(&model, &sequences, trees, sites_mapping, &c, &maskmap_orig);
 
+    // wait for the last samples to be written
+    if (!writer.flush()) {
+        printError("could not write all samples");
+        return EXIT_ERROR;
+    }
+
     // final log message
     maxrss = get_max_memory_usage() / 1000.0;
     printTimerLog(timer, LOG_LOW, "sampling time: ");
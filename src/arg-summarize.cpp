@@ -111,6 +111,8 @@ public:
     Config()
     {
         sample_num=0;
+        arg_reader = NULL;
+        snp_reader = NULL;
         make_parser();
     }
     void make_parser() {
@@ -343,7 +345,8 @@ public:
                    ("-n", "--no-header", &noheader, "Do not output header"));
         config.add(new ConfigParam<string>
                    ("-t", "--tabix-dir", "<tabix dir>", &tabix_dir,
-                    "Specify the directory of the tabix executable"));
+                    "Specify the directory of the tabix executable (no"
+                    " longer used; indexes are read directly)"));
         config.add(new ConfigSwitch
                    ("", "--html", &html,
                     "output HTML instead of plain text (useful with --tree;"
@@ -437,6 +440,10 @@ public:
     bool noheader;
     string tabix_dir;
     bool quiet;
+
+    // indexes of argfile and snpfile shared by the regions of a bed file
+    TabixReader *arg_reader;
+    TabixReader *snp_reader;
     bool version;
     bool help;
     bool help_popmodel;
@@ -1096,8 +1103,10 @@ void print_summaries(vector<double> &stat) {
 int summarizeRegionBySnp(Config *config, const char *region,
                          set<string> inds, vector<string> statname,
                          ArgSummarizeData &data) {
-    TabixStream snp_infile(config->snpfile, region, config->tabix_dir);
-    TabixStream infile(config->argfile, region, config->tabix_dir);
+    TabixStream snp_infile(config->snp_reader, config->snpfile, region,
+                           config->tabix_dir);
+    TabixStream infile(config->arg_reader, config->argfile, region,
+                       config->tabix_dir);
     vector<string> token;
     map<int,BedLine*> last_entry;
     map<int,BedLine*>::iterator it;
@@ -1365,7 +1374,8 @@ int summarizeRegionNoSnp(Config *config, const char *region,
 
     */
 
-    infile = new TabixStream(config->argfile, region, config->tabix_dir);
+    infile = new TabixStream(config->arg_reader, config->argfile, region,
+                             config->tabix_dir);
     if (infile->stream == NULL) return 1;
 
     //parse region to get region_chrom, region_start, region_end.
@@ -2036,6 +2046,17 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "error reading %s\n", c.bedfile.c_str());
             return 1;
         }
+
+        // load the indexes once for all regions
+        TabixReader arg_reader, snp_reader;
+        if (!arg_reader.open(c.argfile.c_str()))
+            return 1;
+        c.arg_reader = &arg_reader;
+        if (!c.snpfile.empty()) {
+            if (!snp_reader.open(c.snpfile.c_str()))
+                return 1;
+            c.snp_reader = &snp_reader;
+        }
         while ((line = fgetline(bedstream.stream))) {
             split(line, '\t', token);
             if (token.size() < 3) {
@@ -2052,6 +2073,7 @@ int main(int argc, char *argv[]) {
             delete [] regionStr;
         }
         bedstream.close();
+        c.arg_reader = c.snp_reader = NULL;
     }
     if (html) printf("</table>\n</html>\n");
 
@@ -200,6 +200,19 @@ public:
     ConfigParser()
     {}
 
+    // Rules refer to variables of the object that owns the parser, so a
+    // copy starts without rules and an assignment keeps its own.
+    ConfigParser(const ConfigParser &other) :
+        prog(other.prog), rest(other.rest)
+    {}
+
+    ConfigParser &operator=(const ConfigParser &other)
+    {
+        prog = other.prog;
+        rest = other.rest;
+        return *this;
+    }
+
     ~ConfigParser()
     {
         clear();
@@ -58,6 +58,14 @@ namespace argweaver {
              mat[i] = val;
      }
 
+     // copy all values from an array of the same dimensions
+     void copy(const MultiArray &other) {
+         assert(matSize == other.matSize);
+         for (int i=0; i < matSize; i++)
+             mat[i] = other.mat[i];
+         defaultVal = other.defaultVal;
+     }
+
      void set(double val, int pos0, int pos1) {
 #ifdef DEBUG
          assert(ndim == 2);
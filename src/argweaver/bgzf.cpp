@@ -0,0 +1,732 @@
+//=============================================================================
+// BGZF (blocked gzip) reading and writing
+
+#include <assert.h>
+#include <string.h>
+#include <zlib.h>
+
+// c++ includes
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "bgzf.h"
+#include "logging.h"
+
+namespace argweaver {
+
+
+// size of a block header and footer
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+
+
+static int g_bgzf_threads = -1;
+
+void set_bgzf_threads(int nthreads)
+{
+    g_bgzf_threads = nthreads;
+}
+
+int get_bgzf_threads()
+{
+    if (g_bgzf_threads >= 0)
+        return g_bgzf_threads;
+    const int ncores = thread::hardware_concurrency();
+    return ncores > 1 ? min(ncores, 4) : 0;
+}
+
+
+static inline int read_uint16(const unsigned char *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+static inline uint32_t read_uint32(const unsigned char *data)
+{
+    return (uint32_t(data[0]) | (uint32_t(data[1]) << 8) |
+            (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24));
+}
+
+static inline void write_uint16(unsigned char *data, int value)
+{
+    data[0] = value & 0xff;
+    data[1] = (value >> 8) & 0xff;
+}
+
+static inline void write_uint32(unsigned char *data, uint32_t value)
+{
+    for (int i=0; i<4; i++)
+        data[i] = (value >> (8 * i)) & 0xff;
+}
+
+
+// Returns true if 'header' starts a BGZF block: a gzip member with one
+// extra subfield 'BC' holding the block size
+static bool is_bgzf_header(const unsigned char *header)
+{
+    return (header[0] == 31 && header[1] == 139 && header[2] == 8 &&
+            (header[3] & 4) && read_uint16(&header[10]) == 6 &&
+            header[12] == 'B' && header[13] == 'C' &&
+            read_uint16(&header[14]) == 2);
+}
+
+
+//=============================================================================
+// block compression
+
+class BgzfBlock
+{
+public:
+    BgzfBlock() :
+        address(0),
+        level(Z_DEFAULT_COMPRESSION),
+        state(BLOCK_NEW),
+        ok(false)
+    {}
+
+    enum State {
+        BLOCK_NEW,
+        BLOCK_QUEUED,
+        BLOCK_RUNNING,
+        BLOCK_DONE
+    };
+
+    int64_t address;    // file offset of the compressed block
+    int level;          // compression level
+    vector<char> in;    // compressed block when reading, data when writing
+    vector<char> out;   // data when reading, compressed block when writing
+    State state;
+    bool ok;
+};
+
+
+// Decompress block->in into block->out
+static bool inflate_block(BgzfBlock *block)
+{
+    const int size = block->in.size();
+    if (size < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE)
+        return false;
+    const unsigned char *footer =
+        (const unsigned char *) &block->in[size - BGZF_FOOTER_SIZE];
+    const uint32_t crc = read_uint32(footer);
+    const uint32_t isize = read_uint32(&footer[4]);
+    if (isize > BGZF_MAX_BLOCK_SIZE)
+        return false;
+    block->out.resize(isize);
+    Bytef empty;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK)
+        return false;
+    zs.next_in = (Bytef *) &block->in[BGZF_HEADER_SIZE];
+    zs.avail_in = size - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    zs.next_out = isize ? (Bytef *) &block->out[0] : &empty;
+    zs.avail_out = isize;
+    const int ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.avail_out != 0)
+        return false;
+
+    return crc32(crc32(0, NULL, 0), zs.next_out - isize, isize) == crc;
+}
+
+
+// Compress block->in into block->out
+static bool deflate_block(BgzfBlock *block)
+{
+    const int isize = block->in.size();
+    block->out.resize(BGZF_MAX_BLOCK_SIZE);
+    unsigned char *out = (unsigned char *) &block->out[0];
+    Bytef empty;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, block->level, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    zs.next_in = isize ? (Bytef *) &block->in[0] : &empty;
+    zs.avail_in = isize;
+    zs.next_out = out + BGZF_HEADER_SIZE;
+    zs.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    const int ret = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END)
+        return false;
+
+    const int size = BGZF_HEADER_SIZE + zs.total_out + BGZF_FOOTER_SIZE;
+    const unsigned char header[BGZF_HEADER_SIZE] = {
+        31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0};
+    memcpy(out, header, BGZF_HEADER_SIZE);
+    write_uint16(&out[16], size - 1);
+    write_uint32(&out[size - BGZF_FOOTER_SIZE],
+                 crc32(crc32(0, NULL, 0), zs.next_in - isize, isize));
+    write_uint32(&out[size - BGZF_FOOTER_SIZE + 4], isize);
+    block->out.resize(size);
+    return true;
+}
+
+
+// A queue of blocks processed by worker threads.  Blocks are taken out in
+// the order they were submitted.
+class BgzfWorkers
+{
+public:
+    typedef bool (*BlockFunc)(BgzfBlock *block);
+
+    BgzfWorkers(int nthreads, BlockFunc func) :
+        func(func),
+        stop(false)
+    {
+        for (int i=0; i<nthreads; i++)
+            threads.push_back(thread(&BgzfWorkers::run, this));
+    }
+
+    ~BgzfWorkers()
+    {
+        clear();
+        {
+            unique_lock<mutex> guard(lock);
+            stop = true;
+        }
+        changed.notify_all();
+        for (unsigned int i=0; i<threads.size(); i++)
+            threads[i].join();
+    }
+
+    int size()
+    {
+        unique_lock<mutex> guard(lock);
+        return queue.size();
+    }
+
+    void submit(BgzfBlock *block)
+    {
+        unique_lock<mutex> guard(lock);
+        block->state = BgzfBlock::BLOCK_QUEUED;
+        queue.push_back(block);
+        changed.notify_all();
+    }
+
+    // Wait for the oldest block and remove it from the queue
+    BgzfBlock *take()
+    {
+        unique_lock<mutex> guard(lock);
+        assert(queue.size() > 0);
+        while (queue.front()->state != BgzfBlock::BLOCK_DONE)
+            changed.wait(guard);
+        BgzfBlock *block = queue.front();
+        queue.pop_front();
+        return block;
+    }
+
+    // Drop all blocks
+    void clear()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            bool running = false;
+            for (unsigned int i=0; i<queue.size(); i++)
+                running = running ||
+                    queue[i]->state == BgzfBlock::BLOCK_RUNNING;
+            if (!running)
+                break;
+            changed.wait(guard);
+        }
+        for (unsigned int i=0; i<queue.size(); i++)
+            delete queue[i];
+        queue.clear();
+    }
+
+protected:
+    void run()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            BgzfBlock *block = NULL;
+            for (unsigned int i=0; i<queue.size() && !block; i++)
+                if (queue[i]->state == BgzfBlock::BLOCK_QUEUED)
+                    block = queue[i];
+            if (!block) {
+                if (stop)
+                    break;
+                changed.wait(guard);
+                continue;
+            }
+
+            block->state = BgzfBlock::BLOCK_RUNNING;
+            guard.unlock();
+            const bool ok = func(block);
+            guard.lock();
+            block->ok = ok;
+            block->state = BgzfBlock::BLOCK_DONE;
+            changed.notify_all();
+        }
+    }
+
+    BlockFunc func;
+    bool stop;
+    deque<BgzfBlock*> queue;
+    vector<thread> threads;
+    mutex lock;
+    condition_variable changed;
+};
+
+
+//=============================================================================
+// reader
+
+BgzfReader::BgzfReader(int nthreads) :
+    filename(NULL),
+    infile(NULL),
+    format(FORMAT_PLAIN),
+    nthreads(nthreads < 0 ? get_bgzf_threads() : nthreads),
+    workers(NULL),
+    block(NULL),
+    block_offset(0),
+    next_address(0),
+    file_done(false),
+    error(false),
+    inflater(NULL),
+    member_open(false)
+{}
+
+
+BgzfReader::~BgzfReader()
+{
+    close();
+}
+
+
+bool BgzfReader::open(const char *_filename)
+{
+    close();
+    filename = _filename;
+    infile = fopen(filename, "rb");
+    if (!infile)
+        return false;
+
+    // determine format from the first block
+    unsigned char header[BGZF_HEADER_SIZE];
+    const int n = fread(header, 1, BGZF_HEADER_SIZE, infile);
+    if (n >= 2 && header[0] == 31 && header[1] == 139) {
+        if (n == BGZF_HEADER_SIZE && is_bgzf_header(header))
+            format = FORMAT_BGZF;
+        else
+            format = FORMAT_GZIP;
+    } else {
+        format = FORMAT_PLAIN;
+    }
+    if (fseeko(infile, 0, SEEK_SET) != 0) {
+        close();
+        return false;
+    }
+
+    if (format == FORMAT_GZIP) {
+        inflater = new z_stream;
+        memset(inflater, 0, sizeof(z_stream));
+        if (inflateInit2(inflater, 15 + 16) != Z_OK) {
+            close();
+            return false;
+        }
+        inbuf.resize(BGZF_MAX_BLOCK_SIZE);
+    }
+
+    return true;
+}
+
+
+int BgzfReader::close()
+{
+    int ret = error ? -1 : 0;
+    clear_blocks();
+    delete workers;
+    workers = NULL;
+    if (inflater) {
+        inflateEnd(inflater);
+        delete inflater;
+        inflater = NULL;
+    }
+    if (infile && fclose(infile) != 0)
+        ret = -1;
+    infile = NULL;
+    next_address = 0;
+    file_done = false;
+    error = false;
+    member_open = false;
+    return ret;
+}
+
+
+void BgzfReader::clear_blocks()
+{
+    if (workers)
+        workers->clear();
+    delete block;
+    block = NULL;
+    block_offset = 0;
+}
+
+
+long BgzfReader::read(char *buf, long len)
+{
+    if (!infile || error)
+        return -1;
+
+    if (format == FORMAT_PLAIN) {
+        const long n = fread(buf, 1, len, infile);
+        return (n == 0 && ferror(infile)) ? -1 : n;
+    } else if (format == FORMAT_GZIP) {
+        return read_gzip(buf, len);
+    }
+
+    long n = 0;
+    while (n < len) {
+        if (!block || block_offset == int(block->out.size())) {
+            if (!next_block()) {
+                if (error && n == 0)
+                    return -1;
+                break;
+            }
+        }
+        const int m = min(len - n, long(block->out.size()) - block_offset);
+        memcpy(&buf[n], &block->out[block_offset], m);
+        block_offset += m;
+        n += m;
+    }
+    return n;
+}
+
+
+bool BgzfReader::read_line(string &line)
+{
+    line.clear();
+    if (!infile || error)
+        return false;
+
+    if (format != FORMAT_BGZF) {
+        char c;
+        long n;
+        while ((n = read(&c, 1)) == 1 && c != '\n')
+            line += c;
+        return n == 1 || (n == 0 && line.size() > 0);
+    }
+
+    while (true) {
+        if (!block || block_offset == int(block->out.size())) {
+            if (!next_block())
+                return !error && line.size() > 0;
+        }
+        const char *data = &block->out[0];
+        const char *start = data + block_offset;
+        const int len = block->out.size() - block_offset;
+        const char *newline = (const char *) memchr(start, '\n', len);
+        if (newline) {
+            line.append(start, newline - start);
+            block_offset = newline + 1 - data;
+            return true;
+        }
+        line.append(start, len);
+        block_offset = block->out.size();
+    }
+}
+
+
+// Read the next compressed block from the file.  Returns NULL at the end of
+// the file or on error.
+BgzfBlock *BgzfReader::read_raw_block()
+{
+    if (file_done)
+        return NULL;
+
+    unsigned char header[BGZF_HEADER_SIZE];
+    const int n = fread(header, 1, BGZF_HEADER_SIZE, infile);
+    if (n == 0 && !ferror(infile)) {
+        file_done = true;
+        return NULL;
+    }
+    if (n < BGZF_HEADER_SIZE || !is_bgzf_header(header)) {
+        printError("corrupt BGZF block in '%s'", filename);
+        file_done = true;
+        error = true;
+        return NULL;
+    }
+
+    const int size = read_uint16(&header[16]) + 1;
+    BgzfBlock *raw = new BgzfBlock();
+    raw->address = next_address;
+    raw->in.resize(max(size, BGZF_HEADER_SIZE));
+    memcpy(&raw->in[0], header, BGZF_HEADER_SIZE);
+    const int rest = raw->in.size() - BGZF_HEADER_SIZE;
+    if (int(fread(&raw->in[BGZF_HEADER_SIZE], 1, rest, infile)) != rest) {
+        printError("truncated BGZF block in '%s'", filename);
+        delete raw;
+        file_done = true;
+        error = true;
+        return NULL;
+    }
+    next_address += raw->in.size();
+    return raw;
+}
+
+
+// Make the next block with data the current block.  Returns false at the
+// end of the file or on error.
+bool BgzfReader::next_block()
+{
+    while (true) {
+        // decompress ahead once the file turns out to have several blocks
+        if (!workers && nthreads > 0 && block)
+            workers = new BgzfWorkers(nthreads, inflate_block);
+        delete block;
+        block = NULL;
+        block_offset = 0;
+
+        if (workers) {
+            const int depth = 2 * nthreads;
+            for (int n=workers->size(); n < depth; n++) {
+                BgzfBlock *raw = read_raw_block();
+                if (!raw)
+                    break;
+                workers->submit(raw);
+            }
+            if (workers->size() == 0)
+                return false;
+            block = workers->take();
+        } else {
+            block = read_raw_block();
+            if (!block)
+                return false;
+            block->ok = inflate_block(block);
+        }
+
+        if (!block->ok) {
+            printError("corrupt BGZF block in '%s'", filename);
+            error = true;
+            return false;
+        }
+        if (block->out.size() > 0)
+            return true;
+    }
+}
+
+
+long BgzfReader::read_gzip(char *buf, long len)
+{
+    inflater->next_out = (Bytef *) buf;
+    inflater->avail_out = len;
+    while (inflater->avail_out > 0) {
+        if (inflater->avail_in == 0) {
+            const int n = fread(&inbuf[0], 1, inbuf.size(), infile);
+            if (n == 0) {
+                if (ferror(infile) || member_open) {
+                    printError("truncated gzip file '%s'", filename);
+                    error = true;
+                }
+                break;
+            }
+            inflater->next_in = (Bytef *) &inbuf[0];
+            inflater->avail_in = n;
+        }
+
+        const int ret = inflate(inflater, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            // files may hold several gzip members
+            inflateReset(inflater);
+            member_open = false;
+        } else if (ret == Z_OK) {
+            member_open = true;
+        } else {
+            printError("corrupt gzip file '%s'", filename);
+            error = true;
+            break;
+        }
+    }
+
+    const long n = len - inflater->avail_out;
+    return (error && n == 0) ? -1 : n;
+}
+
+
+bool BgzfReader::seek(int64_t voffset)
+{
+    if (!infile || format != FORMAT_BGZF)
+        return false;
+
+    // stay within the current block if possible
+    const int offset = voffset & 0xffff;
+    if (block && !error && block->address == voffset >> 16 &&
+        offset <= int(block->out.size())) {
+        block_offset = offset;
+        return true;
+    }
+
+    clear_blocks();
+    error = false;
+    file_done = false;
+    next_address = voffset >> 16;
+    if (fseeko(infile, next_address, SEEK_SET) != 0)
+        return false;
+
+    if (!next_block())
+        return !error && offset == 0;
+    if (offset > 0 && (block->address != voffset >> 16 ||
+                       offset > int(block->out.size()))) {
+        error = true;
+        return false;
+    }
+    block_offset = offset;
+    return true;
+}
+
+
+int64_t BgzfReader::tell() const
+{
+    if (!block)
+        return next_address << 16;
+    if (block_offset == int(block->out.size()))
+        return (block->address + int64_t(block->in.size())) << 16;
+    return (block->address << 16) | block_offset;
+}
+
+
+//=============================================================================
+// writer
+
+BgzfWriter::BgzfWriter(int nthreads, int level) :
+    outfile(NULL),
+    nthreads(nthreads < 0 ? get_bgzf_threads() : nthreads),
+    level(level < 0 ? Z_DEFAULT_COMPRESSION : level),
+    workers(NULL),
+    address(0),
+    error(false)
+{}
+
+
+BgzfWriter::~BgzfWriter()
+{
+    close();
+}
+
+
+bool BgzfWriter::open(const char *filename)
+{
+    close();
+    outfile = fopen(filename, "wb");
+    buf.reserve(BGZF_BLOCK_SIZE);
+    return outfile != NULL;
+}
+
+
+int BgzfWriter::close()
+{
+    if (!outfile)
+        return 0;
+
+    bool ok = !error;
+    if (buf.size() > 0)
+        ok = submit_block(true) && ok;
+    ok = drain(0) && ok;
+    delete workers;
+    workers = NULL;
+
+    // empty block marking the end of the file
+    static const unsigned char eof_marker[28] = {
+        31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0,
+        27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    ok = fwrite(eof_marker, 1, sizeof(eof_marker), outfile) ==
+        sizeof(eof_marker) && ok;
+    ok = fclose(outfile) == 0 && ok;
+
+    outfile = NULL;
+    address = 0;
+    error = false;
+    return ok ? 0 : -1;
+}
+
+
+long BgzfWriter::write(const char *data, long len)
+{
+    if (!outfile || error)
+        return -1;
+
+    long n = 0;
+    while (n < len) {
+        const long m = min(len - n, long(BGZF_BLOCK_SIZE - buf.size()));
+        buf.insert(buf.end(), data + n, data + n + m);
+        n += m;
+        if (buf.size() == BGZF_BLOCK_SIZE && !submit_block(false)) {
+            error = true;
+            return -1;
+        }
+    }
+    return n;
+}
+
+
+bool BgzfWriter::flush_block()
+{
+    if (!outfile || error)
+        return false;
+    if (buf.size() > 0 && !submit_block(false))
+        error = true;
+    return !error;
+}
+
+
+int64_t BgzfWriter::tell()
+{
+    if (!drain(0))
+        error = true;
+    return (address << 16) | buf.size();
+}
+
+
+// Compress the current block, or hand it to the workers
+bool BgzfWriter::submit_block(bool last)
+{
+    BgzfBlock *block = new BgzfBlock();
+    block->level = level;
+    block->in.swap(buf);
+    buf.reserve(BGZF_BLOCK_SIZE);
+
+    if (!workers && nthreads > 0 && !last)
+        workers = new BgzfWorkers(nthreads, deflate_block);
+    if (!workers) {
+        const bool ok = deflate_block(block) && write_block(block);
+        delete block;
+        return ok;
+    }
+
+    workers->submit(block);
+    return drain(2 * nthreads);
+}
+
+
+// Write compressed blocks until at most 'max_pending' are left
+bool BgzfWriter::drain(int max_pending)
+{
+    bool ok = true;
+    while (workers && workers->size() > max_pending) {
+        BgzfBlock *block = workers->take();
+        ok = block->ok && write_block(block) && ok;
+        delete block;
+    }
+    return ok;
+}
+
+
+bool BgzfWriter::write_block(BgzfBlock *block)
+{
+    const size_t size = block->out.size();
+    if (fwrite(&block->out[0], 1, size, outfile) != size)
+        return false;
+    address += size;
+    return true;
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,147 @@
+//=============================================================================
+// BGZF (blocked gzip) reading and writing
+
+#ifndef ARGWEAVER_BGZF_H
+#define ARGWEAVER_BGZF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// c++ includes
+#include <string>
+#include <vector>
+
+// zlib stream (defined in zlib.h)
+struct z_stream_s;
+
+namespace argweaver {
+
+using namespace std;
+
+
+// A BGZF file is a series of gzip members ("blocks") that each hold at most
+// 64kb of data and record their own compressed size, so that blocks can be
+// compressed and decompressed independently and a reader can jump to any
+// block.  A byte is addressed by a virtual offset: the file offset of its
+// block shifted left by 16 bits, plus its offset within the uncompressed
+// block.  Any gzip reader can read a BGZF file.
+
+// uncompressed bytes per block written
+#define BGZF_BLOCK_SIZE 0xff00
+
+// largest block (compressed or uncompressed)
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+
+
+// Number of worker threads used to compress or decompress the blocks of
+// each file (0 does all work on the caller's thread).  By default up to 4
+// threads are used when the machine has several cores.
+void set_bgzf_threads(int nthreads);
+int get_bgzf_threads();
+
+
+class BgzfBlock;
+class BgzfWorkers;
+
+
+// Reads BGZF files.  Blocks ahead of the reader are decompressed on worker
+// threads.  Other gzip files are decompressed as a stream (and cannot
+// seek) and uncompressed files are read as they are.
+class BgzfReader
+{
+public:
+    explicit BgzfReader(int nthreads=-1);
+    ~BgzfReader();
+
+    bool open(const char *filename);
+    int close();
+
+    // Read up to 'len' bytes into 'buf'.  Returns the number of bytes read,
+    // 0 at the end of the file and -1 on error.
+    long read(char *buf, long len);
+
+    // Read a line into 'line' without its newline.  Returns false at the
+    // end of the file or on error.
+    bool read_line(string &line);
+
+    // Returns true if the file is BGZF and supports seek() and tell()
+    bool seekable() const { return format == FORMAT_BGZF; }
+
+    // Move to a virtual offset returned by tell() or BgzfWriter::tell()
+    bool seek(int64_t voffset);
+
+    // Returns the virtual offset of the next byte to read
+    int64_t tell() const;
+
+protected:
+    enum Format {
+        FORMAT_PLAIN,
+        FORMAT_GZIP,
+        FORMAT_BGZF
+    };
+
+    BgzfBlock *read_raw_block();
+    bool next_block();
+    long read_gzip(char *buf, long len);
+    void clear_blocks();
+
+    const char *filename;
+    FILE *infile;
+    Format format;
+    int nthreads;
+    BgzfWorkers *workers;   // started once a second block is needed
+    BgzfBlock *block;       // current block
+    int block_offset;       // offset of next byte in current block
+    int64_t next_address;   // file offset of the next block to read
+    bool file_done;         // all blocks have been read from the file
+    bool error;
+
+    // streaming decompression of non-BGZF gzip files
+    z_stream_s *inflater;
+    vector<char> inbuf;
+    bool member_open;
+};
+
+
+// Writes BGZF files.  Full blocks are compressed on worker threads and
+// written in order.
+class BgzfWriter
+{
+public:
+    explicit BgzfWriter(int nthreads=-1, int level=-1);
+    ~BgzfWriter();
+
+    bool open(const char *filename);
+
+    // Write the remaining data and the end of file marker.  Returns 0 on
+    // success and -1 if anything could not be written.
+    int close();
+
+    // Write 'len' bytes.  Returns 'len' or -1 on error.
+    long write(const char *buf, long len);
+
+    // End the current block, so that the next byte starts a new block
+    bool flush_block();
+
+    // Returns the virtual offset of the next byte to write.  Blocks being
+    // compressed are written first.
+    int64_t tell();
+
+protected:
+    bool submit_block(bool last);
+    bool write_block(BgzfBlock *block);
+    bool drain(int max_pending);
+
+    FILE *outfile;
+    int nthreads;
+    int level;
+    BgzfWorkers *workers;   // started once a first full block is written
+    vector<char> buf;       // data of the current block
+    int64_t address;        // file offset of the next block to write
+    bool error;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_BGZF_H
@@ -0,0 +1,517 @@
+//=============================================================================
+// binary checkpoints of the sampler state
+
+// c includes
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "logging.h"
+#include "pop_model.h"
+
+namespace argweaver {
+
+
+static const char CHECKPOINT_MAGIC[8] = {'A', 'R', 'G', 'W', 'C', 'K', 'P', 'T'};
+static const int CHECKPOINT_VERSION = 1;
+static const int CHECKPOINT_BYTE_ORDER = 0x01020304;
+
+
+//=============================================================================
+// raw values in native layout
+
+class CheckpointWriter
+{
+public:
+    CheckpointWriter(vector<char> &data) : data(data) {}
+
+    template <class T>
+    void put(const T &value)
+    {
+        put_array(&value, 1);
+    }
+
+    template <class T>
+    void put_array(const T *values, int n)
+    {
+        const char *bytes = (const char*) values;
+        data.insert(data.end(), bytes, bytes + sizeof(T) * n);
+    }
+
+    template <class T>
+    void put_vector(const vector<T> &values)
+    {
+        put(int(values.size()));
+        if (values.size() > 0)
+            put_array(&values[0], values.size());
+    }
+
+    void put_string(const string &str)
+    {
+        put(int(str.size()));
+        put_array(str.c_str(), str.size());
+    }
+
+    vector<char> &data;
+};
+
+
+// Reads values back from a mapped checkpoint.  Every read is checked
+// against the end of the file, so a truncated file fails cleanly.
+class CheckpointReader
+{
+public:
+    CheckpointReader(const char *start, const char *end) :
+        pos(start), end(end) {}
+
+    template <class T>
+    bool get(T *value)
+    {
+        return get_array(value, 1);
+    }
+
+    template <class T>
+    bool get_array(T *values, int n)
+    {
+        const size_t len = sizeof(T) * n;
+        if (n < 0 || size_t(end - pos) < len)
+            return false;
+        memcpy((void*) values, pos, len);
+        pos += len;
+        return true;
+    }
+
+    template <class T>
+    bool get_vector(vector<T> *values)
+    {
+        int n;
+        if (!get(&n) || n < 0 || size_t(end - pos) < sizeof(T) * n)
+            return false;
+        values->resize(n);
+        return n == 0 || get_array(&(*values)[0], n);
+    }
+
+    bool get_string(string *str)
+    {
+        int n;
+        if (!get(&n) || n < 0 || end - pos < n)
+            return false;
+        str->assign(pos, n);
+        pos += n;
+        return true;
+    }
+
+    bool at_end() const { return pos == end; }
+
+    const char *pos;
+    const char *end;
+};
+
+
+//=============================================================================
+// sections
+
+template <class T>
+static void save_track(CheckpointWriter &out, const Track<T> &track)
+{
+    out.put(int(track.size()));
+    for (unsigned int i=0; i<track.size(); i++) {
+        out.put_string(track[i].chrom);
+        out.put(track[i].start);
+        out.put(track[i].end);
+        out.put(track[i].value);
+    }
+}
+
+template <class T>
+static bool read_track(CheckpointReader &in, Track<T> *track)
+{
+    int n;
+    if (!in.get(&n) || n < 0)
+        return false;
+    track->clear();
+    for (int i=0; i<n; i++) {
+        RegionValue<T> region;
+        if (!in.get_string(&region.chrom) || !in.get(&region.start) ||
+            !in.get(&region.end) || !in.get(&region.value))
+            return false;
+        track->push_back(region);
+    }
+    return true;
+}
+
+
+static void save_model(CheckpointWriter &out, const ArgModel *model)
+{
+    const int npop = model->num_pops();
+    out.put(model->ntimes);
+    out.put(npop);
+    out.put(model->rho);
+    out.put(model->mu);
+    for (int pop=0; pop<npop; pop++)
+        out.put_array(model->popsizes[pop], 2*model->ntimes-1);
+
+    const PopulationTree *pop_tree = model->pop_tree;
+    out.put(int(pop_tree != NULL));
+    if (pop_tree) {
+        out.put(pop_tree->max_migrations);
+        out.put(int(pop_tree->mig_matrix.size()));
+        for (unsigned int i=0; i<pop_tree->mig_matrix.size(); i++) {
+            const MigMatrix &mat = pop_tree->mig_matrix[i];
+            out.put(mat.npop);
+            out.put_array(mat.mat, mat.npop * mat.npop);
+        }
+    }
+
+    save_track(out, model->mutmap);
+    save_track(out, model->recombmap);
+}
+
+
+static bool read_model(CheckpointReader &in, ArgModel *model)
+{
+    int ntimes, npop;
+    if (!in.get(&ntimes) || !in.get(&npop))
+        return false;
+    if (ntimes != model->ntimes || npop != model->num_pops()) {
+        printError("checkpoint has %d time points and %d populations, but"
+                   " the model has %d and %d", ntimes, npop,
+                   model->ntimes, model->num_pops());
+        return false;
+    }
+    if (!in.get(&model->rho) || !in.get(&model->mu))
+        return false;
+    for (int pop=0; pop<npop; pop++)
+        if (!in.get_array(model->popsizes[pop], 2*ntimes-1))
+            return false;
+
+    int has_pop_tree;
+    if (!in.get(&has_pop_tree))
+        return false;
+    PopulationTree *pop_tree = model->pop_tree;
+    if (bool(has_pop_tree) != (pop_tree != NULL)) {
+        printError("checkpoint and model do not agree on a population tree");
+        return false;
+    }
+    if (pop_tree) {
+        int nmats;
+        if (!in.get(&pop_tree->max_migrations) || !in.get(&nmats))
+            return false;
+        if (nmats != int(pop_tree->mig_matrix.size())) {
+            printError("checkpoint does not match the population tree");
+            return false;
+        }
+        for (int i=0; i<nmats; i++) {
+            MigMatrix &mat = pop_tree->mig_matrix[i];
+            int mat_npop;
+            if (!in.get(&mat_npop))
+                return false;
+            if (mat_npop != mat.npop) {
+                printError("checkpoint does not match the population tree");
+                return false;
+            }
+            if (!in.get_array(mat.mat, mat.npop * mat.npop))
+                return false;
+        }
+        pop_tree->update_population_probs();
+    }
+
+    return read_track(in, &model->mutmap) &&
+        read_track(in, &model->recombmap);
+}
+
+
+static void save_sites_mapping(CheckpointWriter &out,
+                               const SitesMapping *sites_mapping)
+{
+    out.put(int(sites_mapping != NULL));
+    if (!sites_mapping)
+        return;
+    out.put(sites_mapping->old_start);
+    out.put(sites_mapping->old_end);
+    out.put(sites_mapping->new_start);
+    out.put(sites_mapping->new_end);
+    out.put(sites_mapping->nsites);
+    out.put(sites_mapping->seqlen);
+    out.put_vector(sites_mapping->old_sites);
+    out.put_vector(sites_mapping->new_sites);
+    out.put_vector(sites_mapping->all_sites);
+    out.put_vector(sites_mapping->all_sites_start);
+    out.put_vector(sites_mapping->all_sites_end);
+}
+
+
+// The sites mapping is derived from the input, so it is not restored but
+// checked, which catches resuming with different sites or compression.
+static bool check_sites_mapping(CheckpointReader &in,
+                                const SitesMapping *sites_mapping)
+{
+    int has_mapping;
+    if (!in.get(&has_mapping))
+        return false;
+    if (bool(has_mapping) != (sites_mapping != NULL)) {
+        printError("checkpoint does not match the input sites");
+        return false;
+    }
+    if (!sites_mapping)
+        return true;
+
+    SitesMapping saved;
+    if (!in.get(&saved.old_start) || !in.get(&saved.old_end) ||
+        !in.get(&saved.new_start) || !in.get(&saved.new_end) ||
+        !in.get(&saved.nsites) || !in.get(&saved.seqlen) ||
+        !in.get_vector(&saved.old_sites) ||
+        !in.get_vector(&saved.new_sites) ||
+        !in.get_vector(&saved.all_sites) ||
+        !in.get_vector(&saved.all_sites_start) ||
+        !in.get_vector(&saved.all_sites_end))
+        return false;
+
+    const bool same = saved.old_start == sites_mapping->old_start &&
+        saved.old_end == sites_mapping->old_end &&
+        saved.new_start == sites_mapping->new_start &&
+        saved.new_end == sites_mapping->new_end &&
+        saved.nsites == sites_mapping->nsites &&
+        saved.seqlen == sites_mapping->seqlen &&
+        saved.old_sites == sites_mapping->old_sites &&
+        saved.new_sites == sites_mapping->new_sites &&
+        saved.all_sites == sites_mapping->all_sites &&
+        saved.all_sites_start == sites_mapping->all_sites_start &&
+        saved.all_sites_end == sites_mapping->all_sites_end;
+    if (!same)
+        printError("checkpoint does not match the input sites");
+    return same;
+}
+
+
+// Sequences are only saved when their phase is sampled
+static void save_sequences(CheckpointWriter &out, const ArgModel *model,
+                           const Sequences *sequences)
+{
+    const int nseqs = sequences->get_num_seqs();
+    const int seqlen = sequences->length();
+    out.put(nseqs);
+    out.put(seqlen);
+    out.put(int(model->unphased));
+    if (model->unphased) {
+        const char * const *seqs = sequences->get_seqs();
+        for (int i=0; i<nseqs; i++)
+            out.put_array(seqs[i], seqlen);
+    }
+}
+
+
+static bool read_sequences(CheckpointReader &in, const ArgModel *model,
+                           Sequences *sequences)
+{
+    int nseqs, seqlen, unphased;
+    if (!in.get(&nseqs) || !in.get(&seqlen) || !in.get(&unphased))
+        return false;
+    if (nseqs != sequences->get_num_seqs() || seqlen != sequences->length() ||
+        bool(unphased) != model->unphased) {
+        printError("checkpoint does not match the input sequences");
+        return false;
+    }
+    if (unphased) {
+        char **seqs = sequences->get_seqs();
+        for (int i=0; i<nseqs; i++)
+            if (!in.get_array(seqs[i], seqlen))
+                return false;
+    }
+    return true;
+}
+
+
+static void save_local_trees(CheckpointWriter &out, const LocalTrees *trees)
+{
+    out.put_string(trees->chrom);
+    out.put(trees->start_coord);
+    out.put(trees->end_coord);
+    out.put(trees->nnodes);
+    out.put_vector(trees->seqids);
+    out.put(trees->get_num_trees());
+
+    for (LocalTrees::const_iterator it=trees->begin();
+         it != trees->end(); ++it)
+    {
+        const LocalTree *tree = it->tree;
+        out.put(it->blocklen);
+        out.put(it->spr);
+        out.put(tree->nnodes);
+        out.put(tree->capacity);
+        out.put(tree->root);
+        for (int i=0; i<tree->nnodes; i++) {
+            const LocalNode &node = tree->nodes[i];
+            out.put(node.parent);
+            out.put_array(node.child, 2);
+            out.put(node.age);
+            out.put(node.pop_path);
+        }
+        out.put(int(it->mapping != NULL));
+        if (it->mapping)
+            out.put_array(it->mapping, tree->nnodes);
+    }
+}
+
+
+// Returns whether 'node' is a node of a tree with 'nnodes' nodes or -1
+static inline bool valid_node(int node, int nnodes)
+{
+    return node >= -1 && node < nnodes;
+}
+
+
+static bool read_local_trees(CheckpointReader &in, LocalTrees *trees)
+{
+    int ntrees;
+    trees->clear();
+    if (!in.get_string(&trees->chrom) || !in.get(&trees->start_coord) ||
+        !in.get(&trees->end_coord) || !in.get(&trees->nnodes) ||
+        !in.get_vector(&trees->seqids) || !in.get(&ntrees) || ntrees < 0)
+        return false;
+
+    for (int j=0; j<ntrees; j++) {
+        int blocklen, nnodes, capacity, has_mapping;
+        Spr spr;
+        if (!in.get(&blocklen) || !in.get(&spr) || !in.get(&nnodes) ||
+            !in.get(&capacity) || nnodes != trees->nnodes ||
+            capacity < nnodes)
+            return false;
+        if (!valid_node(spr.recomb_node, nnodes) ||
+            !valid_node(spr.coal_node, nnodes))
+            return false;
+
+        LocalTree *tree = new LocalTree(nnodes, capacity);
+        int *mapping = NULL;
+        trees->trees.push_back(LocalTreeSpr(tree, spr, blocklen));
+        if (!in.get(&tree->root) || tree->root < 0 || tree->root >= nnodes)
+            return false;
+        for (int i=0; i<nnodes; i++) {
+            LocalNode &node = tree->nodes[i];
+            if (!in.get(&node.parent) || !in.get_array(node.child, 2) ||
+                !in.get(&node.age) || !in.get(&node.pop_path))
+                return false;
+            if (!valid_node(node.parent, nnodes) ||
+                !valid_node(node.child[0], nnodes) ||
+                !valid_node(node.child[1], nnodes))
+                return false;
+        }
+        if (!in.get(&has_mapping))
+            return false;
+        if (has_mapping) {
+            // sized like the tree, so set_capacity() can copy it
+            mapping = new int [capacity];
+            trees->trees.back().mapping = mapping;
+            if (!in.get_array(mapping, nnodes))
+                return false;
+            for (int i=0; i<nnodes; i++)
+                if (!valid_node(mapping[i], nnodes))
+                    return false;
+        }
+    }
+    return true;
+}
+
+
+//=============================================================================
+// checkpoint files
+
+void save_checkpoint(vector<char> &data, const LocalTrees *trees,
+                     const ArgModel *model, const Sequences *sequences,
+                     const SitesMapping *sites_mapping,
+                     const SamplerState &state)
+{
+    CheckpointWriter out(data);
+    data.clear();
+
+    out.put_array(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    out.put(CHECKPOINT_VERSION);
+    out.put(CHECKPOINT_BYTE_ORDER);
+
+    out.put(state.iter);
+    out.put(state.rand_state);
+    out.put(int(state.have_rand_norm_spare));
+    out.put(state.rand_norm_spare);
+    out.put_vector(state.invisible_recomb_pos);
+    out.put_vector(state.invisible_recombs);
+
+    save_model(out, model);
+    save_sites_mapping(out, sites_mapping);
+    save_sequences(out, model, sequences);
+    save_local_trees(out, trees);
+}
+
+
+static bool read_checkpoint_data(CheckpointReader &in, LocalTrees *trees,
+                                 ArgModel *model, Sequences *sequences,
+                                 const SitesMapping *sites_mapping,
+                                 SamplerState *state)
+{
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    int version, byte_order, have_spare;
+    if (!in.get_array(magic, sizeof(magic)) ||
+        memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0) {
+        printError("not a checkpoint file");
+        return false;
+    }
+    if (!in.get(&version) || !in.get(&byte_order))
+        return false;
+    if (version != CHECKPOINT_VERSION || byte_order != CHECKPOINT_BYTE_ORDER) {
+        printError("checkpoint was written by another version or kind of"
+                   " machine");
+        return false;
+    }
+
+    if (!in.get(&state->iter) || !in.get(&state->rand_state) ||
+        !in.get(&have_spare) || !in.get(&state->rand_norm_spare) ||
+        !in.get_vector(&state->invisible_recomb_pos) ||
+        !in.get_vector(&state->invisible_recombs))
+        return false;
+    state->have_rand_norm_spare = have_spare;
+
+    return read_model(in, model) &&
+        check_sites_mapping(in, sites_mapping) &&
+        read_sequences(in, model, sequences) &&
+        read_local_trees(in, trees) && in.at_end();
+}
+
+
+bool read_checkpoint(const char *filename, LocalTrees *trees,
+                     ArgModel *model, Sequences *sequences,
+                     const SitesMapping *sites_mapping,
+                     SamplerState *state)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        printError("cannot open checkpoint '%s'", filename);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        printError("cannot read checkpoint '%s'", filename);
+        close(fd);
+        return false;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        printError("cannot map checkpoint '%s'", filename);
+        return false;
+    }
+
+    const char *start = (const char*) addr;
+    CheckpointReader in(start, start + st.st_size);
+    bool ok = read_checkpoint_data(in, trees, model, sequences,
+                                   sites_mapping, state);
+    munmap(addr, st.st_size);
+
+    if (!ok)
+        printError("checkpoint '%s' is truncated or corrupt", filename);
+    return ok;
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,68 @@
+//=============================================================================
+// binary checkpoints of the sampler state
+
+#ifndef ARGWEAVER_CHECKPOINT_H
+#define ARGWEAVER_CHECKPOINT_H
+
+// c++ includes
+#include <vector>
+
+#include "common.h"
+#include "local_tree.h"
+#include "model.h"
+#include "sequences.h"
+
+namespace argweaver {
+
+using namespace std;
+
+
+// State of the sampler outside of the ARG and the model, as it is at the end
+// of an iteration
+class SamplerState
+{
+public:
+    SamplerState() :
+        iter(0),
+        rand_state(0),
+        have_rand_norm_spare(false),
+        rand_norm_spare(0.0)
+    {}
+
+    int iter;                       // last completed iteration
+    unsigned long long rand_state;  // state of the sampler's RandStream
+    bool have_rand_norm_spare;      // cached draw of rand_norm()
+    double rand_norm_spare;
+    vector<int> invisible_recomb_pos;
+    vector<Spr> invisible_recombs;
+};
+
+
+// A checkpoint holds everything the sampler needs to continue a chain
+// exactly where it stopped: the local trees, the sampled model parameters
+// (population sizes, migration matrices), the rate maps, the sites mapping,
+// the sequences (their phase is sampled when the model is unphased) and
+// the sampler state.  Values are stored in native byte order and layout,
+// so a checkpoint can only be read on the kind of machine that wrote it.
+// The header records this and read_checkpoint() refuses foreign files.
+
+// Serialize a checkpoint into 'data'.  sites_mapping may be NULL.
+void save_checkpoint(vector<char> &data, const LocalTrees *trees,
+                     const ArgModel *model, const Sequences *sequences,
+                     const SitesMapping *sites_mapping,
+                     const SamplerState &state);
+
+// Read a checkpoint written from save_checkpoint().  The file is mapped
+// into memory rather than read.  'model' and 'sequences' must already be
+// set up from the same input as the checkpointed run; their sampled values
+// are replaced.  Returns false if the file cannot be read or does not fit
+// the model, sequences or sites mapping.
+bool read_checkpoint(const char *filename, LocalTrees *trees,
+                     ArgModel *model, Sequences *sequences,
+                     const SitesMapping *sites_mapping,
+                     SamplerState *state);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_CHECKPOINT_H
@@ -4,6 +4,11 @@
 
 namespace argweaver {
 
+thread_local RandStream *g_rand_stream = NULL;
+thread_local bool g_rand_norm_have_spare = false;
+thread_local double g_rand_norm_spare = 0.0;
+
+
 /* make a draw from a gamma distribution with parameters 'a' and
  * 'b'. Be sure to call srandom externally.  If a == 1, exp_draw is
  * called.  If a > 1, Best's (1978) rejection algorithm is used, and
@@ -101,41 +101,83 @@ void permute(T* array, int *perm, int size)
 //=============================================================================
 // Math
 
+// A stream of random integers in [0, RAND_MAX] (xorshift64*).  Random
+// numbers normally come from rand().  A thread that installs its own stream
+// with set_thread_rand_stream() draws from that stream instead, so that its
+// draws do not depend on what other threads do.
+class RandStream
+{
+public:
+    RandStream(unsigned long long seed=0) { set_seed(seed); }
+
+    void set_seed(unsigned long long seed)
+    {
+        // splitmix64 of the seed, which is never zero
+        unsigned long long z = seed + 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        state = (z ^ (z >> 31)) | 1;
+    }
+
+    int next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return int(((state * 0x2545F4914F6CDD1DULL) >> 33) %
+                   ((unsigned long long) RAND_MAX + 1));
+    }
+
+    unsigned long long state;
+};
+
+extern thread_local RandStream *g_rand_stream;
+
+// Use 'stream' for the random numbers of the calling thread (NULL: rand())
+inline void set_thread_rand_stream(RandStream *stream)
+{ g_rand_stream = stream; }
+
+inline int rand_int()
+{ return g_rand_stream ? g_rand_stream->next() : rand(); }
+
 inline double frand()
-{ return rand() / double(RAND_MAX); }
+{ return rand_int() / double(RAND_MAX); }
 
 inline double frand(double max)
-{ return rand() / double(RAND_MAX) * max; }
+{ return rand_int() / double(RAND_MAX) * max; }
 
 inline double frand(double min, double max)
-{ return min + (rand() / double(RAND_MAX) * (max-min)); }
+{ return min + (rand_int() / double(RAND_MAX) * (max-min)); }
 
 inline int irand(int max)
 {
-    const int i = int(rand() / float(RAND_MAX) * max);
+    const int i = int(rand_int() / float(RAND_MAX) * max);
     return (i == max) ? max - 1 : i;
 }
 
 inline int irand(int min, int max)
 {
-    const int i = min + int(rand() / float(RAND_MAX) * (max - min));
+    const int i = min + int(rand_int() / float(RAND_MAX) * (max - min));
     return (i == max) ? max - 1 : i;
 }
 
+// rand_norm() draws normals in pairs and keeps the second one for the next
+// call.  It is part of the random state of a thread.
+extern thread_local bool g_rand_norm_have_spare;
+extern thread_local double g_rand_norm_spare;
+
 inline double rand_norm(const double mean=0, const double sd=1) {
-  static bool gen_new=true;
-  static double y=0;
   double x;
   double pi = 3.1415926535897;
-  if (gen_new) {
+  if (!g_rand_norm_have_spare) {
      double r1 = sqrt(-2.0*log(frand()));
      double r2 = 2*pi*frand();
      x = r1 * cos(r2);
-     y = r1 * sin(r2);
-     gen_new = false;
+     g_rand_norm_spare = r1 * sin(r2);
+     g_rand_norm_have_spare = true;
   } else {
-     x = y;
-     gen_new = true;
+     x = g_rand_norm_spare;
+     g_rand_norm_have_spare = false;
   }
   x *= sd;
   x += mean;
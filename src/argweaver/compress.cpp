@@ -1,31 +1,181 @@
 
+#include <fcntl.h>
 #include <unistd.h>
+#include <set>
 #include <string>
 
+#include "bgzf.h"
 #include "compress.h"
+#include "logging.h"
 #include "parsing.h"
 
 namespace argweaver {
 
 using namespace std;
 
+//=============================================================================
+// stdio streams over other readers and writers
+
+// callbacks of a stream from open_read_stream()
+struct ReadStream
+{
+    void *data;
+    ReadStreamFunc read;
+    CloseStreamFunc close;
+};
+
+static ssize_t read_stream_read(void *cookie, char *buf, size_t size)
+{
+    ReadStream *stream = (ReadStream *) cookie;
+    return stream->read(stream->data, buf, size);
+}
+
+static int read_stream_close(void *cookie)
+{
+    ReadStream *stream = (ReadStream *) cookie;
+    const int ret = stream->close ? stream->close(stream->data) : 0;
+    delete stream;
+    return ret == 0 ? 0 : EOF;
+}
+
+#ifdef __APPLE__
+static int read_stream_funopen_read(void *cookie, char *buf, int size)
+{
+    return read_stream_read(cookie, buf, size);
+}
+#endif
+
+
+FILE *open_read_stream(void *data, ReadStreamFunc read, CloseStreamFunc close)
+{
+    ReadStream *stream = new ReadStream();
+    stream->data = data;
+    stream->read = read;
+    stream->close = close;
+#ifdef __APPLE__
+    FILE *file = funopen(stream, read_stream_funopen_read, NULL, NULL,
+                         read_stream_close);
+#else
+    cookie_io_functions_t funcs = {
+        read_stream_read, NULL, NULL, read_stream_close};
+    FILE *file = fopencookie(stream, "r", funcs);
+#endif
+    if (!file)
+        delete stream;
+    return file;
+}
+
+
+static long bgzf_stream_read(void *data, char *buf, long len)
+{
+    return ((BgzfReader *) data)->read(buf, len);
+}
+
+static int bgzf_stream_close_reader(void *data)
+{
+    BgzfReader *reader = (BgzfReader *) data;
+    const int ret = reader->close();
+    delete reader;
+    return ret;
+}
+
+static ssize_t bgzf_stream_write(void *cookie, const char *buf, size_t size)
+{
+    // a short count reports an error to stdio
+    const long n = ((BgzfWriter *) cookie)->write(buf, size);
+    return n < 0 ? 0 : n;
+}
+
+static int bgzf_stream_close_writer(void *cookie)
+{
+    BgzfWriter *writer = (BgzfWriter *) cookie;
+    const int ret = writer->close();
+    delete writer;
+    return ret == 0 ? 0 : EOF;
+}
+
+#ifdef __APPLE__
+static int bgzf_stream_funopen_write(void *cookie, const char *buf, int size)
+{
+    const long n = ((BgzfWriter *) cookie)->write(buf, size);
+    return n < 0 ? -1 : n;
+}
+#endif
+
+
+// Open a compressed file as a stdio stream that is (de)compressed
+// in-process
+static FILE *open_bgzf_stream(const char *filename, const char *mode)
+{
+    if (mode[0] == 'r') {
+        BgzfReader *reader = new BgzfReader();
+        if (!reader->open(filename)) {
+            delete reader;
+            return NULL;
+        }
+        FILE *stream = open_read_stream(reader, bgzf_stream_read,
+                                        bgzf_stream_close_reader);
+        if (!stream)
+            delete reader;
+        return stream;
+    }
+
+    BgzfWriter *writer = new BgzfWriter();
+    if (!writer->open(filename)) {
+        delete writer;
+        return NULL;
+    }
+#ifdef __APPLE__
+    FILE *stream = funopen(writer, NULL, bgzf_stream_funopen_write, NULL,
+                           bgzf_stream_close_writer);
+#else
+    cookie_io_functions_t funcs = {
+        NULL, bgzf_stream_write, NULL, bgzf_stream_close_writer};
+    FILE *stream = fopencookie(writer, "w", funcs);
+#endif
+    if (!stream)
+        delete writer;
+    return stream;
+}
+
+
+//=============================================================================
+// compressed streams
+
+// streams opened with popen()
+static set<FILE*> g_pipes;
+static mutex g_pipes_lock;
+
+
+FILE *open_pipe(const char *command, const char *mode)
+{
+    FILE *stream = popen(command, mode);
+    if (stream) {
+        lock_guard<mutex> guard(g_pipes_lock);
+        g_pipes.insert(stream);
+    }
+    return stream;
+}
+
+
 FILE *read_compress(const char *filename, const char *command)
 {
     bool exists = !access(filename, F_OK);
     if (!exists)
         return NULL;
-    const char *command2 = (command ? command : UNZIP_COMMAND);
-    string cmd = string(command2) + " < " + quote_arg(filename);
-    return popen(cmd.c_str(), "r");
+    if (!command)
+        return open_bgzf_stream(filename, "r");
+    string cmd = string(command) + " < " + quote_arg(filename);
+    return open_pipe(cmd.c_str(), "r");
 }
 
 
 FILE *write_compress(const char *filename, const char *command)
 {
-    // TODO: add check to prevent write error
-    const char *command2 = (command ? command : ZIP_COMMAND);
-    string cmd = string(command2) + " > " + quote_arg(filename);
-    return popen(cmd.c_str(), "w");
+    if (!command)
+        return open_bgzf_stream(filename, "w");
+    string cmd = string(command) + " > " + quote_arg(filename);
+    return open_pipe(cmd.c_str(), "w");
 }
 
 
@@ -38,16 +188,135 @@ FILE *open_compress(const char *filename, const char *mode,
     else if (mode[0] == 'r')
         cmd = string(command) + " < " + quote_arg(filename);
 
-    return popen(cmd.c_str(), mode);
+    return open_pipe(cmd.c_str(), mode);
 }
 
 
 int close_compress(FILE *stream)
 {
+    {
+        lock_guard<mutex> guard(g_pipes_lock);
+        if (g_pipes.erase(stream) == 0)
+            return fclose(stream);
+    }
     return pclose(stream);
 }
 
 
+bool is_compress_filename(const char *filename)
+{
+    int len = strlen(filename);
+    return ((len > 3 && strcmp(&filename[len - 3], ".gz") == 0) ||
+            (len > 4 && strcmp(&filename[len - 4], ".bgz") == 0));
+}
+
+
+//=============================================================================
+// background file writer
+
+AsyncFileWriter::AsyncFileWriter(int max_pending) :
+    max_pending(max_pending),
+    busy(false),
+    stop(false),
+    failed(false)
+{
+    worker = thread(&AsyncFileWriter::run, this);
+}
+
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        stop = true;
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+
+void AsyncFileWriter::write(const string &filename, const WriteFunc &func)
+{
+    unique_lock<mutex> guard(lock);
+    while ((int) jobs.size() >= max_pending)
+        changed.wait(guard);
+    Job job = {filename, func};
+    jobs.push_back(job);
+    changed.notify_all();
+}
+
+
+bool AsyncFileWriter::flush()
+{
+    unique_lock<mutex> guard(lock);
+    while (busy || jobs.size() > 0)
+        changed.wait(guard);
+    bool ok = !failed;
+    failed = false;
+    return ok;
+}
+
+
+void AsyncFileWriter::run()
+{
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        // remaining jobs are written before stopping
+        while (!stop && jobs.size() == 0)
+            changed.wait(guard);
+        if (jobs.size() == 0)
+            break;
+
+        Job job = jobs.front();
+        jobs.pop_front();
+        busy = true;
+        changed.notify_all();
+
+        guard.unlock();
+        bool ok = write_file(job);
+        guard.lock();
+
+        if (!ok)
+            failed = true;
+        busy = false;
+        changed.notify_all();
+    }
+}
+
+
+bool AsyncFileWriter::write_file(const Job &job)
+{
+    const string partfile = job.filename + ".part";
+    const bool compress = is_compress_filename(job.filename.c_str());
+    FILE *out = (compress ? write_compress(partfile.c_str()) :
+                 fopen(partfile.c_str(), "w"));
+    if (!out) {
+        printError("cannot write '%s'", job.filename.c_str());
+        return false;
+    }
+
+    bool ok = job.func(out);
+    if (compress)
+        ok = (close_compress(out) == 0) && ok;
+    else
+        ok = (fclose(out) == 0) && ok;
+
+    // make sure the data are on disk before the file appears
+    int fd = open(partfile.c_str(), O_RDONLY);
+    if (fd == -1 || fsync(fd) != 0)
+        ok = false;
+    if (fd != -1)
+        close(fd);
+
+    if (!ok || rename(partfile.c_str(), job.filename.c_str()) != 0) {
+        printError("error writing '%s'", job.filename.c_str());
+        unlink(partfile.c_str());
+        return false;
+    }
+    return true;
+}
+
+
 } // namespace argweaver
 
 
@@ -4,6 +4,14 @@
 #include <string.h>
 #include <stdio.h>
 
+// c++ includes
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
 namespace argweaver {
 
 
@@ -12,15 +20,35 @@ namespace argweaver {
 #define UNZIP_COMMAND "gunzip -f -"
 
 
-FILE *read_compress(const char *filename, const char *command=UNZIP_COMMAND);
+// Open a compressed file for reading or writing.  Without a command, files
+// are decompressed and written as BGZF in-process (see bgzf.h); otherwise
+// the command is run as a filter through a pipe.
+FILE *read_compress(const char *filename, const char *command=NULL);
 
-FILE *write_compress(const char *filename, const char *command=ZIP_COMMAND);
+FILE *write_compress(const char *filename, const char *command=NULL);
 
 FILE *open_compress(const char *filename, const char *mode,
                     const char *command=ZIP_COMMAND);
 
+// Run a shell command through a pipe that close_compress() can close
+FILE *open_pipe(const char *command, const char *mode);
+
+// Close a stream from any of the functions above.  Returns 0 on success.
 int close_compress(FILE *stream);
 
+// functions behind a stream from open_read_stream()
+typedef long (*ReadStreamFunc)(void *data, char *buf, long len);
+typedef int (*CloseStreamFunc)(void *data);
+
+// Open a read-only stdio stream whose data come from 'read' (which returns
+// the number of bytes read, 0 at the end and -1 on error).  'close' (if
+// not NULL) is called when the stream is closed and returns 0 on success.
+// Close the stream with fclose() or close_compress().
+FILE *open_read_stream(void *data, ReadStreamFunc read, CloseStreamFunc close);
+
+// Returns true if a file is written compressed (ends with .gz or .bgz)
+bool is_compress_filename(const char *filename);
+
 
 class CompressStream
 {
@@ -28,11 +56,9 @@ public:
     CompressStream(const char *filename, const char *mode="r",
                    const char *command=NULL)
     {
-        int len = strlen(filename);
         compress = false;
 
-        if ((len > 3 && strcmp(&filename[len - 3], ".gz") == 0) ||
-            (len > 4 && strcmp(&filename[len - 4], ".bgz") == 0)) {
+        if (is_compress_filename(filename)) {
             compress = true;
             if (mode[0] == 'r')
                 stream = read_compress(filename, command);
@@ -53,15 +79,18 @@ public:
         close();
     }
 
-    void close()
+    // Returns 0 if the stream was closed without errors
+    int close()
     {
+        int ret = 0;
         if (stream) {
             if (compress)
-                close_compress(stream);
+                ret = close_compress(stream);
             else
-                fclose(stream);
+                ret = fclose(stream);
             stream = NULL;
         }
+        return ret;
     }
 
     bool compress;
@@ -69,6 +98,48 @@ public:
 };
 
 
+// Writes files on a background thread, so that formatting and compressing
+// output does not hold up the caller.  A job writes one file through a
+// function given the open (and possibly compressing) stream; the function
+// must only use data owned by the job.  Each file is written to
+// <filename>.part, synced and then renamed, so that readers never see a
+// partial file.  When max_pending jobs are queued, write() blocks until the
+// writer catches up.
+class AsyncFileWriter
+{
+public:
+    typedef std::function<bool(FILE *out)> WriteFunc;
+
+    explicit AsyncFileWriter(int max_pending=2);
+    ~AsyncFileWriter();
+
+    // queue writing a file
+    void write(const std::string &filename, const WriteFunc &func);
+
+    // Wait until all queued files are written.  Returns false if any write
+    // failed since the last flush.
+    bool flush();
+
+protected:
+    struct Job {
+        std::string filename;
+        WriteFunc func;
+    };
+
+    void run();
+    bool write_file(const Job &job);
+
+    int max_pending;
+    std::deque<Job> jobs;
+    bool busy;     // a job is being written
+    bool stop;
+    bool failed;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread worker;
+};
+
+
 } // namespace argweaver
 
 #endif // ARGWEAVER_COMPRESS_H
@@ -1,6 +1,7 @@
 
 #include "common.h"
 #include "emit.h"
+#include "emit_simd.h"
 #include "seq.h"
 #include "thread.h"
 
@@ -149,136 +150,139 @@ void prob_tree_mutation(const LocalTree *tree, const ArgModel *model,
 // table of partial likelihood values
 typedef double lk_row[4];
 
+// Partial likelihoods of every node at every site, stored site-major in one
+// contiguous block so that the four values of a node fill one vector.
+// Tables are taken from an arena when given one and from the heap otherwise.
 class LikelihoodTable
 {
 public:
-    LikelihoodTable(int seqlen, int nnodes) :
+    LikelihoodTable(int seqlen, int nnodes, LikelihoodArena *arena=NULL) :
         seqlen(seqlen),
-        nnodes(nnodes)
+        nnodes(nnodes),
+        owned(NULL)
     {
-        data = new lk_row* [seqlen];
-        for (int i=0; i<seqlen; i++)
-            data[i] = new double [nnodes][4];
+        const size_t n = size_t(seqlen) * nnodes * 4;
+        data = (lk_row*) (arena ? arena->alloc(n) : (owned = new double [n]));
     }
 
     ~LikelihoodTable()
     {
-        for (int i=0; i<seqlen; i++)
-            delete [] data[i];
-        delete [] data;
+        delete [] owned;
     }
 
+    // partial likelihoods of all nodes at site i
+    lk_row *operator[](int i) const { return data + size_t(i) * nnodes; }
+
     int seqlen;
     int nnodes;
-    lk_row **data;
+    lk_row *data;
+
+protected:
+    double *owned;
 };
 
 
-// calculate inner partial likelihood for one node and site
-inline void likelihood_site_node_inner(
-    const LocalTree *tree, const int node,
-    const char *const *seqs,
-    const vector<vector<BaseProbs> > &base_probs,
-    const int pos,
-    const double *muts, const double *nomuts, lk_row* inner)
+//=============================================================================
+// likelihood table arena
+
+LikelihoodArena::~LikelihoodArena()
 {
-    const LocalNode* nodes = tree->nodes;
-    const int j = node;
-
-    if (nodes[j].is_leaf()) {
-        // leaf case
-        const char c = seqs[j][pos];
-        if (c == 'N') {
-            inner[j][0] = 1.0;
-            inner[j][1] = 1.0;
-            inner[j][2] = 1.0;
-            inner[j][3] = 1.0;
-        } else if (base_probs.size() > 0) {
-            for (int k=0; k < 4; k++)
-                inner[j][k] = base_probs[j][pos].prob[k];
-        } else {
-            inner[j][0] = 0.0;
-            inner[j][1] = 0.0;
-            inner[j][2] = 0.0;
-            inner[j][3] = 0.0;
-            inner[j][dna2int[(int) c]] = 1.0;
-        }
-    } else {
-        // internal node case
-        int c1 = nodes[j].child[0];
-        int c2 = nodes[j].child[1];
-
-        for (int a=0; a<4; a++) {
-            double p1 = 0.0;
-            double p2 = 0.0;
-
-            for (int b=0; b<4; b++) {
-                if (a == b) {
-                    p1 += inner[c1][b] * nomuts[c1];
-                    p2 += inner[c2][b] * nomuts[c2];
-                } else {
-                    p1 += inner[c1][b] * muts[c1];
-                    p2 += inner[c2][b] * muts[c2];
-                }
-            }
+    for (unsigned int i=0; i<full_slabs.size(); i++)
+        free(full_slabs[i]);
+    free(slab);
+}
 
-            inner[j][a] = p1 * p2;
-        }
+
+double *LikelihoodArena::alloc(size_t n)
+{
+    // keep every table cache line aligned
+    n = (n + 7) & ~size_t(7);
+
+    if (used + n > size) {
+        // full slabs stay alive until the next reset
+        if (slab)
+            full_slabs.push_back(slab);
+        size = max(2 * size, n);
+        slab = new_slab(size);
+        used = 0;
     }
+
+    double *ptr = slab + used;
+    used += n;
+    total += n;
+    return ptr;
 }
 
 
-// calculate outer partial likelihood for one node and site
-inline void likelihood_site_node_outer(
-    const LocalTree *tree, const int root, const int node,
-    const double *muts, const double *nomuts,
-    lk_row* outer, lk_row* inner)
+void LikelihoodArena::reset()
 {
-    const LocalNode* nodes = tree->nodes;
-    const int j = node;
-
-    if (node == root) {
-        // root case
-        outer[j][0] = 1.0;
-        outer[j][1] = 1.0;
-        outer[j][2] = 1.0;
-        outer[j][3] = 1.0;
-    } else {
-        // non-root case
-        int sib = tree->get_sibling(j);
-        int parent = nodes[j].parent;
+    // merge all slabs into one large enough for the previous block
+    if (full_slabs.size() > 0) {
+        for (unsigned int i=0; i<full_slabs.size(); i++)
+            free(full_slabs[i]);
+        full_slabs.clear();
+        free(slab);
+        size = max(size, total);
+        slab = new_slab(size);
+    }
+    used = 0;
+    total = 0;
+}
 
-        if (parent != root) {
-            for (int a=0; a<4; a++) {
-                double p1 = 0.0;
-                double p2 = 0.0;
-                for (int b=0; b<4; b++) {
-                    if (a == b) {
-                        p1 += inner[sib][b] * nomuts[sib];
-                        p2 += outer[parent][b] * nomuts[parent];
-                    } else {
-                        p1 += inner[sib][b] * muts[sib];
-                        p2 += outer[parent][b] * muts[parent];
-                    }
-                }
-                outer[j][a] = p1 * p2;
-            }
-        } else {
-            for (int a=0; a<4; a++) {
-                double p1 = 0.0;
-                for (int b=0; b<4; b++) {
-                    if (a == b)
-                        p1 += inner[sib][b] * nomuts[sib];
-                    else
-                        p1 += inner[sib][b] * muts[sib];
-                }
-                outer[j][a] = p1;
-            }
-        }
+
+double *LikelihoodArena::new_slab(size_t n)
+{
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, 64, n * sizeof(double)) != 0)
+        abort();
+    nallocs++;
+    return (double*) ptr;
+}
+
+
+// Returns the likelihood table arena of the calling thread
+LikelihoodArena &get_likelihood_arena()
+{
+    static thread_local LikelihoodArena arena;
+    return arena;
+}
+
+
+// calculate inner partial likelihood of a leaf with base c (and base
+// probabilities bp, if given)
+static inline void leaf_inner(const char c, const BaseProbs *bp,
+                              double *inner)
+{
+    if (c == 'N') {
+        inner[0] = 1.0;
+        inner[1] = 1.0;
+        inner[2] = 1.0;
+        inner[3] = 1.0;
+    } else if (bp) {
+        for (int k=0; k < 4; k++)
+            inner[k] = bp->prob[k];
+    } else {
+        inner[0] = 0.0;
+        inner[1] = 0.0;
+        inner[2] = 0.0;
+        inner[3] = 0.0;
+        inner[dna2int[(int) c]] = 1.0;
     }
 }
 
 
+// calculate inner partial likelihood for one leaf and site
+static inline void likelihood_site_leaf_inner(
+    const int leaf, const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs,
+    const int pos, lk_row* inner)
+{
+    leaf_inner(seqs[leaf][pos],
+               base_probs.size() > 0 ? &base_probs[leaf][pos] : NULL,
+               inner[leaf]);
+}
+
+
 // calculate entire inner partial likelihood table
 double likelihood_site_inner(
     const LocalTree *tree, const char *const *seqs,
@@ -286,10 +290,20 @@ double likelihood_site_inner(
     const int pos, const int *order, const int norder,
     const double *muts, const double *nomuts, lk_row* inner)
 {
+    const LocalNode* nodes = tree->nodes;
+
     // iterate postorder through nodes
-    for (int i=0; i<norder; i++)
-        likelihood_site_node_inner(
-            tree, order[i], seqs, base_probs, pos, muts, nomuts, inner);
+    for (int i=0; i<norder; i++) {
+        const int j = order[i];
+        if (nodes[j].is_leaf()) {
+            likelihood_site_leaf_inner(j, seqs, base_probs, pos, inner);
+        } else {
+            const int c1 = nodes[j].child[0];
+            const int c2 = nodes[j].child[1];
+            prune_branches(1, 0, inner[c1], muts[c1], nomuts[c1],
+                           inner[c2], muts[c2], nomuts[c2], inner[j]);
+        }
+    }
 
     // sum over root node
     double p = 0.0;
@@ -301,14 +315,51 @@ double likelihood_site_inner(
 }
 
 
-// calculate eniter outer partial likelihood table
-void likelihood_site_outer(
-    const LocalTree *tree,
+// calculate inner partial likelihood tables of several sites, one node
+// at a time for all sites
+void likelihood_sites_inner(
+    const LocalTree *tree, const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs,
+    const vector<int> &sites, const int *order, const int norder,
+    const double *muts, const double *nomuts, LikelihoodTable &inner)
+{
+    const LocalNode* nodes = tree->nodes;
+    const int nsites = sites.size();
+    const int stride = 4 * inner.nnodes;
+    if (nsites == 0)
+        return;
+
+    // iterate postorder through nodes
+    for (int i=0; i<norder; i++) {
+        const int j = order[i];
+        if (nodes[j].is_leaf()) {
+            for (int k=0; k<nsites; k++)
+                likelihood_site_leaf_inner(j, seqs, base_probs, sites[k],
+                                           inner[k]);
+        } else {
+            const int c1 = nodes[j].child[0];
+            const int c2 = nodes[j].child[1];
+            prune_branches(nsites, stride,
+                           inner[0][c1], muts[c1], nomuts[c1],
+                           inner[0][c2], muts[c2], nomuts[c2], inner[0][j]);
+        }
+    }
+}
+
+
+// calculate outer partial likelihood tables of several sites, one node
+// at a time for all sites
+void likelihood_sites_outer(
+    const LocalTree *tree, const int nsites,
     const double *muts, const double *nomuts, bool internal,
-    lk_row *inner, lk_row *outer)
+    LikelihoodTable &inner, LikelihoodTable &outer)
 {
+    const LocalNode* nodes = tree->nodes;
+    const int stride = 4 * outer.nnodes;
     int queue[tree->nnodes];
     int top = 0;
+    if (nsites == 0)
+        return;
 
     // process in preorder
     int maintree_root = internal ? tree->nodes[tree->root].child[1] :
@@ -316,24 +367,43 @@ void likelihood_site_outer(
     queue[top++] = maintree_root;
     while (top > 0) {
         int node = queue[--top];
-        likelihood_site_node_outer(tree, maintree_root, node,
-                                   muts, nomuts, outer, inner);
+
+        if (node == maintree_root) {
+            // root case
+            for (int k=0; k<nsites; k++)
+                for (int a=0; a<4; a++)
+                    outer[k][node][a] = 1.0;
+        } else {
+            // non-root case
+            int sib = tree->get_sibling(node);
+            int parent = nodes[node].parent;
+            if (parent != maintree_root)
+                prune_branches(nsites, stride,
+                               inner[0][sib], muts[sib], nomuts[sib],
+                               outer[0][parent], muts[parent], nomuts[parent],
+                               outer[0][node]);
+            else
+                prune_branches(nsites, stride,
+                               inner[0][sib], muts[sib], nomuts[sib],
+                               NULL, 0.0, 0.0, outer[0][node]);
+        }
 
         // recurse
-        if (!tree->nodes[node].is_leaf()) {
-            queue[top++] = tree->nodes[node].child[0];
-            queue[top++] = tree->nodes[node].child[1];
+        if (!nodes[node].is_leaf()) {
+            queue[top++] = nodes[node].child[0];
+            queue[top++] = nodes[node].child[1];
         }
     }
 }
 
 
+// calculate inner and outer tables for the given sites.  inner[k] and
+// outer[k] hold the tables of site sites[k].
 void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
                       const char *const *seqs,
                       const vector<vector<BaseProbs> > &base_probs,
-                      const int seqlen,
-                      const bool *variant, bool internal,
-                      lk_row **inner, lk_row **outer)
+                      const vector<int> &sites, bool internal,
+                      LikelihoodTable &inner, LikelihoodTable &outer)
 {
     // get postorder
     int norder = tree->nnodes;
@@ -347,13 +417,24 @@ void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
     prob_tree_mutation(tree, model, muts, nomuts);
 
     // calculate emissions for tree at each site
-    for (int i=0; i<seqlen; i++) {
-        if (variant[i]) {
-            likelihood_site_inner(tree, seqs, base_probs, i, order, norder,
-                                  muts, nomuts, inner[i]);
-            likelihood_site_outer(tree, muts, nomuts, internal,
-                                  inner[i], outer[i]);
-        }
+    likelihood_sites_inner(tree, seqs, base_probs, sites, order, norder,
+                           muts, nomuts, inner);
+    likelihood_sites_outer(tree, sites.size(), muts, nomuts, internal,
+                           inner, outer);
+}
+
+
+// calculate inner table of a single leaf for the given sites
+static void calc_leaf_inner(const char *const *seqs,
+                            const vector<vector<BaseProbs> > &base_probs,
+                            const int leaf, const vector<int> &sites,
+                            LikelihoodTable &inner)
+{
+    for (unsigned int k=0; k<sites.size(); k++) {
+        const int i = sites[k];
+        leaf_inner(seqs[leaf][i],
+                   base_probs.size() > 0 ? &base_probs[leaf][i] : NULL,
+                   inner[k][0]);
     }
 }
 
@@ -364,7 +445,7 @@ void likelihood_sites(const LocalTree *tree, const ArgModel *model,
                       const vector<vector<BaseProbs> > &base_probs,
                       const int seqlen, const int statei,
                       const bool *variant,
-                      double **emit, lk_row **table,
+                      double **emit, LikelihoodTable &table,
                       const int prev_node=-1, const int new_node=-1)
 {
     const double *times = model->times;
@@ -441,7 +522,6 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
     const double *times = model->times;
     const int nnodes = tree->nnodes;
     const LocalNode *nodes = tree->nodes;
-    double invariant_lk = -1;
     lk_row table[nnodes];
 
     // get postorder
@@ -462,27 +542,53 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
     }
 
 
-    // calculate emissions for tree at each site
-    double lnl = 0.0;
+    // group variant sites by pattern (-1 for invariant, -2 for masked sites)
+    SitePatterns patterns;
+    vector<int> site_pattern(max(end - start, 0));
+    int invariant_site = -1;
     for (int i=start; i<end; i++) {
-        double lk;
         bool invariant = is_invariant_site(seqs, nseqs, i, base_probs);
-        if (invariant && seqs[0][i] == 'N')
-            continue;
+        if (invariant && seqs[0][i] == 'N') {
+            site_pattern[i - start] = -2;
+        } else if (invariant) {
+            site_pattern[i - start] = -1;
+            if (invariant_site == -1)
+                invariant_site = i;
+        } else {
+            site_pattern[i - start] = patterns.add(seqs, base_probs, nseqs, i);
+        }
+    }
 
-        if (invariant && invariant_lk > 0)
-            // use precommuted invariant site likelihood
-            lk = invariant_lk;
-        else {
-            lk = likelihood_site_inner(tree, seqs, base_probs, i, order,
-                                       tree->nnodes, muts, nomuts, table);
+    // calculate likelihood of each pattern, one node for all patterns
+    const int npatterns = patterns.size();
+    LikelihoodArena &arena = get_likelihood_arena();
+    arena.reset();
+    LikelihoodTable inner(npatterns, nnodes, &arena);
+    likelihood_sites_inner(tree, seqs, base_probs, patterns.sites,
+                           order, nnodes, muts, nomuts, inner);
+    vector<double> pattern_lnl(npatterns);
+    for (int p=0; p<npatterns; p++) {
+        double lk = 0.0;
+        for (int a=0; a<4; a++)
+            lk += inner[p][tree->root][a] * .25;
+        pattern_lnl[p] = log(lk);
+    }
 
-            // save invariant likelihood
-            if (invariant)
-                invariant_lk = lk;
-        }
+    // use precommuted invariant site likelihood
+    double invariant_lnl = 0.0;
+    if (invariant_site != -1)
+        invariant_lnl = log(likelihood_site_inner(
+            tree, seqs, base_probs, invariant_site, order, nnodes,
+            muts, nomuts, table));
 
-        lnl += log(lk);
+    // sum over sites
+    double lnl = 0.0;
+    for (int i=start; i<end; i++) {
+        const int p = site_pattern[i - start];
+        if (p == -1)
+            lnl += invariant_lnl;
+        else if (p >= 0)
+            lnl += pattern_lnl[p];
     }
 
     return lnl;
@@ -657,41 +763,70 @@ void get_infinite_sites_states(const States &states, const LocalTree *tree,
 
 
 
-double calc_emit(lk_row *in, lk_row *out, lk_row *in2,
-		 int i, int node1, int node2, int maintree_root,
-		 double *nomut, double *mut) {
-    double emit=0.0;
-    for (int a=0; a<4; a++) {
-	double p1 = 0.0, p2 = 0.0, p3 = 0.0;
-	for (int b=0; b<4; b++) {
-	    if (a == b) {
-		p1 += in2[node1][b] * nomut[0];
-		p2 += in[node2][b] * nomut[1];
-		p3 += out[node2][b] * nomut[2];
-	    } else {
-		p1 += in2[node1][b] * mut[0];
-		p2 += in[node2][b] * mut[1];
-		p3 += out[node2][b] * mut[2];
-	    }
-	}
-
-	if (node2 != maintree_root) {
-	    emit += p1 * p2 * p3 * .25;
-	} else {
-	    emit += p1 * p2 * .25;
-	}
+//=============================================================================
+// emission tables
+
+int SitePatterns::add(const char *const *seqs,
+                      const vector<vector<BaseProbs> > &base_probs,
+                      int nseqs, int pos)
+{
+    // key is the column of alleles followed by the base probabilities
+    const bool have_base_probs = base_probs.size() > 0;
+    key.resize(nseqs + (have_base_probs ? nseqs * sizeof(double[4]) : 0));
+    for (int j=0; j<nseqs; j++)
+        key[j] = seqs[j][pos];
+    if (have_base_probs) {
+        for (int j=0; j<nseqs; j++)
+            memcpy(&key[nseqs + j * sizeof(double[4])],
+                   base_probs[j][pos].prob, sizeof(double[4]));
     }
-    return emit;
+
+    pair<unordered_map<string, int>::iterator, bool> it =
+        ids.insert(make_pair(key, (int) sites.size()));
+    if (it.second)
+        sites.push_back(pos);
+    return it.first->second;
 }
 
 
+void EmissionTable::alloc(int _seqlen, int _nstates, int _npatterns,
+                          const int *site_pattern, const bool *masked)
+{
+    clear();
+    seqlen = _seqlen;
+    nstates = _nstates;
+    npatterns = _npatterns;
+
+    data = new double [(2 + npatterns) * nstates];
+    rows = new double* [seqlen];
+    for (int j=0; j<nstates; j++)
+        data[j] = 1.0;
+
+    for (int i=0; i<seqlen; i++) {
+        if (site_pattern && site_pattern[i] != -1)
+            rows[i] = pattern_row(site_pattern[i]);
+        else if (masked && masked[i])
+            rows[i] = masked_row();
+        else
+            rows[i] = invariant_row();
+    }
+}
+
+
+void EmissionTable::copy_dense(double **emit) const
+{
+    for (int i=0; i<seqlen; i++)
+        for (int j=0; j<nstates; j++)
+            emit[i][j] = rows[i][j];
+}
+
 
 // calculate emissions for external branch resampling
 void calc_emissions(const States &states, const LocalTree *tree,
                     const char *const *seqs,
                     const vector<vector<BaseProbs> > &base_probs,
                     int nseqs, int seqlen,
-                    const ArgModel *model, bool internal, double **emit,
+                    const ArgModel *model, bool internal, EmissionTable *emit,
 		    PhaseProbs *phase_pr)
 {
     const int nstates = states.size();
@@ -704,8 +839,8 @@ void calc_emissions(const States &states, const LocalTree *tree,
 
     // special case: ignore fully specified local tree
     if (internal && nstates == 0) {
-        for (int i=0; i<seqlen; i++)
-            emit[i][0] = 1.0;
+        emit->alloc(seqlen, 1, 0, NULL, NULL);
+        emit->invariant_row()[0] = 1.0;
         return;
     }
 
@@ -716,55 +851,61 @@ void calc_emissions(const States &states, const LocalTree *tree,
     find_variant_sites(seqs, nseqs, seqlen, variant, base_probs);
     find_masked_sites(seqs, nseqs, seqlen, masked, variant);
 
-
-    // compute inner and outer likelihood tables
-    LikelihoodTable inner(seqlen, tree->nnodes);
-    LikelihoodTable inner_subtree(seqlen, 1);
-    LikelihoodTable outer(seqlen, tree->nnodes);
-    calc_inner_outer(tree, model, seqs, base_probs, seqlen, variant, internal,
-                     inner.data, outer.data);
-
-    if (!internal) {
-        // compute inner table for new leaf
-        for (int i=0; i<seqlen; i++) {
-            const char c = seqs[newleaf][i];
-            if (c == 'N') {
-                inner_subtree.data[i][0][0] = 1.0;
-                inner_subtree.data[i][0][1] = 1.0;
-                inner_subtree.data[i][0][2] = 1.0;
-                inner_subtree.data[i][0][3] = 1.0;
-            } else if (base_probs.size() > 0) {
-                for (int j=0; j < 4; j++)
-                    inner_subtree.data[i][0][j] = base_probs[newleaf][i].prob[j];
-            } else {
-                inner_subtree.data[i][0][0] = 0.0;
-                inner_subtree.data[i][0][1] = 0.0;
-                inner_subtree.data[i][0][2] = 0.0;
-                inner_subtree.data[i][0][3] = 0.0;
-                inner_subtree.data[i][0][dna2int[(int) c]] = 1.0;
+    // group variant sites by pattern
+    SitePatterns patterns;
+    int *site_pattern = new int [seqlen];
+    for (int i=0; i<seqlen; i++)
+        site_pattern[i] = (variant[i] && !masked[i]) ?
+            patterns.add(seqs, base_probs, nseqs, i) : -1;
+    const vector<int> &sites = patterns.sites;
+    const int npatterns = patterns.size();
+    emit->alloc(seqlen, nstates, npatterns, site_pattern, masked);
+
+
+    // compute inner and outer likelihood tables for each pattern
+    LikelihoodArena &arena = get_likelihood_arena();
+    arena.reset();
+    LikelihoodTable inner(npatterns, tree->nnodes, &arena);
+    LikelihoodTable inner_subtree(npatterns, 1, &arena);
+    LikelihoodTable outer(npatterns, tree->nnodes, &arena);
+    calc_inner_outer(tree, model, seqs, base_probs, sites, internal,
+                     inner, outer);
+
+    // compute inner table for new leaf
+    if (!internal)
+        calc_leaf_inner(seqs, base_probs, newleaf, sites, inner_subtree);
+
+    // find patterns that are heterozygous in the unphased pair
+    vector<int> het_sites;
+    vector<int> het_index(npatterns, -1);
+    if (model->unphased && phase_pr != NULL &&
+	phase_pr->treemap1 >= 0 && phase_pr->treemap1 < nseqs &&
+	phase_pr->treemap2 >= 0 && phase_pr->treemap2 < nseqs) {
+	for (int p=0; p < npatterns; p++) {
+            const int i = sites[p];
+	    bool het = (seqs[phase_pr->treemap1][i] !=
+                        seqs[phase_pr->treemap2][i]);
+            if (base_probs.size() > 0 && !het)
+                het = ! (base_probs[phase_pr->treemap1][i].is_equal(
+                         base_probs[phase_pr->treemap2][i]));
+            if (het) {
+                het_index[p] = het_sites.size();
+                het_sites.push_back(i);
             }
         }
     }
 
-    LikelihoodTable inner2(seqlen, tree->nnodes);
-    LikelihoodTable inner_subtree2(seqlen, 1);
-    LikelihoodTable outer2(seqlen, tree->nnodes);
-    bool *het = NULL;
-    if (model->unphased && phase_pr != NULL &&
-	phase_pr->treemap1 >= 0 && phase_pr->treemap1 < nseqs &&
-	phase_pr->treemap2 >= 0 && phase_pr->treemap2 < nseqs) {
+    // compute likelihood tables with the pair's phase flipped
+    const int nhet = het_sites.size();
+    LikelihoodTable inner2(nhet, tree->nnodes, &arena);
+    LikelihoodTable inner_subtree2(nhet, 1, &arena);
+    LikelihoodTable outer2(nhet, tree->nnodes, &arena);
+    if (nhet > 0) {
 	const char *subseqs[nseqs];
 	for (int i=0; i < nseqs; i++)
 	    subseqs[i] = seqs[i];
 	subseqs[phase_pr->treemap1] = seqs[phase_pr->treemap2];
 	subseqs[phase_pr->treemap2] = seqs[phase_pr->treemap1];
-	het = new bool[seqlen];
-	for (int i=0; i < seqlen; i++) {
-	    het[i] = (seqs[phase_pr->treemap1][i] != seqs[phase_pr->treemap2][i]);
-            if (base_probs.size() > 0 && !het[i])
-                het[i] = ! (base_probs[phase_pr->treemap1][i].is_equal(
-                            base_probs[phase_pr->treemap2][i]));
-        }
         vector<vector<BaseProbs> > base_probs2;
         if (base_probs.size() > 0) {
             for (int i=0; i < nseqs; i++) {
@@ -776,30 +917,13 @@ void calc_emissions(const States &states, const LocalTree *tree,
             }
         }
 
-	calc_inner_outer(tree, model, subseqs, base_probs2, seqlen, het,
-			 internal, inner2.data, outer2.data);
-
-	if (!internal) {
-	    // compute inner table for new leaf
-	    for (int i=0; i<seqlen; i++) {
-		const char c = subseqs[newleaf][i];
-		if (c == 'N') {
-		    inner_subtree2.data[i][0][0] = 1.0;
-		    inner_subtree2.data[i][0][1] = 1.0;
-		    inner_subtree2.data[i][0][2] = 1.0;
-		    inner_subtree2.data[i][0][3] = 1.0;
-                } else if (base_probs2.size() > 0) {
-                    for (int j=0; j < 4; j++)
-                        inner_subtree2.data[i][0][j] = base_probs2[newleaf][i].prob[j];
-		} else {
-		    inner_subtree2.data[i][0][0] = 0.0;
-		    inner_subtree2.data[i][0][1] = 0.0;
-		    inner_subtree2.data[i][0][2] = 0.0;
-		    inner_subtree2.data[i][0][3] = 0.0;
-		    inner_subtree2.data[i][0][dna2int[(int) c]] = 1.0;
-		}
-	    }
-	}
+	calc_inner_outer(tree, model, subseqs, base_probs2, het_sites,
+			 internal, inner2, outer2);
+
+	// compute inner table for new leaf
+	if (!internal)
+	    calc_leaf_inner(subseqs, base_probs2, newleaf, het_sites,
+                            inner_subtree2);
     }
 
     // calc tree lengths
@@ -837,14 +961,18 @@ void calc_emissions(const States &states, const LocalTree *tree,
     }
 
 
-    // populate emission table
+    // branch probabilities of each state
+    const int node1 = internal ? subtree_root : 0;
+    int node2s[nstates];
+    double muts[nstates][3], nomuts[nstates][3];
+    double *invariant_row = emit->invariant_row();
     for (int j=0; j<nstates; j++) {
         State state = states[j];
 
         // get nodes
-        int node1 = internal ? subtree_root : 0;
         int node2 = state.node;
         int parent = tree->nodes[node2].parent;
+        node2s[j] = node2;
 
         // get times
         double time1 = internal ? model->times[tree->nodes[node1].age] : 0.0;
@@ -854,7 +982,8 @@ void calc_emissions(const States &states, const LocalTree *tree,
         double coal_time = model->times[state.time];
 
         // get distances
-	double dist[3], mut[3], nomut[3];
+	double dist[3];
+        double *mut = muts[j], *nomut = nomuts[j];
         double curr_mintime = model->get_mintime(state.time);
         dist[0] = max(coal_time - time1, curr_mintime);
         dist[1] = max(coal_time - time2, curr_mintime);
@@ -880,58 +1009,75 @@ void calc_emissions(const States &states, const LocalTree *tree,
                 + max(coal_time - time1, curr_mintime);
 
         // calculate invariant_lk
-        double invariant_lk = .25 * exp(- model->mu * treelen);
+        invariant_row[j] = .25 * exp(- model->mu * treelen);
+    }
+
+    // fill in rows of variant site patterns
+    vector<double> emit2(nstates);
+    vector<double> phase_probs(nhet * nstates);
+    for (int p=0; p<npatterns; p++) {
+        double *row = emit->pattern_row(p);
+        calc_emit_row(nstates, internal ? inner[p][node1] : inner_subtree[p][0],
+                      inner[p][0], outer[p][0], node2s, maintree_root,
+                      muts, nomuts, row);
+        for (int j=0; j<nstates; j++)
+            assert(!isnan(row[j]));
+
+        const int h = het_index[p];
+        if (h != -1) {
+            calc_emit_row(nstates,
+                          internal ? inner2[h][node1] : inner_subtree2[h][0],
+                          inner2[h][0], outer2[h][0], node2s, maintree_root,
+                          muts, nomuts, &emit2[0]);
+            for (int j=0; j<nstates; j++) {
+                phase_probs[h * nstates + j] = row[j] / (row[j] + emit2[j]);
+                row[j] += emit2[j];
+                row[j] *= 0.5;
+                assert(!isnan(row[j]));
+            }
+        }
+    }
 
-        // fill in row of emission table
+    // record phase probabilities of each heterozygous site
+    if (nhet > 0) {
         for (int i=0; i<seqlen; i++) {
-            if (masked[i]) {
-                // masked site
-                emit[i][j] = 1.0;
-            } else if (!variant[i]) {
-                // invariant site
-                emit[i][j] = invariant_lk;
-            } else {
-		emit[i][j] = calc_emit(inner.data[i], outer.data[i],
-				       internal ? inner.data[i] : inner_subtree.data[i],
-				       i, node1, node2, maintree_root,
-				       nomut, mut);
-                assert(!isnan(emit[i][j]));
-		if (het != NULL && het[i]) {
-		    double emit2 = calc_emit(inner2.data[i], outer2.data[i],
-					    internal ? inner2.data[i] : inner_subtree2.data[i],
-					    i, node1, node2, maintree_root,
-					    nomut, mut);
-		    phase_pr->add(i, j, emit[i][j]/(emit[i][j] + emit2), nstates);
-		    emit[i][j] += emit2;
-		    emit[i][j] *= 0.5;
-                    assert(!isnan(emit[i][j]));
-		}
+            const int p = site_pattern[i];
+            if (p != -1 && het_index[p] != -1) {
+                const int h = het_index[p];
+                double *phase_row = phase_pr->get_row(i, nstates);
+                for (int j=0; j<nstates; j++)
+                    phase_row[j] = phase_probs[h * nstates + j];
             }
         }
     }
 
     // optionally enforce infinite sites model
     if (model->infsites_penalty < 1.0) {
+        // only the first site of each pattern needs to be checked
+        bool *first = new bool [seqlen];
+        fill(first, first + seqlen, false);
+        for (int p=0; p<npatterns; p++)
+            first[sites[p]] = true;
 
         bool **valid_states = new_matrix<bool>(seqlen, nstates);
         get_infinite_sites_states(states, tree, seqs, nseqs, seqlen,
-                                  variant, internal, valid_states,
+                                  first, internal, valid_states,
                                   model->unphased ? phase_pr : NULL);
-        for (int i=0; i<seqlen; i++) {
-            if (variant[i]) {
-                for (int j=0; j<nstates; j++)
-                    if (!valid_states[i][j])
-                        emit[i][j] *= model->infsites_penalty;
-            }
+        for (int p=0; p<npatterns; p++) {
+            double *row = emit->pattern_row(p);
+            for (int j=0; j<nstates; j++)
+                if (!valid_states[sites[p]][j])
+                    row[j] *= model->infsites_penalty;
         }
         delete_matrix<bool>(valid_states, seqlen);
+        delete [] first;
     }
 
 
     // clean up
     delete [] variant;
     delete [] masked;
-    if (het != NULL) delete [] het;
+    delete [] site_pattern;
 }
 
 // calculate emissions for external branch resampling
@@ -939,7 +1085,7 @@ void calc_emissions_external(const States &states, const LocalTree *tree,
                              const char *const *seqs,
                              const vector<vector<BaseProbs> > &base_probs,
                              int nseqs, int seqlen,
-                             const ArgModel *model, double **emit,
+                             const ArgModel *model, EmissionTable *emit,
 			     PhaseProbs *phase_pr)
 {
     calc_emissions(states, tree, seqs, base_probs, nseqs, seqlen, model, false,
@@ -951,13 +1097,41 @@ void calc_emissions_internal(const States &states, const LocalTree *tree,
                              const char *const *seqs,
                              const vector<vector<BaseProbs> > &base_probs,
                              int nseqs, int seqlen,
-                             const ArgModel *model, double **emit,
+                             const ArgModel *model, EmissionTable *emit,
                              PhaseProbs *phase_pr)
 {
     calc_emissions(states, tree, seqs, base_probs, nseqs, seqlen, model, true,
 		   emit, phase_pr);
 }
 
+// calculate dense emission matrix for external branch resampling
+void calc_emissions_external(const States &states, const LocalTree *tree,
+                             const char *const *seqs,
+                             const vector<vector<BaseProbs> > &base_probs,
+                             int nseqs, int seqlen,
+                             const ArgModel *model, double **emit,
+			     PhaseProbs *phase_pr)
+{
+    EmissionTable table;
+    calc_emissions(states, tree, seqs, base_probs, nseqs, seqlen, model, false,
+                   &table, phase_pr);
+    table.copy_dense(emit);
+}
+
+// calculate dense emission matrix for internal branch resampling
+void calc_emissions_internal(const States &states, const LocalTree *tree,
+                             const char *const *seqs,
+                             const vector<vector<BaseProbs> > &base_probs,
+                             int nseqs, int seqlen,
+                             const ArgModel *model, double **emit,
+                             PhaseProbs *phase_pr)
+{
+    EmissionTable table;
+    calc_emissions(states, tree, seqs, base_probs, nseqs, seqlen, model, true,
+		   &table, phase_pr);
+    table.copy_dense(emit);
+}
+
 
 
 
@@ -1256,7 +1430,7 @@ void calc_emissions_external_slow(
 
         likelihood_sites(&tree2, model, seqs, base_probs,
                          seqlen, j, variant, emit,
-                         table.data, -1, -1);
+                         table, -1, -1);
 
         remove_tree_branch(&tree2, newleaf, model, NULL);
     }
@@ -1301,7 +1475,7 @@ void calc_emissions_internal_slow(
         apply_spr(&tree2, add_spr);
 
         likelihood_sites(&tree2, model, seqs, base_probs, seqlen, j, variant,
-                         emit, table.data, -1, -1);
+                         emit, table, -1, -1);
 
         Spr remove_spr(subtree_root, subtree_root_age,
                        tree2.root, maxtime);
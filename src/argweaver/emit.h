@@ -1,6 +1,10 @@
 #ifndef ARGWEAVER_EMIT_H
 #define ARGWEAVER_EMIT_H
 
+// c++ includes
+#include <string>
+#include <unordered_map>
+
 #include "local_tree.h"
 #include "model.h"
 #include "states.h"
@@ -8,6 +12,132 @@
 
 namespace argweaver {
 
+
+// Memory for the partial likelihood tables of a block.  Tables are carved
+// out of one contiguous, cache line aligned slab, which is reused for the
+// next block after reset() instead of being freed.
+class LikelihoodArena
+{
+public:
+    LikelihoodArena() :
+        nallocs(0),
+        size(0),
+        used(0),
+        total(0),
+        slab(NULL)
+    {}
+    ~LikelihoodArena();
+
+    // Returns aligned memory for n doubles, valid until the next reset
+    double *alloc(size_t n);
+
+    // make all memory available again
+    void reset();
+
+    int nallocs;    // number of slabs allocated so far
+
+protected:
+    double *new_slab(size_t n);
+
+    size_t size;    // doubles in current slab
+    size_t used;    // doubles used in current slab
+    size_t total;   // doubles used since last reset
+    double *slab;
+    vector<double*> full_slabs;
+};
+
+// Returns the likelihood table arena of the calling thread
+LikelihoodArena &get_likelihood_arena();
+
+
+// Groups sites by their pattern: the alleles of all sequences at the site,
+// together with their base probabilities when given.  Sites with the same
+// pattern have the same likelihoods, which therefore only need to be
+// computed once per pattern.
+class SitePatterns
+{
+public:
+    SitePatterns() {}
+
+    // Returns the pattern id of site 'pos', adding a new pattern if needed
+    int add(const char *const *seqs,
+            const vector<vector<BaseProbs> > &base_probs,
+            int nseqs, int pos);
+
+    // number of patterns
+    int size() const { return sites.size(); }
+
+    void clear()
+    {
+        ids.clear();
+        sites.clear();
+    }
+
+    vector<int> sites;  // first site of each pattern
+
+protected:
+    unordered_map<string, int> ids;
+    string key;
+};
+
+
+// Emission probabilities for a block of sites.  Every masked site has
+// probability one in all states and every invariant site has the same
+// probabilities, so these sites share one row each.  Variant sites with
+// the same pattern (see SitePatterns) share one row per pattern.  rows[i]
+// points to the row of site i, so the table can be read like a dense
+// [seqlen][nstates] matrix.
+class EmissionTable
+{
+public:
+    EmissionTable() :
+        seqlen(0),
+        nstates(0),
+        npatterns(0),
+        rows(NULL),
+        data(NULL)
+    {}
+
+    ~EmissionTable()
+    {
+        clear();
+    }
+
+    // Allocate rows for a block of sites.  site_pattern[i] is the pattern
+    // of variant site i and -1 for all other sites, which are invariant
+    // unless masked.
+    void alloc(int _seqlen, int _nstates, int _npatterns,
+               const int *site_pattern, const bool *masked);
+
+    void clear()
+    {
+        delete [] rows;
+        delete [] data;
+        rows = NULL;
+        data = NULL;
+        npatterns = 0;
+    }
+
+    // shared row of all masked sites (all ones)
+    double *masked_row() { return data; }
+
+    // shared row of all invariant sites
+    double *invariant_row() { return data + nstates; }
+
+    // shared row of all variant sites with pattern 'pattern'
+    double *pattern_row(int pattern) { return data + (2 + pattern) * nstates; }
+
+    // copy emissions into a dense [seqlen][nstates] matrix
+    void copy_dense(double **emit) const;
+
+    int seqlen;
+    int nstates;
+    int npatterns;
+    double **rows;              // [seqlen] emission row of each site
+    double *data;               // [2 + npatterns][nstates] row storage
+};
+
+
 void find_masked_sites(const char *const *seqs, int nseqs, int seqlen,
                        bool *masked, bool *invariant=NULL);
 
@@ -31,6 +161,18 @@ void calc_emissions_internal(const States &states, const LocalTree *tree,
                              int nseqs, int seqlen,
                              const ArgModel *model, double **emit,
                              PhaseProbs *phase_pr=NULL);
+void calc_emissions_external(const States &states, const LocalTree *tree,
+                             const char * const *seqs,
+                             const vector<vector<BaseProbs> > &base_probs,
+                             int nseqs, int seqlen,
+                             const ArgModel *model, EmissionTable *emit,
+                             PhaseProbs *phase_pr);
+void calc_emissions_internal(const States &states, const LocalTree *tree,
+                             const char *const *seqs,
+                             const vector<vector<BaseProbs> > &base_probs,
+                             int nseqs, int seqlen,
+                             const ArgModel *model, EmissionTable *emit,
+                             PhaseProbs *phase_pr=NULL);
 
 double likelihood_tree(const LocalTree *tree, const ArgModel *model,
                        const char *const *seqs,
@@ -0,0 +1,263 @@
+//=============================================================================
+// vectorized Felsenstein pruning kernels for site likelihoods
+
+#include "emit_simd.h"
+#include "forward_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define ARGWEAVER_X86_SIMD 1
+#   include <immintrin.h>
+#endif
+
+
+namespace argweaver {
+
+
+//=============================================================================
+// scalar kernels
+
+static inline void prune_scalar(const double *in, double mut, double nomut,
+                                double *p)
+{
+    for (int a=0; a<4; a++) {
+        double s = 0.0;
+        for (int b=0; b<4; b++) {
+            if (a == b)
+                s += in[b] * nomut;
+            else
+                s += in[b] * mut;
+        }
+        p[a] = s;
+    }
+}
+
+
+static void prune_branches_scalar(
+    int nsites, int stride,
+    const double *in1, double mut1, double nomut1,
+    const double *in2, double mut2, double nomut2, double *out)
+{
+    double p1[4], p2[4];
+    for (int k=0; k<nsites; k++) {
+        const int i = k * stride;
+        prune_scalar(&in1[i], mut1, nomut1, p1);
+        if (in2) {
+            prune_scalar(&in2[i], mut2, nomut2, p2);
+            for (int a=0; a<4; a++)
+                out[i + a] = p1[a] * p2[a];
+        } else {
+            for (int a=0; a<4; a++)
+                out[i + a] = p1[a];
+        }
+    }
+}
+
+
+static void calc_emit_row_scalar(
+    int nstates, const double *in1, const double *inner, const double *outer,
+    const int *nodes, int root,
+    const double (*muts)[3], const double (*nomuts)[3], double *emit)
+{
+    double p1[4], p2[4], p3[4];
+    for (int j=0; j<nstates; j++) {
+        const int node = nodes[j];
+        prune_scalar(in1, muts[j][0], nomuts[j][0], p1);
+        prune_scalar(&inner[4*node], muts[j][1], nomuts[j][1], p2);
+
+        double e = 0.0;
+        if (node != root) {
+            prune_scalar(&outer[4*node], muts[j][2], nomuts[j][2], p3);
+            for (int a=0; a<4; a++)
+                e += p1[a] * p2[a] * p3[a] * .25;
+        } else {
+            for (int a=0; a<4; a++)
+                e += p1[a] * p2[a] * .25;
+        }
+        emit[j] = e;
+    }
+}
+
+
+#ifdef ARGWEAVER_X86_SIMD
+
+//=============================================================================
+// SSE2 kernels (bases 0,1 and 2,3 in two registers)
+
+// coefficients of base b for bases (a, a+1)
+static inline __m128d prune_coef_sse2(int a, int b, double mut, double nomut)
+{
+    return _mm_set_pd(a + 1 == b ? nomut : mut, a == b ? nomut : mut);
+}
+
+
+static inline void prune_sse2(const double *in, double mut, double nomut,
+                              __m128d *lo, __m128d *hi)
+{
+    __m128d s0 = _mm_setzero_pd();
+    __m128d s1 = _mm_setzero_pd();
+    for (int b=0; b<4; b++) {
+        const __m128d x = _mm_set1_pd(in[b]);
+        s0 = _mm_add_pd(s0, _mm_mul_pd(x, prune_coef_sse2(0, b, mut, nomut)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(x, prune_coef_sse2(2, b, mut, nomut)));
+    }
+    *lo = s0;
+    *hi = s1;
+}
+
+
+static void prune_branches_sse2(
+    int nsites, int stride,
+    const double *in1, double mut1, double nomut1,
+    const double *in2, double mut2, double nomut2, double *out)
+{
+    __m128d lo1, hi1, lo2, hi2;
+    for (int k=0; k<nsites; k++) {
+        const int i = k * stride;
+        prune_sse2(&in1[i], mut1, nomut1, &lo1, &hi1);
+        if (in2) {
+            prune_sse2(&in2[i], mut2, nomut2, &lo2, &hi2);
+            lo1 = _mm_mul_pd(lo1, lo2);
+            hi1 = _mm_mul_pd(hi1, hi2);
+        }
+        _mm_storeu_pd(&out[i], lo1);
+        _mm_storeu_pd(&out[i + 2], hi1);
+    }
+}
+
+
+static void calc_emit_row_sse2(
+    int nstates, const double *in1, const double *inner, const double *outer,
+    const int *nodes, int root,
+    const double (*muts)[3], const double (*nomuts)[3], double *emit)
+{
+    const __m128d quarter = _mm_set1_pd(.25);
+    __m128d lo1, hi1, lo2, hi2, lo3, hi3;
+    double terms[4];
+
+    for (int j=0; j<nstates; j++) {
+        const int node = nodes[j];
+        prune_sse2(in1, muts[j][0], nomuts[j][0], &lo1, &hi1);
+        prune_sse2(&inner[4*node], muts[j][1], nomuts[j][1], &lo2, &hi2);
+        lo1 = _mm_mul_pd(lo1, lo2);
+        hi1 = _mm_mul_pd(hi1, hi2);
+        if (node != root) {
+            prune_sse2(&outer[4*node], muts[j][2], nomuts[j][2], &lo3, &hi3);
+            lo1 = _mm_mul_pd(lo1, lo3);
+            hi1 = _mm_mul_pd(hi1, hi3);
+        }
+        _mm_storeu_pd(&terms[0], _mm_mul_pd(lo1, quarter));
+        _mm_storeu_pd(&terms[2], _mm_mul_pd(hi1, quarter));
+
+        double e = 0.0;
+        for (int a=0; a<4; a++)
+            e += terms[a];
+        emit[j] = e;
+    }
+}
+
+
+//=============================================================================
+// AVX2 kernels (all four bases in one register)
+
+__attribute__((target("avx2")))
+static inline __m256d prune_avx2(const double *in, double mut, double nomut)
+{
+    __m256d s = _mm256_setzero_pd();
+    for (int b=0; b<4; b++) {
+        double coef[4] = {mut, mut, mut, mut};
+        coef[b] = nomut;
+        s = _mm256_add_pd(s, _mm256_mul_pd(_mm256_set1_pd(in[b]),
+                                           _mm256_loadu_pd(coef)));
+    }
+    return s;
+}
+
+
+__attribute__((target("avx2")))
+static void prune_branches_avx2(
+    int nsites, int stride,
+    const double *in1, double mut1, double nomut1,
+    const double *in2, double mut2, double nomut2, double *out)
+{
+    for (int k=0; k<nsites; k++) {
+        const int i = k * stride;
+        __m256d p = prune_avx2(&in1[i], mut1, nomut1);
+        if (in2)
+            p = _mm256_mul_pd(p, prune_avx2(&in2[i], mut2, nomut2));
+        _mm256_storeu_pd(&out[i], p);
+    }
+}
+
+
+__attribute__((target("avx2")))
+static void calc_emit_row_avx2(
+    int nstates, const double *in1, const double *inner, const double *outer,
+    const int *nodes, int root,
+    const double (*muts)[3], const double (*nomuts)[3], double *emit)
+{
+    const __m256d quarter = _mm256_set1_pd(.25);
+    double terms[4];
+
+    for (int j=0; j<nstates; j++) {
+        const int node = nodes[j];
+        __m256d p = _mm256_mul_pd(
+            prune_avx2(in1, muts[j][0], nomuts[j][0]),
+            prune_avx2(&inner[4*node], muts[j][1], nomuts[j][1]));
+        if (node != root)
+            p = _mm256_mul_pd(
+                p, prune_avx2(&outer[4*node], muts[j][2], nomuts[j][2]));
+        _mm256_storeu_pd(terms, _mm256_mul_pd(p, quarter));
+
+        double e = 0.0;
+        for (int a=0; a<4; a++)
+            e += terms[a];
+        emit[j] = e;
+    }
+}
+
+#endif // ARGWEAVER_X86_SIMD
+
+
+//=============================================================================
+// dispatch
+
+void prune_branches(int nsites, int stride,
+                    const double *in1, double mut1, double nomut1,
+                    const double *in2, double mut2, double nomut2,
+                    double *out)
+{
+#ifdef ARGWEAVER_X86_SIMD
+    const ForwardKernel kernel = get_forward_kernel();
+    if (kernel == FORWARD_KERNEL_AVX2)
+        return prune_branches_avx2(nsites, stride, in1, mut1, nomut1,
+                                   in2, mut2, nomut2, out);
+    if (kernel == FORWARD_KERNEL_SSE2)
+        return prune_branches_sse2(nsites, stride, in1, mut1, nomut1,
+                                   in2, mut2, nomut2, out);
+#endif
+    prune_branches_scalar(nsites, stride, in1, mut1, nomut1,
+                          in2, mut2, nomut2, out);
+}
+
+
+void calc_emit_row(int nstates, const double *in1,
+                   const double *inner, const double *outer,
+                   const int *nodes, int root,
+                   const double (*muts)[3], const double (*nomuts)[3],
+                   double *emit)
+{
+#ifdef ARGWEAVER_X86_SIMD
+    const ForwardKernel kernel = get_forward_kernel();
+    if (kernel == FORWARD_KERNEL_AVX2)
+        return calc_emit_row_avx2(nstates, in1, inner, outer, nodes, root,
+                                  muts, nomuts, emit);
+    if (kernel == FORWARD_KERNEL_SSE2)
+        return calc_emit_row_sse2(nstates, in1, inner, outer, nodes, root,
+                                  muts, nomuts, emit);
+#endif
+    calc_emit_row_scalar(nstates, in1, inner, outer, nodes, root,
+                         muts, nomuts, emit);
+}
+
+
+} // namespace argweaver
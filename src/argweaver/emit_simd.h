@@ -0,0 +1,47 @@
+//=============================================================================
+// vectorized Felsenstein pruning kernels for site likelihoods
+
+#ifndef ARGWEAVER_EMIT_SIMD_H
+#define ARGWEAVER_EMIT_SIMD_H
+
+
+namespace argweaver {
+
+
+// Partial likelihood tables hold four values (one per base) for every node
+// of a site.  Under the Jukes-Cantor model, the probability of the partial
+// likelihoods 'in' below a branch given base a at the top of the branch is
+//
+//   p(in, a) = sum_b in[b] * (a == b ? nomut : mut)
+//
+// The kernels below compute all four bases of p() in one vector register,
+// using the instruction set chosen for the forward kernels (see
+// get_forward_kernel()).  Sums are accumulated in the same order as the
+// scalar loops, so every instruction set gives bit-identical results.
+
+
+// For each of nsites sites k, set out[k] = p(in1[k], .) * p(in2[k], .), or
+// just p(in1[k], .) if in2 is NULL.  Row k of each table starts at
+// k * stride doubles.
+void prune_branches(int nsites, int stride,
+                    const double *in1, double mut1, double nomut1,
+                    const double *in2, double mut2, double nomut2,
+                    double *out);
+
+// Emission probabilities of every state at one site,
+//
+//   emit[j] = sum_a p(in1, a) * p(inner[n], a) * p(outer[n], a) * .25
+//
+// where n = nodes[j] and each p() uses the branch probabilities muts[j] and
+// nomuts[j].  inner and outer are the partial likelihood tables of the site
+// (four values per node).  The outer term is left out for root states.
+void calc_emit_row(int nstates, const double *in1,
+                   const double *inner, const double *outer,
+                   const int *nodes, int root,
+                   const double (*muts)[3], const double (*nomuts)[3],
+                   double *emit);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_EMIT_SIMD_H
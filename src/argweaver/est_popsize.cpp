@@ -18,8 +18,11 @@ namespace argweaver {
 using namespace std;
 
 
-double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
-                                  bool sample_popsize_recomb, double heat,
+// The ARG does not change while population sizes are resampled, so
+// proposals are scored from the coalescent statistics in 'stats' instead of
+// walking the trees again.
+double resample_single_popsize_mh(ArgModel *model, const ArgPriorStats &stats,
+                                  double heat,
                                   const list<PopsizeConfigParam>::iterator &it,
                                   double curr_like, int index) {
     list<PopsizeConfigParam> &l = model->popsize_config.params;
@@ -50,29 +53,11 @@ double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
     for ( ; it2 != it->intervals.end(); it2++)
         model->popsizes[it2->pop][it2->time] = new_popsize;
 
-    const int npop = model->num_pops();
-    int ntimes = model->ntimes;
-    int vec_size = 2 * npop * ntimes;
-    double num_coal_alloc[vec_size];
-    double num_nocoal_alloc[vec_size];
-    double *num_coal[npop];
-    double *num_nocoal[npop];
-    for (int i=0; i < npop; i++) {
-        num_coal[i] = &num_coal_alloc[i*ntimes];
-        num_nocoal[i] = &num_nocoal_alloc[i*ntimes];
-    }
-
-    double new_like = sample_popsize_recomb ?
-        calc_arg_prior(model, trees, num_coal, num_nocoal) :
-        calc_arg_prior_recomb_integrate(model, trees, num_coal, num_nocoal);
+    double new_like = stats.calc_log_prior(model);
 
 #ifdef ARGWEAVER_MPI
     comm->Reduce(rank == 0 ? MPI_IN_PLACE : &new_like,
                  &new_like, 1, MPI::DOUBLE, MPI_SUM, 0);
-    comm->Reduce(rank == 0 ? MPI_IN_PLACE : num_coal,
-                 num_coal, vec_size, MPI::DOUBLE, MPI::SUM, 0);
-    comm->Reduce(rank == 0 ? MPI_IN_PLACE : num_nocoal,
-                 num_nocoal, vec_size, MPI::DOUBLE, MPI::SUM, 0);
     if (rank == 0) {
 #endif
 
@@ -85,7 +70,6 @@ double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
 
         printLog(LOG_LOW, "%i\t%f\t%f\t%f\t%f\t%s\n",
                  index,
-                 //num_coal[pop][tidx], num_nocoal[pop][tidx],
                  lr, curr_popsize, new_popsize, lr,
                  accept ? "accept" : "reject");
 
@@ -108,10 +92,10 @@ double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
 
 // Metropolis-Hastings population size resampling; not used anymore
 void resample_popsizes_mh(ArgModel *model, const LocalTrees *trees,
-                       bool sample_popsize_recomb, double heat) {
+                          double heat) {
     list<PopsizeConfigParam> &l = model->popsize_config.params;
-    double curr_like = sample_popsize_recomb ? calc_arg_prior(model, trees) :
-        calc_arg_prior_recomb_integrate(model, trees, NULL, NULL, NULL);
+    ArgPriorStats stats;
+    double curr_like = stats.collect(model, trees);
 #ifdef ARGWEAVER_MPI
     MPI::Intracomm *comm = model->mc3.group_comm;
     int rank = comm->Get_rank();
@@ -123,11 +107,20 @@ void resample_popsizes_mh(ArgModel *model, const LocalTrees *trees,
         for (list<PopsizeConfigParam>::iterator it = l.begin();
              it != l.end(); it++) {
             curr_like =
-                resample_single_popsize_mh(model, trees, sample_popsize_recomb,
-                                           heat, it, curr_like, idx++);
+                resample_single_popsize_mh(model, stats, heat, it,
+                                           curr_like, idx++);
+
+            // periodically make sure that the statistics still agree with
+            // a full recomputation of the prior
+            PopsizeConfig &config = model->popsize_config;
+            if (config.prior_check > 0 &&
+                ++config.nproposals >= config.prior_check) {
+                config.nproposals = 0;
+                if (!stats.check(model, trees))
+                    abort();
+            }
         }
     }
-
 }
 
 
@@ -50,7 +50,7 @@ double kineticEnergy(double *x, int len);
 
 // Metropolis-Hastings resampling; no longer used in favor of HMC
 void resample_popsizes_mh(ArgModel *model, const LocalTrees *trees,
-                          bool sample_popsize_recomb, double heat=1.0);
+                          double heat=1.0);
 
 }; // namespace argweaver
 
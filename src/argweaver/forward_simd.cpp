@@ -0,0 +1,403 @@
+//=============================================================================
+// vectorized kernels for the forward algorithm
+
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+
+#include "forward_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define ARGWEAVER_X86_SIMD 1
+#   include <immintrin.h>
+#endif
+
+
+namespace argweaver {
+
+
+//=============================================================================
+// kernel dispatch
+
+// kernel chosen with set_forward_kernel(), or FORWARD_KERNEL_AUTO
+static std::atomic<int> g_forward_kernel(FORWARD_KERNEL_AUTO);
+
+
+// Returns the best kernel supported by the CPU
+static ForwardKernel cpu_forward_kernel()
+{
+#ifdef ARGWEAVER_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return FORWARD_KERNEL_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return FORWARD_KERNEL_SSE2;
+#endif
+    return FORWARD_KERNEL_SCALAR;
+}
+
+
+// Returns the best kernel supported by the CPU.  The CPU is only probed
+// once; initialization of the local static is thread-safe.
+static ForwardKernel detect_forward_kernel()
+{
+    static const ForwardKernel kernel = cpu_forward_kernel();
+    return kernel;
+}
+
+
+ForwardKernel get_forward_kernel()
+{
+    const int kernel = g_forward_kernel.load(std::memory_order_relaxed);
+    if (kernel == FORWARD_KERNEL_AUTO)
+        return detect_forward_kernel();
+    return (ForwardKernel) kernel;
+}
+
+
+void set_forward_kernel(ForwardKernel kernel)
+{
+    if (kernel == FORWARD_KERNEL_AUTO) {
+        g_forward_kernel = FORWARD_KERNEL_AUTO;
+        return;
+    }
+
+    // never use an instruction set the CPU does not have
+    g_forward_kernel = std::min(kernel, detect_forward_kernel());
+}
+
+
+const char *forward_kernel_name(ForwardKernel kernel)
+{
+    switch (kernel) {
+    case FORWARD_KERNEL_SCALAR: return "scalar";
+    case FORWARD_KERNEL_SSE2:   return "sse2";
+    case FORWARD_KERNEL_AVX2:   return "avx2";
+    default:                    return "auto";
+    }
+}
+
+
+//=============================================================================
+// block tables
+
+static inline int round_up(int n, int m)
+{
+    return (n + m - 1) / m * m;
+}
+
+
+void ForwardBlockKernel::init(int _nstates, int _nin, int _nout)
+{
+    const int vecsize = 4;
+
+    nstates = _nstates;
+    // kernels may write one vector past the last state
+    stride = round_up(nstates, vecsize) + vecsize;
+    nin = _nin;
+    nout = _nout;
+    nout_stride = max(round_up(nout, vecsize), vecsize);
+
+    in_group.assign(nstates, nin);
+    out_group.assign(stride, 0);
+    group_trans.assign(nin * nout_stride, 0.0);
+
+    row_start.assign(1, 0);
+    row_src.clear();
+    row_coef.clear();
+
+    fin.assign(nin + 1, 0.0);
+    tf.assign(nout_stride + vecsize, 0.0);
+    sums.assign(stride, 0.0);
+}
+
+
+void ForwardBlockKernel::add_same_branch(int nsrc, const int *_src,
+                                         const double *_coef)
+{
+    row_src.insert(row_src.end(), _src, _src + nsrc);
+    row_coef.insert(row_coef.end(), _coef, _coef + nsrc);
+    row_start.push_back(row_src.size());
+}
+
+
+void ForwardBlockKernel::finish()
+{
+    const int vecsize = 4;
+    assert(int(row_start.size()) == nstates + 1);
+
+    block_start.clear();
+    src_start.clear();
+    src.clear();
+    coef_start.clear();
+    group_start.clear();
+    coef.clear();
+
+    for (int k=0; k<nstates;) {
+        // extend block while states share the same sources
+        const int nsrc = row_start[k+1] - row_start[k];
+        const int *src0 = row_src.data() + row_start[k];
+        int k1 = k + 1;
+        while (k1 < nstates &&
+               row_start[k1+1] - row_start[k1] == nsrc &&
+               equal(src0, src0 + nsrc, row_src.data() + row_start[k1]))
+            k1++;
+
+        // coefficients are stored [source][state in block]
+        const int m = k1 - k;
+        const int mpad = round_up(m, vecsize);
+        block_start.push_back(k);
+        src_start.push_back(src.size());
+        coef_start.push_back(coef.size());
+        src.insert(src.end(), src0, src0 + nsrc);
+        coef.resize(coef.size() + nsrc * mpad, 0.0);
+        double *c = coef.data() + coef_start.back();
+        for (int s=0; s<nsrc; s++)
+            for (int i=0; i<m; i++)
+                c[s * mpad + i] = row_coef[row_start[k+i] + s];
+
+        // states along a branch usually have consecutive time groups
+        int group0 = out_group[k];
+        for (int i=1; i<m; i++)
+            if (out_group[k+i] != group0 + i)
+                group0 = -1;
+        group_start.push_back(group0);
+
+        k = k1;
+    }
+    block_start.push_back(nstates);
+    src_start.push_back(src.size());
+}
+
+
+//=============================================================================
+// forward column kernels
+//
+// Every kernel evaluates the same sums in the same order: within a state,
+// the group term is added first and same-branch terms follow in table
+// order.  Vectorization is only across states (or output groups).
+
+
+// sum previous column into time/path groups (shared by all kernels)
+static inline void forward_group_sums(ForwardBlockKernel *k,
+                                      const double *col1)
+{
+    double *fin = &k->fin[0];
+    const int *in_group = &k->in_group[0];
+    fill(fin, fin + k->nin + 1, 0.0);
+    for (int j=0; j<k->nstates; j++)
+        fin[in_group[j]] += col1[j];
+}
+
+
+// multiply by emissions and normalize (norm is summed in state order)
+static inline double forward_emit_norm(const ForwardBlockKernel *k,
+                                       double *col2, const double *emit)
+{
+    const double *sums = &k->sums[0];
+    double norm = 0.0;
+    for (int j=0; j<k->nstates; j++) {
+        col2[j] = sums[j] * emit[j];
+        norm += col2[j];
+    }
+    return norm;
+}
+
+
+static void forward_column_scalar(ForwardBlockKernel *k, const double *col1,
+                                  double *col2, const double *emit)
+{
+    const int nstates = k->nstates;
+    const int nout_stride = k->nout_stride;
+
+    forward_group_sums(k, col1);
+
+    double *tf = &k->tf[0];
+    fill(tf, tf + nout_stride, 0.0);
+    for (int i=0; i<k->nin; i++) {
+        const double f = k->fin[i];
+        const double *row = &k->group_trans[i * nout_stride];
+        for (int o=0; o<nout_stride; o++)
+            tf[o] += row[o] * f;
+    }
+
+    double *sums = &k->sums[0];
+    for (int j=0; j<nstates; j++)
+        sums[j] = tf[k->out_group[j]];
+    const int nblocks = k->block_start.size() - 1;
+    for (int b=0; b<nblocks; b++) {
+        const int k0 = k->block_start[b];
+        const int m = k->block_start[b+1] - k0;
+        const int mpad = round_up(m, 4);
+        const int nsrc = k->src_start[b+1] - k->src_start[b];
+        const int *src = k->src.data() + k->src_start[b];
+        const double *coef = k->coef.data() + k->coef_start[b];
+        for (int s=0; s<nsrc; s++) {
+            const double v = col1[src[s]];
+            for (int i=0; i<m; i++)
+                sums[k0 + i] += coef[s * mpad + i] * v;
+        }
+    }
+
+    double norm = forward_emit_norm(k, col2, emit);
+    assert(norm > 0);
+    for (int j=0; j<nstates; j++)
+        col2[j] /= norm;
+}
+
+
+#ifdef ARGWEAVER_X86_SIMD
+
+static void forward_column_sse2(ForwardBlockKernel *k, const double *col1,
+                                double *col2, const double *emit)
+{
+    const int nstates = k->nstates;
+    const int nout_stride = k->nout_stride;
+
+    forward_group_sums(k, col1);
+
+    // group transitions
+    double *tf = &k->tf[0];
+    for (int o=0; o<nout_stride; o+=2)
+        _mm_storeu_pd(&tf[o], _mm_setzero_pd());
+    for (int i=0; i<k->nin; i++) {
+        const __m128d f = _mm_set1_pd(k->fin[i]);
+        const double *row = &k->group_trans[i * nout_stride];
+        for (int o=0; o<nout_stride; o+=2) {
+            __m128d t = _mm_mul_pd(_mm_loadu_pd(&row[o]), f);
+            _mm_storeu_pd(&tf[o], _mm_add_pd(_mm_loadu_pd(&tf[o]), t));
+        }
+    }
+
+    // same-branch terms (blocks are written in order, so lanes past the
+    // end of a block are overwritten by the next block)
+    const int *out_group = &k->out_group[0];
+    double *sums = &k->sums[0];
+    const int nblocks = k->block_start.size() - 1;
+    for (int b=0; b<nblocks; b++) {
+        const int k0 = k->block_start[b];
+        const int m = k->block_start[b+1] - k0;
+        const int mpad = round_up(m, 4);
+        const int nsrc = k->src_start[b+1] - k->src_start[b];
+        const int *src = k->src.data() + k->src_start[b];
+        const double *coef = k->coef.data() + k->coef_start[b];
+        const int group0 = k->group_start[b];
+        for (int i=0; i<m; i+=2) {
+            const int j = k0 + i;
+            __m128d acc = (group0 >= 0) ? _mm_loadu_pd(&tf[group0 + i]) :
+                _mm_set_pd(tf[out_group[j+1]], tf[out_group[j]]);
+            for (int s=0; s<nsrc; s++) {
+                const __m128d c = _mm_loadu_pd(&coef[s * mpad + i]);
+                const __m128d v = _mm_set1_pd(col1[src[s]]);
+                acc = _mm_add_pd(acc, _mm_mul_pd(c, v));
+            }
+            _mm_storeu_pd(&sums[j], acc);
+        }
+    }
+
+    // emissions and normalization
+    double norm = forward_emit_norm(k, col2, emit);
+    assert(norm > 0);
+    const __m128d vnorm = _mm_set1_pd(norm);
+    int j = 0;
+    for (; j+2<=nstates; j+=2)
+        _mm_storeu_pd(&col2[j], _mm_div_pd(_mm_loadu_pd(&col2[j]), vnorm));
+    for (; j<nstates; j++)
+        col2[j] /= norm;
+}
+
+
+// gather four doubles (explicit mask avoids undefined source register)
+__attribute__((target("avx2")))
+static inline __m256d gather4(const double *base, __m128i index)
+{
+    const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), base, index, all, 8);
+}
+
+
+__attribute__((target("avx2")))
+static void forward_column_avx2(ForwardBlockKernel *k, const double *col1,
+                                double *col2, const double *emit)
+{
+    const int nstates = k->nstates;
+    const int nout_stride = k->nout_stride;
+
+    forward_group_sums(k, col1);
+
+    // group transitions
+    double *tf = &k->tf[0];
+    for (int o=0; o<nout_stride; o+=4)
+        _mm256_storeu_pd(&tf[o], _mm256_setzero_pd());
+    for (int i=0; i<k->nin; i++) {
+        const __m256d f = _mm256_set1_pd(k->fin[i]);
+        const double *row = &k->group_trans[i * nout_stride];
+        for (int o=0; o<nout_stride; o+=4) {
+            __m256d t = _mm256_mul_pd(_mm256_loadu_pd(&row[o]), f);
+            _mm256_storeu_pd(&tf[o],
+                             _mm256_add_pd(_mm256_loadu_pd(&tf[o]), t));
+        }
+    }
+
+    // same-branch terms (blocks are written in order, so lanes past the
+    // end of a block are overwritten by the next block)
+    double *sums = &k->sums[0];
+    const int nblocks = k->block_start.size() - 1;
+    for (int b=0; b<nblocks; b++) {
+        const int k0 = k->block_start[b];
+        const int m = k->block_start[b+1] - k0;
+        const int mpad = round_up(m, 4);
+        const int nsrc = k->src_start[b+1] - k->src_start[b];
+        const int *src = k->src.data() + k->src_start[b];
+        const double *coef = k->coef.data() + k->coef_start[b];
+        const int group0 = k->group_start[b];
+        for (int i=0; i<m; i+=4) {
+            const int j = k0 + i;
+            __m256d acc;
+            if (group0 >= 0) {
+                acc = _mm256_loadu_pd(&tf[group0 + i]);
+            } else {
+                const __m128i groups = _mm_loadu_si128(
+                    (const __m128i*) &k->out_group[j]);
+                acc = gather4(tf, groups);
+            }
+            for (int s=0; s<nsrc; s++) {
+                const __m256d c = _mm256_loadu_pd(&coef[s * mpad + i]);
+                const __m256d v = _mm256_set1_pd(col1[src[s]]);
+                acc = _mm256_add_pd(acc, _mm256_mul_pd(c, v));
+            }
+            _mm256_storeu_pd(&sums[j], acc);
+        }
+    }
+
+    // emissions and normalization
+    double norm = forward_emit_norm(k, col2, emit);
+    assert(norm > 0);
+    const __m256d vnorm = _mm256_set1_pd(norm);
+    int j = 0;
+    for (; j+4<=nstates; j+=4)
+        _mm256_storeu_pd(&col2[j],
+                         _mm256_div_pd(_mm256_loadu_pd(&col2[j]), vnorm));
+    for (; j<nstates; j++)
+        col2[j] /= norm;
+}
+
+#endif // ARGWEAVER_X86_SIMD
+
+
+void ForwardBlockKernel::forward_column(ForwardKernel kernel,
+                                        const double *col1, double *col2,
+                                        const double *emit)
+{
+#ifdef ARGWEAVER_X86_SIMD
+    if (kernel == FORWARD_KERNEL_AVX2)
+        return forward_column_avx2(this, col1, col2, emit);
+    if (kernel == FORWARD_KERNEL_SSE2)
+        return forward_column_sse2(this, col1, col2, emit);
+#endif
+    forward_column_scalar(this, col1, col2, emit);
+}
+
+
+} // namespace argweaver
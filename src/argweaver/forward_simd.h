@@ -0,0 +1,107 @@
+//=============================================================================
+// vectorized kernels for the forward algorithm
+
+#ifndef ARGWEAVER_FORWARD_SIMD_H
+#define ARGWEAVER_FORWARD_SIMD_H
+
+// c++ includes
+#include <vector>
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// instruction sets available for the forward recursion
+enum ForwardKernel {
+    FORWARD_KERNEL_AUTO = -1,   // pick best kernel supported by the CPU
+    FORWARD_KERNEL_SCALAR = 0,  // original scalar loops
+    FORWARD_KERNEL_SSE2 = 1,
+    FORWARD_KERNEL_AVX2 = 2
+};
+
+
+// Returns the kernel used by arghmm_forward_block.  The first call detects
+// the CPU features unless a kernel was chosen with set_forward_kernel().
+// Safe to call from several threads at once.
+ForwardKernel get_forward_kernel();
+
+// Force a particular kernel (FORWARD_KERNEL_AUTO restores CPU detection).
+// Kernels the CPU does not support fall back to the next best one.
+void set_forward_kernel(ForwardKernel kernel);
+
+// Returns a human readable name for a kernel
+const char *forward_kernel_name(ForwardKernel kernel);
+
+
+// Flattened, branch-free layout of the compressed transition matrix of one
+// block.  Each forward column is computed in three contiguous passes:
+//
+//   1. sum the previous column into time/path groups (fin)
+//   2. multiply the group sums by the group transition matrix (tf)
+//   3. for every state, add the same-branch terms
+//
+// Same-branch terms are stored as branch blocks: runs of consecutive states
+// (the states of one branch) whose terms come from the same source states.
+// For each source, its value in the previous column is broadcast and
+// multiplied with a contiguous row of coefficients for the whole block, so
+// that no gathers are needed.  All sums are accumulated in the same order
+// as the scalar kernel, so every kernel produces bit-identical forward
+// tables.
+class ForwardBlockKernel
+{
+public:
+    ForwardBlockKernel() :
+        nstates(0), stride(0), nin(0), nout(0), nout_stride(0)
+    {}
+
+    // allocate tables for a block
+    void init(int _nstates, int _nin, int _nout);
+
+    // Add the same-branch terms of the next state (states must be added
+    // in order).  src[i] are source states and coef[i] their coefficients.
+    void add_same_branch(int nsrc, const int *src, const double *coef);
+
+    // lay out branch blocks once all states have been added
+    void finish();
+
+    // compute forward column col2 from col1
+    void forward_column(ForwardKernel kernel, const double *col1,
+                        double *col2, const double *emit);
+
+    int nstates;      // number of states
+    int stride;       // nstates rounded up to vector width (plus padding)
+    int nin;          // number of (time, path) groups of the previous column
+    int nout;         // number of (time, path) groups of the next column
+    int nout_stride;  // nout rounded up to vector width
+
+    vector<int> in_group;       // [nstates] group of each state (or nin)
+    vector<int> out_group;      // [stride] output group of each state
+    vector<double> group_trans; // [nin][nout_stride] group transitions
+
+    // branch blocks
+    vector<int> block_start;    // [nblocks+1] first state of each block
+    vector<int> src_start;      // [nblocks+1] offset of sources in src
+    vector<int> src;            // source states of each block
+    vector<int> coef_start;     // [nblocks] offset of coefficients in coef
+    vector<int> group_start;    // [nblocks] first output group of a block
+                                // with consecutive groups (or -1)
+    vector<double> coef;        // [nsrc][block size rounded up] per block
+
+    // scratch space
+    vector<double> fin;         // [nin+1] group sums of previous column
+    vector<double> tf;          // [nout_stride+4] transition * group sums
+    vector<double> sums;        // [stride] unnormalized column
+
+protected:
+    // same-branch terms of each state before finish()
+    vector<int> row_start;
+    vector<int> row_src;
+    vector<double> row_coef;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_FORWARD_SIMD_H
@@ -10,6 +10,7 @@
 #include "logging.h"
 #include "parsing.h"
 #include "pop_model.h"
+#include "smc_binary.h"
 
 
 namespace argweaver {
@@ -518,6 +519,104 @@ void LocalTrees::copy(const LocalTrees &other)
 }
 
 
+//=============================================================================
+// snapshots of local trees
+
+void LocalTreesSnapshot::save(const LocalTrees &trees)
+{
+    recycle();
+
+    // mappings are allocated with the largest tree capacity so that they
+    // can be reused for any tree
+    int len = 0;
+    for (LocalTrees::const_iterator it=trees.begin(); it != trees.end(); ++it)
+        len = max(len, it->tree->capacity);
+    if (len > mapping_len) {
+        for (unsigned int i=0; i<free_mappings.size(); i++)
+            delete [] free_mappings[i];
+        free_mappings.clear();
+        mapping_len = len;
+    }
+
+    saved.chrom = trees.chrom;
+    saved.start_coord = trees.start_coord;
+    saved.end_coord = trees.end_coord;
+    saved.nnodes = trees.nnodes;
+    saved.seqids = trees.seqids;
+
+    for (LocalTrees::const_iterator it=trees.begin(); it != trees.end(); ++it) {
+        LocalTree *tree;
+        if (free_trees.size() > 0) {
+            tree = free_trees.back();
+            free_trees.pop_back();
+        } else {
+            tree = new LocalTree();
+        }
+        tree->copy(*it->tree);
+
+        int *mapping = NULL;
+        if (it->mapping) {
+            if (free_mappings.size() > 0) {
+                mapping = free_mappings.back();
+                free_mappings.pop_back();
+            } else {
+                mapping = new int [mapping_len];
+            }
+            std::copy(it->mapping, it->mapping + it->tree->nnodes, mapping);
+        }
+
+        saved.trees.push_back(LocalTreeSpr(tree, it->spr, it->blocklen,
+                                           mapping));
+    }
+    owned = true;
+}
+
+
+void LocalTreesSnapshot::restore(LocalTrees *trees)
+{
+    trees->trees.swap(saved.trees);
+    swap(trees->chrom, saved.chrom);
+    swap(trees->start_coord, saved.start_coord);
+    swap(trees->end_coord, saved.end_coord);
+    swap(trees->nnodes, saved.nnodes);
+    swap(trees->seqids, saved.seqids);
+
+    // saved now holds the proposal, whose mappings have unknown lengths
+    owned = false;
+}
+
+
+void LocalTreesSnapshot::recycle()
+{
+    for (LocalTrees::iterator it=saved.begin(); it != saved.end(); ++it) {
+        free_trees.push_back(it->tree);
+        it->tree = NULL;
+        if (it->mapping) {
+            if (owned)
+                free_mappings.push_back(it->mapping);
+            else
+                delete [] it->mapping;
+            it->mapping = NULL;
+        }
+    }
+    saved.trees.clear();
+}
+
+
+void LocalTreesSnapshot::clear()
+{
+    saved.clear();
+    for (unsigned int i=0; i<free_trees.size(); i++)
+        delete free_trees[i];
+    for (unsigned int i=0; i<free_mappings.size(); i++)
+        delete [] free_mappings[i];
+    free_trees.clear();
+    free_mappings.clear();
+    mapping_len = 0;
+    owned = false;
+}
+
+
 // get total ARG length
 double get_arglen(const LocalTrees *trees, const double *times)
 {
@@ -803,6 +902,112 @@ void map_congruent_trees(const LocalTree *tree1, const int *seqids1,
 
 
 
+// Count, for every node of a tree, the leaves below it that are less than
+// 'k' and the leaves below it that are marked
+static void count_leaves_below(const LocalTree *tree, int k,
+                               const bool *marked, int *nless, int *nmarked)
+{
+    const int nleaves = tree->get_num_leaves();
+    int order[tree->nnodes];
+    tree->get_postorder(order);
+    for (int i=0; i<tree->nnodes; i++) {
+        const int j = order[i];
+        if (j < nleaves) {
+            nless[j] = int(j < k);
+            nmarked[j] = int(marked[j]);
+        } else {
+            const int *c = tree->nodes[j].child;
+            nless[j] = nless[c[0]] + nless[c[1]];
+            nmarked[j] = nmarked[c[0]] + nmarked[c[1]];
+        }
+    }
+}
+
+
+// Find where leaf k joins the leaves less than k: 'join' is the first
+// ancestor of k with such leaves below it and 'sib' is its child that
+// holds them
+static void find_leaf_join(const LocalTree *tree, int k, const int *nless,
+                           int *join, int *sib)
+{
+    int node = k;
+    int parent = tree->nodes[node].parent;
+    while (true) {
+        const int *c = tree->nodes[parent].child;
+        const int other = (c[0] == node ? c[1] : c[0]);
+        if (nless[other] > 0) {
+            *join = parent;
+            *sib = other;
+            return;
+        }
+        node = parent;
+        parent = tree->nodes[node].parent;
+    }
+}
+
+
+// Find a series of SPRs that turns tree1 into a tree congruent to tree2,
+// that is with the same topology and ages up to node names.  Both trees
+// must number their leaves alike.  Leaves are pruned and regrafted in
+// order, so that after leaf k has moved, tree1 and tree2 agree on leaves
+// 0..k.  At most one SPR per leaf is needed.
+void find_spr_path(const LocalTree *tree1, const LocalTree *tree2,
+                   vector<Spr> &sprs)
+{
+    const int nleaves = tree1->get_num_leaves();
+    const int nnodes = tree1->nnodes;
+    assert(tree2->nnodes == nnodes);
+
+    LocalTree tree(*tree1);
+    const LocalNode *nodes = tree.nodes;
+    const LocalNode *nodes2 = tree2->nodes;
+    int nless[nnodes], nmarked[nnodes];
+    int nless2[nnodes], nmarked2[nnodes];
+    bool marked[nleaves];
+
+    sprs.clear();
+    for (int k=1; k<nleaves; k++) {
+        // leaf k joins leaves 'sib2' of tree2 at time 'age'
+        int join2, sib2;
+        fill(marked, marked + nleaves, false);
+        count_leaves_below(tree2, k, marked, nless2, nmarked2);
+        find_leaf_join(tree2, k, nless2, &join2, &sib2);
+        const int age = nodes2[join2].age;
+
+        int norder;
+        int order[nnodes];
+        tree2->get_preorder(sib2, order, norder);
+        for (int i=0; i<norder; i++)
+            if (order[i] < k)
+                marked[order[i]] = true;
+        const int nsib = nless2[sib2];
+
+        // skip leaves that already join the same leaves at the same time
+        int join, sib;
+        count_leaves_below(&tree, k, marked, nless, nmarked);
+        find_leaf_join(&tree, k, nless, &join, &sib);
+        if (nodes[join].age == age && nless[sib] == nsib &&
+            nmarked[sib] == nsib)
+            continue;
+
+        // find the lowest node above the marked leaves, then the branch
+        // above it that spans 'age'.  Leaves 0..k-1 agree, so this branch
+        // is part of the same branch as in tree2 once leaf k is removed.
+        int coal_node = 0;
+        while (!marked[coal_node])
+            coal_node++;
+        while (nmarked[coal_node] < nsib)
+            coal_node = nodes[coal_node].parent;
+        while (nodes[coal_node].parent != -1 &&
+               nodes[nodes[coal_node].parent].age < age)
+            coal_node = nodes[coal_node].parent;
+
+        Spr spr(k, 0, coal_node, age, 0);
+        apply_spr(&tree, spr);
+        sprs.push_back(spr);
+    }
+}
+
 // infer the mapping between two trees that differ by an SPR with known
 // recombination node
 void infer_mapping(const LocalTree *tree1, const LocalTree *tree2,
@@ -1744,6 +1949,22 @@ bool read_local_trees(FILE *infile, const double *times, int ntimes,
     assert((invisible_recomb_pos==NULL && invisible_recombs==NULL) ||
            (invisible_recomb_pos!=NULL && invisible_recombs!=NULL));
 
+    // binary files start with a byte that text files do not
+    int first = getc(infile);
+    if (first != EOF && (unsigned char) first == 0x89) {
+        vector<char> data(1, char(first));
+        char buf[BUFSIZ];
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), infile)) > 0)
+            data.insert(data.end(), buf, buf + len);
+        return read_local_trees_binary(&data[0], data.size(), times, ntimes,
+                                       trees, seqnames, -1, -1,
+                                       invisible_recomb_pos,
+                                       invisible_recombs);
+    }
+    if (first != EOF)
+        ungetc(first, infile);
+
     // init tree
     seqnames.clear();
     trees->clear();
@@ -1836,7 +2057,7 @@ bool read_local_trees(FILE *infile, const double *times, int ntimes,
                 ispr.recomb_time = find_time(recomb_time, times, ntimes);
                 ispr.coal_time = find_time(coal_time, times, ntimes);
                 invisible_recombs->push_back(ispr);
-                invisible_recomb_pos->push_back(pos);
+                invisible_recomb_pos->push_back(pos - 1); // convert to 0-index
             }
             // for now just ignore these; could add argument to read them
             // into a separate object
@@ -2042,7 +2263,7 @@ bool assert_spr(const LocalTree *last_tree, const LocalTree *tree,
 {
     LocalNode *last_nodes = last_tree->nodes;
     LocalNode *nodes = tree->nodes;
-    static int count=0;
+    static thread_local int count=0;
     count++;
 
     if (spr->is_null()) {
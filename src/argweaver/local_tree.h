@@ -706,6 +706,40 @@ public:
 };
 
 
+// A saved copy of a set of local trees, for rolling back a rejected
+// Metropolis-Hastings proposal.  Proposals re-thread a branch through every
+// tree of the region they resample, so the whole region is saved.  save()
+// copies into the trees and mappings left over from earlier saves instead
+// of allocating new ones, restore() swaps the saved trees back in without
+// copying, and an accepted proposal needs no work at all.
+class LocalTreesSnapshot
+{
+public:
+    LocalTreesSnapshot() : owned(false), mapping_len(0) {}
+    ~LocalTreesSnapshot() { clear(); }
+
+    // Save a copy of 'trees'
+    void save(const LocalTrees &trees);
+
+    // Roll 'trees' back to the last saved copy.  The trees of the rejected
+    // proposal are reused by the next save().
+    void restore(LocalTrees *trees);
+
+    // free saved trees and all buffers
+    void clear();
+
+protected:
+    // move the saved trees and mappings into the buffers for reuse
+    void recycle();
+
+    LocalTrees saved;
+    bool owned;                      // mappings in saved were allocated here
+    int mapping_len;                 // length of mappings allocated here
+    vector<LocalTree*> free_trees;   // trees available for reuse
+    vector<int*> free_mappings;      // mappings available for reuse
+};
+
+
 // count the lineages in a tree
 void count_lineages(const LocalTree *tree, int ntimes,
                     int *nbranches, int *nrecombs,
@@ -797,6 +831,8 @@ double get_arglen(const LocalTrees *trees, const double *times);
 void map_congruent_trees(const LocalTree *tree1, const int *seqids1,
                          const LocalTree *tree2, const int *seqids2,
                          int *mapping);
+void find_spr_path(const LocalTree *tree1, const LocalTree *tree2,
+                   vector<Spr> &sprs);
 void infer_mapping(const LocalTree *tree1, const LocalTree *tree2,
                    int recomb_node, int *mapping);
 void repair_spr(const LocalTree *last_tree, const LocalTree *tree, Spr &spr,
@@ -854,7 +890,9 @@ bool write_newick_tree(const char *filename, const LocalTree *tree,
                        bool oneline, bool pop_model=false);
 void write_local_trees(FILE *out, const LocalTrees *trees,
                        const char *const *names, const double *times,
-                       bool pop_model=false);
+                       bool pop_model=false,
+                       const vector<int> &self_recomb_pos=vector<int>(),
+                       const vector<Spr> &self_recombs=vector<Spr>());
 bool write_local_trees(const char *filename, const LocalTrees *trees,
                        const char *const *names, const double *times,
                        bool pop_model=false,
@@ -870,8 +908,10 @@ bool write_local_trees(const char *filename, const LocalTrees *trees,
                        bool pop_model=false,
                        const vector<int> &self_recomb_pos=vector<int>(),
                        const vector<Spr> &self_recombs=vector<Spr>());
+int find_time(double time, const double *times, int ntimes);
 bool parse_local_tree(const char* newick, LocalTree *tree,
                       const double *times, int ntimes);
+// Read text or binary (see smc_binary.h) local trees
 bool read_local_trees(FILE *infile, const double *times, int ntimes,
                       LocalTrees *trees, vector<string> &seqnames,
                       vector<int> *invisible_recomb_pos=NULL,
@@ -15,13 +15,14 @@ namespace argweaver {
 // Errors and Logging
 
 Logger g_logger(stderr, LOG_QUIET);
+thread_local int g_log_level_offset = 0;
 
 
 void Logger::printTimerLog(const Timer &timer, int level, const char *fmt, ...)
 {
     va_list ap;
 
-    if (level <= loglevel) {
+    if (isLogLevel(level)) {
         va_start(ap, fmt);
         printTimerLog(timer, level, fmt, ap);
         va_end(ap);
@@ -38,7 +39,7 @@ void Logger::printTimerLog(const Timer &timer, int level, const char *fmt, ...)
 void Logger::printTimerLog(const Timer &timer, int level, const char *fmt,
                            va_list ap)
 {
-    if (level <= loglevel) {
+    if (isLogLevel(level)) {
         // print message
         vfprintf(logstream, fmt, ap);
 
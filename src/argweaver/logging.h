@@ -91,6 +91,12 @@ public:
 };
 
 
+// Adjustment of the log level by incLogLevel() and decLogLevel() in the
+// current thread.  Each thread nests its own adjustments on top of the
+// shared level, so that concurrent samplers do not race on it.
+extern thread_local int g_log_level_offset;
+
+
 class Logger
 {
 public:
@@ -110,7 +116,7 @@ public:
     {
         va_list ap;
 
-        if (level <= loglevel) {
+        if (isLogLevel(level)) {
             va_start(ap, fmt);
             vfprintf(logstream, fmt, ap);
             fflush(logstream);
@@ -126,7 +132,7 @@ public:
 
     void printLog(int level, const char *fmt, va_list ap)
     {
-        if (level <= loglevel) {
+        if (isLogLevel(level)) {
             vfprintf(logstream, fmt, ap);
             fflush(logstream);
         }
@@ -139,30 +145,25 @@ public:
         loglevel = level;
     }
 
+    // the offset is shared by all loggers, so chained loggers follow
     int incLogLevel()
     {
-        if (chain)
-            chain->incLogLevel();
-        loglevel++;
-        return loglevel;
+        return loglevel + ++g_log_level_offset;
     }
 
     int decLogLevel()
     {
-        if (chain)
-            chain->decLogLevel();
-        loglevel--;
-        return loglevel;
+        return loglevel + --g_log_level_offset;
     }
 
     int getLogLevel()
     {
-        return loglevel;
+        return loglevel + g_log_level_offset;
     }
 
     bool isLogLevel(int level) const
     {
-        return level <= loglevel;
+        return level <= loglevel + g_log_level_offset;
     }
 
     void printTimerLog(const Timer &timer, int level, const char *fmt,
@@ -245,6 +246,13 @@ inline int incLogLevel()
 inline int decLogLevel()
 { return g_logger.decLogLevel(); }
 
+// log level adjustment of the current thread (e.g. to pass on to workers)
+inline int getLogLevelOffset()
+{ return g_log_level_offset; }
+
+inline void setLogLevelOffset(int offset)
+{ g_log_level_offset = offset; }
+
 
 // global function API
 void printLog(int level, const char *fmt, ...);
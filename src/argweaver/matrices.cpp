@@ -4,35 +4,22 @@
 
 namespace argweaver {
 
-// calculate transition and emission matrices for current block
-void calc_arghmm_matrices_internal(
+// calculate emission matrix for current block (internal branch)
+static void calc_arghmm_emit_internal(
     const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
-    const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
-    const int start, const int end, int minage,
+    const LocalTree *tree, const States &states,
+    const int start, const int end,
     ArgHmmMatrices *matrices, PhaseProbs *phase_pr)
 {
-    const bool internal = true;
-
-    // get block information
     const int blocklen = end - start;
-    matrices->blocklen = blocklen;
-    const LocalTree *tree = tree_spr->tree;
 
-    LineageCounts lineages(model->ntimes, model->num_pops());  // only allocates
-    States last_states;
-    States states;
-    matrices->states_model.set(model->ntimes, internal, minage, model->pop_tree);
-    matrices->states_model.get_coal_states(tree, states);
-    const int nstates = states.size();
-
-    // calculate emissions
     if (seqs) {
         const int nleaves = trees->get_num_leaves();
         char *subseqs[nleaves];
 	//	int phase_nodes[2]={-1,-1};
         for (int i=0; i<nleaves; i++)
             subseqs[i] = &seqs->seqs[trees->seqids[i]][start];
-        matrices->emit = new_matrix<double>(blocklen, max(nstates, 1));
+        matrices->emit = new EmissionTable();
         if (model->unphased && phase_pr != NULL)
             phase_pr->offset = start;
         vector<vector<BaseProbs> > sub_base_probs;
@@ -51,6 +38,88 @@ void calc_arghmm_matrices_internal(
     } else {
         matrices->emit = NULL;
     }
+}
+
+
+// calculate emission matrix for current block (new chromosome)
+static void calc_arghmm_emit_external(
+    const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
+    const LocalTree *tree, const States &states,
+    const int start, const int end, const int new_chrom,
+    ArgHmmMatrices *matrices, PhaseProbs *phase_pr)
+{
+    const int blocklen = end - start;
+
+    if (seqs) {
+        const int nleaves = trees->get_num_leaves();
+        char *subseqs[seqs->get_num_seqs()];
+        for (int i=0; i<nleaves; i++)
+            subseqs[i] = &seqs->seqs[trees->seqids[i]][start];
+        subseqs[nleaves] = &seqs->seqs[new_chrom][start];
+        matrices->emit = new EmissionTable();
+	if (model->unphased)
+	    phase_pr->offset = start;
+        vector<vector<BaseProbs> > sub_base_probs;
+        sub_base_probs.clear();
+        if (seqs->base_probs.size() > 0) {
+            for (int i=0; i <= nleaves; i++) {
+                int idx = ( i < nleaves ? trees->seqids[i] : new_chrom );
+                vector<BaseProbs>::const_iterator first = seqs->base_probs[idx].begin() + start;
+                vector<BaseProbs>::const_iterator last = seqs->base_probs[idx].begin() + end;
+                sub_base_probs.push_back(vector<BaseProbs>(first,last));
+            }
+        }
+        calc_emissions_external(states, tree, subseqs, sub_base_probs,
+                                nleaves + 1, blocklen,
+                                model, matrices->emit, phase_pr);
+    } else {
+        matrices->emit = NULL;
+    }
+}
+
+
+// calculate the transition matrix within a block, reusing an identical
+// matrix from memo if given
+static TransMatrix *calc_transmat(
+    const LocalTree *tree, const ArgModel *model, const States &states,
+    const LineageCounts *lineages, bool internal, int minage,
+    TransMatrixMemo *memo)
+{
+    if (memo)
+        return memo->calc_transition_probs(tree, model, states, lineages,
+                                           internal, minage);
+
+    TransMatrix *transmat = new TransMatrix(model, states.size());
+    transmat->calc_transition_probs(tree, model, states, lineages,
+                                    internal, minage);
+    return transmat;
+}
+
+
+// calculate transition and emission matrices for current block
+void calc_arghmm_matrices_internal(
+    const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
+    const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
+    const int start, const int end, int minage,
+    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, TransMatrixMemo *memo)
+{
+    const bool internal = true;
+
+    // get block information
+    const int blocklen = end - start;
+    matrices->blocklen = blocklen;
+    const LocalTree *tree = tree_spr->tree;
+
+    LineageCounts lineages(model->ntimes, model->num_pops());  // only allocates
+    States last_states;
+    States states;
+    matrices->states_model.set(model->ntimes, internal, minage, model->pop_tree);
+    matrices->states_model.get_coal_states(tree, states);
+    const int nstates = states.size();
+
+    // calculate emissions
+    calc_arghmm_emit_internal(model, seqs, trees, tree, states, start, end,
+                              matrices, phase_pr);
 
 
     // calculate switch transition matrix if we are starting a new block
@@ -80,9 +149,9 @@ void calc_arghmm_matrices_internal(
     lineages.count(tree, model->pop_tree, internal);
 
     // calculate transmat and use it for rest of block
-    matrices->transmat = new TransMatrix(model, nstates);
-    matrices->transmat->calc_transition_probs(tree, model, states, &lineages,
-                          internal, matrices->states_model.minage);
+    matrices->transmat = calc_transmat(tree, model, states, &lineages,
+                                       internal, matrices->states_model.minage,
+                                       memo);
 }
 
 
@@ -92,7 +161,8 @@ void calc_arghmm_matrices_external(
     const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
-    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, int start_pop)
+    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, int start_pop,
+    TransMatrixMemo *memo)
 {
     // get block information
     const int blocklen = end - start;
@@ -108,31 +178,8 @@ void calc_arghmm_matrices_external(
     const int nstates = states.size();
 
     // calculate emissions
-    if (seqs) {
-        const int nleaves = trees->get_num_leaves();
-        char *subseqs[seqs->get_num_seqs()];
-        for (int i=0; i<nleaves; i++)
-            subseqs[i] = &seqs->seqs[trees->seqids[i]][start];
-        subseqs[nleaves] = &seqs->seqs[new_chrom][start];
-        matrices->emit = new_matrix<double>(blocklen, nstates);
-	if (model->unphased)
-	    phase_pr->offset = start;
-        vector<vector<BaseProbs> > sub_base_probs;
-        sub_base_probs.clear();
-        if (seqs->base_probs.size() > 0) {
-            for (int i=0; i <= nleaves; i++) {
-                int idx = ( i < nleaves ? trees->seqids[i] : new_chrom );
-                vector<BaseProbs>::const_iterator first = seqs->base_probs[idx].begin() + start;
-                vector<BaseProbs>::const_iterator last = seqs->base_probs[idx].begin() + end;
-                sub_base_probs.push_back(vector<BaseProbs>(first,last));
-            }
-        }
-        calc_emissions_external(states, tree, subseqs, sub_base_probs,
-                                nleaves + 1, blocklen,
-                                model, matrices->emit, phase_pr);
-    } else {
-        matrices->emit = NULL;
-    }
+    calc_arghmm_emit_external(model, seqs, trees, tree, states, start, end,
+                              new_chrom, matrices, phase_pr);
 
 
     // calculate switch transition matrix if we are starting a new block
@@ -162,10 +209,9 @@ void calc_arghmm_matrices_external(
     lineages.count(tree, model->pop_tree);
 
     // calculate transmat and use it for rest of block
-    matrices->transmat = new TransMatrix(model, nstates);
-    matrices->transmat->calc_transition_probs(tree, model, states, &lineages,
-                                              false,
-                                              matrices->states_model.minage);
+    matrices->transmat = calc_transmat(tree, model, states, &lineages,
+                                       false, matrices->states_model.minage,
+                                       memo);
 }
 
 
@@ -175,17 +221,223 @@ void calc_arghmm_matrices(
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
     const StatesModel &states_model, ArgHmmMatrices *matrices,
-    PhaseProbs *phase_pr, int start_pop)
+    PhaseProbs *phase_pr, int start_pop, TransMatrixMemo *memo)
 {
     if (states_model.internal)
         calc_arghmm_matrices_internal(
             model, seqs, trees, last_tree_spr, tree_spr,
             start, end, states_model.minage, matrices,
-            phase_pr);
+            phase_pr, memo);
     else
         calc_arghmm_matrices_external(
             model, seqs, trees, last_tree_spr,  tree_spr,
-            start, end, new_chrom, matrices, phase_pr, start_pop);
+            start, end, new_chrom, matrices, phase_pr, start_pop, memo);
+}
+
+
+// calculate only the emission matrix for current block
+void calc_arghmm_emissions(
+    const ArgModel *model, const Sequences *seqs,
+    const LocalTrees *trees, const LocalTreeSpr *tree_spr,
+    const int start, const int end, const int new_chrom,
+    const StatesModel &states_model, ArgHmmMatrices *matrices,
+    PhaseProbs *phase_pr)
+{
+    States states;
+    states_model.get_coal_states(tree_spr->tree, states);
+
+    matrices->blocklen = end - start;
+    if (states_model.internal)
+        calc_arghmm_emit_internal(model, seqs, trees, tree_spr->tree, states,
+                                  start, end, matrices, phase_pr);
+    else
+        calc_arghmm_emit_external(model, seqs, trees, tree_spr->tree, states,
+                                  start, end, new_chrom, matrices, phase_pr);
+}
+
+
+//=============================================================================
+// lookahead pipeline
+
+ArgHmmMatrixPipeline::ArgHmmMatrixPipeline(
+    const ArgHmmMatrixIter *iter, int start, int end,
+    int depth, int nthreads, PhaseProbs *phase_pr) :
+    phase_pr(phase_pr),
+    iter(iter),
+    end(end),
+    depth(depth),
+    slots(depth),
+    filled(depth, false),
+    claimed(start),
+    consumed(start),
+    stopping(false)
+{
+    for (int i=0; i<nthreads; i++)
+        threads.push_back(thread(&ArgHmmMatrixPipeline::worker, this));
+}
+
+
+ArgHmmMatrixPipeline::~ArgHmmMatrixPipeline()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        stopping = true;
+    }
+    space.notify_all();
+    for (unsigned int i=0; i<threads.size(); i++)
+        threads[i].join();
+}
+
+
+void ArgHmmMatrixPipeline::take(int block, ArgHmmMatrices *matrices)
+{
+    unique_lock<mutex> guard(lock);
+    assert(block == consumed);
+    const int slot = block % depth;
+    while (!filled[slot])
+        ready.wait(guard);
+
+    *matrices = slots[slot];
+    slots[slot].detach();
+    filled[slot] = false;
+    consumed++;
+    guard.unlock();
+    space.notify_all();
+}
+
+
+void ArgHmmMatrixPipeline::worker()
+{
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        // claim the next block once its slot is free
+        while (!stopping && claimed < end && claimed >= consumed + depth)
+            space.wait(guard);
+        if (stopping || claimed >= end)
+            return;
+        const int block = claimed++;
+        guard.unlock();
+
+        ArgHmmMatrices matrices;
+        if (phase_pr) {
+            unique_lock<mutex> phase_guard(phase_lock);
+            iter->calc_matrices(block, &matrices, phase_pr);
+        } else {
+            iter->calc_matrices(block, &matrices, phase_pr);
+        }
+
+        guard.lock();
+        const int slot = block % depth;
+        slots[slot] = matrices;
+        matrices.detach();
+        filled[slot] = true;
+        ready.notify_all();
+    }
+}
+
+
+//=============================================================================
+// transition matrix cache
+
+// approximate memory used by a block's transition matrices
+static size_t transmat_bytes(const ArgHmmMatrices &matrices)
+{
+    size_t bytes = sizeof(TransMatrix);
+    const TransMatrix *transmat = matrices.transmat;
+    if (transmat) {
+        const size_t ntimes = transmat->ntimes;
+        const size_t npaths = transmat->npaths;
+        size_t ndoubles = 4 * npaths * npaths * ntimes;
+        if (transmat->smc_prime)
+            ndoubles += 20 * npaths * npaths * ntimes + transmat->nstates;
+        else
+            ndoubles += 2 * ntimes + 4 * npaths * ntimes +
+                3 * npaths * npaths * ntimes;
+        bytes += ndoubles * sizeof(double);
+    }
+
+    const TransMatrixSwitch *transmat_switch = matrices.transmat_switch;
+    if (transmat_switch) {
+        const size_t nstates1 = max(transmat_switch->nstates1, 1);
+        const size_t nstates2 = max(transmat_switch->nstates2, 1);
+        const size_t npaths = transmat_switch->npaths;
+        bytes += sizeof(TransMatrixSwitch) +
+            nstates1 * (3 * sizeof(int) + sizeof(double)) +
+            2 * nstates2 * npaths * sizeof(double) +
+            (transmat_switch->row_state.size() +
+             transmat_switch->row_start.size() +
+             transmat_switch->col_start.size()) * sizeof(int) +
+            2 * transmat_switch->row_cols.size() *
+            (sizeof(int) + sizeof(double));
+    }
+
+    return bytes;
+}
+
+
+bool ArgHmmMatrixCache::lookup(int block, ArgHmmMatrices *matrices)
+{
+    map<int, Entry>::iterator it = entries.find(block);
+    if (it == entries.end()) {
+        nmisses++;
+        return false;
+    }
+    nhits++;
+
+    // mark as most recently used
+    Entry &entry = it->second;
+    lru.splice(lru.begin(), lru, entry.lru);
+
+    matrices->nstates1 = entry.nstates1;
+    matrices->nstates2 = entry.nstates2;
+    matrices->blocklen = entry.blocklen;
+    matrices->states_model = entry.states_model;
+    matrices->transmat = entry.transmat;
+    matrices->transmat_switch = entry.transmat_switch;
+    return true;
+}
+
+
+void ArgHmmMatrixCache::insert(int block, const ArgHmmMatrices &matrices)
+{
+    assert(entries.find(block) == entries.end());
+
+    lru.push_front(block);
+    Entry &entry = entries[block];
+    entry.nstates1 = matrices.nstates1;
+    entry.nstates2 = matrices.nstates2;
+    entry.blocklen = matrices.blocklen;
+    entry.states_model = matrices.states_model;
+    entry.transmat = matrices.transmat;
+    entry.transmat_switch = matrices.transmat_switch;
+    entry.bytes = transmat_bytes(matrices);
+    entry.lru = lru.begin();
+    nbytes += entry.bytes;
+
+    // evict least recently used blocks, but never the new one
+    while (nbytes > max_bytes && lru.size() > 1)
+        evict(lru.back());
+}
+
+
+void ArgHmmMatrixCache::evict(int block)
+{
+    map<int, Entry>::iterator it = entries.find(block);
+    assert(it != entries.end());
+    Entry &entry = it->second;
+
+    delete entry.transmat;
+    delete entry.transmat_switch;
+    nbytes -= entry.bytes;
+    lru.erase(entry.lru);
+    entries.erase(it);
+}
+
+
+void ArgHmmMatrixCache::clear()
+{
+    while (!lru.empty())
+        evict(lru.back());
 }
 
 
@@ -6,7 +6,11 @@
 
 
 // c++ includes
+#include <condition_variable>
 #include <list>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string.h>
 
@@ -43,7 +47,7 @@ public:
     ArgHmmMatrices(int nstates1, int nstates2, int blocklen,
                    TransMatrix *transmat,
                    TransMatrixSwitch *transmat_switch,
-                   double **emit):
+                   EmissionTable *emit):
         nstates1(nstates1),
         nstates2(nstates2),
         blocklen(blocklen),
@@ -69,7 +73,7 @@ public:
             transmat_switch = NULL;
         }
         if (emit) {
-            delete_matrix<double>(emit, blocklen);
+            delete emit;
             emit = NULL;
         }
     }
@@ -94,7 +98,7 @@ public:
     StatesModel states_model;
     TransMatrix* transmat; // transition matrix within this block
     TransMatrixSwitch* transmat_switch; // transition matrix from previous block
-    double **emit; // emission matrix
+    EmissionTable *emit; // emission matrix
 };
 
 
@@ -104,7 +108,72 @@ void calc_arghmm_matrices(
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
     const StatesModel &states_model, ArgHmmMatrices *matrices,
-    PhaseProbs *phase_pr, int start_pop);
+    PhaseProbs *phase_pr, int start_pop, TransMatrixMemo *memo=NULL);
+
+void calc_arghmm_emissions(
+    const ArgModel *model, const Sequences *seqs,
+    const LocalTrees *trees, const LocalTreeSpr *tree_spr,
+    const int start, const int end, const int new_chrom,
+    const StatesModel &states_model, ArgHmmMatrices *matrices,
+    PhaseProbs *phase_pr);
+
+
+// Cache of the transition matrices (not emissions) of each block, so that
+// several passes over the same ARG (forward algorithm, traceback,
+// recombination sampling) compute them only once.  Blocks are identified
+// by their index, so all iterators sharing a cache must iterate the same
+// blocks with the same states model.  The least recently used blocks are
+// freed once the cache exceeds max_bytes.
+class ArgHmmMatrixCache
+{
+public:
+    ArgHmmMatrixCache(size_t max_bytes) :
+        max_bytes(max_bytes),
+        nbytes(0),
+        nhits(0),
+        nmisses(0)
+    {}
+
+    ~ArgHmmMatrixCache()
+    {
+        clear();
+    }
+
+    // Fill in the transition matrices of a block if present.  The cache
+    // keeps ownership of the matrices.
+    bool lookup(int block, ArgHmmMatrices *matrices);
+
+    // Store the transition matrices of a block.  The cache takes ownership
+    // of matrices.transmat and matrices.transmat_switch.
+    void insert(int block, const ArgHmmMatrices &matrices);
+
+    // free all matrices
+    void clear();
+
+    size_t max_bytes;  // memory budget
+    size_t nbytes;     // approximate memory currently used
+    int nhits;
+    int nmisses;
+
+protected:
+    class Entry
+    {
+    public:
+        int nstates1;
+        int nstates2;
+        int blocklen;
+        StatesModel states_model;
+        TransMatrix *transmat;
+        TransMatrixSwitch *transmat_switch;
+        size_t bytes;
+        list<int>::iterator lru;
+    };
+
+    void evict(int block);
+
+    map<int, Entry> entries;
+    list<int> lru;     // block indices, most recently used first
+};
 
 
 
@@ -211,9 +280,59 @@ protected:
 
 
 
+class ArgHmmMatrixIter;
+
+
+// Computes the matrices of upcoming blocks on background threads while the
+// caller works on the current block.  Workers claim blocks in order and
+// store them in a ring of 'depth' slots, so that at most 'depth' blocks are
+// held ahead of the consumer.  Blocks must be taken in order.
+class ArgHmmMatrixPipeline
+{
+public:
+    ArgHmmMatrixPipeline(const ArgHmmMatrixIter *iter, int start, int end,
+                         int depth, int nthreads, PhaseProbs *phase_pr);
+    ~ArgHmmMatrixPipeline();
+
+    // Wait for the matrices of the next block and move them into matrices
+    void take(int block, ArgHmmMatrices *matrices);
+
+    // returns the block expected by the next take()
+    int next_block() const {
+        return consumed;
+    }
+
+    PhaseProbs *const phase_pr;
+
+protected:
+    void worker();
+
+    const ArgHmmMatrixIter *iter;
+    const int end;
+    const int depth;
+
+    mutex lock;
+    condition_variable ready;     // signaled when a slot is filled
+    condition_variable space;     // signaled when a slot is taken
+    vector<ArgHmmMatrices> slots;
+    vector<bool> filled;
+    int claimed;    // next block to be claimed by a worker
+    int consumed;   // next block to be taken by the consumer
+    bool stopping;
+
+    // Emissions of unphased models record phasing probabilities in
+    // phase_pr, so their blocks are computed one at a time.
+    mutex phase_lock;
+
+    vector<thread> threads;
+};
+
+
 // iterates through matricies for the ArgHmm
 class ArgHmmMatrixIter
 {
+    friend class ArgHmmMatrixPipeline;
+
 public:
     ArgHmmMatrixIter(const ArgModel *model, const Sequences *seqs,
                       const LocalTrees *trees,
@@ -223,6 +342,13 @@ public:
         seqs(seqs),
         trees(trees),
         new_chrom(_new_chrom),
+        cache(NULL),
+        memo(NULL),
+        mat_cached(false),
+        lookahead(0),
+        lookahead_threads(1),
+        pipeline(NULL),
+        pipeline_ok(false),
         blocks(model, trees)
     {
         if (new_chrom == -1)
@@ -233,7 +359,8 @@ public:
 
     virtual ~ArgHmmMatrixIter()
     {
-        mat.clear();
+        stop_pipeline();
+        release_matrices();
     }
 
     virtual void setup() {
@@ -255,6 +382,25 @@ public:
         states_model.set_start_pop(start_pop, model->pop_tree);
     }
 
+    // share transition matrices with other iterators over the same blocks
+    void set_cache(ArgHmmMatrixCache *_cache) {
+        cache = _cache;
+    }
+
+    // reuse identical transition matrices between blocks
+    void set_memo(TransMatrixMemo *_memo) {
+        memo = _memo;
+    }
+
+    // Compute the matrices of up to 'depth' blocks ahead of a forward
+    // iteration on 'nthreads' background threads (depth=0 disables).
+    // Iterating in any other order falls back to synchronous computation.
+    void set_lookahead(int depth, int nthreads=1) {
+        stop_pipeline();
+        lookahead = depth;
+        lookahead_threads = max(nthreads, 1);
+    }
+
     //==================================================
     // iteration methods
 
@@ -264,6 +410,8 @@ public:
         if (blocks.size() == 0)
             setup();
         block_index = 0;
+        stop_pipeline();
+        pipeline_ok = lookahead > 0;
     }
 
     virtual void rbegin()
@@ -271,6 +419,8 @@ public:
         if (blocks.size() == 0)
             setup();
         block_index = blocks.size() - 1;
+        stop_pipeline();
+        pipeline_ok = false;
     }
 
     virtual bool next()
@@ -296,8 +446,33 @@ public:
 
     virtual ArgHmmMatrices &ref_matrices(PhaseProbs *phase_pr = NULL)
     {
-        mat.clear();
-        calc_matrices(&mat, phase_pr);
+        release_matrices();
+        if (use_pipeline(phase_pr)) {
+            pipeline->take(block_index, &mat);
+            if (cache) {
+                // keep any transition matrices already in the cache
+                ArgHmmMatrices cached;
+                if (cache->lookup(block_index, &cached)) {
+                    delete mat.transmat;
+                    delete mat.transmat_switch;
+                    mat.transmat = cached.transmat;
+                    mat.transmat_switch = cached.transmat_switch;
+                    cached.detach();
+                } else {
+                    cache->insert(block_index, mat);
+                }
+                mat_cached = true;
+            }
+        } else if (!cache) {
+            calc_matrices(&mat, phase_pr);
+        } else if (cache->lookup(block_index, &mat)) {
+            calc_emissions(&mat, phase_pr);
+            mat_cached = true;
+        } else {
+            calc_matrices(&mat, phase_pr);
+            cache->insert(block_index, mat);
+            mat_cached = true;
+        }
         return mat;
     }
 
@@ -306,8 +481,12 @@ public:
     }
 
     const LocalTreeSpr *get_last_tree_spr() const {
-        if (block_index > 0)
-            return blocks.at(block_index-1).tree_spr;
+        return get_last_tree_spr(block_index);
+    }
+
+    const LocalTreeSpr *get_last_tree_spr(int block) const {
+        if (block > 0)
+            return blocks.at(block-1).tree_spr;
         else
             return NULL;
     }
@@ -352,17 +531,73 @@ public:
 protected:
 
     void calc_matrices(ArgHmmMatrices *matrices, PhaseProbs *phase_pr = NULL)
+    {
+        calc_matrices(block_index, matrices, phase_pr);
+    }
+
+    // calculate the matrices of any block (safe to call from several
+    // threads as long as phase_pr is not shared)
+    void calc_matrices(int index, ArgHmmMatrices *matrices,
+                       PhaseProbs *phase_pr) const
     {
         ArgModel local_model;
-        ArgModelBlock &block = blocks.at(block_index);
+        const ArgModelBlock &block = blocks.at(index);
 
         model->get_local_model_index(block.model_index, local_model);
-        const LocalTreeSpr * last_tree_spr = get_last_tree_spr();
+        const LocalTreeSpr * last_tree_spr = get_last_tree_spr(index);
 
         argweaver::calc_arghmm_matrices(
             &local_model, seqs, trees, last_tree_spr, block.tree_spr,
             block.start, block.end, new_chrom, states_model, matrices,
-	    phase_pr, start_pop);
+	    phase_pr, start_pop, memo);
+    }
+
+    void calc_emissions(ArgHmmMatrices *matrices, PhaseProbs *phase_pr = NULL)
+    {
+        ArgModel local_model;
+        ArgModelBlock &block = blocks.at(block_index);
+
+        model->get_local_model_index(block.model_index, local_model);
+        argweaver::calc_arghmm_emissions(
+            &local_model, seqs, trees, block.tree_spr,
+            block.start, block.end, new_chrom, matrices->states_model,
+            matrices, phase_pr);
+    }
+
+    // free current matrices, except those owned by the cache
+    void release_matrices()
+    {
+        if (mat_cached) {
+            mat.transmat = NULL;
+            mat.transmat_switch = NULL;
+            mat_cached = false;
+        }
+        mat.clear();
+    }
+
+    // Returns true if the matrices of the current block should come from
+    // the lookahead pipeline, starting or stopping it as needed.
+    bool use_pipeline(PhaseProbs *phase_pr)
+    {
+        if (pipeline && (pipeline->next_block() != block_index ||
+                         pipeline->phase_pr != phase_pr)) {
+            // iteration left the forward order
+            stop_pipeline();
+            pipeline_ok = false;
+        }
+        if (!pipeline && pipeline_ok && block_index == 0)
+            pipeline = new ArgHmmMatrixPipeline(
+                this, block_index, blocks.size(), lookahead,
+                lookahead_threads, phase_pr);
+        return pipeline != NULL;
+    }
+
+    void stop_pipeline()
+    {
+        if (pipeline) {
+            delete pipeline;
+            pipeline = NULL;
+        }
     }
 
 
@@ -373,8 +608,16 @@ protected:
     int new_chrom;
     int start_pop;
 
+    ArgHmmMatrixCache *cache;
+    TransMatrixMemo *memo;
+    bool mat_cached;  // true if mat's transition matrices belong to cache
     ArgHmmMatrices mat;
 
+    int lookahead;          // blocks computed ahead (0: no pipeline)
+    int lookahead_threads;  // threads computing blocks ahead
+    ArgHmmMatrixPipeline *pipeline;
+    bool pipeline_ok;       // true while iterating in forward order
+
     // record of common blocks
     ArgModelBlocks blocks;
     int block_index;
@@ -2,6 +2,10 @@
 #include "mpi.h"
 #endif
 
+// c++ includes
+#include <math.h>
+#include <thread>
+
 #include "mcmcmc.h"
 
 namespace argweaver {
@@ -43,4 +47,73 @@ namespace argweaver {
     free(groups);
 #endif
 }
+
+
+//=============================================================================
+// replica exchange between threads
+
+ReplicaExchange::ReplicaExchange(int nchains, double heat_interval,
+                                 int seed) :
+    nchains(nchains),
+    heat_interval(heat_interval),
+    swap_ratio(0.0),
+    swap_accept(false),
+    groups(nchains),
+    chains(nchains),
+    logprobs(nchains, 0.0),
+    narrived(0),
+    generation(0),
+    rand(seed)
+{
+    swap[0] = swap[1] = -1;
+    for (int i=0; i<nchains; i++)
+        groups[i] = chains[i] = i;
+}
+
+
+void ReplicaExchange::exchange(int chain, double logprob)
+{
+    logprobs[chain] = logprob;
+
+    const int gen = generation.load(std::memory_order_acquire);
+    if (narrived.fetch_add(1, std::memory_order_acq_rel) == nchains - 1) {
+        // last chain to arrive proposes the swap and releases the others
+        narrived.store(0, std::memory_order_relaxed);
+        propose_swap();
+        generation.fetch_add(1, std::memory_order_release);
+    } else {
+        while (generation.load(std::memory_order_acquire) == gen)
+            std::this_thread::yield();
+    }
+}
+
+
+// same proposal and acceptance as mcmcmc_swap across MPI groups
+void ReplicaExchange::propose_swap()
+{
+    RandStream *orig_stream = g_rand_stream;
+    set_thread_rand_stream(&rand);
+
+    swap[0] = irand(nchains);
+    swap[1] = irand(nchains - 1);
+    if (swap[1] >= swap[0])
+        swap[1]++;
+
+    const double heat0 = get_heat(swap[0]), heat1 = get_heat(swap[1]);
+    const double like0 = logprobs[chains[swap[0]]];
+    const double like1 = logprobs[chains[swap[1]]];
+    swap_ratio = (heat0 - heat1) * like1 + (heat1 - heat0) * like0;
+    swap_accept = (swap_ratio >= 0.0 || frand() < exp(swap_ratio));
+
+    if (swap_accept) {
+        const int chain0 = chains[swap[0]], chain1 = chains[swap[1]];
+        chains[swap[0]] = chain1;
+        chains[swap[1]] = chain0;
+        groups[chain0] = swap[1];
+        groups[chain1] = swap[0];
+    }
+
+    set_thread_rand_stream(orig_stream);
+}
+
 }
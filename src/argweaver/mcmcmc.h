@@ -1,6 +1,11 @@
 #ifndef ARGWEAVER_MCMCMC_H
 #define ARGWEAVER_MCMCMC_H
 
+// c++ includes
+#include <atomic>
+#include <vector>
+
+#include "common.h"
 #include "logging.h"
 
 #ifdef ARGWEAVER_MPI
@@ -34,6 +39,48 @@ class Mc3Config
 #endif
 };
 
+
+
+// Replica exchange between chains that run in threads of one process.
+// Chain i starts in group i, with heat 1 - heat_interval * i.  After each
+// iteration, every chain publishes the log probability of its state and
+// waits for the others at an atomic barrier; the last chain to arrive
+// proposes to exchange the heats of two random groups.  Only heats move
+// between chains, never ARGs.  Proposals draw from their own random
+// stream, so the outcome does not depend on thread timing.
+class ReplicaExchange
+{
+public:
+    ReplicaExchange(int nchains, double heat_interval, int seed);
+
+    // Publish the log probability of a chain's state and wait until all
+    // chains have done so and a swap has been proposed.  Groups and the
+    // last swap may be read until the chain calls exchange() again.
+    void exchange(int chain, double logprob);
+
+    int get_group(int chain) const { return groups[chain]; }
+    double get_heat(int group) const { return 1.0 - heat_interval * group; }
+
+    int nchains;
+    double heat_interval;
+
+    // last proposed swap
+    int swap[2];        // groups
+    double swap_ratio;  // log acceptance ratio
+    bool swap_accept;
+
+protected:
+    void propose_swap();
+
+    std::vector<int> groups;       // group of each chain
+    std::vector<int> chains;       // chain of each group
+    std::vector<double> logprobs;  // published log probability of each chain
+    std::atomic<int> narrived;     // chains at the barrier
+    std::atomic<int> generation;   // number of completed exchanges
+    RandStream rand;
+};
+
+
 } //namespace argweaver
 
 #endif
@@ -180,6 +180,7 @@ void ArgModel::copy(const ArgModel &other) {
     unphased_file = other.unphased_file;
     popsize_config = other.popsize_config;
     mc3 = other.mc3;
+    hmm_options = other.hmm_options;
     smc_prime = other.smc_prime;
 
     if (other.pop_tree)
@@ -351,6 +352,8 @@ PopsizeConfig::PopsizeConfig(string filename, int ntimes, int npop,
     sample(true),
     popsize_prior_alpha(1.0),
     popsize_prior_beta(1.0e-4),
+    prior_check(100),
+    nproposals(0),
     config_buildup(0),
     epsilon(0.01),
     pseudocount(0)
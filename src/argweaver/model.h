@@ -95,6 +95,8 @@ class PopsizeConfig
     popsize_prior_alpha(1.0),
     popsize_prior_beta(1.0e-4),
     numsample(1),
+    prior_check(100),
+    nproposals(0),
     neighbor_prior(false),
     config_buildup(0),
     epsilon(0.01),
@@ -134,6 +136,9 @@ class PopsizeConfig
     double popsize_prior_alpha;
     double popsize_prior_beta;
     int numsample;  //number of times to do the sampling per threading operation
+    int prior_check;  // check the cached ARG prior against a full
+                      // recomputation every prior_check proposals (0=never)
+    int nproposals;   // proposals since the last prior check
     bool neighbor_prior;
     int config_buildup;
     double epsilon;  // Hamiltonian MCMC stepsize parameter
@@ -142,6 +147,44 @@ class PopsizeConfig
 };
 
 
+// Run-time options for the threading HMM.  None of them change the sampled
+// distribution.  forward_checkpoint and the matrix options only trade memory
+// for computation and give the same paths for a given random seed, while
+// forward_runs samples the paths within runs differently and so changes
+// the random stream.
+class ArgHmmOptions
+{
+ public:
+    ArgHmmOptions() :
+        forward_checkpoint(0),
+        forward_runs(true),
+        matrix_cache_size(256),
+        matrix_lookahead(0),
+        matrix_threads(1)
+    {}
+
+    // Store only every k-th column of the forward table and recompute
+    // the others during traceback (0: store all, -1: k = sqrt(seqlen))
+    int forward_checkpoint;
+
+    // Jump over runs of sites with the same emissions (e.g. invariant or
+    // masked sites) with powers of the forward operator where that is
+    // cheaper than computing every column of the forward table
+    bool forward_runs;
+
+    // Memory budget (MB) for reusing transition matrices of the forward
+    // pass in the traceback and recombination sampling (0: no reuse)
+    int matrix_cache_size;
+
+    // Number of blocks whose matrices are computed ahead of the forward
+    // algorithm on background threads (0: compute them synchronously)
+    int matrix_lookahead;
+
+    // Number of background threads computing matrices ahead
+    int matrix_threads;
+};
+
+
 // The model parameters and time discretization scheme
 class ArgModel
 {
@@ -243,6 +286,7 @@ class ArgModel
     unphased_file(other.unphased_file),
     popsize_config(other.popsize_config),
     mc3(other.mc3),
+    hmm_options(other.hmm_options),
     pop_tree(other.pop_tree),
     smc_prime(other.smc_prime) {}
 
@@ -260,6 +304,7 @@ class ArgModel
         unphased_file(other.unphased_file),
         popsize_config(other.popsize_config),
         mc3(other.mc3),
+        hmm_options(other.hmm_options),
         smc_prime(other.smc_prime)
     {
         copy(other);
@@ -490,6 +535,7 @@ class ArgModel
         model.coal_time_steps = coal_time_steps;
         model.popsizes = popsizes;
         model.popsize_config = popsize_config;
+        model.hmm_options = hmm_options;
         model.pop_tree = pop_tree;
         model.smc_prime = smc_prime;
     }
@@ -516,6 +562,7 @@ class ArgModel
         model.time_steps = time_steps;
         model.coal_time_steps = coal_time_steps;
         model.popsizes = popsizes;
+        model.hmm_options = hmm_options;
         model.pop_tree = pop_tree;
         model.smc_prime = smc_prime;
     }
@@ -590,6 +637,7 @@ protected:
     string unphased_file;
     PopsizeConfig popsize_config;
     Mc3Config mc3;
+    ArgHmmOptions hmm_options;
     Track<double> mutmap;    // mutation map
     Track<double> recombmap; // recombination map
     PopulationTree *pop_tree;
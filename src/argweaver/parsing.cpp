@@ -125,6 +125,21 @@ void split(const char *str, const char *delim, vector<string> &tokens)
     }
 }
 
+void split(const char *start, const char *end, const char delim,
+           vector<Token> &tokens)
+{
+    tokens.clear();
+    while (true) {
+        const char *next = (const char*) memchr(start, delim, end - start);
+        if (!next) {
+            tokens.push_back(Token(start, end));
+            break;
+        }
+        tokens.push_back(Token(start, next));
+        start = next + 1;
+    }
+}
+
 
 
 // concatenate multiple strings into one newly allocated string
@@ -95,6 +95,59 @@ inline char *trim(string &word)
 void split(const char *str, const char delim, vector<string> &tokens);
 void split(const char *str, const char *delim, vector<string> &tokens);
 
+
+// A token of a larger buffer: the characters [start, end)
+struct Token
+{
+    Token() : start(NULL), end(NULL) {}
+    Token(const char *start, const char *end) : start(start), end(end) {}
+
+    int length() const { return end - start; }
+    bool equals(const char *str) const {
+        const int len = strlen(str);
+        return length() == len && strncmp(start, str, len) == 0;
+    }
+
+    const char *start;
+    const char *end;
+};
+
+// Split the characters [start, end) at 'delim', as split() would, without
+// copying them
+void split(const char *start, const char *end, const char delim,
+           vector<Token> &tokens);
+
+
+// A null-terminated copy of a token, for passing it to atof(), atoi() or
+// sscanf().  Short tokens are copied onto the stack.
+class TokenString
+{
+public:
+    explicit TokenString(const Token &token)
+    {
+        const int len = token.length();
+        if (len < (int) sizeof(buf)) {
+            memcpy(buf, token.start, len);
+            buf[len] = '\0';
+            str = buf;
+        } else {
+            long_str.assign(token.start, len);
+            str = long_str.c_str();
+        }
+    }
+
+    const char *c_str() const { return str; }
+
+private:
+    TokenString(const TokenString &other);
+    TokenString &operator=(const TokenString &other);
+
+    char buf[64];
+    string long_str;
+    const char *str;
+};
+
+
 char *concat_strs(char **strs, int nstrs);
 
 string quote_arg(string text);
@@ -3,6 +3,8 @@
 //
 
 // c++ includes
+#include <atomic>
+#include <thread>
 #include <vector>
 
 // arghmm includes
@@ -159,8 +161,8 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
     int *removal_path = new int [trees->get_num_trees()];
 
     // save a copy of the local trees
-    LocalTrees trees2;
-    trees2.copy(*trees);
+    LocalTreesSnapshot snapshot;
+    snapshot.save(*trees);
 
     // ramdomly choose a removal path
     double npaths = sample_arg_removal_path_uniform(trees, removal_path);
@@ -172,7 +174,7 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
     double accept_prob = exp(npaths - npaths2);
     bool accept = (frand() < accept_prob);
     if (!accept)
-        trees->copy(trees2);
+        snapshot.restore(trees);
 
     // logging
     printLog(LOG_LOW, "accept_prob = exp(%lf - %lf) = %f, accept = %d\n",
@@ -190,7 +192,7 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
 void resample_arg_mcmc_all(const ArgModel *model, Sequences *sequences,
                            LocalTrees *trees, bool do_leaf,
                            int window, int niters, double heat,
-                           bool no_resample_mig)
+                           bool no_resample_mig, int nthreads)
 {
     if (do_leaf) {
         resample_arg_random_leaf(model, sequences, trees);
@@ -231,7 +233,7 @@ void resample_arg_mcmc_all(const ArgModel *model, Sequences *sequences,
                      time_interval, sequences->names[hap].c_str(), num_break);
         } else {
             double accept_rate = resample_arg_regions(
-              model, sequences, trees, window, niters, heat);
+              model, sequences, trees, window, niters, heat, nthreads);
             printLog(LOG_LOW, "resample_arg_regions: accept=%f\n", accept_rate);
         }
     }
@@ -471,7 +473,7 @@ int resample_arg_by_time_and_hap(
     LocalTrees *trees, int time_interval, int hap)
 {
     const int maxtime = model->get_removed_root_time();
-    static int count=0;
+    static thread_local int count=0;
     const bool open_ended=true;
     LocalTrees orig_trees;
     decLogLevel();
@@ -620,31 +622,20 @@ int resample_arg_by_time_and_hap(
 }
 
 
-// resample an ARG only for a given region
-// all branches are possible to resample
-// open_ended -- If true and region touches start or end of local trees do not
-//               conditioned on state.
-double resample_arg_region(
-    const ArgModel *model, Sequences *sequences,
-    LocalTrees *trees, int region_start, int region_end, int niters,
-    bool open_ended, double heat)
+// resample the threading of a window of the ARG that has been partitioned
+// out into 'trees2'.  The window is conditioned on its start and end trees
+// unless open_start or open_end are set.  If 'concurrent' is true, other
+// windows are resampled at the same time and the caller has already
+// lowered the log level (it is shared by all threads).
+static double resample_arg_window(
+    const ArgModel *model, const Sequences *sequences, LocalTrees *trees2,
+    int niters, bool open_start, bool open_end, double heat,
+    bool concurrent=false)
 {
     const int maxtime = model->get_removed_root_time();
-    static int count=0;
-
-    // special case: zero length region
-    if (region_start == region_end)
-        return 1.0;
-
-    // assert region is within trees
-    assert(region_start >= trees->start_coord);
-    assert(region_end <= trees->end_coord);
-    assert(region_start < region_end);
-
-    // partion trees into three segments
-    LocalTrees *trees2 = partition_local_trees(trees, region_start);
-    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
-    assert(trees2->length() == region_end - region_start);
+    static thread_local int count=0;
+    const int region_start = trees2->start_coord;
+    const int region_end = trees2->end_coord;
 
     // TODO: refactor
     // extend stub (zero length block) if it happens to exist
@@ -657,14 +648,14 @@ double resample_arg_region(
 
     // perform several iterations of resampling
     int accepts = 0;
+    LocalTreesSnapshot snapshot;
     for (int i=0; i<niters; i++) {
         count++;
         printLog(LOG_LOW, "region sample: iter=%d, region=(%d, %d)\n",
                  i, region_start, region_end);
 
         // save a copy of the local trees
-        LocalTrees old_trees2;
-        old_trees2.copy(*trees2);
+        snapshot.save(*trees2);
 
         // get starting and ending trees
         LocalTree start_tree(*trees2->front().tree);
@@ -687,17 +678,18 @@ double resample_arg_region(
             &end_tree, end_tree_partial, maxtime);
 
         // set start/end state to null if open ended is requested
-        if (open_ended) {
-            if (region_start == trees->start_coord)
-                start_state.set_null();
-            if (region_end == trees3->end_coord)
-                end_state.set_null();
-        }
+        if (open_start)
+            start_state.set_null();
+        if (open_end)
+            end_state.set_null();
+
         // sample new ARG conditional on start and end states
-        decLogLevel();
+        if (!concurrent)
+            decLogLevel();
         cond_sample_arg_thread_internal(model, sequences, trees2,
                                         start_state, end_state);
-        incLogLevel();
+        if (!concurrent)
+            incLogLevel();
         assert_trees(trees2, model->pop_tree);
 
         double npaths2 = count_total_arg_removal_paths(trees2);
@@ -707,7 +699,7 @@ double resample_arg_region(
         bool accept = (frand() < accept_prob);
 
         if (!accept) {
-            trees2->copy(old_trees2);
+            snapshot.restore(trees2);
         } else {
             accepts++;
         }
@@ -725,6 +717,38 @@ double resample_arg_region(
         trees2->end_coord--;
     }
 
+    return accepts / double(niters);
+}
+
+
+// resample an ARG only for a given region
+// all branches are possible to resample
+// open_ended -- If true and region touches start or end of local trees do not
+//               conditioned on state.
+double resample_arg_region(
+    const ArgModel *model, Sequences *sequences,
+    LocalTrees *trees, int region_start, int region_end, int niters,
+    bool open_ended, double heat)
+{
+    // special case: zero length region
+    if (region_start == region_end)
+        return 1.0;
+
+    // assert region is within trees
+    assert(region_start >= trees->start_coord);
+    assert(region_end <= trees->end_coord);
+    assert(region_start < region_end);
+    const bool open_start = open_ended && region_start == trees->start_coord;
+    const bool open_end = open_ended && region_end == trees->end_coord;
+
+    // partion trees into three segments
+    LocalTrees *trees2 = partition_local_trees(trees, region_start);
+    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
+    assert(trees2->length() == region_end - region_start);
+
+    double accept_rate = resample_arg_window(
+        model, sequences, trees2, niters, open_start, open_end, heat);
+
     // rejoin trees
     append_local_trees(trees, trees2, true, model->pop_tree);
     append_local_trees(trees, trees3, true, model->pop_tree);
@@ -733,30 +757,114 @@ double resample_arg_region(
     delete trees2;
     delete trees3;
 
-    return accepts / double(niters);
+    return accept_rate;
 }
 
 
+// Resample disjoint windows of the ARG concurrently on 'nthreads' threads.
+// Every window gets its own random stream, seeded from the main stream in
+// window order, so the result does not depend on how windows are scheduled
+// or on 'nthreads'.  Returns the sum of the acceptance rates of the windows.
+static double resample_arg_windows(
+    const ArgModel *model, const Sequences *sequences, LocalTrees *trees,
+    const vector<pair<int, int> > &windows, int niters, double heat,
+    int nthreads)
+{
+    const int nwindows = windows.size();
+    const int start_coord = trees->start_coord;
+    const int end_coord = trees->end_coord;
+
+    // partition trees into alternating windows and gaps; trees keeps the
+    // part before the first window
+    vector<LocalTrees*> parts;
+    LocalTrees *rest = trees;
+    for (int i=0; i<nwindows; i++) {
+        assert(i == 0 || windows[i].first >= windows[i-1].second);
+        LocalTrees *window = partition_local_trees(rest, windows[i].first);
+        rest = partition_local_trees(window, windows[i].second);
+        assert(window->length() == windows[i].second - windows[i].first);
+        parts.push_back(window);
+        parts.push_back(rest);
+    }
+
+    vector<RandStream> streams(nwindows);
+    for (int i=0; i<nwindows; i++) {
+        const unsigned long long high = rand_int();
+        const unsigned long long low = rand_int();
+        streams[i].set_seed((high << 31) ^ low);
+    }
+    vector<double> accept_rates(nwindows, 0.0);
+
+    // resample windows, handing them out to threads in order
+    decLogLevel();
+    const int log_offset = getLogLevelOffset();
+    atomic<int> next(0);
+    auto worker = [&]() {
+        // workers log like the calling thread, which keeps its own stream
+        RandStream *orig_stream = g_rand_stream;
+        setLogLevelOffset(log_offset);
+        for (int i = next++; i < nwindows; i = next++) {
+            set_thread_rand_stream(&streams[i]);
+            accept_rates[i] = resample_arg_window(
+                model, sequences, parts[2*i], niters,
+                windows[i].first == start_coord,
+                windows[i].second == end_coord, heat, true);
+        }
+        set_thread_rand_stream(orig_stream);
+    };
+    vector<thread> threads;
+    for (int i=1; i<min(nthreads, nwindows); i++)
+        threads.push_back(thread(worker));
+    worker();
+    for (unsigned int i=0; i<threads.size(); i++)
+        threads[i].join();
+    incLogLevel();
+
+    // rejoin trees
+    double accept_rate = 0.0;
+    for (unsigned int i=0; i<parts.size(); i++) {
+        append_local_trees(trees, parts[i], true, model->pop_tree);
+        delete parts[i];
+    }
+    for (int i=0; i<nwindows; i++)
+        accept_rate += accept_rates[i];
+
+    return accept_rate;
+}
 
 
 // resample an ARG a region at a time in a sliding window
+// If nthreads > 1, even and odd windows (which do not overlap one another)
+// are resampled in two phases, each on nthreads threads.  Any nthreads > 1
+// gives the same result for a given seed, but it differs from the result
+// of sliding one window at a time (nthreads = 1).
 double resample_arg_regions(
     const ArgModel *model, Sequences *sequences,
-    LocalTrees *trees, int window, int niters, double heat)
+    LocalTrees *trees, int window, int niters, double heat, int nthreads)
 {
     decLogLevel();
     double accept_rate = 0.0;
     int nwindows = 0;
     int currwindow = irand(window - window/4, window + window/4);
     int currstep = (int)currwindow/2+1;
+    vector<pair<int, int> > phases[2];
     for (int start=trees->start_coord;
          start == trees->start_coord || start+currwindow/2 <trees->end_coord;
          start+=currstep)
     {
-        nwindows++;
         int end = min(start + currwindow, trees->end_coord);
-        accept_rate += resample_arg_region(
-             model, sequences, trees, start, end, niters, true, heat);
+        if (nthreads > 1)
+            phases[nwindows % 2].push_back(make_pair(start, end));
+        else
+            accept_rate += resample_arg_region(
+                model, sequences, trees, start, end, niters, true, heat);
+        nwindows++;
+    }
+    for (int phase=0; phase<2; phase++) {
+        if (phases[phase].size() > 0)
+            accept_rate += resample_arg_windows(
+                model, sequences, trees, phases[phase], niters, heat,
+                nthreads);
     }
     incLogLevel();
 
@@ -764,6 +872,211 @@ double resample_arg_regions(
     return accept_rate;
 }
 
+//=============================================================================
+// chunked sampling
+
+// Sample an ARG for one chunk of the sequences and resample it 'niters'
+// times.  'trees' gives the coordinates of the chunk.
+static void sample_arg_chunk(
+    const ArgModel *model, Sequences *sequences, LocalTrees *trees,
+    int niters, int window, int window_niters, int num_buildup)
+{
+    const int capacity = 2 * sequences->get_num_seqs() - 1;
+    trees->make_trunk(trees->start_coord, trees->end_coord, 0, 0, capacity);
+
+    // sequences are added in order, so all chunks name their leaves alike
+    sample_arg_seq(model, sequences, trees, false, num_buildup);
+    for (int i=0; i<niters; i++)
+        resample_arg_mcmc_all(model, sequences, trees, frand() < .5,
+                              window, window_niters);
+}
+
+
+// Join 'trees2' onto the end of 'trees'.  'trees' is cut at 'pos' and
+// 'trees2' at 'pos + span'.  In between, the last tree of 'trees' is
+// turned into the first remaining tree of 'trees2' by a series of SPRs,
+// one per position except for the last one, which fills up the span.
+// 'span' must be at least the number of leaves minus one.
+static void stitch_local_trees(const ArgModel *model, LocalTrees *trees,
+                               LocalTrees *trees2, int pos, int span)
+{
+    delete partition_local_trees(trees, pos);
+    LocalTrees *right = partition_local_trees(trees2, pos + span);
+
+    // partitioning at a block start leaves a zero length stub behind
+    if (trees->back().blocklen == 0) {
+        trees->back().clear();
+        trees->trees.pop_back();
+    }
+
+    vector<Spr> sprs;
+    find_spr_path(trees->back().tree, right->front().tree, sprs);
+    assert(int(sprs.size()) <= span);
+
+    if (sprs.size() == 0)
+        trees->back().blocklen += span;
+    for (unsigned int i=0; i<sprs.size(); i++) {
+        const LocalTree *last_tree = trees->back().tree;
+        LocalTree *tree = new LocalTree(*last_tree);
+        int *mapping = new int [tree->capacity];
+        for (int j=0; j<tree->nnodes; j++)
+            mapping[j] = j;
+        mapping[last_tree->nodes[sprs[i].recomb_node].parent] = -1;
+        apply_spr(tree, sprs[i], model->pop_tree);
+
+        const int blocklen = (i + 1 < sprs.size() ? 1 : span - i);
+        trees->trees.push_back(LocalTreeSpr(tree, sprs[i], blocklen, mapping));
+    }
+    trees->end_coord = pos + span;
+
+    // the first tree of 'right' is congruent with the last tree of 'trees'
+    append_local_trees(trees, right, true, model->pop_tree);
+    delete right;
+}
+
+
+// Choose where to stitch two chunks that overlap in [start, end) for a
+// junction of length 'span'.  Candidates are the block starts of 'trees'
+// (at most 'max_candidates' of them, evenly spaced) and 'mid'.  The
+// candidate needing the fewest SPRs wins, then the one nearest to 'mid'.
+static int find_stitch_pos(const LocalTrees *trees, const LocalTrees *trees2,
+                           int start, int end, int mid, int span,
+                           int max_candidates=16)
+{
+    vector<int> candidates;
+    int block_start = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();
+         ++it) {
+        if (block_start > start && block_start + span < end)
+            candidates.push_back(block_start);
+        block_start += it->blocklen;
+    }
+    if (int(candidates.size()) > max_candidates) {
+        vector<int> subset;
+        for (int i=0; i<max_candidates; i++)
+            subset.push_back(
+                candidates[i * candidates.size() / max_candidates]);
+        candidates.swap(subset);
+    }
+    candidates.push_back(mid);
+
+    int best = mid;
+    int best_nsprs = -1;
+    vector<Spr> sprs;
+    for (unsigned int i=0; i<candidates.size(); i++) {
+        const int pos = candidates[i];
+        find_spr_path(trees->get_block(pos - 1)->tree,
+                      trees2->get_block(pos + span)->tree, sprs);
+        const int nsprs = sprs.size();
+        if (best_nsprs == -1 || nsprs < best_nsprs ||
+            (nsprs == best_nsprs && abs(pos - mid) < abs(best - mid))) {
+            best = pos;
+            best_nsprs = nsprs;
+        }
+    }
+    return best;
+}
+
+
+// Sequentially sample an ARG in overlapping chunks.  The region of 'trees'
+// is divided into chunks of about 'chunk_size' that are extended by
+// 'flank' on each side.  Chunks are sampled independently on 'nthreads'
+// threads, each followed by 'niters' resampling iterations, and then
+// stitched together within their overlaps.  Finally the ARG around each
+// junction is resampled conditional on the trees at either end.  'trees'
+// must not contain any sequences yet.
+void sample_arg_seq_chunks(const ArgModel *model, Sequences *sequences,
+                           LocalTrees *trees, int chunk_size, int flank,
+                           int niters, int window, int window_niters,
+                           int nthreads, int num_buildup)
+{
+    const int start_coord = trees->start_coord;
+    const int end_coord = trees->end_coord;
+    const int nseqs = sequences->get_num_seqs();
+    const int span = max(nseqs - 1, 1);
+    const int nchunks = max(1, int((end_coord - start_coord) /
+                                   double(chunk_size) + .5));
+    assert(model->pop_tree == NULL);
+    assert(trees->get_num_leaves() == 0);
+    assert(flank > span || nchunks == 1);
+
+    // phase is not sampled until the chunks are joined
+    ArgModel chunk_model(*model);
+    chunk_model.unphased = false;
+
+    vector<int> bounds;
+    for (int i=0; i<=nchunks; i++)
+        bounds.push_back(start_coord + int((end_coord - start_coord) *
+                                           double(i) / nchunks));
+    vector<LocalTrees*> chunks;
+    for (int i=0; i<nchunks; i++) {
+        LocalTrees *chunk = (i == 0 ? trees : new LocalTrees());
+        chunk->chrom = trees->chrom;
+        chunk->start_coord = max(start_coord, bounds[i] - flank);
+        chunk->end_coord = min(end_coord, bounds[i+1] + flank);
+        chunks.push_back(chunk);
+    }
+
+    vector<RandStream> streams(nchunks);
+    for (int i=0; i<nchunks; i++) {
+        const unsigned long long high = rand_int();
+        const unsigned long long low = rand_int();
+        streams[i].set_seed((high << 31) ^ low);
+    }
+
+    // sample chunks, handing them out to threads in order
+    decLogLevel();
+    const int log_offset = getLogLevelOffset();
+    atomic<int> next(0);
+    auto worker = [&]() {
+        RandStream *orig_stream = g_rand_stream;
+        setLogLevelOffset(log_offset);
+        for (int i = next++; i < nchunks; i = next++) {
+            set_thread_rand_stream(&streams[i]);
+            sample_arg_chunk(&chunk_model, sequences, chunks[i], niters,
+                             window, window_niters, num_buildup);
+            printLog(LOG_LOW, "sampled chunk %d of %d (%d-%d)\n",
+                     i + 1, nchunks, chunks[i]->start_coord,
+                     chunks[i]->end_coord);
+        }
+        set_thread_rand_stream(orig_stream);
+    };
+    vector<thread> threads;
+    for (int i=1; i<min(nthreads, nchunks); i++)
+        threads.push_back(thread(worker));
+    worker();
+    for (unsigned int i=0; i<threads.size(); i++)
+        threads[i].join();
+    incLogLevel();
+
+    // stitch chunks
+    vector<pair<int, int> > junctions;
+    for (int i=1; i<nchunks; i++) {
+        const int pos = find_stitch_pos(
+            trees, chunks[i], chunks[i]->start_coord, trees->end_coord,
+            bounds[i], span);
+        stitch_local_trees(model, trees, chunks[i], pos, span);
+        delete chunks[i];
+
+        int junction_start = max(pos - flank, start_coord);
+        if (junctions.size() > 0)
+            junction_start = max(junction_start, junctions.back().second);
+        const int junction_end = min(pos + span + flank, end_coord);
+        if (junction_start < junction_end)
+            junctions.push_back(make_pair(junction_start, junction_end));
+    }
+    assert(trees->end_coord == end_coord);
+    assert_trees(trees, model->pop_tree);
+
+    // reconcile the ARG across the junctions
+    if (junctions.size() > 0) {
+        printLog(LOG_LOW, "resample %d chunk junctions\n",
+                 int(junctions.size()));
+        resample_arg_windows(&chunk_model, sequences, trees, junctions,
+                             nseqs, 1.0, nthreads);
+    }
+}
+
 void resample_migrates(ArgModel *model,
                        const LocalTrees *trees,
                        vector<Spr> &invisible_recombs) {
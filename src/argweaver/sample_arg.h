@@ -39,7 +39,7 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
 void resample_arg_mcmc_all(const ArgModel *model, Sequences *sequences,
                            LocalTrees *trees, bool do_leaf,
                            int window, int niters, double heat=1.0,
-                           bool no_resample_mig=false);
+                           bool no_resample_mig=false, int nthreads=1);
 
 void resample_arg_climb(const ArgModel *model, Sequences *sequences,
                         LocalTrees *trees, double recomb_preference);
@@ -72,7 +72,12 @@ double resample_arg_cut(
 double resample_arg_regions(
     const ArgModel *model, Sequences *sequences,
     LocalTrees *trees, int window, int niters=1,
-    double heat=1.0);
+    double heat=1.0, int nthreads=1);
+
+void sample_arg_seq_chunks(const ArgModel *model, Sequences *sequences,
+                           LocalTrees *trees, int chunk_size, int flank,
+                           int niters, int window, int window_niters,
+                           int nthreads=1, int num_buildup=1);
 
 int resample_arg_by_time_and_hap(
     const ArgModel *model, Sequences *sequences,
@@ -6,6 +6,7 @@
 // arghmm includes
 #include "common.h"
 #include "emit.h"
+#include "forward_simd.h"
 #include "hmm.h"
 #include "local_tree.h"
 #include "logging.h"
@@ -218,6 +219,66 @@ void arghmm_forward_block(const ArgModel *model,
     assert(idx <= max_idx);
 
 
+    // use vectorized kernel if available
+    const ForwardKernel kernel = get_forward_kernel();
+    if (kernel != FORWARD_KERNEL_SCALAR) {
+        // enumerate (time, path) groups in the order of the scalar loops
+        int group_index[ntimes][max_numpath];
+        int ngroups = 0;
+        for (int a=0; a<ntimes; a++)
+            for (int pa=0; pa < numpath_per_time[a]; pa++)
+                group_index[a][pa] = (a < ntimes-1) ? ngroups++ : -1;
+
+        // tables are rebuilt for every block but keep their memory
+        static thread_local ForwardBlockKernel block;
+        block.init(nstates, ngroups, ngroups);
+        for (int b=0; b<ntimes-1; b++)
+            for (int pb=0; pb < numpath_per_time[b]; pb++)
+                for (int a=0; a<ntimes-1; a++)
+                    for (int pa=0; pa < numpath_per_time[a]; pa++)
+                        block.group_trans[group_index[a][pa] *
+                                          block.nout_stride +
+                                          group_index[b][pb]] =
+                            tmatrix[b][pb][a][pa];
+
+        int row_src[ntimes + max_numpath];
+        double row_coef[ntimes + max_numpath];
+        idx = 0;
+        for (int k=0; k<nstates; k++) {
+            const int b = states[k].time;
+            const int age2 = ages2[states[k].node];
+            const int group = group_index[b][path_map[k]];
+            assert(group >= 0);
+            block.in_group[k] = group;
+            block.out_group[k] = group;
+
+            int n = 0;
+            for (int a=age1_state[k]; a <= age2; a++) {
+                int j_state = nextState[idx++];
+                if (j_state >= 0) {
+                    row_src[n] = j_state;
+                    row_coef[n++] = tmatrix2[k][a];
+                }
+            }
+            if (max_numpath > 1) {
+                for (int pa=0; pa < numpath_per_time[b]; pa++) {
+                    int j_state = nextState[idx++];
+                    if (j_state >= 0) {
+                        row_src[n] = j_state;
+                        row_coef[n++] = tmatrix3[k][pa];
+                    }
+                }
+            }
+            block.add_same_branch(n, row_src, row_coef);
+        }
+        block.finish();
+
+        for (int i=1; i<blocklen; i++)
+            block.forward_column(kernel, fw[i-1], fw[i], emit[i]);
+        return;
+    }
+
+
     double tmatrix_fgroups[max_numpath][ntimes];
     double fgroups[max_numpath][ntimes];
     for (int i=1; i<blocklen; i++) {
@@ -337,6 +398,254 @@ void arghmm_forward_block_slow(const LocalTree *tree, const int ntimes,
 }
 
 
+//=============================================================================
+// Jumping over runs of columns with the same emissions
+//
+// Within a run of columns that share the emission row e, every step of the
+// forward algorithm applies the same operator M[k][j] = T(j, k) e[k].  The
+// powers M^(2^l) are computed by repeated squaring, so that 2^l columns can
+// be advanced with one matrix-vector product.  The traceback samples the
+// path inside a jumped run by bisection from the same powers.  Since runs
+// are usually sampled without a change of state, a whole sub-run is first
+// tested for staying in one state, which costs O(1).
+
+
+// Powers M^(2^l) of the forward column operator of one emission row.  Each
+// power is stored row-major (entry [k*n + j] is the weight of going from
+// state j to state k) and scaled so that its largest entry is 1.
+class ForwardRunOperator
+{
+public:
+    ForwardRunOperator(const LocalTree *tree, const States &states,
+                       const TransMatrix *matrix, const double *emit,
+                       int nlevels) :
+        nstates(states.size()),
+        powers(nlevels + 1),
+        logscales(nlevels + 1)
+    {
+        const int n = nstates;
+        vector<double> &base = powers[0];
+        base.resize(n * n);
+        for (int k=0; k<n; k++)
+            for (int j=0; j<n; j++)
+                base[k*n + j] = matrix->get(tree, states, j, k) * emit[k];
+        logscales[0] = rescale(base);
+
+        for (int l=1; l<=nlevels; l++) {
+            mult(powers[l-1], powers[l-1], powers[l]);
+            logscales[l] = 2.0 * logscales[l-1] + rescale(powers[l]);
+        }
+    }
+
+    // Advance col1 by 2^level columns into col2 (normalized).  col1 and
+    // col2 may be the same column.
+    void forward(int level, const double *col1, double *col2) const
+    {
+        const int n = nstates;
+        const double *power = &powers[level][0];
+        double col[n];
+        double norm = 0.0;
+        for (int k=0; k<n; k++) {
+            double sum = 0.0;
+            for (int j=0; j<n; j++)
+                sum += power[k*n + j] * col1[j];
+            col[k] = sum;
+            norm += sum;
+        }
+        assert(norm > 0.0);
+        for (int k=0; k<n; k++)
+            col2[k] = col[k] / norm;
+    }
+
+    // Weight of going from state j to state k in 2^level steps
+    inline double get(int level, int j, int k) const
+    {
+        return powers[level][k*nstates + j];
+    }
+
+    // Probability that a path of 2^level steps from state j to state j
+    // stays in state j
+    double stay_prob(int level, int j) const
+    {
+        const double stay = get(0, j, j);
+        const double total = get(level, j, j);
+        if (stay <= 0.0 || total <= 0.0)
+            return 0.0;
+        const double prob = exp((1 << level) * (log(stay) + logscales[0]) -
+                                (log(total) + logscales[level]));
+        return min(prob, 1.0);
+    }
+
+    int nstates;
+    vector<vector<double> > powers;
+    vector<double> logscales;
+
+protected:
+    // Scale a matrix so that its largest entry is 1 and return the log of
+    // the scaling factor
+    static double rescale(vector<double> &mat)
+    {
+        const double top = max_array(&mat[0], mat.size());
+        assert(top > 0.0);
+        for (unsigned int i=0; i<mat.size(); i++)
+            mat[i] /= top;
+        return log(top);
+    }
+
+    // c = a * b
+    void mult(const vector<double> &a, const vector<double> &b,
+              vector<double> &c) const
+    {
+        const int n = nstates;
+        c.assign(n * n, 0.0);
+        for (int i=0; i<n; i++) {
+            double *row = &c[i*n];
+            for (int l=0; l<n; l++) {
+                const double x = a[i*n + l];
+                if (x == 0.0)
+                    continue;
+                const double *brow = &b[l*n];
+                for (int j=0; j<n; j++)
+                    row[j] += x * brow[j];
+            }
+        }
+    }
+};
+
+
+static inline bool same_emit_row(const double *row1, const double *row2,
+                                 int nstates)
+{
+    return row1 == row2 ||
+        memcmp(row1, row2, nstates * sizeof(double)) == 0;
+}
+
+
+// A run of columns start+1 .. start+len that share one emission row
+struct ForwardRun
+{
+    ForwardRun(int start, int len, int row) :
+        start(start), len(len), row(row)
+    {}
+
+    int start;
+    int len;
+    int row;
+};
+
+
+// Returns the number of doublings (jumps of 2^nlevels columns) that saves
+// the most work over computing every column of the given runs, or 0 if
+// jumping does not pay.  Computing one column costs about nstates * ntimes
+// operations, each squaring nstates^3, and the powers are computed again
+// during the traceback.
+static int choose_run_levels(const vector<ForwardRun> &runs, int row,
+                             int nstates, int ntimes)
+{
+    int maxlen = 0;
+    for (unsigned int i=0; i<runs.size(); i++)
+        if (runs[i].row == row)
+            maxlen = max(maxlen, runs[i].len);
+
+    const double n = nstates;
+    int best = 0;
+    double best_gain = 0.0;
+    for (int l=1; (1 << l) <= maxlen; l++) {
+        double njumps = 0;
+        for (unsigned int i=0; i<runs.size(); i++)
+            if (runs[i].row == row)
+                njumps += runs[i].len >> l;
+        const double gain = njumps * (1 << l) * n * ntimes -
+            2.0 * n * n * (l * n + ntimes) - njumps * n * n;
+        if (gain > best_gain) {
+            best = l;
+            best_gain = gain;
+        }
+    }
+    return best;
+}
+
+
+void arghmm_forward_block_runs(const ArgModel *model, const LocalTree *tree,
+                               const int blocklen, const States &states,
+                               const LineageCounts &lineages,
+                               const TransMatrix *matrix,
+                               const double* const *emit, double **fw,
+                               ArgHmmForwardTable *forward, int start,
+                               int first)
+{
+    const int nstates = states.size();
+    const int ntimes = model->ntimes;
+
+    // a jump needs at least one squaring and a matrix for the operator
+    if (nstates == 0 ||
+        double(blocklen) * ntimes < 2.0 * nstates * (nstates + ntimes)) {
+        arghmm_forward_block(model, tree, blocklen, states, lineages,
+                             matrix, emit, fw);
+        return;
+    }
+
+    // find runs of columns with the same emissions and number their rows
+    vector<ForwardRun> runs;
+    vector<const double*> rows;
+    for (int i=max(first, 0) + 1; i<blocklen; ) {
+        int j = i + 1;
+        while (j < blocklen && same_emit_row(emit[j], emit[i], nstates))
+            j++;
+        if (j - i > 1) {
+            unsigned int r = 0;
+            while (r < rows.size() && !same_emit_row(rows[r], emit[i],
+                                                     nstates))
+                r++;
+            if (r == rows.size())
+                rows.push_back(emit[i]);
+            runs.push_back(ForwardRun(i - 1, j - i, r));
+        }
+        i = j;
+    }
+
+    // decide how far to jump for each row
+    vector<int> levels(rows.size());
+    vector<ForwardRunOperator*> ops(rows.size(), NULL);
+    vector<int> jump_rows(rows.size(), -1);
+    for (unsigned int r=0; r<rows.size(); r++)
+        levels[r] = choose_run_levels(runs, r, nstates, ntimes);
+
+    // compute columns between jumps and jump over runs
+    int done = 0;
+    for (unsigned int i=0; i<runs.size(); i++) {
+        const int r = runs[i].row;
+        const int level = levels[r];
+        const int njumps = level > 0 ? runs[i].len >> level : 0;
+        if (njumps == 0)
+            continue;
+        if (!ops[r]) {
+            ops[r] = new ForwardRunOperator(tree, states, matrix, rows[r],
+                                            level);
+            jump_rows[r] = forward->add_jump_row(rows[r], nstates);
+        }
+
+        int col = runs[i].start;
+        if (col > done)
+            arghmm_forward_block(model, tree, col - done + 1, states,
+                                 lineages, matrix, &emit[done], &fw[done]);
+        for (int k=0; k<njumps; k++) {
+            ops[r]->forward(level, fw[col], fw[col + (1 << level)]);
+            forward->jumps.push_back(
+                ForwardJump(start + col, 1 << level, jump_rows[r]));
+            col += 1 << level;
+        }
+        done = col;
+    }
+    if (done < blocklen - 1)
+        arghmm_forward_block(model, tree, blocklen - done, states, lineages,
+                             matrix, &emit[done], &fw[done]);
+
+    for (unsigned int r=0; r<ops.size(); r++)
+        delete ops[r];
+}
+
+
 
 
 // run forward algorithm for one column of the table
@@ -346,50 +655,24 @@ void arghmm_forward_switch(const double *col1, double* col2,
                            const double *emit)
 {
     // if state space is size zero, we still treat it as size 1
-    const int nstates1 = max(matrix->nstates1, 1);
     const int nstates2 = max(matrix->nstates2, 1);
-    //    printf("nstates1=%i nstates2=%i\n", nstates1, nstates2);
 
     // initialize all entries in col2 to 0
     for (int k=0; k<nstates2; k++)
         col2[k] = 0.0;
 
-    // add deterministic transitions
-    for (int j=0; j<nstates1; j++) {
-        int k = matrix->determ[j];
-        if (k != -1 && matrix->recombsrc[j] < 0 && matrix->recoalsrc[j] < 0) {
-            col2[k] += col1[j] * matrix->determprob[j];
+    // add deterministic, recombination and recoalescing transitions,
+    // streaming only the non-zero entries
+    assert(!matrix->row_start.empty());
+    const int nrows = matrix->row_state.size();
+    for (int r=0; r<nrows; r++) {
+        const double p = col1[matrix->row_state[r]];
+        for (int e=matrix->row_start[r]; e<matrix->row_start[r+1]; e++) {
+            const int k = matrix->row_cols[e];
+            col2[k] += p * matrix->row_vals[e];
             assert(!isnan(col2[k]));
         }
     }
-
-    // add recombination and recoalescing transitions
-    for (int j=0; j < nstates1; j++) {
-        if (matrix->recombsrc[j] >= 0) {
-            assert(matrix->recoalsrc[j] < 0);
-            for (int k=0; k<nstates2; k++) {
-                double val = matrix->get(j, k);
-                if (val > 0) {
-                    col2[k] += col1[j] * val;
-                    assert(!isnan(col2[k]));
-                    //                    printf("recombsrc %i %i %e %e\n", j, k, val, col2[k]);
-                }
-            }
-        }
-    }
-    for (int j=0; j < nstates1; j++) {
-        if (matrix->recoalsrc[j] >= 0) {
-            assert(matrix->recombsrc[j] < 0);
-            for (int k=0; k<nstates2; k++) {
-                double val = matrix->get(j, k);
-                if (val > 0) {
-                    col2[k] += col1[j] * val;
-                    assert(!isnan(col2[k]));
-                    //                    printf("recoalsrc %i %i %e %e\n", j, k, val, col2[k]);
-                }
-            }
-        }
-    }
     double norm = 0.0;
     for (int k=0; k<nstates2; k++) {
         col2[k] *= emit[k];
@@ -419,6 +702,26 @@ void arghmm_forward_switch(const double *col1, double* col2,
 
 
 
+// Returns a new forward table as configured by model->hmm_options
+ArgHmmForwardTable *new_forward_table(const ArgModel *model,
+                                      int start_coord, int seqlen)
+{
+    int interval = model->hmm_options.forward_checkpoint;
+    if (interval < 0)
+        interval = int(ceil(sqrt(double(seqlen))));
+    if (interval == 0)
+        return new ArgHmmForwardTable(start_coord, seqlen);
+    return new ArgHmmForwardTableCheckpoint(start_coord, seqlen, interval);
+}
+
+
+// Returns the transition matrix cache budget in bytes
+static size_t matrix_cache_bytes(const ArgModel *model)
+{
+    return size_t(max(model->hmm_options.matrix_cache_size, 0)) << 20;
+}
+
+
 // Run forward algorithm for all blocks
 void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
@@ -435,6 +738,7 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
 #endif
 
     double **fw = forward->get_table();
+    const bool runs = model->hmm_options.forward_runs;
     // forward algorithm over local trees
     for (matrix_iter->begin(); matrix_iter->more(); matrix_iter->next()) {
         // get block information
@@ -443,7 +747,7 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
         int pos = matrix_iter->get_block_start();
         int blocklen = matrices.blocklen;
         model->get_local_model(pos, local_model, &mu_idx, &rho_idx);
-        double **emit = matrices.emit;
+        double **emit = matrices.emit->rows;
 
         // allocate the forward table
         if (pos > trees->start_coord || !prior_given)
@@ -470,7 +774,7 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
         } else if (matrices.transmat_switch) {
             // perform one column of forward algorithm with transmat_switch
             arghmm_forward_switch(fw[pos-1], fw[pos],
-                matrices.transmat_switch, matrices.emit[0]);
+                matrices.transmat_switch, matrices.emit->rows[0]);
         } else {
             // we are still inside the same ARG block, therefore the
             // state-space does not change and no switch matrix is needed
@@ -491,6 +795,12 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
             arghmm_forward_block_slow(tree, model->ntimes, blocklen,
                                       states, lineages, matrices.transmat,
                                       emit, fw_block);
+        else if (runs)
+            arghmm_forward_block_runs(model, tree, blocklen,
+                                      states, lineages, matrices.transmat,
+                                      emit, fw_block, forward,
+                                      fw_block == &fw[pos] ? pos : pos - 1,
+                                      fw_block == &fw[pos] ? 0 : 1);
         else
             arghmm_forward_block(model, tree, blocklen,
                                  states, lineages, matrices.transmat,
@@ -553,12 +863,16 @@ double sample_hmm_posterior(
 int sample_hmm_posterior_step(const TransMatrixSwitch *matrix,
                               const double *col1, int state2)
 {
-    const int nstates1 = max(matrix->nstates1, 1);
-    double A[nstates1];
+    // only the non-zero entries of column state2 can be sampled
+    assert(!matrix->col_start.empty());
+    const int start = matrix->col_start[state2];
+    const int n = matrix->col_start[state2 + 1] - start;
+    assert(n > 0);
+    double A[n];
 
-    for (int j=0; j<nstates1; j++)
-        A[j] = col1[j] * matrix->get(j, state2);
-    int k = sample(A, nstates1);
+    for (int i=0; i<n; i++)
+        A[i] = col1[matrix->col_rows[start + i]] * matrix->col_vals[start + i];
+    int k = matrix->col_rows[start + sample(A, n)];
 
     // DEBUG
     assert(matrix->get(k, state2) != 0.0);
@@ -566,13 +880,262 @@ int sample_hmm_posterior_step(const TransMatrixSwitch *matrix,
 }
 
 
+// Sample the states path[1] .. path[2^level - 1] of a run between the given
+// states path[0] and path[2^level].  If 'changes' is true, the path is
+// conditioned on not staying in the state path[0] == path[2^level].
+static void sample_run_path(const ForwardRunOperator &op, int level,
+                            int *path, bool changes)
+{
+    if (level == 0)
+        return;
+    const int nstates = op.nstates;
+    const int len = 1 << level, half = len / 2;
+    const int state1 = path[0], state2 = path[len];
+
+    // test whether the path stays in one state
+    double stay = 0.0;
+    if (state1 == state2) {
+        stay = op.stay_prob(level, state1);
+        if (!changes) {
+            if (frand() < stay) {
+                fill(path + 1, path + len, state1);
+                return;
+            }
+            changes = true;
+        }
+    } else {
+        changes = false;
+    }
+
+    // sample the middle state
+    double A[nstates];
+    double total = 0.0;
+    for (int j=0; j<nstates; j++) {
+        A[j] = op.get(level-1, state1, j) * op.get(level-1, j, state2);
+        total += A[j];
+    }
+    assert(total > 0.0);
+    if (changes && total > A[state1])
+        A[state1] = max(A[state1] - stay * total, 0.0);
+    const int mid = sample(A, nstates);
+    path[half] = mid;
+
+    if (changes && mid == state1) {
+        // at least one half of the path leaves the state: the first, the
+        // second or both, with weights proportional to stay * (1 - stay),
+        // (1 - stay) * stay and (1 - stay)^2
+        const double stay2 = op.stay_prob(level-1, state1);
+        const double halves[3] = {stay2, stay2, 1.0 - stay2};
+        const int c = sample(halves, 3);
+        if (c == 0)
+            fill(path + 1, path + half, state1);
+        else
+            sample_run_path(op, level-1, path, true);
+        if (c == 1)
+            fill(path + half + 1, path + len, state1);
+        else
+            sample_run_path(op, level-1, path + half, true);
+    } else {
+        sample_run_path(op, level-1, path, false);
+        sample_run_path(op, level-1, path + half, false);
+    }
+}
+
+
+static bool jump_before(const ForwardJump &jump, int pos)
+{
+    return jump.start < pos;
+}
+
+
+// Find the jumps [first, last) of the block [pos, pos + blocklen)
+static void find_block_jumps(const ArgHmmForwardTable *forward, int pos,
+                             int blocklen, int *first, int *last)
+{
+    const vector<ForwardJump> &jumps = forward->jumps;
+    *first = lower_bound(jumps.begin(), jumps.end(), pos, jump_before) -
+        jumps.begin();
+    *last = *first;
+    while (*last < int(jumps.size()) && jumps[*last].start < pos + blocklen)
+        (*last)++;
+}
+
+
+// The operators of the jumps of one block, computed again during the
+// traceback for each emission row that is used
+class ForwardJumpOperators
+{
+public:
+    ForwardJumpOperators(const LocalTree *tree, const States &states,
+                         const TransMatrix *matrix,
+                         const ArgHmmForwardTable *forward) :
+        tree(tree), states(states), matrix(matrix), forward(forward)
+    {}
+
+    ~ForwardJumpOperators()
+    {
+        for (unsigned int r=0; r<ops.size(); r++)
+            delete ops[r];
+    }
+
+    // Returns the operator of a jump and its number of doublings
+    const ForwardRunOperator &get(const ForwardJump &jump, int *level)
+    {
+        *level = 0;
+        while ((1 << *level) < jump.nsteps)
+            (*level)++;
+        assert((1 << *level) == jump.nsteps);
+
+        unsigned int r = 0;
+        while (r < rows.size() && rows[r] != jump.row)
+            r++;
+        if (r == rows.size()) {
+            rows.push_back(jump.row);
+            ops.push_back(new ForwardRunOperator(
+                tree, states, matrix, &forward->jump_rows[jump.row][0],
+                *level));
+        }
+        return *ops[r];
+    }
+
+protected:
+    const LocalTree *tree;
+    const States &states;
+    const TransMatrix *matrix;
+    const ArgHmmForwardTable *forward;
+    vector<int> rows;
+    vector<ForwardRunOperator*> ops;
+};
+
+
+// Sample path[start] .. path[end - 1] given path[end], including the runs
+// of the jumps [first, last), which must lie within [start, end]
+static double sample_hmm_posterior_jumps(
+    const LocalTree *tree, const States &states, const TransMatrix *matrix,
+    const ArgHmmForwardTable *forward, ForwardJumpOperators &ops,
+    int first, int last, int start, int end, const double *const *fw,
+    int *path)
+{
+    const int nstates = states.size();
+    double lnl = 0.0;
+
+    for (int i=last-1; i>=first; i--) {
+        const ForwardJump &jump = forward->jumps[i];
+        const int jump_end = jump.start + jump.nsteps;
+        lnl += sample_hmm_posterior(end - jump_end + 1, tree, states, matrix,
+                                    &fw[jump_end], &path[jump_end]);
+
+        // sample the start of the run, then the states within it
+        int level;
+        const ForwardRunOperator &op = ops.get(jump, &level);
+        double A[nstates];
+        for (int j=0; j<nstates; j++)
+            A[j] = fw[jump.start][j] * op.get(level, j, path[jump_end]);
+        path[jump.start] = sample(A, nstates);
+        sample_run_path(op, level, &path[jump.start], false);
+        end = jump.start;
+    }
+    lnl += sample_hmm_posterior(end - start + 1, tree, states, matrix,
+                                &fw[start], &path[start]);
+    return lnl;
+}
+
+
+double sample_hmm_posterior_runs(
+    int blocklen, const LocalTree *tree, const States &states,
+    const TransMatrix *matrix, const ArgHmmForwardTable *forward, int pos,
+    const double *const *fw, int *path)
+{
+    int first, last;
+    find_block_jumps(forward, pos, blocklen, &first, &last);
+    if (first == last)
+        return sample_hmm_posterior(blocklen, tree, states, matrix,
+                                    &fw[pos], &path[pos]);
+
+    ForwardJumpOperators ops(tree, states, matrix, forward);
+    return sample_hmm_posterior_jumps(tree, states, matrix, forward, ops,
+                                      first, last, pos, pos + blocklen - 1,
+                                      fw, path);
+}
+
+
+// Sample the path of one block from a checkpointed forward table.
+// Segments between checkpoints are recomputed from last to first with the
+// jumps of the forward pass, which consumes random numbers in the same
+// order as the full table.  A segment never starts within a jump, since
+// the columns of a jumped run are not computed.
+static double sample_hmm_posterior_checkpoint(
+    const ArgModel *model, ArgHmmForwardTableCheckpoint *forward,
+    const LocalTree *tree, const States &states,
+    const LineageCounts &lineages, ArgHmmMatrices &mat, int pos,
+    double **fw, int *path)
+{
+    const vector<ForwardJump> &jumps = forward->jumps;
+    ForwardJumpOperators ops(tree, states, mat.transmat, forward);
+    double lnl = 0.0;
+    assert(mat.emit);
+
+    int first, last;
+    find_block_jumps(forward, pos, mat.blocklen, &first, &last);
+    int end = pos + mat.blocklen - 1;
+    while (end > pos) {
+        // move the start of the segment before any jump it falls into
+        int start = forward->prev_checkpoint(pos, end);
+        int k = last;
+        while (k > first && jumps[k-1].start + jumps[k-1].nsteps > start) {
+            if (jumps[k-1].start < start)
+                start = forward->prev_checkpoint(pos, jumps[k-1].start + 1);
+            else
+                k--;
+        }
+
+        // recompute the segment with the jumps [k, last)
+        forward->map_segment(start, end, mat.nstates2, jumps.data() + k,
+                             last - k);
+        int col = start;
+        for (int i=k; i<last; i++) {
+            if (jumps[i].start > col)
+                arghmm_forward_block(model, tree, jumps[i].start - col + 1,
+                                     states, lineages, mat.transmat,
+                                     &mat.emit->rows[col - pos], &fw[col]);
+            col = jumps[i].start + jumps[i].nsteps;
+            if (col < end) {
+                int level;
+                ops.get(jumps[i], &level).forward(
+                    level, fw[jumps[i].start], fw[col]);
+            }
+        }
+        if (col < end)
+            arghmm_forward_block(model, tree, end - col, states, lineages,
+                                 mat.transmat, &mat.emit->rows[col - pos],
+                                 &fw[col]);
+
+        lnl += sample_hmm_posterior_jumps(tree, states, mat.transmat,
+                                          forward, ops, k, last, start, end,
+                                          fw, path);
+        end = start;
+        last = k;
+    }
+
+    return lnl;
+}
+
+
+// NOTE: if forward is a checkpointed table, matrix_iter must compute
+// emissions (i.e. be given sequences) so that missing columns can be
+// recomputed.
 double stochastic_traceback(
     const LocalTrees *trees, const ArgModel *model,
     ArgHmmMatrixIter *matrix_iter,
-    double **fw, int *path, bool last_state_given, bool internal)
+    double **fw, int *path, bool last_state_given, bool internal,
+    ArgHmmForwardTable *forward, PhaseProbs *phase_pr)
 {
     States states;
     double lnl = 0.0;
+    ArgHmmForwardTableCheckpoint *checkpoint = NULL;
+    if (forward && forward->checkpoint_interval() > 0)
+        checkpoint = (ArgHmmForwardTableCheckpoint*) forward;
+    LineageCounts lineages(model->ntimes, model->num_pops());
     /*    printf("stochastic_traceback last_state_given=%i internal=%i\n",
           (int)last_state_given, (int)internal);*/
 
@@ -581,7 +1144,7 @@ double stochastic_traceback(
     int pos = trees->end_coord;
 
     if (!last_state_given) {
-        ArgHmmMatrices &mat = matrix_iter->ref_matrices();
+        ArgHmmMatrices &mat = matrix_iter->ref_matrices(phase_pr);
         const int nstates = max(mat.nstates2, 1);
         path[pos-1] = sample(fw[pos-1], nstates);
         lnl = fw[pos-1][path[pos-1]];
@@ -589,13 +1152,24 @@ double stochastic_traceback(
 
     // iterate backward through blocks
     for (; matrix_iter->more(); matrix_iter->prev()) {
-        ArgHmmMatrices &mat = matrix_iter->ref_matrices();
+        ArgHmmMatrices &mat = matrix_iter->ref_matrices(phase_pr);
         LocalTree *tree = matrix_iter->get_tree_spr()->tree;
         mat.states_model.get_coal_states(tree, states);
         pos -= mat.blocklen;
 
-        lnl += sample_hmm_posterior(mat.blocklen, tree, states,
-                                    mat.transmat, &fw[pos], &path[pos]);
+        if (checkpoint) {
+            lineages.count(tree, model->pop_tree, internal);
+            lnl += sample_hmm_posterior_checkpoint(
+                model, checkpoint, tree, states, lineages, mat, pos,
+                fw, path);
+        } else if (forward) {
+            lnl += sample_hmm_posterior_runs(mat.blocklen, tree, states,
+                                             mat.transmat, forward, pos,
+                                             fw, path);
+        } else {
+            lnl += sample_hmm_posterior(mat.blocklen, tree, states,
+                                        mat.transmat, &fw[pos], &path[pos]);
+        }
 
         // fill in last col of next block
         if (pos > trees->start_coord) {
@@ -628,7 +1202,8 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
                        LocalTrees *trees, int new_chrom)
 {
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    ArgHmmForwardTable *forward = new_forward_table(
+        model, trees->start_coord, trees->length());
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
     int start_pop = sequences->get_pop(new_chrom);
@@ -643,24 +1218,42 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
       printf("treemap = %i %i\n", phase_pr.treemap1, phase_pr.treemap2);
 
     // build matrices
+    ArgHmmMatrixCache matrix_cache(matrix_cache_bytes(model));
+    TransMatrixMemo transmat_memo;
     ArgHmmMatrixIter matrix_iter(model, sequences, trees, new_chrom);
     matrix_iter.set_start_pop(start_pop);
+    if (matrix_cache.max_bytes > 0)
+        matrix_iter.set_cache(&matrix_cache);
+    matrix_iter.set_memo(&transmat_memo);
+    matrix_iter.set_lookahead(model->hmm_options.matrix_lookahead,
+                              model->hmm_options.matrix_threads);
 
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
 		       model->unphased ? &phase_pr : NULL);
     int nstates = get_num_coal_states(trees->front().tree, model->ntimes);
     printTimerLog(time, LOG_LOW,
                   "forward (%3d states, %6d blocks):",
                   nstates, trees->get_num_trees());
+    if (forward->jumps.size() > 0)
+        printLog(LOG_LOW, "forward runs: %d columns jumped\n",
+                 forward->njumped());
 
     // traceback
     time.start();
-    double **fw = forward.get_table();
+    double **fw = forward->get_table();
     ArgHmmMatrixIter matrix_iter2(model, NULL, trees, new_chrom);
     matrix_iter2.set_start_pop(start_pop);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path);
+    if (matrix_cache.max_bytes > 0)
+        matrix_iter2.set_cache(&matrix_cache);
+    matrix_iter2.set_memo(&transmat_memo);
+    // a checkpointed table needs emissions to recompute columns
+    const bool checkpoint = forward->checkpoint_interval() > 0;
+    stochastic_traceback(trees, model,
+                         checkpoint ? &matrix_iter : &matrix_iter2,
+                         fw, thread_path, false, false, forward,
+                         model->unphased ? &phase_pr : NULL);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
 
@@ -684,8 +1277,12 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
     assert_trees(trees, model->pop_tree);
     printTimerLog(time, LOG_LOW,
                   "add thread:                         ");
+    printLog(LOG_LOW, "transition matrix memo: %d hits, %d misses"
+             " (%d updated)\n", transmat_memo.nhits, transmat_memo.nmisses,
+             transmat_memo.nupdates);
 
     // clean up
+    delete forward;
     delete [] thread_path_alloc;
 }
 
@@ -698,13 +1295,21 @@ void sample_arg_thread_internal(
     const bool internal = true;
 
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    ArgHmmForwardTable *forward = new_forward_table(
+        model, trees->start_coord, trees->length());
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
 
     // build matrices
+    ArgHmmMatrixCache matrix_cache(matrix_cache_bytes(model));
+    TransMatrixMemo transmat_memo;
     ArgHmmMatrixIter matrix_iter(model, sequences, trees);
     matrix_iter.set_internal(internal, minage);
+    if (matrix_cache.max_bytes > 0)
+        matrix_iter.set_cache(&matrix_cache);
+    matrix_iter.set_memo(&transmat_memo);
+    matrix_iter.set_lookahead(model->hmm_options.matrix_lookahead,
+                              model->hmm_options.matrix_threads);
 
     if (phase_pr != NULL)
         printLog(LOG_HIGH, "treemap = %i %i\n",
@@ -712,21 +1317,30 @@ void sample_arg_thread_internal(
 
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
                        phase_pr, false, internal);
     int nstates = get_num_coal_states_internal(
            trees->front().tree, model->ntimes, minage);
     printTimerLog(time, LOG_LOW,
                   "forward (%3d states, %6d blocks):",
                   nstates, trees->get_num_trees());
+    if (forward->jumps.size() > 0)
+        printLog(LOG_LOW, "forward runs: %d columns jumped\n",
+                 forward->njumped());
 
     // traceback
     time.start();
-    double **fw = forward.get_table();
+    double **fw = forward->get_table();
     ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
     matrix_iter2.set_internal(internal, minage);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
-                         false, internal);
+    if (matrix_cache.max_bytes > 0)
+        matrix_iter2.set_cache(&matrix_cache);
+    matrix_iter2.set_memo(&transmat_memo);
+    // a checkpointed table needs emissions to recompute columns
+    const bool checkpoint = forward->checkpoint_interval() > 0;
+    stochastic_traceback(trees, model,
+                         checkpoint ? &matrix_iter : &matrix_iter2,
+                         fw, thread_path, false, internal, forward, phase_pr);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
 
@@ -746,8 +1360,12 @@ void sample_arg_thread_internal(
                         recomb_pos, recombs, model->pop_tree);
     printTimerLog(time, LOG_LOW,
                   "add thread:                         ");
+    printLog(LOG_LOW, "transition matrix memo: %d hits, %d misses"
+             " (%d updated)\n", transmat_memo.nhits, transmat_memo.nmisses,
+             transmat_memo.nupdates);
 
     // clean up
+    delete forward;
     delete [] thread_path_alloc;
 }
 
@@ -831,9 +1449,10 @@ void cond_sample_arg_thread_internal(
     const State start_state, const State end_state)
 {
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    ArgHmmForwardTable *forward = new_forward_table(
+        model, trees->start_coord, trees->length());
     States states;
-    double **fw = forward.get_table();
+    double **fw = forward->get_table();
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
     const bool internal = true;
@@ -846,14 +1465,21 @@ void cond_sample_arg_thread_internal(
     assert_trees(trees, model->pop_tree, true);
 
     // build matrices
+    ArgHmmMatrixCache matrix_cache(matrix_cache_bytes(model));
+    TransMatrixMemo transmat_memo;
     ArgHmmMatrixIter matrix_iter(model, sequences, trees);
     matrix_iter.set_internal(internal);
+    if (matrix_cache.max_bytes > 0)
+        matrix_iter.set_cache(&matrix_cache);
+    matrix_iter.set_memo(&transmat_memo);
+    matrix_iter.set_lookahead(model->hmm_options.matrix_lookahead,
+                              model->hmm_options.matrix_threads);
 
     // fill in first column of forward table
     matrix_iter.begin();
     matrix_iter.get_coal_states(states);
-    forward.new_block(matrix_iter.get_block_start(),
-                      matrix_iter.get_block_end(), states.size());
+    forward->new_block(matrix_iter.get_block_start(),
+                       matrix_iter.get_block_end(), states.size());
 
     if (states.size() > 0) {
         if (!start_state.is_null()) {
@@ -878,7 +1504,7 @@ void cond_sample_arg_thread_internal(
 
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward, NULL,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward, NULL,
                        prior_given, internal);
 
     // TODO: Check that we don't need more arguments here!
@@ -887,6 +1513,9 @@ void cond_sample_arg_thread_internal(
     printTimerLog(time, LOG_LOW,
                   "forward (%3d states, %6d blocks):",
                   nstates, trees->get_num_trees());
+    if (forward->jumps.size() > 0)
+        printLog(LOG_LOW, "forward runs: %d columns jumped\n",
+                 forward->njumped());
 
     // fill in last state of traceback
     matrix_iter.rbegin();
@@ -913,8 +1542,15 @@ void cond_sample_arg_thread_internal(
     time.start();
     ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
     matrix_iter2.set_internal(internal);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
-                         last_state_given, internal);
+    if (matrix_cache.max_bytes > 0)
+        matrix_iter2.set_cache(&matrix_cache);
+    matrix_iter2.set_memo(&transmat_memo);
+    // a checkpointed table needs emissions to recompute columns
+    const bool checkpoint = forward->checkpoint_interval() > 0;
+    stochastic_traceback(trees, model,
+                         checkpoint ? &matrix_iter : &matrix_iter2,
+                         fw, thread_path, last_state_given, internal,
+                         forward);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
     if (!start_state.is_null())
@@ -935,8 +1571,12 @@ void cond_sample_arg_thread_internal(
     assert_trees(trees, model->pop_tree);
     printTimerLog(time, LOG_LOW,
                   "add thread:                         ");
+    printLog(LOG_LOW, "transition matrix memo: %d hits, %d misses"
+             " (%d updated)\n", transmat_memo.nhits, transmat_memo.nmisses,
+             transmat_memo.nupdates);
 
     // clean up
+    delete forward;
     delete [] thread_path_alloc;
 }
 
@@ -32,6 +32,21 @@ using namespace std;
 // Forward tables
 
 
+// A run of columns that the forward algorithm jumped over.  Columns start
+// and start + nsteps are stored, the columns in between are not computed.
+// They all use the emission row jump_rows[row] of the forward table.
+struct ForwardJump
+{
+    ForwardJump(int start, int nsteps, int row) :
+        start(start), nsteps(nsteps), row(row)
+    {}
+
+    int start;
+    int nsteps;
+    int row;
+};
+
+
 class ArgHmmForwardTable
 {
 public:
@@ -74,6 +89,24 @@ public:
         for (unsigned int i=0; i<blocks.size(); i++)
             delete [] blocks[i];
         blocks.clear();
+        jumps.clear();
+        jump_rows.clear();
+    }
+
+    // number of columns that the forward algorithm jumped over
+    int njumped() const
+    {
+        int n = 0;
+        for (unsigned int i=0; i<jumps.size(); i++)
+            n += jumps[i].nsteps - 1;
+        return n;
+    }
+
+    // keep a copy of an emission row used by jumps and return its index
+    int add_jump_row(const double *emit, int nstates)
+    {
+        jump_rows.push_back(vector<double>(emit, emit + nstates));
+        return jump_rows.size() - 1;
     }
 
     virtual double **get_table()
@@ -88,9 +121,19 @@ public:
         return ptr;
     }
 
+    // number of columns between stored columns (0: all columns stored)
+    virtual int checkpoint_interval() const
+    {
+        return 0;
+    }
+
     int start_coord;
     int seqlen;
 
+    // jumps over runs of columns, in order of position
+    vector<ForwardJump> jumps;
+    vector<vector<double> > jump_rows;
+
 protected:
     double **fw;
     vector<double*> blocks;
@@ -124,18 +167,157 @@ public:
 };
 
 
+// Forward table that only stores every k-th column of the sequence (and the
+// first and last column of each block).  The remaining columns share a two
+// column scratch buffer during the forward pass and are recomputed one
+// segment at a time during the traceback (see map_segment), which reduces
+// memory from O(L) to O(L/k + k) columns.  Jumps over runs of columns are
+// repeated when a segment is recomputed, and a segment is extended to the
+// start of a jump that its first checkpoint falls into.
+class ArgHmmForwardTableCheckpoint : public ArgHmmForwardTable
+{
+public:
+    ArgHmmForwardTableCheckpoint(int start_coord, int seqlen, int interval) :
+        ArgHmmForwardTable(start_coord, seqlen),
+        interval(max(interval, 1))
+    {}
+
+    // allocate another block of the forward table
+    virtual void new_block(int start, int end, int nstates)
+    {
+        // allocate checkpoint columns
+        nstates = max(nstates, 1);
+        int ncheckpoints = 0;
+        for (int i=start; i<end; i++)
+            if (is_checkpoint(start, end, i))
+                ncheckpoints++;
+        double *block = new double [ncheckpoints * nstates];
+        blocks.push_back(block);
+
+        // scratch columns are shared by all blocks
+        if (int(scratch.size()) < 2 * nstates)
+            scratch.resize(2 * nstates);
+
+        // link block to fw table
+        int n = 0;
+        for (int i=start; i<end; i++) {
+            assert(i-start_coord >= 0 && i-start_coord < seqlen);
+            if (is_checkpoint(start, end, i))
+                fw[i-start_coord] = &block[(n++)*nstates];
+            else
+                fw[i-start_coord] = &scratch[(i % 2)*nstates];
+        }
+        assert(n == ncheckpoints);
+    }
+
+    // whether column i of the block [start, end) is stored
+    bool is_checkpoint(int start, int end, int i) const
+    {
+        return i == start || i == end - 1 || (i - start_coord) % interval == 0;
+    }
+
+    // last stored column before column i of the block starting at start
+    int prev_checkpoint(int start, int i) const
+    {
+        return max(start, start_coord +
+                   ((i - 1 - start_coord) / interval) * interval);
+    }
+
+    // link the columns strictly between checkpoints start and end to a
+    // segment buffer so that they can be recomputed.  The columns within
+    // the given jumps (sorted, between start and end) are not computed and
+    // share one scratch column.
+    void map_segment(int start, int end, int nstates,
+                     const ForwardJump *jumps=NULL, int njumps=0)
+    {
+        nstates = max(nstates, 1);
+        int len = max(end - start - 1, 0);
+        for (int k=0; k<njumps; k++)
+            len -= jumps[k].nsteps - 1;
+        if (int(segment.size()) < len * nstates)
+            segment.resize(len * nstates);
+        if (int(scratch.size()) < nstates)
+            scratch.resize(nstates);
+
+        int n = 0, k = 0;
+        for (int i=start+1; i<end; i++) {
+            while (k < njumps && jumps[k].start + jumps[k].nsteps <= i)
+                k++;
+            if (k < njumps && jumps[k].start < i)
+                fw[i-start_coord] = &scratch[0];
+            else
+                fw[i-start_coord] = &segment[(n++)*nstates];
+        }
+        assert(n == len);
+    }
+
+    virtual int checkpoint_interval() const
+    {
+        return interval;
+    }
+
+protected:
+    int interval;
+    vector<double> scratch;
+    vector<double> segment;
+};
+
+
+// Returns a new forward table as configured by model->hmm_options
+ArgHmmForwardTable *new_forward_table(const ArgModel *model,
+                                      int start_coord, int seqlen);
+
+
 //=============================================================================
 // Forward algorithm for thread path
 
+void arghmm_forward_block(const ArgModel *model, const LocalTree *tree,
+                          const int blocklen, const States &states,
+                          const LineageCounts &lineages,
+                          const TransMatrix *matrix,
+                          const double* const *emit, double **fw);
+void arghmm_forward_block_slow(const LocalTree *tree, const int ntimes,
+                               const int blocklen, const States &states,
+                               const LineageCounts &lineages,
+                               const TransMatrix *matrix,
+                               const double* const *emit, double **fw);
+
+// Computes one block of the forward table like arghmm_forward_block, but
+// jumps over runs of columns that share one emission row (e.g. invariant or
+// masked sites) with precomputed powers of the column operator wherever
+// that is cheaper than computing every column.  Jumps are recorded in
+// 'forward'; 'start' is the position of fw[0] and no jump starts before
+// column 'first'.
+void arghmm_forward_block_runs(const ArgModel *model, const LocalTree *tree,
+                               const int blocklen, const States &states,
+                               const LineageCounts &lineages,
+                               const TransMatrix *matrix,
+                               const double* const *emit, double **fw,
+                               ArgHmmForwardTable *forward, int start,
+                               int first);
+
 void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
     ArgHmmForwardTable *forward, PhaseProbs *phase_pr=NULL,
     bool prior_given=false, bool internal=false, bool slow=false);
 
+double sample_hmm_posterior(
+    int blocklen, const LocalTree *tree, const States &states,
+    const TransMatrix *matrix, const double *const *fw, int *path);
+
+// Samples the path of the block at [pos, pos + blocklen) like
+// sample_hmm_posterior, including the runs of columns that the forward
+// algorithm jumped over.  'fw' and 'path' are indexed by position.
+double sample_hmm_posterior_runs(
+    int blocklen, const LocalTree *tree, const States &states,
+    const TransMatrix *matrix, const ArgHmmForwardTable *forward, int pos,
+    const double *const *fw, int *path);
+
 double stochastic_traceback(
     const LocalTrees *trees, const ArgModel *model,
     ArgHmmMatrixIter *matrix_iter,
-    double **fw, int *path, bool last_state_given=false, bool internal=false);
+    double **fw, int *path, bool last_state_given=false, bool internal=false,
+    ArgHmmForwardTable *forward=NULL, PhaseProbs *phase_pr=NULL);
 
 //=============================================================================
 // ARG thread sampling
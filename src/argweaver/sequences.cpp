@@ -1,3 +1,7 @@
+#include <stdarg.h>
+
+#include <thread>
+
 #include "common.h"
 #include "logging.h"
 #include "parsing.h"
@@ -17,70 +21,62 @@ namespace argweaver {
 //=============================================================================
 // input/output: FASTA
 
+// Sequences are read straight into the block of memory that the alignment
+// keeps them in
 bool read_fasta(FILE *infile, Sequences *seqs)
 {
-    // store lines until they are ready to discard
-    class Discard : public vector<char*> {
-    public:
-        ~Discard() { clean(); }
-        void clean() {
-            for (unsigned int i=0; i<size(); i++)
-                delete [] at(i);
-            clear();
-        }
-    };
-
-
     // init sequences
     seqs->clear();
-    seqs->set_owned(true);
 
     char *line;
     string key;
-    vector<char*> seq;
-    Discard discard;
-
-    while ((line = fgetline(infile))) {
-        chomp(line);
+    vector<string> keys;
+    vector<char> data;
+    int seqlen = -1, start = 0;
+    bool in_seq = false;
 
-        if (line[0] == '>') {
-            // parse key line
-
-            if (seq.size() > 0) {
-                // add new sequence
-                char *full_seq = concat_strs(&seq[0], seq.size());
-                if (!seqs->append(key, full_seq, vector<BaseProbs>())) {
-                    printError("sequences are not the same length: %d != %d",
-                               seqs->length(), strlen(full_seq));
-                    delete [] full_seq;
-                    return false;
-                }
-                seq.clear();
-                discard.clean();
+    while (true) {
+        line = fgetline(infile);
+        if (line)
+            chomp(line);
+
+        if (in_seq && (!line || line[0] == '>')) {
+            // end of sequence
+            const int len = data.size() - start;
+            if (seqlen == -1) {
+                seqlen = len;
+            } else if (len != seqlen) {
+                printError("sequences are not the same length: %d != %d",
+                           seqlen, len);
+                delete [] line;
+                return false;
             }
+            data.push_back('\0');
+            start = data.size();
+            in_seq = false;
+        }
+        if (!line)
+            break;
 
+        if (line[0] == '>') {
             // new key found
             key = string(trim(&line[1]));
-            delete [] line;
         } else {
-            // parse sequence line
-
-            seq.push_back(trim(line));
-            discard.push_back(line);
+            // parse sequence line (blank lines between sequences are
+            // skipped)
+            const char *bases = trim(line);
+            if (!in_seq && bases[0] != '\0') {
+                keys.push_back(key);
+                in_seq = true;
+            }
+            data.insert(data.end(), bases, bases + strlen(bases));
         }
+        delete [] line;
     }
 
-    // add last sequence
-    if (seq.size() > 0) {
-        char *full_seq = concat_strs(&seq[0], seq.size());
-        if (!seqs->append(key, full_seq, vector<BaseProbs>())) {
-            printError("sequences are not the same length: %d != %d",
-                       seqs->length(), strlen(full_seq));
-            delete [] full_seq;
-            return false;
-        }
-        discard.clean();
-    }
+    seqs->set_seqs(data, keys.size(), max(seqlen, 0));
+    for (unsigned int i=0; i<keys.size(); i++)
+        seqs->names[i] = keys[i];
 
     return true;
 }
@@ -139,7 +135,7 @@ void write_sites(FILE *stream, Sites *sites, bool write_masked) {
     fprintf(stream, "\n");
     fprintf(stream, "#REGION\t%s\t%i\t%i\n",
             sites->chrom.c_str(), sites->start_coord + 1, sites->end_coord);
-    if (sites->positions.size() != sites->cols.size()) {
+    if ((int)sites->positions.size() != sites->cols.size()) {
         fprintf(stderr, "Error in write_sites: positions.size()=%i cols.size=%i\n",
                 (int)sites->positions.size(), (int)sites->cols.size());
         exit(-1);
@@ -326,7 +322,7 @@ bool read_sites(FILE *infile, Sites *sites,
             }
 
             // record site.
-            sites->append(position, col, true);
+            sites->append(position, col);
 
 
             if (fields.size() == 2) {
@@ -395,6 +391,28 @@ bool read_sites(const char *filename, Sites *sites,
 }
 
 
+//=============================================================================
+// input/output: VCF
+
+// size of the blocks in which VCF files are read
+#define VCF_BUFFER_SIZE (4 << 20)
+
+static int g_vcf_threads = -1;
+
+void set_vcf_threads(int nthreads)
+{
+    g_vcf_threads = nthreads;
+}
+
+int get_vcf_threads()
+{
+    if (g_vcf_threads >= 0)
+        return g_vcf_threads;
+    const int ncores = thread::hardware_concurrency();
+    return ncores > 1 ? min(ncores, 4) : 0;
+}
+
+
 class GenoFilter {
 public:
     string code;
@@ -423,317 +441,573 @@ public:
 };
 
 
-bool read_vcf(FILE *infile, Sites *sites, double min_qual,
-              const char *genotype_filter, bool parse_genotype_probs,
-              double min_base_prob, bool add_ref, const set<string> keep_inds) {
-    const char *delim = "\t";
-    char *line=NULL;
-    int nseqs = 0, nsample=0;
-    bool error = false;
-    const char *headerStart = "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\t";
-    string chrname = "";
+// warnings are only given for the first line that raises them
+static bool g_vcf_warn_ref_len = false;
+static bool g_vcf_warn_bad_allele = false;
+static bool g_vcf_warn_probs = false;
+
+enum {
+    VCF_WARN_REF_LEN = 1,
+    VCF_WARN_ALT_COUNT = 2,
+    VCF_WARN_BAD_ALLELE = 4,
+    VCF_WARN_PROBS = 8
+};
+
+
+// The result of parsing one VCF record
+struct VcfRecord
+{
+    enum { SKIP, SITE, ERROR } status;
+    int lineno;
+    int position;
+    char *col;              // a column of the sites, or col_buf
+    vector<char> col_buf;
+    vector<BaseProbs> base_probs;
+    int num_masked;
+    int total;
+    int num_indel;
+    int warnings;
+    Token bad_allele;
+    string error;
+
+    void reset(int _lineno, char *_col=NULL) {
+        status = SKIP;
+        lineno = _lineno;
+        col = _col;
+        base_probs.clear();
+        num_masked = total = num_indel = 0;
+        warnings = 0;
+    }
+
+    void set_error(const char *fmt, ...) {
+        char msg[1000];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        error = msg;
+        status = ERROR;
+    }
+};
+
+
+// Parses the records of a VCF file.  Once the samples have been set up
+// from the first record, records are parsed independently of each other
+// and may be parsed concurrently, each thread with its own 'fields'.
+class VcfParser
+{
+public:
+    VcfParser(double min_qual, const char *genotype_filter,
+              bool parse_genotype_probs, double min_base_prob, bool add_ref,
+              const set<string> &keep_inds) :
+        min_qual(min_qual),
+        parse_genotype_probs(parse_genotype_probs),
+        min_base_prob(min_base_prob),
+        add_ref(add_ref),
+        keep_inds(keep_inds),
+        nsample(0),
+        nseqs(0)
+    {
+        if (genotype_filter != NULL && strlen(genotype_filter) > 0) {
+            vector<string> tmp;
+            split(genotype_filter, ";", tmp);
+            for (int i=0; i < (int)tmp.size(); i++) {
+                gf.push_back(GenoFilter(tmp[i].c_str()));
+            }
+        }
+    }
+
+    // Per thread buffers for the fields of a record
+    struct Fields {
+        vector<Token> fields;
+        vector<Token> alt;
+        vector<Token> format;
+        vector<Token> seqfields;
+        vector<int> gf_index;
+    };
+
+    void set_samples(const char *start, const char *end) {
+        vector<Token> tokens;
+        split(start, end, '\t', tokens);
+        sample_names.clear();
+        for (unsigned int i=0; i<tokens.size(); i++)
+            sample_names.push_back(string(tokens[i].start,
+                                          tokens[i].length()));
+        nsample = (int)sample_names.size();
+    }
+
+    // Records can only be parsed concurrently after the first one
+    bool concurrent() const {
+        return ploidy.size() > 0 && chrname != "";
+    }
+
+    // Parse the record [line, end).  'sites' is only needed (and names are
+    // only added to it) while the samples are not set up.
+    void parse(const char *line, const char *end, VcfRecord *rec,
+               Fields &buf, Sites *sites);
+
+    int get_num_filters() const { return gf.size(); }
+
+protected:
+    bool setup_samples(VcfRecord *rec, Fields &buf, int gt_idx,
+                       Sites *sites);
+
+    const double min_qual;
     vector<GenoFilter> gf;
-    int num_masked=0, total=0;
-    int numIndel=0;
-    static bool warnRefLen=false;
-    static bool warnProbs=false;
-    vector<bool> keep_ind;
+    const bool parse_genotype_probs;
+    const double min_base_prob;
+    const bool add_ref;
+    const set<string> &keep_inds;
+
+    int nsample;
     vector<string> sample_names;
+    string chrname;
     vector<int> ploidy;
-    ploidy.clear();
+    vector<bool> keep_ind;
+    int nseqs;
+};
 
-    if (genotype_filter != NULL && strlen(genotype_filter) > 0) {
-        vector<string> tmp;
-        split(genotype_filter, ";", tmp);
-        for (int i=0; i < (int)tmp.size(); i++) {
-            gf.push_back(GenoFilter(tmp[i].c_str()));
+
+// On the first record, process sample names and figure out ploidy (only
+// ploidy 1 or two supported)
+bool VcfParser::setup_samples(VcfRecord *rec, Fields &buf, int gt_idx,
+                              Sites *sites)
+{
+    assert(sites);
+    nseqs = 0;
+    for (int i=0; i < nsample; i++) {
+        keep_ind.push_back(keep_inds.size() == 0 ||
+                           keep_inds.find(sample_names[i]) != keep_inds.end());
+        split(buf.fields[9+i].start, buf.fields[9+i].end, ':', buf.seqfields);
+        const int gt_len = gt_idx < (int)buf.seqfields.size() ?
+            buf.seqfields[gt_idx].length() : 0;
+        if (gt_len == 1) {
+            ploidy.push_back(1);
+            if (keep_ind[i]) {
+                nseqs++;
+                sites->names.push_back(sample_names[i]);
+            }
+        } else if (gt_len == 3) {
+            ploidy.push_back(2);
+            if (keep_ind[i]) {
+                nseqs += 2;
+                for (int j=0; j < 2; j++) {
+                    char tmp[sample_names[i].length()+3];
+                    sprintf(tmp, "%s_%i", sample_names[i].c_str(), j+1);
+                    sites->names.push_back(string(tmp));
+                }
+            }
+        } else {
+            rec->set_error("Bad genotype on line %i of VCF", rec->lineno);
+            return false;
         }
     }
+    if (add_ref) {
+        sites->names.push_back("REF");
+        nseqs++;
+    }
+    printf("nseqs = %i\n", nseqs - add_ref);
+    return true;
+}
 
-    // note that this does not affect chrom, start_coord, end_coord
-    sites->clear();
 
-    int lineno = 1;
-    while (!error) {
-        if (line != NULL) delete [] line;
-        line = fgetline(infile);
-        if (line == NULL) break;
-        chomp(line);
-        lineno++;
-        if (strncmp(line, "##", 2) == 0) {
-            continue;
-        }
-        if (strncmp(line, headerStart, strlen(headerStart)) == 0) {
-            split(&line[strlen(headerStart)], delim, sample_names);
-            nsample = (int)sample_names.size();
-            continue;
-        }
+void VcfParser::parse(const char *line, const char *end, VcfRecord *rec,
+                      Fields &buf, Sites *sites)
+{
+    const int lineno = rec->lineno;
+    vector<Token> &fields = buf.fields;
+    vector<Token> &seqfields = buf.seqfields;
 
-        vector<string> fields;
-        split(line, delim, fields);
-        if ((int)fields.size() != 9 + nsample) {
-            printError("Not enough fields in line %i of VCF file", lineno);
-            return false;
-        }
-        if (chrname == "")
-            chrname = fields[0];
-        else if (chrname != fields[0]) {
-            printError("VCF file contains multiple chromosomes. Must supply region str (chr:start-end)");
-            return false;
-        }
-        int position;
-        if (1 != sscanf(fields[1].c_str(), "%i", &position)) {
-            printError("Error parsing position field in VCF\n");
-            return false;
+    split(line, end, '\t', fields);
+    if ((int)fields.size() != 9 + nsample) {
+        rec->set_error("Not enough fields in line %i of VCF file", lineno);
+        return;
+    }
+    if (chrname == "") {
+        assert(sites);
+        chrname = string(fields[0].start, fields[0].length());
+    } else if (!fields[0].equals(chrname.c_str())) {
+        rec->set_error("VCF file contains multiple chromosomes. Must supply region str (chr:start-end)");
+        return;
+    }
+    int position;
+    if (1 != sscanf(TokenString(fields[1]).c_str(), "%i", &position)) {
+        rec->set_error("Error parsing position field in VCF\n");
+        return;
+    }
+    position--;  //convert to 0-index
+    double qual = atof(TokenString(fields[5]).c_str());
+    char alleles[5];  // alleles can only be A,C,G,T,N
+    int num_alleles=1;
+    if (fields[3].length() != 1) {
+        rec->warnings |= VCF_WARN_REF_LEN;
+        rec->num_indel++;
+        return;
+    }
+    alleles[0] = fields[3].start[0];
+    vector<Token> &alt = buf.alt;
+    split(fields[4].start, fields[4].end, ',', alt);
+    if (alt.size() > 4) {
+        rec->warnings |= VCF_WARN_ALT_COUNT;
+        return;
+    }
+    for (int i=0; i < (int)alt.size(); i++) {
+        if (alt[i].length() != 1) {
+            rec->warnings |= VCF_WARN_BAD_ALLELE;
+            rec->bad_allele = alt[i];
+            rec->num_indel++;
+            return;
         }
-        position--;  //convert to 0-index
-        double qual = atof(fields[5].c_str());
-        char alleles[5];  // alleles can only be A,C,G,T,N
-        int num_alleles=1;
-        if (fields[3].length() != 1) {
-            if (!warnRefLen) {
-                printWarning("Reference allele is not length one on line %i of VCF... skipping this and future similar lines",
-                             lineno);
-                warnRefLen=true;
-            }
-            numIndel++;
-            continue;
+        alleles[num_alleles++] = alt[i].start[0];
+    }
+    // next: parse FORMAT in fields[8] and figure out where to find
+    // GT
+    vector<Token> &format = buf.format;
+    split(fields[8].start, fields[8].end, ':', format);
+    int gt_idx=-1;
+    int pl_idx=-1;
+    int gl_idx=-1;
+    int pp_idx=-1;
+    for (int i=0; i < (int)format.size(); i++) {
+        if (format[i].equals("GT")) {
+            gt_idx=i;
         }
-        alleles[0] = fields[3].c_str()[0];
-        vector<string> alt;
-        split(fields[4].c_str(), ",", alt);
-        static bool badAlleleWarn=false;
-        if (alt.size() > 4) {
-            if (!badAlleleWarn) {
-                printError("length of ALT allele should not be more than 4 on line %i of VCF\n",
-                           lineno);
-                badAlleleWarn=true;
+        if (parse_genotype_probs) {
+            if (format[i].equals("PL")) {
+                pl_idx = i;
             }
-            continue;
-        }
-        bool badAllele=false;
-        for (int i=0; i < (int)alt.size(); i++) {
-            if (alt[i].length() != 1) {
-                if (!badAlleleWarn) {
-                    printWarning("ReadVCF can only handle alleles A,C,G,T,N currently;"
-                                 " got allele %s on line %i; skipping this line and"
-                                 " other similar ones",
-                               alt[i].c_str(), lineno);
-                    badAlleleWarn=true;
-                }
-                badAllele=true;
-                numIndel++;
-                break;
+            if (format[i].equals("GL")) {
+                gl_idx = i;
             }
-            alleles[num_alleles++] = alt[i].c_str()[0];
-        }
-        if (badAllele) continue;
-        // next: parse FORMAT in fields[8] and figure out where to find
-        // GT
-        vector<string> format;
-        split(fields[8].c_str(), ":", format);
-        int gt_idx=-1;
-        int pl_idx=-1;
-        int gl_idx=-1;
-        int pp_idx=-1;
-        for (int i=0; i < (int)format.size(); i++) {
-            if (strcmp(format[i].c_str(), "GT")==0) {
-                gt_idx=i;
-            }
-            if (parse_genotype_probs) {
-                if (strcmp(format[i].c_str(), "PL")==0) {
-                    pl_idx = i;
-                }
-                if (strcmp(format[i].c_str(), "GL")==0) {
-                    gl_idx = i;
-                }
-                if (strcmp(format[i].c_str(), "PP")==0) {
-                    pp_idx = i;
-                }
+            if (format[i].equals("PP")) {
+                pp_idx = i;
             }
         }
-        if (gt_idx == -1) {
-            printError("Did not find GT in format field in VCF file line %i",
+    }
+    if (gt_idx == -1) {
+        rec->set_error("Did not find GT in format field in VCF file line %i",
                        lineno);
-            return false;
-        }
+        return;
+    }
 
-        vector<BaseProbs> base_probs;
-        // get positions for genotype filter(s)
-        for (int i=0; i < (int)gf.size(); i++) {
-            gf[i].index = -1;
-            for (int j=0; j < (int)format.size(); j++) {
-                if (format[j] == gf[i].code) {
-                    gf[i].index = j;
-                    break;
-                }
+    // get positions for genotype filter(s)
+    vector<int> &gf_index = buf.gf_index;
+    gf_index.assign(gf.size(), -1);
+    for (int i=0; i < (int)gf.size(); i++) {
+        for (int j=0; j < (int)format.size(); j++) {
+            if (format[j].equals(gf[i].code.c_str())) {
+                gf_index[i] = j;
+                break;
             }
         }
+    }
 
+    if (ploidy.size() == 0 && !setup_samples(rec, buf, gt_idx, sites))
+        return;
+    if (nseqs - add_ref  <= 0) {
+        rec->set_error("Did not find sequences to keep in VCF file\n");
+        return;
+    }
 
-        vector<string> seqfields;
-        string gtstr;
-        // on first input line, process sample names and figure out ploidy
-        // (only ploidy 1 or two supported)
-        if (ploidy.size() == 0) {
-            nseqs = 0;
-            for (int i=0; i < nsample; i++) {
-                if (keep_inds.size() > 0 && keep_inds.find(sample_names[i]) == keep_inds.end()) {
-                    keep_ind.push_back(false);
-                }
-                keep_ind.push_back(true);
-                split(fields[9+i].c_str(), ":", seqfields);
-                gtstr = seqfields[gt_idx];
-                if (gtstr.length() == 1) {
-                    ploidy.push_back(1);
-                    if (keep_ind[i]) {
-                        nseqs++;
-                        sites->names.push_back(sample_names[i]);
-                    }
-                } else if (gtstr.length() == 3) {
-                    ploidy.push_back(2);
-                    if (keep_ind[i]) {
-                        nseqs += 2;
-                        for (int j=0; j < 2; j++) {
-                            char tmp[sample_names[i].length()+3];
-                            sprintf(tmp, "%s_%i", sample_names[i].c_str(), j+1);
-                            sites->names.push_back(string(tmp));
-                        }
-                    }
-                } else {
-                    printError("Bad genotype on line %i of VCF", lineno);
-                    return false;
-                }
-            }
-            if (add_ref) {
-                sites->names.push_back("REF");
-                nseqs++;
-            }
-            printf("nseqs = %i\n", nseqs - add_ref);
-            // otherwise this line contains a variant
-        }
-        if (nseqs - add_ref  <= 0) {
-            printError("Did not find sequences to keep in VCF file\n");
-            return false;
-        }
-
-        char col[nseqs+1];
-        col[nseqs] = '\0';
-        int idx=0;
-        for (int i=0; i < nsample; i++) {
-            if (!keep_ind[i]) continue;
-            bool masked = ( num_alleles > 2 || qual < min_qual );
-            split(fields[9+i].c_str(), ":", seqfields);
-            if (seqfields.size() != format.size()) {
-                if (gt_idx < (int)seqfields.size() && seqfields[gt_idx] == "./.")
-                    masked=true;
-                else {
-                    printError("Field %i does not match format string on line %i of VCF file\n",
+    vector<BaseProbs> &base_probs = rec->base_probs;
+    if (!rec->col) {
+        rec->col_buf.resize(nseqs+1);
+        rec->col = &rec->col_buf[0];
+    }
+    char *col = rec->col;
+    col[nseqs] = '\0';
+    int idx=0;
+    for (int i=0; i < nsample; i++) {
+        if (!keep_ind[i]) continue;
+        bool masked = ( num_alleles > 2 || qual < min_qual );
+        split(fields[9+i].start, fields[9+i].end, ':', seqfields);
+        if (seqfields.size() != format.size()) {
+            if (gt_idx < (int)seqfields.size() &&
+                seqfields[gt_idx].equals("./."))
+                masked=true;
+            else {
+                rec->set_error("Field %i does not match format string on line %i of VCF file\n",
                                9+i+1, lineno);
-                    return false;
-                }
-            } else {
-                for (int j=0; j < (int)gf.size(); j++) {
-                    if (gf[j].index >= 0) {
-                        int val = atoi(seqfields[gf[j].index].c_str());
-                        if ((  gf[j].is_min  && val < gf[j].cutoff) ||
-                            ((!gf[j].is_min) && val > gf[j].cutoff)) {
-                            masked=true;
-                            break;
-                        }
+                return;
+            }
+        } else {
+            for (int j=0; j < (int)gf.size(); j++) {
+                if (gf_index[j] >= 0) {
+                    int val = atoi(TokenString(seqfields[gf_index[j]]).c_str());
+                    if ((  gf[j].is_min  && val < gf[j].cutoff) ||
+                        ((!gf[j].is_min) && val > gf[j].cutoff)) {
+                        masked=true;
+                        break;
                     }
                 }
             }
+        }
 
-            if (parse_genotype_probs) {
-                BaseProbs bp = BaseProbs('N');
-                base_probs.push_back(bp);
-                if (ploidy[i] == 2) base_probs.push_back(bp);
-            }
-            total++;
-            if (masked) {
-                col[idx] = 'N';
-                if (ploidy[i] == 2) col[idx+1] = 'N';
-                idx += ploidy[i];
-                num_masked+= ploidy[i];
-                continue;
-            }
-            if (parse_genotype_probs && pl_idx == -1 &&
-                gl_idx == -1 && pp_idx == -1) {
-                if (!warnProbs) {
-                    printWarning("Did not find PL, GL, or PP in format field in VCF file line %i",
-                                 lineno);
-                    warnProbs=true;
-                }
-            }
-            gtstr = seqfields[gt_idx];
-            if (ploidy[i]==2 && gtstr.length() != 3) {
-                printError("genotype not length three on line %i of VCF",
+        if (parse_genotype_probs) {
+            BaseProbs bp = BaseProbs('N');
+            base_probs.push_back(bp);
+            if (ploidy[i] == 2) base_probs.push_back(bp);
+        }
+        rec->total++;
+        if (masked) {
+            col[idx] = 'N';
+            if (ploidy[i] == 2) col[idx+1] = 'N';
+            idx += ploidy[i];
+            rec->num_masked += ploidy[i];
+            continue;
+        }
+        if (parse_genotype_probs && pl_idx == -1 &&
+            gl_idx == -1 && pp_idx == -1) {
+            rec->warnings |= VCF_WARN_PROBS;
+        }
+        const Token &gtstr = seqfields[gt_idx];
+        if (ploidy[i]==2 && gtstr.length() != 3) {
+            rec->set_error("genotype not length three on line %i of VCF",
                            lineno);
-                return false;
-            }
-            if (ploidy[i]==1 && gtstr.length() != 1) {
-                printError("genotype not length one on line %i of VCF for haploid sample",
+            return;
+        }
+        if (ploidy[i]==1 && gtstr.length() != 1) {
+            rec->set_error("genotype not length one on line %i of VCF for haploid sample",
                            lineno);
-                return false;
-            }
-            if (ploidy[i] == 2) {
-                if (gtstr.c_str()[1] != '|' &&
-                    gtstr.c_str()[1] != '/') {
-                    printError("genotype middle character not '|' or '/' on line %i",
+            return;
+        }
+        if (ploidy[i] == 2) {
+            if (gtstr.start[1] != '|' &&
+                gtstr.start[1] != '/') {
+                rec->set_error("genotype middle character not '|' or '/' on line %i",
                                lineno);
-                    return false;
-                }
+                return;
             }
-            for (int j=0; j < ploidy[i]; j++) {
-                char allele = gtstr.c_str()[j*2];
-                if (allele == '.') {
-                    col[idx] = 'N';
-                    if (parse_genotype_probs)
-                        base_probs[idx].set_mask();
-                } else {
-                    int ia = allele - '0';
-                    if (ia < 0 || ia >= num_alleles) {
-                        printError("Bad GT in field %i,line %i of VCF",
+        }
+        for (int j=0; j < ploidy[i]; j++) {
+            char allele = gtstr.start[j*2];
+            if (allele == '.') {
+                col[idx] = 'N';
+                if (parse_genotype_probs)
+                    base_probs[idx].set_mask();
+            } else {
+                int ia = allele - '0';
+                if (ia < 0 || ia >= num_alleles) {
+                    rec->set_error("Bad GT in field %i,line %i of VCF",
                                    i+9+1, lineno);
-                        return false;
-                    }
-                    col[idx] = alleles[ia];
-                    if (parse_genotype_probs) {
-                        // PL and GL are the same except GL is float;
-                        // set_by_pl treats input as float anyway
-                        if (gl_idx >= 0) pl_idx = gl_idx;
-                        if (pl_idx >= 0)
-                            base_probs[idx].set_by_pl(alleles[0], alleles[1],
-                                                      seqfields[pl_idx], j);
-                        else if (pp_idx >= 0)
-                            base_probs[idx].set_by_pp(seqfields[pp_idx], j);
-                        else base_probs[idx].set_certain(alleles[ia]);
-                        if (base_probs[idx].maxProb() < min_base_prob) {
-                            col[idx] = 'N';
-                            base_probs[idx].set_mask();
-                            num_masked++;
-                        }
+                    return;
+                }
+                col[idx] = alleles[ia];
+                if (parse_genotype_probs) {
+                    // PL and GL are the same except GL is float;
+                    // set_by_pl treats input as float anyway
+                    if (gl_idx >= 0) pl_idx = gl_idx;
+                    if (pl_idx >= 0)
+                        base_probs[idx].set_by_pl(alleles[0], alleles[1],
+                                                  seqfields[pl_idx], j);
+                    else if (pp_idx >= 0)
+                        base_probs[idx].set_by_pp(seqfields[pp_idx], j);
+                    else base_probs[idx].set_certain(alleles[ia]);
+                    if (base_probs[idx].maxProb() < min_base_prob) {
+                        col[idx] = 'N';
+                        base_probs[idx].set_mask();
+                        rec->num_masked++;
                     }
                 }
-                idx++;
             }
+            idx++;
         }
-        if (add_ref) {
-            assert(idx == nseqs-1);
-            col[idx] = alleles[0];
-            if (parse_genotype_probs)
-                base_probs.push_back(BaseProbs(alleles[0]));
-        }
-        sites->append(position, col, true);
+    }
+    if (add_ref) {
+        assert(idx == nseqs-1);
+        col[idx] = alleles[0];
         if (parse_genotype_probs)
-            sites->base_probs.push_back(base_probs);
+            base_probs.push_back(BaseProbs(alleles[0]));
     }
+    rec->status = VcfRecord::SITE;
+    rec->position = position;
+}
+
+
+// Add a parsed record as site 'nsites' of 'sites', giving its warnings or
+// error.  Sites may already hold a column for the record, which is moved
+// down over the columns of skipped records.
+static bool add_vcf_record(VcfRecord &rec, Sites *sites,
+                           bool parse_genotype_probs, int *nsites)
+{
+    if (rec.warnings & VCF_WARN_REF_LEN && !g_vcf_warn_ref_len) {
+        printWarning("Reference allele is not length one on line %i of VCF... skipping this and future similar lines",
+                     rec.lineno);
+        g_vcf_warn_ref_len=true;
+    }
+    if (rec.warnings & VCF_WARN_ALT_COUNT && !g_vcf_warn_bad_allele) {
+        printError("length of ALT allele should not be more than 4 on line %i of VCF\n",
+                   rec.lineno);
+        g_vcf_warn_bad_allele=true;
+    }
+    if (rec.warnings & VCF_WARN_BAD_ALLELE && !g_vcf_warn_bad_allele) {
+        printWarning("ReadVCF can only handle alleles A,C,G,T,N currently;"
+                     " got allele %.*s on line %i; skipping this line and"
+                     " other similar ones",
+                     rec.bad_allele.length(), rec.bad_allele.start,
+                     rec.lineno);
+        g_vcf_warn_bad_allele=true;
+    }
+    if (rec.warnings & VCF_WARN_PROBS && !g_vcf_warn_probs) {
+        printWarning("Did not find PL, GL, or PP in format field in VCF file line %i",
+                     rec.lineno);
+        g_vcf_warn_probs=true;
+    }
+
+    if (rec.status == VcfRecord::ERROR) {
+        printError("%s", rec.error.c_str());
+        return false;
+    }
+    if (rec.status == VcfRecord::SITE) {
+        if (*nsites < sites->get_num_sites()) {
+            sites->positions[*nsites] = rec.position;
+            char *col = sites->cols[*nsites];
+            if (col != rec.col)
+                memcpy(col, rec.col, sites->get_num_seqs());
+        } else {
+            sites->append(rec.position, rec.col);
+        }
+        (*nsites)++;
+        if (parse_genotype_probs) {
+            sites->base_probs.push_back(vector<BaseProbs>());
+            sites->base_probs.back().swap(rec.base_probs);
+        }
+    }
+    return true;
+}
+
+
+// The file is read in large blocks and records are parsed where they lie in
+// the block.  The records of a block are split into contiguous batches that
+// are parsed on worker threads, each record straight into a column of the
+// sites, and then added to the sites in order.
+bool read_vcf(FILE *infile, Sites *sites, double min_qual,
+              const char *genotype_filter, bool parse_genotype_probs,
+              double min_base_prob, bool add_ref, const set<string> keep_inds) {
+    const char *headerStart = "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\t";
+    const int header_len = strlen(headerStart);
+    VcfParser parser(min_qual, genotype_filter, parse_genotype_probs,
+                     min_base_prob, add_ref, keep_inds);
+    int num_masked=0, total=0;
+    int numIndel=0;
+
+    // note that this does not affect chrom, start_coord, end_coord
+    sites->clear();
+
+    const int nthreads = max(get_vcf_threads(), 1);
+    vector<VcfParser::Fields> bufs(nthreads);
+    vector<char> data(VCF_BUFFER_SIZE);
+    vector<Token> lines;
+    vector<int> linenos;
+    vector<VcfRecord> records;
+    int lineno = 1;
+    size_t len = 0;
+    bool eof = false;
+    bool error = false;
+    int nsites = 0;
+
+    // add parsed records to sites in order
+    auto add_records = [&](int nrecords) {
+        for (int i=0; i<nrecords && !error; i++) {
+            num_masked += records[i].num_masked;
+            total += records[i].total;
+            numIndel += records[i].num_indel;
+            error = !add_vcf_record(records[i], sites, parse_genotype_probs,
+                                    &nsites);
+        }
+        sites->positions.resize(nsites);
+        sites->cols.resize(nsites);
+    };
+
+    // parse the pending records in contiguous batches, one per thread
+    auto flush = [&]() {
+        const int nrecords = lines.size();
+        if ((int)records.size() < nrecords)
+            records.resize(nrecords);
+        for (int i=0; i<nrecords; i++)
+            sites->append(-1);
+        for (int i=0; i<nrecords; i++)
+            records[i].reset(linenos[i], sites->cols[nsites + i]);
+
+        const int nbatches = min(nthreads, nrecords);
+        auto worker = [&](int batch) {
+            const int start = (long long) nrecords * batch / nbatches;
+            const int end = (long long) nrecords * (batch + 1) / nbatches;
+            for (int i=start; i<end; i++)
+                parser.parse(lines[i].start, lines[i].end, &records[i],
+                             bufs[batch], NULL);
+        };
+        vector<thread> threads;
+        for (int i=1; i<nbatches; i++)
+            threads.push_back(thread(worker, i));
+        if (nbatches > 0)
+            worker(0);
+        for (unsigned int i=0; i<threads.size(); i++)
+            threads[i].join();
+
+        add_records(nrecords);
+        lines.clear();
+        linenos.clear();
+    };
+
+    while (!eof && !error) {
+        // fill the block after the incomplete line left from the last one
+        if (len == data.size())
+            data.resize(2 * data.size());
+        const size_t nread = fread(&data[len], 1, data.size() - len, infile);
+        len += nread;
+        eof = (nread == 0);
+
+        const char *block_end = &data[0] + len;
+        const char *line = &data[0];
+        while (line < block_end && !error) {
+            const char *next = (const char*) memchr(line, '\n',
+                                                    block_end - line);
+            if (!next && !eof)
+                break;
+            Token record(line, next ? next : block_end);
+            if (next && record.length() > 0 && record.end[-1] == '\r')
+                record.end--;
+            line = next ? next + 1 : block_end;
+            lineno++;
+
+            if (record.length() >= 2 && strncmp(record.start, "##", 2) == 0)
+                continue;
+            if (record.length() >= header_len &&
+                strncmp(record.start, headerStart, header_len) == 0) {
+                flush();
+                parser.set_samples(record.start + header_len, record.end);
+                continue;
+            }
+            if (!parser.concurrent()) {
+                // the first record sets up the samples
+                flush();
+                if (records.size() < 1)
+                    records.resize(1);
+                records[0].reset(lineno);
+                parser.parse(record.start, record.end, &records[0], bufs[0],
+                             sites);
+                add_records(1);
+                continue;
+            }
+            lines.push_back(record);
+            linenos.push_back(lineno);
+        }
+        if (!error)
+            flush();
+
+        len = block_end - line;
+        memmove(&data[0], line, len);
+    }
+
+    if (error)
+        return false;
 
     printLog(LOG_LOW, "Read %i sites from %i lines of VCF file (num skipped indels=%i)\n",
              sites->get_num_sites(), lineno, numIndel);
-    if (gf.size() > 0) printLog(LOG_LOW, "Masked %.1f out of %i genotypes\n",
-                                (double)num_masked/2, total);
+    if (parser.get_num_filters() > 0)
+        printLog(LOG_LOW, "Masked %.1f out of %i genotypes\n",
+                 (double)num_masked/2, total);
     return true;
 }
 
@@ -824,6 +1098,15 @@ bool read_vcfs(const vector<string> filenames, Sites* sites, const string region
 
 
 // Converts a Sites alignment to a Sequences alignment
+// Sites are copied to and from sequences in tiles of this many sites by this
+// many sequences, so that the columns and the parts of the sequences being
+// copied stay in cache
+#define TRANSPOSE_BLOCK 64
+
+// Sequences are scanned for variant sites this many positions at a time
+#define SCAN_BLOCK 4096
+
+
 void make_sequences_from_sites(const Sites *sites, Sequences *sequences,
                                char default_char)
 {
@@ -834,33 +1117,51 @@ void make_sequences_from_sites(const Sites *sites, Sequences *sequences,
     bool have_pops = ( sites->pops.size() > 0);
     bool have_base_probs = ( sites->base_probs.size() > 0 );
 
-    sequences->clear();
-    sequences->set_owned(true);
-
+    sequences->alloc_seqs(nseqs, seqlen);
+    char **seqs = sequences->get_seqs();
     for (int i=0; i<nseqs; i++) {
-        char *seq = new char [seqlen+1];
-        seq[seqlen] = '\0';
-        vector<BaseProbs> base_probs;
-        int col = 0;
-        for (int j=0; j<seqlen; j++) {
-            if (col < nsites && start+j == sites->positions[col]) {
-                // variant site
-                seq[j] = sites->cols[col][i];
-                if (have_base_probs)
+        memset(seqs[i], default_char, seqlen);
+        sequences->names[i] = sites->names[i];
+        sequences->pops[i] = have_pops ? sites->pops[i] : 0;
+    }
+
+    // sites within the alignment
+    const int first = lower_bound(sites->positions.begin(),
+                                  sites->positions.begin() + nsites, start) -
+        sites->positions.begin();
+    const int last = lower_bound(sites->positions.begin() + first,
+                                 sites->positions.begin() + nsites,
+                                 start + seqlen) - sites->positions.begin();
+
+    // transpose the columns into the sequences one tile at a time
+    for (int col0=first; col0<last; col0+=TRANSPOSE_BLOCK) {
+        const int col1 = min(col0 + TRANSPOSE_BLOCK, last);
+        for (int i0=0; i0<nseqs; i0+=TRANSPOSE_BLOCK) {
+            const int i1 = min(i0 + TRANSPOSE_BLOCK, nseqs);
+            for (int i=i0; i<i1; i++) {
+                char *seq = seqs[i] - start;
+                for (int col=col0; col<col1; col++)
+                    seq[sites->positions[col]] = sites->cols[col][i];
+            }
+        }
+    }
+
+    if (have_base_probs) {
+        for (int i=0; i<nseqs; i++) {
+            vector<BaseProbs> base_probs;
+            base_probs.reserve(seqlen);
+            int col = first;
+            for (int j=0; j<seqlen; j++) {
+                if (col < last && start+j == sites->positions[col]) {
                     base_probs.push_back(sites->base_probs[col][i]);
-                col++;
-            } else {
-                seq[j] = default_char;
-                if (have_base_probs)
+                    col++;
+                } else {
                     base_probs.push_back(BaseProbs(default_char));
+                }
             }
+            sequences->base_probs.push_back(base_probs);
         }
-
-        sequences->append(sites->names[i], seq, base_probs,
-                          have_pops ? sites->pops[i] : 0);
     }
-
-    sequences->set_length(seqlen);
 }
 
 
@@ -887,7 +1188,7 @@ int Sites::remove_invariant() {
         if (variant) {
             if (i != nsite) {
                 positions[nsite] = positions[i];
-                strncpy(cols[nsite], cols[i], nseq);
+                memcpy(cols[nsite], cols[i], nseq);
                 if (have_base_probs)
                     base_probs[nsite] = base_probs[i];
             }
@@ -957,10 +1258,11 @@ int Sites::subset(vector<int> keep) {
         pops = new_pops;
     }
     vector<int> new_positions;
-    vector<char*> new_cols;
+    SiteColumns new_cols;
+    new_cols.set_width(keep.size());
     vector<vector<BaseProbs> > new_base_probs;
+    char tmp[keep.size()+1];
     for (unsigned int i=0; i < positions.size(); i++) {
-        char *tmp = new char[keep.size()+1];
         bool variant=false;
         vector<BaseProbs> bp;
         for (unsigned int j=0; j < keep.size(); j++) {
@@ -973,14 +1275,13 @@ int Sites::subset(vector<int> keep) {
             if (tmp[j]=='N' || tmp[j] != tmp[0]) variant=true;
         }
         tmp[keep.size()] = '\0';
-        delete [] cols[i];
         if (variant) {
             new_cols.push_back(tmp);
             new_positions.push_back(positions[i]);
             if (have_base_probs) new_base_probs.push_back(bp);
-        } else delete [] tmp;
+        }
     }
-    cols = new_cols;
+    cols.swap(new_cols);
     positions = new_positions;
     if (have_base_probs) base_probs = new_base_probs;
     printLog(LOG_LOW, "subset sites (nseqs=%i, nsites=%i)\n",
@@ -1032,14 +1333,12 @@ int Sites::remove_overlapping(const TrackNullValue &track) {
         if (overlapping) continue;
         if (i != idx) {
             positions[idx] = positions[i];
-            strncpy(cols[idx], cols[i], numhap);
+            memcpy(cols[idx], cols[i], numhap);
             if (have_base_probs)
                 base_probs[idx] = base_probs[i];
         }
         idx++;
     }
-    for (unsigned int i=idx; i < cols.size(); i++)
-        delete [] cols[i];
     positions.resize(idx);
     cols.resize(idx);
     if (have_base_probs)
@@ -1144,7 +1443,8 @@ bool Sites::merge(const Sites &other) {
     }
 
     vector<int> old_positions = positions;
-    vector<char*> old_cols = cols;
+    SiteColumns old_cols;
+    old_cols.swap(cols);
     vector<vector<BaseProbs> > old_base_probs = base_probs;
     bool have_base_probs=false;
     if (old_base_probs.size() > 0 || other.base_probs.size() > 0)  {
@@ -1157,7 +1457,6 @@ bool Sites::merge(const Sites &other) {
         have_base_probs=true;
     }
     positions.clear();
-    cols.clear();
     base_probs.clear();
     int i1=0, i2=0;
     int num_seq = names.size();
@@ -1227,14 +1526,12 @@ bool Sites::merge(const Sites &other) {
             i1++;
             i2++;
         }
-        append(pos, col, true);
+        append(pos, col);
         if (have_base_probs) {
             assert((int)bp.size() == num_seq);
             base_probs.push_back(bp);
         }
     }
-    for (int i=0; i < (int)old_cols.size(); i++)
-        delete [] old_cols[i];
     return true;
 }
 
@@ -1258,15 +1555,13 @@ TrackNullValue Sites::remove_masked() {
         } else {
             if (idx != i) {
                 positions[idx] = positions[i];
-                strncpy(cols[idx], cols[i], numhap);
+                memcpy(cols[idx], cols[i], numhap);
                 if (have_base_probs)
                     base_probs[idx] = base_probs[i];
             }
             idx++;
         }
     }
-    for (unsigned int i=idx; i < cols.size(); i++)
-        delete [] cols[i];
     positions.resize(idx);
     cols.resize(idx);
     if (have_base_probs)
@@ -1417,28 +1712,54 @@ void make_sites_from_sequences(const Sequences *sequences, Sites *sites)
     sites->names.insert(sites->names.begin(),
                         sequences->names.begin(), sequences->names.end());
 
-    for (int i=0; i<seqlen; i++) {
-        bool isSite=false;  //need to make site if position is N or varaint or
-                            // has baseprobs and is not certain
+    // need to make site if position is N or variant or has baseprobs and
+    // is not certain.  Each block of positions is scanned one sequence at a
+    // time.
+    vector<int> site_pos;
+    char is_site[SCAN_BLOCK];
+    for (int start=0; nseqs > 0 && start<seqlen; start+=SCAN_BLOCK) {
+        const int len = min(SCAN_BLOCK, seqlen - start);
+        const char *ref = &seqs[0][start];
+        memset(is_site, 0, len);
         for (int j=0; j < nseqs; j++) {
-            if (seqs[j][i] == 'N' ||
-                seqs[j][i] != seqs[0][i] ||
-                (have_base_probs && !sequences->base_probs[j][i].is_certain())) {
-                isSite=true;
-                break;
+            const char *seq = &seqs[j][start];
+            if (have_base_probs) {
+                const BaseProbs *bp = &sequences->base_probs[j][start];
+                for (int i=0; i<len; i++)
+                    if (!is_site[i])
+                        is_site[i] = (seq[i] == 'N' || seq[i] != ref[i] ||
+                                      !bp[i].is_certain());
+            } else {
+                for (int i=0; i<len; i++)
+                    is_site[i] |= (seq[i] == 'N') | (seq[i] != ref[i]);
             }
         }
-        if (!isSite) continue;
+        for (int i=0; i<len; i++)
+            if (is_site[i])
+                site_pos.push_back(start + i);
+    }
 
-        char *col = new char [nseqs+1];
-        col[nseqs]='\0';
-        for (int j=0; j<nseqs; j++)
-            col[j] = seqs[j][i];
-        sites->append(i, col);
-        if (have_base_probs) {
+    // transpose the sites into columns one tile at a time
+    const int nsites = site_pos.size();
+    for (int k=0; k<nsites; k++)
+        sites->append(site_pos[k]);
+    for (int k0=0; k0<nsites; k0+=TRANSPOSE_BLOCK) {
+        const int k1 = min(k0 + TRANSPOSE_BLOCK, nsites);
+        for (int j0=0; j0<nseqs; j0+=TRANSPOSE_BLOCK) {
+            const int j1 = min(j0 + TRANSPOSE_BLOCK, nseqs);
+            for (int k=k0; k<k1; k++) {
+                char *col = sites->cols[k];
+                for (int j=j0; j<j1; j++)
+                    col[j] = seqs[j][site_pos[k]];
+            }
+        }
+    }
+
+    if (have_base_probs) {
+        for (int k=0; k<nsites; k++) {
             vector<BaseProbs> bp;
             for (int j=0; j < nseqs; j++)
-                bp.push_back(sequences->base_probs[j][i]);
+                bp.push_back(sequences->base_probs[j][site_pos[k]]);
             sites->base_probs.push_back(bp);
         }
     }
@@ -1600,6 +1921,21 @@ void Sequences::set_pairs(const ArgModel *mod) {
     }
 }
 
+void Sequences::copy(const Sequences &other)
+{
+    alloc_seqs(other.seqs.size(), other.seqlen);
+    for (unsigned int i=0; i<other.seqs.size(); i++)
+        memcpy(seqs[i], other.seqs[i], seqlen);
+    names = other.names;
+    pops = other.pops;
+    pairs = other.pairs;
+    non_singleton_snp = other.non_singleton_snp;
+    ages = other.ages;
+    real_ages = other.real_ages;
+    base_probs = other.base_probs;
+}
+
+
 void PhaseProbs::sample_phase(int *thread_path) {
     int sing_tot=0, sing_switch=0, non_sing_tot=0, non_sing_switch=0;
     if (probs.size() == 0)
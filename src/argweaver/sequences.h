@@ -71,18 +71,22 @@ class BaseProbs
     // in VCF 4.2 specification is that PL is integers
     void set_by_pl(const char refAllele, const char altAllele,
                    const string &pl, int hap_id) {
+        set_by_pl(refAllele, altAllele,
+                  Token(pl.c_str(), pl.c_str() + pl.length()), hap_id);
+    }
+
+    void set_by_pl(const char refAllele, const char altAllele,
+                   const Token &pl, int hap_id) {
         assert(hap_id == 0 || hap_id == 1);
         for (int i=0; i < 4; i++) prob[i]=0.0;
-        vector<string> pl_score_strings;
         double pl_scores[3];
-        split(pl.c_str(), ",", pl_score_strings);
-        if (pl_score_strings.size() != 3) {
-            printError("Error parsing PL string %s\n", pl.c_str());
+        if (!parse_scores(pl, pl_scores, 3)) {
+            printError("Error parsing PL string %.*s\n",
+                       pl.length(), pl.start);
             assert(0);
         }
         double sum=0.0;
         for (int i=0; i < 3; i++) {
-            pl_scores[i] = atof(pl_score_strings[i].c_str());
             pl_scores[i] = pow(10, -pl_scores[i]/10.0);
             sum += pl_scores[i];
         }
@@ -108,18 +112,20 @@ class BaseProbs
     }
 
     void set_by_pp(const string &pp, int hap_id) {
+        set_by_pp(Token(pp.c_str(), pp.c_str() + pp.length()), hap_id);
+    }
+
+    void set_by_pp(const Token &pp, int hap_id) {
         assert(hap_id == 0 || hap_id == 1);
         for (int i=0; i < 4; i++) prob[i]=0.0;
-        vector<string> pp_score_strings;
         double pp_scores[10];
-        split(pp.c_str(), ",", pp_score_strings);
-        if (pp_score_strings.size() != 10) {
-            printError("Error parsing PP string %s\n", pp.c_str());
+        if (!parse_scores(pp, pp_scores, 10)) {
+            printError("Error parsing PP string %.*s\n",
+                       pp.length(), pp.start);
             assert(0);
         }
         double sum=0.0;
         for (int i=0; i < 10; i++) {
-            pp_scores[i] = atof(pp_score_strings[i].c_str());
             pp_scores[i] = pow(10, -pp_scores[i]/10.0);
             sum += pp_scores[i];
         }
@@ -142,7 +148,9 @@ class BaseProbs
             prob[i] = 1.0;
     }
     void set_certain(char c) {
-        if (c=='N') {
+        // anything other than A, C, G or T (such as a '.' ALT allele) is
+        // unknown
+        if (c=='N' || dna2int[(unsigned char) c] < 0) {
             set_mask();
             return;
         }
@@ -174,6 +182,23 @@ class BaseProbs
         return true;
     }
     double prob[4];
+
+protected:
+    // Parse exactly 'n' comma separated scores from 'str'
+    static bool parse_scores(const Token &str, double *scores, int n) {
+        const char *start = str.start;
+        for (int i=0; i < n; i++) {
+            const char *end = (const char*) memchr(start, ',',
+                                                   str.end - start);
+            if ((end == NULL) != (i == n - 1))
+                return false;
+            if (end == NULL)
+                end = str.end;
+            scores[i] = atof(TokenString(Token(start, end)).c_str());
+            start = end + 1;
+        }
+        return true;
+    }
 };
 
 
@@ -182,11 +207,13 @@ class Sequences
 {
 public:
     explicit Sequences(int seqlen=0) :
-        seqlen(seqlen), owned(false)
+        generation(0),
+        seqlen(seqlen)
     {}
 
     Sequences(char **_seqs, int nseqs, int seqlen) :
-        seqlen(seqlen), owned(false)
+        generation(0),
+        seqlen(seqlen)
     {
         extend(_seqs, nseqs);
     }
@@ -194,7 +221,8 @@ public:
     // initialize from a subset of another Sequences alignment
     Sequences(const Sequences *sequences, int nseqs=-1, int _seqlen=-1,
               int offset=0) :
-        seqlen(_seqlen), owned(false)
+        generation(0),
+        seqlen(_seqlen)
     {
         // use same nseqs and/or seqlen by default
         if (nseqs == -1)
@@ -255,9 +283,29 @@ public:
     }
 
 
-    void set_owned(bool _owned)
+    // Take over 'nseqs' sequences of length 'seqlen' stored one after
+    // another in 'buf', each followed by a null, and point seqs at them.
+    // The alignment keeps them in this single block (buf is left empty).
+    // Names are empty.
+    void set_seqs(vector<char> &buf, int nseqs, int _seqlen)
+    {
+        assert(buf.size() == (size_t) nseqs * (_seqlen + 1));
+        clear();
+        seqlen = _seqlen;
+        data.swap(buf);
+        for (int i=0; i<nseqs; i++) {
+            seqs.push_back(&data[(size_t) i * (seqlen + 1)]);
+            names.push_back("");
+            pops.push_back(0);
+        }
+    }
+
+    // Allocate storage for 'nseqs' sequences of length 'seqlen' as with
+    // set_seqs().  Bases are unset.
+    void alloc_seqs(int nseqs, int _seqlen)
     {
-        owned = _owned;
+        vector<char> buf((size_t) nseqs * (_seqlen + 1), '\0');
+        set_seqs(buf, nseqs, _seqlen);
     }
 
     void extend(char **_seqs, int nseqs)
@@ -303,11 +351,7 @@ public:
 
     void clear()
     {
-        if (owned) {
-            const int nseqs = get_num_seqs();
-            for (int i=0; i<nseqs; i++)
-                delete [] seqs[i];
-        }
+        data.clear();
         seqs.clear();
         names.clear();
         pops.clear();
@@ -316,6 +360,10 @@ public:
         base_probs.clear();
     }
 
+    // Copy another alignment and own the copied sequence data (e.g. for a
+    // chain that samples phase independently)
+    void copy(const Sequences &other);
+
 
     //set pairs vector assuming that diploids are named XXXX_1 and XXXX_2
     bool set_pairs_by_name();
@@ -371,6 +419,7 @@ public:
     }
 
     void switch_alleles(int coord, int seq1, int seq2) {
+      generation++;
       char tmp = seqs[seq1][coord];
       seqs[seq1][coord] = seqs[seq2][coord];
       seqs[seq2][coord] = tmp;
@@ -400,9 +449,13 @@ public:
     vector <double> real_ages;
     vector<vector<BaseProbs> > base_probs;
 
+    // incremented whenever alleles are switched in place (e.g. when
+    // resampling phase), so that caches can tell the sequences changed
+    int generation;
+
 protected:
     int seqlen;
-    bool owned;
+    vector<char> data;  // sequences owned by the alignment (see set_seqs)
 };
 
 
@@ -425,6 +478,15 @@ class PhaseProbs
       }
    }
 
+   // Returns the probabilities of all states at a coordinate, so that a
+   // whole row can be filled without looking up each state.
+   double *get_row(int coord, int nstate) {
+       vector<double> &row = probs[coord + offset];
+       if ((int) row.size() < nstate)
+           row.resize(nstate);
+       return &row[0];
+   }
+
    unsigned int size() {
      return probs.size();
    }
@@ -444,6 +506,89 @@ class PhaseProbs
 };
 
 
+// The columns of a Sites alignment, stored one after another in a single
+// allocation.  A column holds the base of every sequence followed by a
+// null, so cols[i] can be used as a string.  Pointers to columns are valid
+// until columns are added.
+class SiteColumns
+{
+public:
+    SiteColumns() : width(0), ncols(0) {}
+
+    inline int size() const { return ncols; }
+
+    inline int get_width() const { return width; }
+
+    // The number of bases per column can only be changed while empty
+    void set_width(int _width)
+    {
+        assert(ncols == 0);
+        width = _width;
+    }
+
+    // Offset of column i in the block (size_t, since large alignments
+    // exceed 2^31 bytes)
+    inline size_t offset(int i) const
+    {
+        return (size_t) i * (width + 1);
+    }
+
+    inline char *operator[](int i)
+    {
+        return &data[offset(i)];
+    }
+
+    inline const char *operator[](int i) const
+    {
+        return &data[offset(i)];
+    }
+
+    void reserve(int n)
+    {
+        data.reserve(offset(n));
+    }
+
+    // Add or remove columns at the end.  Bases of new columns are unset.
+    void resize(int n)
+    {
+        data.resize(offset(n));
+        for (int i=ncols; i<n; i++)
+            data[offset(i) + width] = '\0';
+        ncols = n;
+    }
+
+    // Add a column and return it for its bases to be set
+    char *push_back()
+    {
+        resize(ncols + 1);
+        return (*this)[ncols - 1];
+    }
+
+    void push_back(const char *col)
+    {
+        memcpy(push_back(), col, width);
+    }
+
+    void clear()
+    {
+        data.clear();
+        ncols = 0;
+    }
+
+    void swap(SiteColumns &other)
+    {
+        data.swap(other.data);
+        std::swap(width, other.width);
+        std::swap(ncols, other.ncols);
+    }
+
+protected:
+    vector<char> data;
+    int width;
+    int ncols;
+};
+
+
 // sites are represented internally as 0-index and end-exclusive
 // file-format represents sites as 1-index and end-inclusive
 class Sites
@@ -459,26 +604,23 @@ public:
         clear();
     }
 
-    void append(int position, char* col, bool copy=false) {
+    // Add a site and return its column for the bases to be set
+    char *append(int position) {
+        if (cols.size() == 0)
+            cols.set_width(get_num_seqs());
+        assert(cols.get_width() == get_num_seqs());
         positions.push_back(position);
-        if (copy) {
-            unsigned int len = strlen(col);
-            assert(len == names.size());
-            char *col2 = new char [len + 1];
-            strcpy(col2, col);
-            cols.push_back(col2);
-        } else {
-            cols.push_back(col);
-        }
+        return cols.push_back();
+    }
+
+    void append(int position, const char *col) {
+        assert(strlen(col) == names.size());
+        memcpy(append(position), col, names.size());
     }
 
     void append_masked(int position, bool have_base_probs) {
-        positions.push_back(position);
         int n = get_num_seqs();
-        char *col = new char[n+1];
-        col[n] = '\0';
-        for (int i=0; i < n; i++) col[i] = 'N';
-        cols.push_back(col);
+        memset(append(position), 'N', n);
         if (have_base_probs) {
             vector<BaseProbs> bp;
             for (int i=0; i < n; i++)
@@ -489,8 +631,6 @@ public:
 
     void clear()
     {
-        for (unsigned int i=0; i<cols.size(); i++)
-            delete [] cols[i];
         names.clear();
         positions.clear();
         cols.clear();
@@ -551,7 +691,7 @@ public:
     vector<string> names;
     vector<int> pops;
     vector<int> positions;
-    vector<char*> cols;
+    SiteColumns cols;
     vector<vector<BaseProbs> > base_probs;
 };
 
@@ -705,6 +845,12 @@ bool read_sites(FILE *infile, Sites *sites,
 bool read_sites(const char *filename, Sites *sites,
                 int subregion_start=-1, int subregion_end=-1, bool quiet=false);
 
+// Number of worker threads parsing the records of a VCF file (0 parses them
+// on the caller's thread).  By default up to 4 threads are used when the
+// machine has several cores.
+void set_vcf_threads(int nthreads);
+int get_vcf_threads();
+
 bool read_vcf(FILE *infile, Sites *sites, double min_qual,
               const char *genotype_filter,
               bool parse_genotype_probs, double min_base_prob,
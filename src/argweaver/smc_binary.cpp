@@ -0,0 +1,694 @@
+//=============================================================================
+// binary SMC files (local trees with an index by position)
+
+// c includes
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// c++ includes
+#include <algorithm>
+
+#include "compress.h"
+#include "logging.h"
+#include "smc_binary.h"
+
+namespace argweaver {
+
+
+static const char SMC_BINARY_MAGIC[8] =
+    {'\x89', 'S', 'M', 'C', 'B', '\r', '\n', '\x1a'};
+static const int SMC_BINARY_VERSION = 1;
+
+// flags of the header
+static const int SMC_BINARY_POP_MODEL = 1;
+
+// size of the trailer: offsets of the invisible recombinations and index
+static const int SMC_BINARY_TRAILER_SIZE = 16;
+
+
+//=============================================================================
+// variable length integers
+
+class SmcBinaryWriter
+{
+public:
+    SmcBinaryWriter(vector<char> &data) : data(data) {}
+
+    void put(unsigned long long value)
+    {
+        while (value >= 0x80) {
+            data.push_back(char((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        data.push_back(char(value));
+    }
+
+    // signed values are zigzag encoded, so small magnitudes stay short
+    void put_signed(long long value)
+    {
+        put(value < 0 ? (((unsigned long long) -(value + 1)) << 1) | 1 :
+            ((unsigned long long) value) << 1);
+    }
+
+    void put_fixed(uint64_t value)
+    {
+        for (int i=0; i<8; i++)
+            data.push_back(char((value >> (8 * i)) & 0xff));
+    }
+
+    void put_double(double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        put_fixed(bits);
+    }
+
+    void put_string(const string &str)
+    {
+        put(str.size());
+        data.insert(data.end(), str.begin(), str.end());
+    }
+
+    // node ids may be -1
+    void put_node(const LocalNode &node)
+    {
+        put(node.parent + 1);
+        put(node.child[0] + 1);
+        put(node.child[1] + 1);
+        put(node.age);
+        put_signed(node.pop_path);
+    }
+
+    void put_spr(const Spr &spr)
+    {
+        put(spr.recomb_node);
+        put(spr.recomb_time);
+        put(spr.coal_node);
+        put(spr.coal_time);
+        put_signed(spr.pop_path);
+    }
+
+    vector<char> &data;
+};
+
+
+// Reads values back.  Every value is checked against the end of the data
+// and the ranges of the file, so a corrupt file fails cleanly.
+class SmcBinaryReader
+{
+public:
+    SmcBinaryReader(const char *start, const char *end) :
+        pos(start), end(end), nnodes(0), ntimes(0) {}
+
+    bool get(unsigned long long *value)
+    {
+        *value = 0;
+        for (int shift=0; shift<64 && pos < end; shift += 7) {
+            const unsigned char byte = *pos++;
+            *value |= ((unsigned long long) (byte & 0x7f)) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    bool get_int(int *value, long long max=INT_MAX)
+    {
+        unsigned long long x;
+        if (!get(&x) || max < 0 || x > (unsigned long long) max)
+            return false;
+        *value = int(x);
+        return true;
+    }
+
+    bool get_signed(long long *value)
+    {
+        unsigned long long x;
+        if (!get(&x))
+            return false;
+        *value = (x & 1) ? -(long long) (x >> 1) - 1 : (long long) (x >> 1);
+        return true;
+    }
+
+    bool get_signed_int(int *value)
+    {
+        long long x;
+        if (!get_signed(&x) || x < INT_MIN || x > INT_MAX)
+            return false;
+        *value = int(x);
+        return true;
+    }
+
+    bool get_fixed(uint64_t *value)
+    {
+        if (end - pos < 8)
+            return false;
+        *value = 0;
+        for (int i=0; i<8; i++)
+            *value |= ((uint64_t) (unsigned char) pos[i]) << (8 * i);
+        pos += 8;
+        return true;
+    }
+
+    bool get_double(double *value)
+    {
+        uint64_t bits;
+        if (!get_fixed(&bits))
+            return false;
+        memcpy(value, &bits, sizeof(bits));
+        return true;
+    }
+
+    bool get_string(string *str)
+    {
+        int n;
+        if (!get_int(&n) || end - pos < n)
+            return false;
+        str->assign(pos, n);
+        pos += n;
+        return true;
+    }
+
+    // a node id, which may be -1
+    bool get_node_id(int *value)
+    {
+        if (!get_int(value, nnodes))
+            return false;
+        (*value)--;
+        return true;
+    }
+
+    bool get_node(LocalNode *node)
+    {
+        return get_node_id(&node->parent) &&
+            get_node_id(&node->child[0]) && get_node_id(&node->child[1]) &&
+            get_int(&node->age, ntimes - 1) &&
+            get_signed_int(&node->pop_path);
+    }
+
+    bool get_spr(Spr *spr)
+    {
+        return get_int(&spr->recomb_node, nnodes - 1) &&
+            get_int(&spr->recomb_time, ntimes - 1) &&
+            get_int(&spr->coal_node, nnodes - 1) &&
+            get_int(&spr->coal_time, ntimes - 1) &&
+            get_signed_int(&spr->pop_path);
+    }
+
+    const char *pos;
+    const char *end;
+    int nnodes;     // ranges of node ids and times
+    int ntimes;
+};
+
+
+static inline bool same_node(const LocalNode &a, const LocalNode &b)
+{
+    return a.parent == b.parent && a.child[0] == b.child[0] &&
+        a.child[1] == b.child[1] && a.age == b.age &&
+        a.pop_path == b.pop_path;
+}
+
+
+bool is_smc_binary(const char *data, size_t size)
+{
+    return size >= sizeof(SMC_BINARY_MAGIC) &&
+        memcmp(data, SMC_BINARY_MAGIC, sizeof(SMC_BINARY_MAGIC)) == 0;
+}
+
+
+//=============================================================================
+// writing
+
+void write_local_trees_binary(vector<char> &data, const LocalTrees *trees,
+                              const char *const *names, const double *times,
+                              int ntimes, bool pop_model,
+                              const vector<int> &self_recomb_pos,
+                              const vector<Spr> &self_recombs,
+                              int index_step)
+{
+    const int nnodes = trees->nnodes;
+    const int nleaves = trees->get_num_leaves();
+    SmcBinaryWriter out(data);
+    data.clear();
+
+    assert(self_recomb_pos.size() == self_recombs.size());
+    assert(index_step > 0);
+
+    // header
+    for (unsigned int i=0; i<sizeof(SMC_BINARY_MAGIC); i++)
+        data.push_back(SMC_BINARY_MAGIC[i]);
+    out.put(SMC_BINARY_VERSION);
+    out.put(pop_model ? SMC_BINARY_POP_MODEL : 0);
+    out.put_string(trees->chrom);
+    out.put(trees->start_coord);
+    out.put(trees->end_coord - trees->start_coord);
+    if (names) {
+        out.put(nleaves);
+        for (int i=0; i<nleaves; i++)
+            out.put_string(names[trees->seqids[i]]);
+    } else {
+        out.put(0);
+    }
+    out.put(ntimes);
+    for (int i=0; i<ntimes; i++)
+        out.put_double(times[i]);
+    out.put(nnodes);
+    out.put(trees->get_num_trees());
+
+    // Nodes are renamed as in write_local_trees(): the mapping of each SPR
+    // passes a node's name on to the node it maps to, and the broken node's
+    // name to the recoalescing node.
+    vector<int> total_mapping(nnodes), tmp_mapping(nnodes);
+    vector<LocalNode> named(nnodes), last_named(nnodes);
+    for (int i=0; i<nnodes; i++)
+        total_mapping[i] = i;
+
+    vector<char> index_data;
+    SmcBinaryWriter index_out(index_data);
+    int nindex = 0, last_index_tree = 0;
+    int last_index_start = trees->start_coord;
+    size_t last_index_offset = 0;
+
+    vector<int> invisible_pos;
+    vector<Spr> invisible;
+    int self_idx = 0;
+
+    const LocalTree *last_tree = NULL;
+    int end = trees->start_coord;
+    int j = 0;
+    for (LocalTrees::const_iterator it=trees->begin();
+         it != trees->end(); ++it, j++)
+    {
+        const LocalTree *tree = it->tree;
+        const int start = end;
+        end += it->blocklen;
+        const size_t offset = data.size();
+
+        out.put(it->blocklen);
+        if (last_tree) {
+            // SPR in names of the last tree
+            const Spr &spr = it->spr;
+            out.put_spr(Spr(total_mapping[spr.recomb_node], spr.recomb_time,
+                            total_mapping[spr.coal_node], spr.coal_time,
+                            spr.pop_path));
+
+            // update total mapping
+            const int *mapping = it->mapping;
+            for (int i=0; i<nnodes; i++)
+                tmp_mapping[i] = total_mapping[i];
+            for (int i=0; i<nnodes; i++) {
+                if (mapping[i] != -1)
+                    total_mapping[mapping[i]] = tmp_mapping[i];
+                else {
+                    int recoal = get_recoal_node(last_tree, spr, mapping);
+                    total_mapping[recoal] = tmp_mapping[i];
+                }
+            }
+        }
+
+        // rename nodes
+        for (int i=0; i<nnodes; i++) {
+            const LocalNode &node = tree->nodes[i];
+            LocalNode &node2 = named[total_mapping[i]];
+            node2.parent = (node.parent == -1 ? -1 :
+                            total_mapping[node.parent]);
+            for (int k=0; k<2; k++)
+                node2.child[k] = (node.child[k] == -1 ? -1 :
+                                  total_mapping[node.child[k]]);
+            node2.age = node.age;
+            node2.pop_path = node.pop_path;
+        }
+        const int root = total_mapping[tree->root];
+
+        // write the nodes that differ from the last tree
+        int nchanged = 0;
+        for (int i=0; i<nnodes; i++)
+            if (!last_tree || !same_node(named[i], last_named[i]))
+                nchanged++;
+        out.put(root);
+        out.put(nchanged);
+        for (int i=0, last_id=-1; i<nnodes; i++) {
+            if (!last_tree || !same_node(named[i], last_named[i])) {
+                out.put(i - last_id - 1);
+                out.put_node(named[i]);
+                last_id = i;
+            }
+        }
+
+        // index a copy of the tree
+        if (j % index_step == 0) {
+            index_out.put(j - last_index_tree);
+            index_out.put(start - last_index_start);
+            index_out.put(offset - last_index_offset);
+            index_out.put(root);
+            for (int i=0; i<nnodes; i++)
+                index_out.put_node(named[i]);
+            last_index_tree = j;
+            last_index_start = start;
+            last_index_offset = offset;
+            nindex++;
+        }
+
+        // invisible recombinations within this tree
+        while (self_idx < (int) self_recomb_pos.size() &&
+               self_recomb_pos[self_idx] < end) {
+            const Spr &spr = self_recombs[self_idx];
+            invisible_pos.push_back(self_recomb_pos[self_idx]);
+            invisible.push_back(
+                Spr(total_mapping[spr.recomb_node], spr.recomb_time,
+                    total_mapping[spr.coal_node], spr.coal_time,
+                    spr.pop_path));
+            self_idx++;
+        }
+
+        named.swap(last_named);
+        last_tree = tree;
+    }
+
+    // invisible recombinations
+    const size_t invisible_offset = data.size();
+    out.put(invisible.size());
+    for (unsigned int i=0; i<invisible.size(); i++) {
+        out.put_signed(i == 0 ? invisible_pos[i] :
+                       (long long) invisible_pos[i] - invisible_pos[i-1]);
+        out.put_spr(invisible[i]);
+    }
+
+    // index
+    const size_t index_offset = data.size();
+    out.put(nindex);
+    data.insert(data.end(), index_data.begin(), index_data.end());
+
+    out.put_fixed(invisible_offset);
+    out.put_fixed(index_offset);
+}
+
+
+bool write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const char *const *names, const double *times,
+                              int ntimes, bool pop_model,
+                              const vector<int> &self_recomb_pos,
+                              const vector<Spr> &self_recombs)
+{
+    vector<char> data;
+    write_local_trees_binary(data, trees, names, times, ntimes, pop_model,
+                             self_recomb_pos, self_recombs);
+    return fwrite(&data[0], 1, data.size(), out) == data.size();
+}
+
+
+//=============================================================================
+// reading
+
+bool read_local_trees_binary(const char *data, size_t size,
+                             const double *times, int ntimes,
+                             LocalTrees *trees, vector<string> &seqnames,
+                             int start, int end,
+                             vector<int> *invisible_recomb_pos,
+                             vector<Spr> *invisible_recombs)
+{
+    assert((invisible_recomb_pos==NULL && invisible_recombs==NULL) ||
+           (invisible_recomb_pos!=NULL && invisible_recombs!=NULL));
+
+    seqnames.clear();
+    trees->clear();
+
+    if (!is_smc_binary(data, size) ||
+        size < sizeof(SMC_BINARY_MAGIC) + SMC_BINARY_TRAILER_SIZE) {
+        printError("not a binary SMC file");
+        return false;
+    }
+
+    // trailer
+    const char *data_end = data + size - SMC_BINARY_TRAILER_SIZE;
+    SmcBinaryReader trailer(data_end, data + size);
+    uint64_t invisible_offset, index_offset;
+    if (!trailer.get_fixed(&invisible_offset) ||
+        !trailer.get_fixed(&index_offset) ||
+        invisible_offset > index_offset ||
+        index_offset > size - SMC_BINARY_TRAILER_SIZE) {
+        printError("bad binary SMC trailer");
+        return false;
+    }
+
+    // header
+    SmcBinaryReader in(data + sizeof(SMC_BINARY_MAGIC), data_end);
+    int version, flags, start_coord, length, nnames, file_ntimes, nnodes,
+        ntrees;
+    if (!in.get_int(&version) || version != SMC_BINARY_VERSION) {
+        printError("binary SMC file was written by another version");
+        return false;
+    }
+    if (!in.get_int(&flags) || !in.get_string(&trees->chrom) ||
+        !in.get_int(&start_coord) || !in.get_int(&length) ||
+        !in.get_int(&nnames)) {
+        printError("bad binary SMC header");
+        return false;
+    }
+    seqnames.resize(nnames);
+    for (int i=0; i<nnames; i++) {
+        if (!in.get_string(&seqnames[i])) {
+            printError("bad binary SMC header");
+            return false;
+        }
+    }
+    if (!in.get_int(&file_ntimes)) {
+        printError("bad binary SMC header");
+        return false;
+    }
+    vector<int> time_map(file_ntimes);
+    for (int i=0; i<file_ntimes; i++) {
+        double time;
+        if (!in.get_double(&time)) {
+            printError("bad binary SMC header");
+            return false;
+        }
+        time_map[i] = find_time(time, times, ntimes);
+    }
+    if (!in.get_int(&nnodes) || !in.get_int(&ntrees)) {
+        printError("bad binary SMC header");
+        return false;
+    }
+    in.nnodes = nnodes;
+    in.ntimes = file_ntimes;
+
+    const int end_coord = start_coord + length;
+    if (start < start_coord)
+        start = start_coord;
+    if (end == -1 || end > end_coord)
+        end = end_coord;
+    trees->start_coord = start;
+    trees->end_coord = max(start, end);
+
+    // find the closest indexed tree before the region
+    vector<LocalNode> nodes(nnodes);
+    int root = -1;
+    int first_tree = 0;
+    int coord = start_coord;
+    if (start > start_coord) {
+        SmcBinaryReader index(data + index_offset, data_end);
+        index.nnodes = nnodes;
+        index.ntimes = file_ntimes;
+        int nindex;
+        if (!index.get_int(&nindex)) {
+            printError("bad binary SMC index");
+            return false;
+        }
+        int tree = 0, tree_start = start_coord;
+        size_t offset = 0;
+        for (int i=0; i<nindex; i++) {
+            int dtree, dstart, root2;
+            unsigned long long doffset;
+            if (!index.get_int(&dtree) || !index.get_int(&dstart) ||
+                !index.get(&doffset) || !index.get_int(&root2, nnodes - 1)) {
+                printError("bad binary SMC index");
+                return false;
+            }
+            tree += dtree;
+            tree_start += dstart;
+            offset += doffset;
+            if (tree_start > start) {
+                break;
+            } else if (offset >= invisible_offset) {
+                printError("bad binary SMC index");
+                return false;
+            }
+
+            first_tree = tree;
+            coord = tree_start;
+            in.pos = data + offset;
+            root = root2;
+            for (int k=0; k<nnodes; k++) {
+                if (!index.get_node(&nodes[k])) {
+                    printError("bad binary SMC index");
+                    return false;
+                }
+            }
+        }
+    }
+
+    // decode trees, applying the changed nodes to the last tree
+    const char *trees_end = data + invisible_offset;
+    in.end = trees_end;
+    LocalTree *last_tree = NULL;
+    for (int j=first_tree; j<ntrees && coord < end; j++) {
+        int blocklen, nchanged;
+        Spr spr;
+        spr.set_null();
+        if (!in.get_int(&blocklen) || (j > 0 && !in.get_spr(&spr)) ||
+            !in.get_int(&root, nnodes - 1) || !in.get_int(&nchanged, nnodes)) {
+            printError("bad binary SMC tree (tree %d)", j);
+            return false;
+        }
+        for (int i=0, id=-1; i<nchanged; i++) {
+            int skip;
+            if (!in.get_int(&skip, nnodes - 1 - id - 1) ||
+                !in.get_node(&nodes[id + skip + 1])) {
+                printError("bad binary SMC tree (tree %d)", j);
+                return false;
+            }
+            id += skip + 1;
+        }
+
+        const int tree_start = coord;
+        coord += blocklen;
+        if (coord <= start)
+            continue;
+
+        LocalTree *tree = new LocalTree(nnodes, nnodes);
+        for (int i=0; i<nnodes; i++) {
+            tree->nodes[i] = nodes[i];
+            tree->nodes[i].age = time_map[nodes[i].age];
+        }
+        tree->root = root;
+
+        // setup mapping
+        int *mapping = NULL;
+        if (last_tree) {
+            spr.recomb_time = time_map[spr.recomb_time];
+            spr.coal_time = time_map[spr.coal_time];
+            mapping = new int [nnodes];
+            for (int i=0; i<nnodes; i++)
+                mapping[i] = i;
+            if (spr.recomb_node != spr.coal_node)
+                mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
+        } else {
+            spr.set_null();
+        }
+
+        // trim the block to the region
+        blocklen = min(coord, end) - max(tree_start, start);
+        trees->trees.push_back(LocalTreeSpr(tree, spr, blocklen, mapping));
+        last_tree = tree;
+    }
+
+    if (invisible_recombs) {
+        SmcBinaryReader invisible(data + invisible_offset,
+                                  data + index_offset);
+        invisible.nnodes = nnodes;
+        invisible.ntimes = file_ntimes;
+        int ninvisible;
+        long long pos = 0;
+        if (!invisible.get_int(&ninvisible)) {
+            printError("bad binary SMC invisible recombinations");
+            return false;
+        }
+        for (int i=0; i<ninvisible; i++) {
+            long long dpos;
+            Spr spr;
+            if (!invisible.get_signed(&dpos) || !invisible.get_spr(&spr)) {
+                printError("bad binary SMC invisible recombinations");
+                return false;
+            }
+            pos += dpos;
+            if (pos < start || pos >= end)
+                continue;
+            spr.recomb_time = time_map[spr.recomb_time];
+            spr.coal_time = time_map[spr.coal_time];
+            invisible_recomb_pos->push_back(pos);
+            invisible_recombs->push_back(spr);
+        }
+    }
+
+    // set trees info
+    if (trees->get_num_trees() > 0) {
+        trees->nnodes = nnodes;
+        trees->set_default_seqids();
+    }
+
+    return true;
+}
+
+
+bool read_local_trees_region(const char *filename, const double *times,
+                             int ntimes, int start, int end,
+                             LocalTrees *trees, vector<string> &seqnames)
+{
+    // read uncompressed binary files in place
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        printError("cannot read file '%s'", filename);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            if (is_smc_binary((const char*) addr, st.st_size)) {
+                bool result = read_local_trees_binary(
+                    (const char*) addr, st.st_size, times, ntimes,
+                    trees, seqnames, start, end);
+                munmap(addr, st.st_size);
+                close(fd);
+                return result;
+            }
+            munmap(addr, st.st_size);
+        }
+    }
+    close(fd);
+
+    // read whole file and partition it
+    CompressStream stream(filename, "r");
+    if (!stream.stream) {
+        printError("cannot read file '%s'", filename);
+        return false;
+    }
+    if (!read_local_trees(stream.stream, times, ntimes, trees, seqnames))
+        return false;
+
+    if ((start != -1 && start >= trees->end_coord) ||
+        (end != -1 && end <= trees->start_coord)) {
+        // region is outside of the trees
+        trees->clear();
+        trees->start_coord = trees->end_coord = max(start, trees->start_coord);
+        return true;
+    }
+    if (start > trees->start_coord && start < trees->end_coord) {
+        LocalTrees *trees2 = partition_local_trees(trees, start, true);
+        trees->clear();
+        trees->trees.splice(trees->begin(), trees2->trees);
+        trees->start_coord = trees2->start_coord;
+        trees->end_coord = trees2->end_coord;
+        delete trees2;
+    }
+    if (end > trees->start_coord && end < trees->end_coord) {
+        delete partition_local_trees(trees, end, true);
+
+        // drop the empty copy left when the region ends at a block start
+        if (trees->back().blocklen == 0) {
+            trees->back().clear();
+            trees->trees.pop_back();
+        }
+    }
+
+    return true;
+}
+
+
+} // namespace argweaver
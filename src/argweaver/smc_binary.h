@@ -0,0 +1,79 @@
+//=============================================================================
+// binary SMC files (local trees with an index by position)
+
+#ifndef ARGWEAVER_SMC_BINARY_H
+#define ARGWEAVER_SMC_BINARY_H
+
+// c++ includes
+#include <string>
+#include <vector>
+
+#include "local_tree.h"
+
+namespace argweaver {
+
+using namespace std;
+
+
+// A binary SMC file holds the same information as a text .smc file:
+//
+//   - a header with the sequence names, region and time points
+//   - the first tree as arrays of parents, children, ages and pop paths
+//   - for every later tree, its SPR, block length and the nodes that
+//     changed from the tree before it
+//   - the invisible recombinations (SPR-INVIS lines)
+//   - an index of every SMC_BINARY_INDEX_STEP-th tree by start coordinate,
+//     with a copy of the tree, so that reading a region only decodes the
+//     trees after the closest indexed tree
+//
+// Integers are stored as variable length (LEB128) numbers and times as
+// indices into the time points of the header, so files are small and do
+// not depend on the byte order of the machine.  Node ids follow the naming
+// of text .smc files, which keeps a node's id from one tree to the next,
+// so converting between the formats is lossless.  read_local_trees()
+// recognizes binary files, compressed or not.
+
+// trees between index entries
+#define SMC_BINARY_INDEX_STEP 256
+
+
+// Returns true if 'data' starts like a binary SMC file
+bool is_smc_binary(const char *data, size_t size);
+
+// Serialize local trees into 'data'.  Arguments are as in
+// write_local_trees(), with the number of time points added.
+void write_local_trees_binary(vector<char> &data, const LocalTrees *trees,
+                              const char *const *names, const double *times,
+                              int ntimes, bool pop_model=false,
+                              const vector<int> &self_recomb_pos=vector<int>(),
+                              const vector<Spr> &self_recombs=vector<Spr>(),
+                              int index_step=SMC_BINARY_INDEX_STEP);
+bool write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const char *const *names, const double *times,
+                              int ntimes, bool pop_model=false,
+                              const vector<int> &self_recomb_pos=vector<int>(),
+                              const vector<Spr> &self_recombs=vector<Spr>());
+
+// Read local trees from a binary SMC file in memory.  If 'start' and 'end'
+// are not -1, only the trees of the region [start, end) are read and the
+// local trees are trimmed to it, as with partition_local_trees().  Times
+// are mapped to the closest of 'times'.
+bool read_local_trees_binary(const char *data, size_t size,
+                             const double *times, int ntimes,
+                             LocalTrees *trees, vector<string> &seqnames,
+                             int start=-1, int end=-1,
+                             vector<int> *invisible_recomb_pos=NULL,
+                             vector<Spr> *invisible_recombs=NULL);
+
+// Read the local trees of the region [start, end) of a text or binary SMC
+// file ('start' or 'end' may be -1 for the start or end of the file).  An
+// uncompressed binary file is mapped into memory and read through its
+// index; other files are read whole and partitioned.
+bool read_local_trees_region(const char *filename, const double *times,
+                             int ntimes, int start, int end,
+                             LocalTrees *trees, vector<string> &seqnames);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_SMC_BINARY_H
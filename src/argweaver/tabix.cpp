@@ -1,6 +1,8 @@
 #include <unistd.h>
-#include <string>
+#include <string.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <string>
 
 #include "tabix.h"
 #include "parsing.h"
@@ -11,29 +13,479 @@ namespace argweaver {
 using namespace std;
 
 
+//=============================================================================
+// index
+
+// Bounds-checked reading of little-endian index fields
+class IndexParser
+{
+public:
+    IndexParser(const char *data, int size) :
+        data((const unsigned char *) data), size(size), pos(0), ok(true)
+    {}
+
+    bool has(int64_t n) {
+        ok = ok && n >= 0 && pos + n <= size;
+        return ok;
+    }
+
+    int32_t read_int32() {
+        return int32_t(read_uint64(4));
+    }
+
+    uint64_t read_uint64(int nbytes=8) {
+        uint64_t value = 0;
+        if (!has(nbytes))
+            return 0;
+        for (int i=0; i<nbytes; i++)
+            value |= uint64_t(data[pos + i]) << (8 * i);
+        pos += nbytes;
+        return value;
+    }
+
+    const char *read_bytes(int n) {
+        if (!has(n))
+            return NULL;
+        const char *bytes = (const char *) &data[pos];
+        pos += n;
+        return bytes;
+    }
+
+    const unsigned char *data;
+    int64_t size;
+    int64_t pos;
+    bool ok;
+};
+
+
+bool TabixIndex::read(const char *filename)
+{
+    // the index itself is BGZF compressed
+    string index_file = string(filename) + ".tbi";
+    bool csi = false;
+    if (access(index_file.c_str(), F_OK) != 0) {
+        index_file = string(filename) + ".csi";
+        csi = true;
+    }
+
+    BgzfReader reader(0);
+    if (!reader.open(index_file.c_str())) {
+        printError("cannot find index of '%s' (.tbi or .csi)", filename);
+        return false;
+    }
+    vector<char> data;
+    char buf[BGZF_MAX_BLOCK_SIZE];
+    long n;
+    while ((n = reader.read(buf, sizeof(buf))) > 0)
+        data.insert(data.end(), buf, buf + n);
+    if (n < 0 || reader.close() != 0 || data.size() == 0 ||
+        !parse(&data[0], data.size(), csi)) {
+        printError("cannot read index '%s'", index_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// Parse the tabix fields and sequence names
+bool TabixIndex::parse_aux(const char *data, int size)
+{
+    IndexParser parser(data, size);
+    format = parser.read_int32();
+    col_seq = parser.read_int32();
+    col_beg = parser.read_int32();
+    col_end = parser.read_int32();
+    meta = parser.read_int32();
+    skip = parser.read_int32();
+    const int names_len = parser.read_int32();
+    const char *names = parser.read_bytes(names_len);
+    if (!parser.ok)
+        return false;
+
+    ref_ids.clear();
+    for (int i=0; i<names_len; i += strlen(&names[i]) + 1) {
+        if (!memchr(&names[i], '\0', names_len - i))
+            return false;
+        const int id = ref_ids.size();
+        ref_ids[string(&names[i])] = id;
+    }
+    return true;
+}
+
+
+bool TabixIndex::parse(const char *data, int size, bool csi)
+{
+    IndexParser parser(data, size);
+    const char *magic = parser.read_bytes(4);
+    if (!magic || memcmp(magic, csi ? "CSI\1" : "TBI\1", 4) != 0)
+        return false;
+
+    int nrefs;
+    if (csi) {
+        min_shift = parser.read_int32();
+        depth = parser.read_int32();
+        const int aux_len = parser.read_int32();
+        const char *aux = parser.read_bytes(aux_len);
+        if (!parser.ok || !parse_aux(aux, aux_len))
+            return false;
+        nrefs = parser.read_int32();
+    } else {
+        min_shift = 14;
+        depth = 5;
+        nrefs = parser.read_int32();
+        const int64_t aux_start = parser.pos;
+        parser.read_bytes(6 * 4);
+        parser.read_bytes(parser.read_int32());
+        if (!parser.ok ||
+            !parse_aux(&data[aux_start], parser.pos - aux_start))
+            return false;
+    }
+    if (!parser.ok || nrefs < 0 || nrefs != int(ref_ids.size()) ||
+        min_shift <= 0 || depth < 0 || min_shift + 3 * depth > 62)
+        return false;
+
+    refs.clear();
+    refs.resize(nrefs);
+    for (int i=0; i<nrefs; i++) {
+        Ref &ref = refs[i];
+        const int nbins = parser.read_int32();
+        for (int j=0; j<nbins && parser.ok; j++) {
+            const unsigned int bin_id = parser.read_int32();
+            Bin &bin = ref.bins[bin_id];
+            bin.loffset = csi ? parser.read_uint64() : 0;
+            const int nchunks = parser.read_int32();
+            if (!parser.has(16 * int64_t(nchunks)))
+                return false;
+            for (int k=0; k<nchunks; k++) {
+                const int64_t beg = parser.read_uint64();
+                const int64_t end = parser.read_uint64();
+                bin.chunks.push_back(Chunk(beg, end));
+            }
+        }
+        if (!csi) {
+            const int nintervals = parser.read_int32();
+            if (!parser.has(8 * int64_t(nintervals)))
+                return false;
+            for (int k=0; k<nintervals; k++)
+                ref.linear.push_back(parser.read_uint64());
+        }
+    }
+    return parser.ok;
+}
+
+
+void TabixIndex::query(const string &chrom, int64_t beg, int64_t end,
+                       vector<Chunk> &chunks) const
+{
+    chunks.clear();
+    map<string, int>::const_iterator it = ref_ids.find(chrom);
+    if (it == ref_ids.end())
+        return;
+    const Ref &ref = refs[it->second];
+    beg = max(beg, int64_t(0));
+    end = min(end, int64_t(1) << (min_shift + 3 * depth));
+    if (beg >= end)
+        return;
+
+    // smallest offset of any record overlapping beg
+    int64_t min_offset = 0;
+    if (ref.linear.size() > 0) {
+        const size_t i = min(size_t(beg >> min_shift), ref.linear.size() - 1);
+        min_offset = ref.linear[i];
+    } else {
+        // the smallest bin holding beg that has records
+        unsigned int bin = ((1u << (3 * depth)) - 1) / 7 + (beg >> min_shift);
+        while (true) {
+            map<unsigned int, Bin>::const_iterator b = ref.bins.find(bin);
+            if (b != ref.bins.end()) {
+                min_offset = b->second.loffset;
+                break;
+            }
+            if (bin == 0)
+                break;
+            bin = (bin - 1) >> 3;
+        }
+    }
+
+    // collect the chunks of all bins overlapping the region
+    unsigned int first = 0;
+    int shift = min_shift + 3 * depth;
+    for (int level=0; level<=depth; level++) {
+        for (int64_t i=(beg >> shift); i<=((end - 1) >> shift); i++) {
+            map<unsigned int, Bin>::const_iterator b =
+                ref.bins.find(first + i);
+            if (b == ref.bins.end())
+                continue;
+            for (unsigned int k=0; k<b->second.chunks.size(); k++)
+                if (b->second.chunks[k].second > min_offset)
+                    chunks.push_back(b->second.chunks[k]);
+        }
+        first += 1 << (3 * level);
+        shift -= 3;
+    }
+
+    // merge overlapping chunks
+    sort(chunks.begin(), chunks.end());
+    unsigned int n = 0;
+    for (unsigned int i=0; i<chunks.size(); i++) {
+        if (n > 0 && chunks[i].first <= chunks[n-1].second)
+            chunks[n-1].second = max(chunks[n-1].second, chunks[i].second);
+        else
+            chunks[n++] = chunks[i];
+    }
+    chunks.resize(n);
+}
+
+
+//=============================================================================
+// reader
+
+bool TabixReader::open(const char *filename)
+{
+    if (!reader.open(filename)) {
+        printError("cannot open '%s'", filename);
+        return false;
+    }
+    if (!reader.seekable()) {
+        printError("'%s' is not compressed with bgzip", filename);
+        reader.close();
+        return false;
+    }
+    if (!index.read(filename)) {
+        reader.close();
+        return false;
+    }
+
+    // keep the header for every region
+    header.clear();
+    string line;
+    while (reader.read_line(line) &&
+           (int(header.size()) < index.skip ||
+            (line.size() > 0 && line[0] == index.meta)))
+        header.push_back(line);
+
+    done = true;
+    return true;
+}
+
+
+bool TabixReader::set_region(const char *region, bool with_header)
+{
+    chunks.clear();
+    pending.clear();
+    pending_pos = 0;
+    in_chunk = false;
+    chunk_index = 0;
+    whole_file = (region == NULL);
+    done = true;
+
+    if (!whole_file) {
+        if (!parse_tabix_region(region, &qchrom, &qbeg, &qend)) {
+            printError("bad region format (%s); should be chr:start-end",
+                       region);
+            return false;
+        }
+        index.query(qchrom, qbeg, qend, chunks);
+    }
+
+    header_line = with_header ? 0 : header.size();
+    if (whole_file) {
+        header_line = header.size();
+        if (!reader.seek(0))
+            return false;
+    }
+    done = false;
+    return true;
+}
+
+
+bool TabixReader::read_line(string &line)
+{
+    if (whole_file)
+        return !done && reader.read_line(line);
+
+    if (header_line < header.size()) {
+        line = header[header_line++];
+        return true;
+    }
+
+    while (!done) {
+        if (chunk_index >= chunks.size()) {
+            done = true;
+            break;
+        }
+        const TabixIndex::Chunk &chunk = chunks[chunk_index];
+        if (!in_chunk) {
+            if (reader.tell() != chunk.first && !reader.seek(chunk.first)) {
+                done = true;
+                break;
+            }
+            in_chunk = true;
+        }
+        if (reader.tell() >= chunk.second || !reader.read_line(line)) {
+            chunk_index++;
+            in_chunk = false;
+            continue;
+        }
+
+        bool past_end;
+        if (overlaps(line, &past_end))
+            return true;
+        if (past_end)
+            done = true;
+    }
+    return false;
+}
+
+
+// Returns true if a record overlaps the region.  'past_end' is set if the
+// record starts after the region, so that no later record can overlap.
+bool TabixReader::overlaps(const string &line, bool *past_end) const
+{
+    *past_end = false;
+    if (line.empty() || line[0] == index.meta)
+        return false;
+
+    const int format = index.format & 0xffff;
+    const int ref_col = (format == 2 ? 4 : 0);
+    const int last_col = max(max(index.col_seq, index.col_beg),
+                             max(index.col_end, ref_col));
+    int64_t beg = -1, end = -1;
+    bool chrom_found = false;
+    size_t start = 0;
+    for (int col=1; col<=last_col && start <= line.size(); col++) {
+        size_t stop = line.find('\t', start);
+        if (stop == string::npos)
+            stop = line.size();
+
+        if (col == index.col_seq) {
+            if (line.compare(start, stop - start, qchrom) != 0)
+                return false;
+            chrom_found = true;
+        }
+        if (col == index.col_beg)
+            beg = strtoll(&line[start], NULL, 10);
+        if (col == index.col_end)
+            end = strtoll(&line[start], NULL, 10);
+        if (col == ref_col)
+            end = beg + (stop - start);
+        start = stop + 1;
+    }
+    if (!chrom_found || beg < 0)
+        return false;
+
+    // convert to 0-based, half-open coordinates
+    if (!(index.format & 0x10000)) {
+        beg--;
+        if (format == 2)
+            end--;
+    }
+    if (end <= beg)
+        end = beg + 1;
+
+    if (beg >= qend)
+        *past_end = true;
+    return beg < qend && end > qbeg;
+}
+
+
+long TabixReader::read(char *buf, long len)
+{
+    long n = 0;
+    while (n < len) {
+        if (pending_pos == pending.size()) {
+            pending_pos = 0;
+            if (!read_line(pending)) {
+                pending.clear();
+                break;
+            }
+            pending += '\n';
+        }
+        const long m = min(len - n, long(pending.size() - pending_pos));
+        memcpy(&buf[n], &pending[pending_pos], m);
+        pending_pos += m;
+        n += m;
+    }
+    return n;
+}
+
+
+bool parse_tabix_region(const char *region, string *chrom, int64_t *beg,
+                        int64_t *end)
+{
+    string str(region);
+    str.erase(remove(str.begin(), str.end(), ','), str.end());
+    *beg = 0;
+    *end = int64_t(1) << 62;
+
+    const size_t colon = str.rfind(':');
+    if (colon == string::npos) {
+        *chrom = str;
+        return !str.empty();
+    }
+    *chrom = str.substr(0, colon);
+
+    const char *pos = str.c_str() + colon + 1;
+    char *rest;
+    const int64_t start = strtoll(pos, &rest, 10);
+    if (rest == pos || start < 1)
+        return false;
+    *beg = start - 1;
+    if (*rest == '\0')
+        return !chrom->empty();
+    if (*rest != '-')
+        return false;
+
+    pos = rest + 1;
+    *end = strtoll(pos, &rest, 10);
+    return rest != pos && *rest == '\0' && !chrom->empty() && *beg < *end;
+}
+
+
+//=============================================================================
+// streams
+
+static long tabix_stream_read(void *data, char *buf, long len)
+{
+    return ((TabixReader *) data)->read(buf, len);
+}
+
+static int tabix_stream_close(void *data)
+{
+    delete (TabixReader *) data;
+    return 0;
+}
+
+
 FILE *read_tabix(const char *filename, const char *region,
                  const char *tabix_dir) {
-    FILE *pipe;
-
     if (region == NULL) {
         return read_compress(filename);
     }
 
-    string cmd = "tabix -h " + quote_arg(filename) + " " +  region;
-    if (tabix_dir != NULL && strlen(tabix_dir) > 0)
-        cmd = string(tabix_dir) + "/" + cmd;
-    pipe = popen(cmd.c_str(), "r");
-    if (pipe == NULL) {
-        printError("Error opening %s with tabix. Is tabix installed and"
-                   " in your PATH?\n",
-                   filename);
+    TabixReader *reader = new TabixReader();
+    if (!reader->open(filename) || !reader->set_region(region)) {
+        delete reader;
+        return NULL;
     }
-    return pipe;
+    FILE *stream = open_read_stream(reader, tabix_stream_read,
+                                    tabix_stream_close);
+    if (!stream)
+        delete reader;
+    return stream;
+}
+
+
+FILE *read_tabix(TabixReader *reader, const char *region)
+{
+    if (!reader->set_region(region))
+        return NULL;
+    return open_read_stream(reader, tabix_stream_read, NULL);
 }
 
 
 int close_tabix(FILE *stream) {
-    return pclose(stream);
+    return close_compress(stream);
 }
 
 }
@@ -2,16 +2,143 @@
 #define ARGWEAVER_TABIX_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <map>
 #include <string>
+#include <vector>
 
+#include "bgzf.h"
 #include "logging.h"
 
 namespace argweaver {
 
 using namespace std;
 
+
+// A tabix (.tbi) or CSI (.csi) index of a sorted, BGZF compressed text file
+class TabixIndex
+{
+public:
+    TabixIndex() :
+        format(0),
+        col_seq(1),
+        col_beg(2),
+        col_end(3),
+        meta('#'),
+        skip(0),
+        min_shift(14),
+        depth(5)
+    {}
+
+    // Load the index of 'filename' from <filename>.tbi or <filename>.csi
+    bool read(const char *filename);
+
+    // A range of virtual offsets [beg, end) holding records of a region
+    typedef pair<int64_t, int64_t> Chunk;
+
+    // Find the sorted, disjoint chunks that may hold records of chrom
+    // overlapping [beg, end) (0-based, half-open)
+    void query(const string &chrom, int64_t beg, int64_t end,
+               vector<Chunk> &chunks) const;
+
+    // columns and conventions of the indexed file
+    int format;         // 0: generic, 1: SAM, 2: VCF, plus 0x10000 if
+                        // coordinates are 0-based half-open (UCSC)
+    int col_seq;        // 1-based columns of sequence name, start and end
+    int col_beg;
+    int col_end;
+    char meta;          // lines starting with this character are headers
+    int skip;           // number of leading lines to skip
+
+protected:
+    struct Bin {
+        int64_t loffset;        // smallest offset of records in bin (CSI)
+        vector<Chunk> chunks;
+    };
+    struct Ref {
+        map<unsigned int, Bin> bins;
+        vector<int64_t> linear;  // linear index (TBI)
+    };
+
+    bool parse(const char *data, int size, bool csi);
+    bool parse_aux(const char *data, int size);
+
+    int min_shift;
+    int depth;
+    map<string, int> ref_ids;
+    vector<Ref> refs;
+};
+
+
+// Reads the records of regions of a BGZF file through its tabix index.
+// One reader can serve any number of regions in turn.
+class TabixReader
+{
+public:
+    TabixReader() :
+        whole_file(false),
+        header_line(0),
+        done(true),
+        in_chunk(false),
+        chunk_index(0),
+        qbeg(0),
+        qend(0),
+        pending_pos(0)
+    {}
+
+    // Open a file and load its index
+    bool open(const char *filename);
+    void close() { reader.close(); }
+
+    // Start reading the records overlapping 'region' (chr, chr:start or
+    // chr:start-end, 1-based inclusive as in tabix), or the whole file if
+    // 'region' is NULL.  With 'with_header', the header lines of the file
+    // are read first.
+    bool set_region(const char *region, bool with_header=true);
+
+    // Read the next line (without its newline).  Returns false when the
+    // region has been read.
+    bool read_line(string &line);
+
+    // Read the lines as text, as in BgzfReader::read()
+    long read(char *buf, long len);
+
+protected:
+    bool overlaps(const string &line, bool *past_end) const;
+
+    BgzfReader reader;
+    TabixIndex index;
+    vector<TabixIndex::Chunk> chunks;   // chunks of the current region
+    vector<string> header;              // header lines of the file
+    bool whole_file;
+    unsigned int header_line;           // next header line to read
+    bool done;
+    bool in_chunk;
+    unsigned int chunk_index;
+    string qchrom;
+    int64_t qbeg;
+    int64_t qend;
+    string pending;          // text not yet returned by read()
+    unsigned int pending_pos;
+};
+
+
+// Parse a region string (chr, chr:start or chr:start-end, 1-based and
+// inclusive, commas allowed) into 0-based half-open coordinates
+bool parse_tabix_region(const char *region, string *chrom, int64_t *beg,
+                        int64_t *end);
+
+// Open the lines of 'filename' overlapping 'region', preceded by its header.
+// The file is read through its index.  Without a region the whole file is
+// read.  'tabix_dir' is no longer used.
 FILE *read_tabix(const char *filename, const char *region,
                  const char *tabix_dir);
+
+// Open the lines overlapping 'region' of a file opened by 'reader'.  The
+// reader must outlive the stream, and only one stream of a reader may be
+// read at a time.
+FILE *read_tabix(TabixReader *reader, const char *region);
+
 int close_tabix(FILE *stream);
 
 class TabixStream
@@ -36,6 +163,20 @@ public:
         }
     }
 
+    // Read a region through 'reader' (whose index is already loaded) if it
+    // is given, otherwise open 'filename'
+    TabixStream(TabixReader *reader, string filename, const char *region,
+                string tabix_dir) {
+        if (reader)
+            stream = read_tabix(reader, region);
+        else
+            stream = read_tabix(filename.c_str(), region, NULL);
+        if (stream == NULL) {
+            printError("Error opening %s, region=%s\n",
+                       filename.c_str(), region == NULL ? "NULL" : region);
+        }
+    }
+
     ~TabixStream()
     {
         close();
@@ -200,7 +200,7 @@ void add_spr_branch(const LocalTree *tree, const LocalTree *last_tree,
     const State orig_state(state);
     const State orig_last_state(last_state);
     const Spr orig_spr(*spr);
-    static int count=0;
+    static thread_local int count=0;
     count++;
 #endif
 
@@ -356,7 +356,7 @@ void add_arg_thread(LocalTrees *trees, const StatesModel &states_model,
     State last_state;
     LocalTree *last_tree = NULL;
 #ifdef DEBUG
-    static int count=0;
+    static thread_local int count=0;
 #endif
 
     assert_trees(trees, pop_tree, true);
@@ -832,7 +832,7 @@ void sample_arg_removal_path_forward(
             if (next_nodes[1] == -1)
                 j = 0;
             else
-                j = int(rand() < prob_switch);
+                j = int(rand_int() < prob_switch);
             path[i++] = next_nodes[j];
 
             // ensure that a removal path re-enters the local tree correctly
@@ -869,7 +869,7 @@ void sample_arg_removal_path_backward(
         if (prev_nodes[1] == -1)
             j = 0;
         else
-            j = int(rand() < prob_switch);
+            j = int(rand_int() < prob_switch);
         path[i--] = prev_nodes[j];
 
         spr2 = &it->spr;
@@ -1392,7 +1392,7 @@ void add_spr_branch(const LocalTree *tree, const LocalTree *last_tree,
     const LocalNode *last_nodes = last_tree->nodes;
     int node2 = state.node;
     int last_newcoal = last_nodes[last_subtree_root].parent;
-    static int count=0;
+    static thread_local int count=0;
     bool fix_mapping=true;
     count++;
 
@@ -1541,7 +1541,7 @@ void add_arg_thread_path(LocalTrees *trees, const StatesModel &states_model,
     unsigned int irecomb = 0;
     int end = trees->start_coord;
 #ifdef DEBUG
-    static int count=0;
+    static thread_local int count=0;
     LocalTree orig_tree;
     LocalTree orig_last_tree;
     Spr orig_spr;
@@ -1721,8 +1721,8 @@ void remove_arg_thread_path(LocalTrees *trees, const int *removal_path,
     LocalTree *tree = NULL;
     State *original_states = NULL;
 #ifdef DEBUG
-    static int count=0;
-    static int call_count=0;
+    static thread_local int count=0;
+    static thread_local int call_count=0;
     call_count++;
     assert_trees(trees, pop_tree, false);
     LocalTree orig_last_tree;
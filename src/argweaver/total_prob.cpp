@@ -7,6 +7,8 @@
 #include "common.h"
 #include "emit.h"
 #include "local_tree.h"
+#include "logging.h"
+#include "pop_model.h"
 #include "sequences.h"
 #include "trans.h"
 #include "total_prob.h"
@@ -57,8 +59,69 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
 }
 
 
-    // TODO: This fills in compressed sites with A's... should
-    // take mask into account!
+// Likelihood of one block [start, end) of an ARG whose sequences are
+// compressed.  mask_pos is a search hint into the mask, and base_probs is
+// scratch space with one vector per sequence (or empty).
+// TODO: This fills in compressed sites with A's... should
+// take mask into account!
+static double calc_block_likelihood(
+    const ArgModel *local_model, const Sequences *sequences,
+    const LocalTree *tree, const int *seqids, int start, int end,
+    const SitesMapping* sites_mapping,
+    const TrackNullValue *maskmap_uncompressed, int *mask_pos,
+    vector<vector<BaseProbs> > &base_probs)
+{
+    const int nseqs = sequences->get_num_seqs();
+    const int blocklen = end - start;
+    const char default_char = 'A';
+    const bool have_base_probs = (base_probs.size() > 0);
+    const bool mask_sorted = maskmap_uncompressed->is_sorted();
+    const vector<int> &all_sites = sites_mapping->all_sites;
+
+    // get sequences for trees
+    char *seqs[nseqs];
+    char *matrix = new char [blocklen*nseqs];
+    for (int j=0; j<nseqs; j++)
+        seqs[j] = &matrix[j*blocklen];
+    if (have_base_probs) {
+        for (int j=0; j < nseqs; j++) base_probs[j].clear();
+    }
+
+    // find first site within this block
+    unsigned int i2 = lower_bound(all_sites.begin(), all_sites.end(), start)
+        - all_sites.begin();
+
+    // copy sites into new alignment
+    for (int i=start; i<end; i++) {
+        while (i2 < all_sites.size() && all_sites[i2] < i)
+            i2++;
+        if (i2 < all_sites.size() && i == all_sites[i2]) {
+            // copy site
+            for (int j=0; j<nseqs; j++) {
+                seqs[j][i-start] = sequences->seqs[seqids[j]][i2];
+                if (have_base_probs)
+                    base_probs[j].push_back(BaseProbs(sequences->base_probs[seqids[j]][i2]));
+            }
+        } else {
+            // copy non-variant site
+            char c=default_char;
+            if (maskmap_uncompressed->find(i, mask_pos, mask_sorted))
+                c='N';
+            for (int j=0; j<nseqs; j++) {
+                seqs[j][i-start] = c;
+                if (have_base_probs)
+                    base_probs[j].push_back(BaseProbs(default_char));
+            }
+        }
+    }
+
+    double lnl = likelihood_tree(tree, local_model, seqs, base_probs,
+                                 nseqs, 0, end-start);
+    delete [] matrix;
+    return lnl;
+}
+
+
 // NOTE: trees should be uncompressed and sequences compressed
 //start_coord and end_coord uncompressed, 0 based
 double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
@@ -72,7 +135,6 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
 
     double lnl = 0.0;
     int nseqs = sequences->get_num_seqs();
-    const char default_char = 'A';
 
     if (start_coord < trees->start_coord)
         start_coord = trees->start_coord;
@@ -83,19 +145,14 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
     if (trees->nnodes < 3)
         return lnl += log(.25) * (end_coord - start_coord);
 
-    bool have_base_probs = ( sequences->base_probs.size() > 0 );
     vector<vector<BaseProbs> > base_probs;
-    if (have_base_probs) {
-        for (int j=0; j < nseqs; j++) {
-            base_probs.push_back(vector<BaseProbs>());
-        }
-    }
+    if (sequences->base_probs.size() > 0)
+        base_probs.resize(nseqs);
 
     int end = trees->start_coord;
     int mu_idx = 0;
     int rho_idx = 0;
     int mask_pos=0;
-    bool mask_sorted = maskmap_uncompressed->is_sorted();
     for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
         int start = end;
         end = start + it->blocklen;
@@ -105,61 +162,20 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
             start = start_coord;
         if (end > end_coord)
             end = end_coord;
-        int blocklen = end - start;
-        LocalTree *tree = it->tree;
-
-
-        // get sequences for trees
-        char *seqs[nseqs];
-        char *matrix = new char [blocklen*nseqs];
-        for (int j=0; j<nseqs; j++)
-            seqs[j] = &matrix[j*blocklen];
-        if (have_base_probs) {
-            for (int j=0; j < nseqs; j++) base_probs[j].clear();
-        }
-
-
-        // find first site within this block
-        unsigned int i2 = 0;
-
-        // copy sites into new alignment
-        for (int i=start; i<end; i++) {
-            while (i2 < sites_mapping->all_sites.size() &&
-                   sites_mapping->all_sites[i2] < i)
-                i2++;
-            if (i2 < sites_mapping->all_sites.size() &&
-                i == sites_mapping->all_sites[i2]) {
-                // copy site
-                for (int j=0; j<nseqs; j++) {
-                    seqs[j][i-start] = sequences->seqs[trees->seqids[j]][i2];
-                    if (have_base_probs)
-                        base_probs[j].push_back(BaseProbs(sequences->base_probs[trees->seqids[j]][i2]));
-                }
-            } else {
-                // copy non-variant site
-                char c=default_char;
-                if (maskmap_uncompressed->find(i, &mask_pos, mask_sorted))
-                    c='N';
-                for (int j=0; j<nseqs; j++) {
-                    seqs[j][i-start] = c;
-                    if (have_base_probs)
-                        base_probs[j].push_back(BaseProbs(default_char));
-                }
-            }
-        }
 
         ArgModel local_model;
         model->get_local_model((start+end)/2, local_model,
                                &mu_idx, &rho_idx);
-        lnl += likelihood_tree(tree, &local_model, seqs, base_probs,
-                               nseqs, 0, end-start);
-
-        delete [] matrix;
+        lnl += calc_block_likelihood(&local_model, sequences, it->tree,
+                                     &trees->seqids[0], start, end,
+                                     sites_mapping, maskmap_uncompressed,
+                                     &mask_pos, base_probs);
     }
 
     return lnl;
 }
 
+
 //=============================================================================
 // ARG prior
 
@@ -292,20 +308,32 @@ void calc_coal_rates_spr_self(const ArgModel *model, const LocalTree *tree,
 }
 
 
-void calc_coal_rates_spr(const ArgModel *model, const LocalTree *tree,
-                         const Spr &spr, const LineageCounts &lineages,
-                         double *coal_rates)
+// Returns the number of branches an SPR can coalesce with in half time
+// interval i, and sets 'pop' to the population of the SPR in that interval.
+static inline int count_spr_coal_branches(
+    const ArgModel *model, const LocalTree *tree, const Spr &spr,
+    const LineageCounts &lineages, int i, int *pop)
 {
     /// note broken_age only used for !smc_prime
     int broken_age = tree->nodes[tree->nodes[spr.recomb_node].parent].age;
+    int pop_time = (i+1)/2;
+    int spr_pop = model->get_pop(spr.pop_path, pop_time);
+    int recomb_parent_pop =
+        model->get_pop(tree->nodes[spr.recomb_node].pop_path, pop_time);
+    *pop = spr_pop;
+    return lineages.nbranches_pop[spr_pop][i]
+        - int((!model->smc_prime) && i/2 < broken_age && spr_pop == recomb_parent_pop);
+}
 
+
+void calc_coal_rates_spr(const ArgModel *model, const LocalTree *tree,
+                         const Spr &spr, const LineageCounts &lineages,
+                         double *coal_rates)
+{
     for (int i=spr.recomb_time*2; i<=2*spr.coal_time; i++) {
-        int pop_time = (i+1)/2;
-        int spr_pop = model->get_pop(spr.pop_path, pop_time);
-        int recomb_parent_pop =
-            model->get_pop(tree->nodes[spr.recomb_node].pop_path, pop_time);
-        int nbranches = lineages.nbranches_pop[spr_pop][i]
-            - int((!model->smc_prime) && i/2 < broken_age && spr_pop == recomb_parent_pop);
+        int spr_pop;
+        int nbranches = count_spr_coal_branches(model, tree, spr, lineages,
+                                                i, &spr_pop);
         if (nbranches < 0) {
             // the rates here should never be used in downstream calculations
             coal_rates[i]=0;
@@ -472,6 +500,29 @@ double calc_log_self_recomb_prob(const ArgModel *model, LocalTree *tree,
 }
 
 
+// Prior of the last 'len' sites of a block and of the SPR to the next
+// block (spr=NULL for the last block).  lineages should be counted for
+// 'tree', with one recombination removed at the root age.
+static double calc_block_prior(const ArgModel *local_model,
+                               const LocalTree *tree, const Spr *spr,
+                               LineageCounts &lineages, double treelen,
+                               int len, double **num_coal, double **num_nocoal)
+{
+    double recomb_rate = max(local_model->rho * treelen, local_model->rho);
+
+    if (spr == NULL) {
+        // probability of not recombining after blocklen
+        return - recomb_rate * len;
+    }
+
+    // probability of recombining after blocklen
+    double lnl = log(recomb_rate) - recomb_rate * len;
+    lnl += calc_log_spr_prob(local_model, tree, *spr, lineages, treelen,
+                             num_coal, num_nocoal, 1.0, true);
+    return lnl;
+}
+
+
 // calculate the probability of an ARG given the model parameters
 double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
 		      double **num_coal, double **num_nocoal,
@@ -554,25 +605,281 @@ double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
 
         if (end < end_coord) {
             // not last block
-            // probability of recombining after blocklen
-	    lnl += log(recomb_rate) - recomb_rate * (end - last_pos);
-
-            // get SPR move information
             ++it;
-            const Spr *spr = &it->spr;
-            lnl += calc_log_spr_prob(&local_model, tree, *spr, lineages, treelen,
-                                     num_coal, num_nocoal, 1.0, true);
-
+            lnl += calc_block_prior(&local_model, tree, &it->spr, lineages,
+                                    treelen, end - last_pos,
+                                    num_coal, num_nocoal);
         } else {
             // last block
-            // probability of not recombining after blocklen
-            lnl += - recomb_rate * (end - last_pos);
+            lnl += calc_block_prior(&local_model, tree, NULL, lineages,
+                                    treelen, end - last_pos,
+                                    num_coal, num_nocoal);
             ++it;
         }
     }
     return lnl;
  }
 
+double ArgPriorStats::collect(const ArgModel *model, const LocalTrees *trees)
+{
+    ntimes = model->ntimes;
+    npops = model->num_pops();
+    first_a.assign(npops * ntimes, 0);
+    first_b.assign(npops * ntimes, 0);
+    nocoal_lens.assign(npops * 2 * ntimes, 0.0);
+    recoals.clear();
+
+    // lineages of the first tree (see calc_log_tree_prior)
+    LineageCounts lineages(ntimes, npops);
+    lineages.count(trees->front().tree, model->pop_tree);
+    for (int pop=0; pop < npops; pop++) {
+        for (int i=0; i<ntimes-1; i++) {
+            first_a[pop*ntimes + i] = (lineages.ncoals_pop[pop][i] +
+                                       lineages.nbranches_pop[pop][2*i])/2;
+            first_b[pop*ntimes + i] = lineages.nbranches_pop[pop][2*i];
+        }
+    }
+
+    // coalescent terms of each SPR (see calc_log_spr_prob)
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
+        const LocalTree *tree = it->tree;
+        if (++it == trees->end())
+            break;
+        const Spr &spr = it->spr;
+        if (spr.recomb_node == tree->root ||
+            get_treelen(tree, model->times, ntimes, false) == 0.0)
+            continue;
+        lineages.count(tree, model->pop_tree);
+
+        const int k = spr.recomb_time;
+        const int j = spr.coal_time;
+        int pop;
+        for (int m=2*k; m<2*j-1; m++) {
+            int nbranches = count_spr_coal_branches(model, tree, spr,
+                                                    lineages, m, &pop);
+            if (nbranches > 0)
+                nocoal_lens[pop*2*ntimes + m] +=
+                    model->coal_time_steps[m] * nbranches;
+        }
+
+        if (j < ntimes - 2) {
+            RecoalEvent event;
+            event.time = j;
+            event.nbranches_below = -1;
+            if (j > k)
+                event.nbranches_below = max(count_spr_coal_branches(
+                    model, tree, spr, lineages, 2*j-1, &pop), 0);
+            event.nbranches = max(count_spr_coal_branches(
+                model, tree, spr, lineages, 2*j, &pop), 0);
+            event.pop = pop;
+            recoals[event]++;
+        }
+    }
+
+    double lnl = calc_arg_prior(model, trees);
+    base = lnl - calc_coal_terms(model);
+    return lnl;
+}
+
+
+bool ArgPriorStats::check(const ArgModel *model, const LocalTrees *trees,
+                          double tol) const
+{
+    const double full = calc_arg_prior(model, trees);
+    const double cached = calc_log_prior(model);
+    if (fabs(full - cached) <= tol * fabs(full) + tol)
+        return true;
+    printError("cached ARG prior %f differs from full prior %f",
+               cached, full);
+    return false;
+}
+
+
+double ArgPriorStats::calc_coal_terms(const ArgModel *model) const
+{
+    double lnl = 0.0;
+
+    for (int pop=0; pop < npops; pop++) {
+        for (int i=0; i<ntimes-1; i++) {
+            double t = model->coal_time_steps[2*i];
+            if (i > 0) t += model->coal_time_steps[2*i-1];
+            lnl += log_prob_coal_counts(first_a[pop*ntimes + i],
+                                        first_b[pop*ntimes + i], t,
+                                        2.0 * model->popsizes[pop][2*i]);
+        }
+        for (int m=0; m<2*ntimes; m++) {
+            const double len = nocoal_lens[pop*2*ntimes + m];
+            if (len > 0.0)
+                lnl -= len / (2.0 * model->popsizes[pop][m]);
+        }
+    }
+
+    for (map<RecoalEvent, int>::const_iterator it=recoals.begin();
+         it != recoals.end(); ++it) {
+        const RecoalEvent &event = it->first;
+        const int i = 2 * event.time;
+        double rate = model->coal_time_steps[i] * event.nbranches /
+            (2.0 * model->popsizes[event.pop][i]);
+        if (event.nbranches_below >= 0)
+            rate += model->coal_time_steps[i-1] * event.nbranches_below /
+                (2.0 * model->popsizes[event.pop][i-1]);
+        lnl += it->second * log(1.0 - exp(-rate));
+    }
+
+    return lnl;
+}
+
+
+// Prior of one block of 'blocklen' sites and of the SPR to the next block
+// (real_spr=NULL for the last block), with recombinations that do not
+// change the tree integrated out.
+static double calc_block_prior_recomb_integrate(
+    const ArgModel *model, LocalTree *tree, const Spr *real_spr,
+    LineageCounts &lineages, int blocklen, double rho,
+    double **num_coal, double **num_nocoal)
+{
+    double lnl = 0.0;
+    double treelen = get_treelen(tree, model->times, model->ntimes, false);
+    lineages.count(tree, model->pop_tree);
+    const int root_age = tree->nodes[tree->root].age;
+    lineages.nrecombs[root_age]--;  // SMC' calcs not affected by this
+
+    // calculate probability P(blocklen | T_{i-1})
+    double recomb_rate = max(rho * treelen, rho);
+
+
+    //for single site, probability of no recomb
+    double pr_no_recomb = exp(-recomb_rate);
+    double pr_recomb = 1.0 - pr_no_recomb;
+    double pr_self = 0.0;
+
+    // only do this for smc_prime because under non-smc-prime, recombs to
+    // parent/sister branch that do not change topology are still in ARG
+    if (model->smc_prime)
+        pr_self = pr_recomb * exp(calc_log_self_recomb_prob(model, tree, lineages, treelen));
+    double log_pr_nochange  = log(pr_no_recomb + pr_self);
+
+
+    if (real_spr == NULL)
+        blocklen++;
+    if (blocklen > 1) {
+        lnl += ((double)blocklen - 1.0)*log_pr_nochange;
+    }
+
+    if (real_spr != NULL) {
+        // not last block, add probability of any recomb that results in
+        // same topology as sampled SPR
+        int node = real_spr->recomb_node;
+        int parent = tree->nodes[node].parent;
+        int sib = tree->nodes[parent].child[0] == node ?
+            tree->nodes[parent].child[1] : tree->nodes[parent].child[0];
+        int max_age = min(tree->nodes[parent].age,
+                          real_spr->coal_time);
+        assert(tree->nodes[node].age <= max_age);
+        assert(real_spr->recomb_time >= tree->nodes[node].age &&
+               real_spr->recomb_time <= max_age);
+        if (real_spr->coal_time == tree->nodes[parent].age &&
+            (real_spr->coal_node == parent ||
+             real_spr->coal_node == sib) &&
+            model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
+                               real_spr->recomb_time, real_spr->coal_time)) {
+            lnl += log_pr_nochange;
+            return lnl;
+        }
+
+        // from here we assume that the SPR changes the tree
+        double recomb_sum = 0.0;
+        int target_path = model->consistent_path(tree->nodes[node].pop_path,
+                                                 real_spr->pop_path,
+                                                 tree->nodes[node].age,
+                                                 real_spr->recomb_time,
+                                                 real_spr->coal_time);
+        double coal_rates[2*model->ntimes];
+        int minage = tree->nodes[node].age;
+        bool coalToSib = false;
+        bool coalToParent = false;
+        if (real_spr->coal_node == sib) {
+            if (model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
+                                   real_spr->recomb_time, real_spr->coal_time)) {
+                coalToSib = true;
+                if (tree->nodes[sib].age < minage)
+                    minage = tree->nodes[sib].age;
+            }
+        } else if (real_spr->coal_node == parent) {
+            int path = model->consistent_path(tree->nodes[node].pop_path,
+                                              tree->nodes[parent].pop_path,
+                                              tree->nodes[node].age,
+                                              tree->nodes[parent].age,
+                                              real_spr->coal_time);
+            if (model->paths_equal(path, real_spr->pop_path,
+                                   real_spr->recomb_time, real_spr->coal_time)) {
+                coalToParent = true;
+                if (tree->nodes[sib].age < minage)
+                    minage = tree->nodes[sib].age;
+            }
+        }
+
+        calc_coal_rates_spr(model, tree,
+                            Spr(node, minage, real_spr->coal_node,
+                                real_spr->coal_time, target_path),
+                            lineages, coal_rates);
+        int this_max_age = min(max_age,
+                               model->max_matching_path(tree->nodes[node].pop_path,
+                                                        target_path, tree->nodes[node].age));
+        for (int age=tree->nodes[node].age; age <= this_max_age; age++) {
+            Spr spr(node, age, real_spr->coal_node, real_spr->coal_time,
+                    target_path);
+            double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                               treelen, num_coal, num_nocoal,
+                                               age == real_spr->recomb_time
+                                               ? 1.0 : 0.0, true, coal_rates));
+            recomb_sum += val;
+        }
+        if (coalToSib) {
+            if (! model->paths_equal(target_path, tree->nodes[sib].pop_path,
+                             tree->nodes[sib].age, real_spr->coal_time)) {
+                calc_coal_rates_spr(model, tree,
+                                    Spr(sib, tree->nodes[sib].age,
+                                        node, real_spr->coal_time,
+                                        tree->nodes[sib].pop_path),
+                                    lineages, coal_rates);
+            }
+            for (int age=tree->nodes[sib].age; age <= max_age; age++) {
+                Spr spr(sib, age, node, real_spr->coal_time,
+                        tree->nodes[sib].pop_path);
+                double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                                   treelen, num_coal, num_nocoal,
+                                                   0, true, coal_rates));
+                recomb_sum += val;
+            }
+        } else if (coalToParent) {
+            int path = model->consistent_path(tree->nodes[sib].pop_path,
+                                              tree->nodes[parent].pop_path,
+                                              tree->nodes[sib].age,
+                                              tree->nodes[parent].age,
+                                              real_spr->coal_time);
+            if (! model->paths_equal(path, tree->nodes[sib].pop_path,
+                             tree->nodes[sib].age, real_spr->coal_time)) {
+                calc_coal_rates_spr(model, tree,
+                                    Spr(sib, tree->nodes[sib].age,
+                                        parent, real_spr->coal_time, path),
+                                    lineages, coal_rates);
+            }
+            for (int age=tree->nodes[sib].age; age <= max_age; age++) {
+                Spr spr(sib, age, parent, real_spr->coal_time, path);
+                recomb_sum += exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                                    treelen, num_coal, num_nocoal,
+                                                    0, true, coal_rates));
+            }
+        }
+        lnl += log(pr_recomb * recomb_sum);
+        if (isinf(lnl))
+            assert(0);
+    }
+    return lnl;
+}
+
+
 double calc_arg_prior_recomb_integrate(const ArgModel *model,
                                        const LocalTrees *trees,
                                        double **num_coal, double **num_nocoal,
@@ -612,150 +919,12 @@ double calc_arg_prior_recomb_integrate(const ArgModel *model,
             end = end_coord;
         int blocklen = end - start;
         LocalTree *tree = it->tree;
-        double treelen = get_treelen(tree, model->times, model->ntimes, false);
-        lineages.count(tree, model->pop_tree);
-        const int root_age = tree->nodes[tree->root].age;
-        lineages.nrecombs[root_age]--;  // SMC' calcs not affected by this
-
-        // calculate probability P(blocklen | T_{i-1})
-        double rho = model->get_local_rho(trees->start_coord, &rho_idx);
-        double recomb_rate = max(rho * treelen, rho);
-
-
-        //for single site, probability of no recomb
-        double pr_no_recomb = exp(-recomb_rate);
-        double pr_recomb = 1.0 - pr_no_recomb;
-        double pr_self = 0.0;
-
-        // only do this for smc_prime because under non-smc-prime, recombs to
-        // parent/sister branch that do not change topology are still in ARG
-        if (model->smc_prime)
-            pr_self = pr_recomb * exp(calc_log_self_recomb_prob(model, tree, lineages, treelen));
-        double log_pr_nochange  = log(pr_no_recomb + pr_self);
-
-
-        if (end >= end_coord)
-            blocklen++;
-        if (blocklen > 1) {
-            lnl += ((double)blocklen - 1.0)*log_pr_nochange;
-        }
-
-        if (end < end_coord) {
-            // not last block, add probability of any recomb that results in
-            // same topology as sampled SPR
-
-            // get SPR move information
-            ++it;
-            const Spr *real_spr = &it->spr;
-            int node = real_spr->recomb_node;
-            int parent = tree->nodes[node].parent;
-            int sib = tree->nodes[parent].child[0] == node ?
-                tree->nodes[parent].child[1] : tree->nodes[parent].child[0];
-            int max_age = min(tree->nodes[parent].age,
-                              real_spr->coal_time);
-            assert(tree->nodes[node].age <= max_age);
-            assert(real_spr->recomb_time >= tree->nodes[node].age &&
-                   real_spr->recomb_time <= max_age);
-            if (real_spr->coal_time == tree->nodes[parent].age &&
-                (real_spr->coal_node == parent ||
-                 real_spr->coal_node == sib) &&
-                model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
-                                   real_spr->recomb_time, real_spr->coal_time)) {
-                lnl += log_pr_nochange;
-                continue;
-            }
-
-            // from here we assume that the SPR changes the tree
-            double recomb_sum = 0.0;
-            int target_path = model->consistent_path(tree->nodes[node].pop_path,
-                                                     real_spr->pop_path,
-                                                     tree->nodes[node].age,
-                                                     real_spr->recomb_time,
-                                                     real_spr->coal_time);
-            double coal_rates[2*model->ntimes];
-            int minage = tree->nodes[node].age;
-            bool coalToSib = false;
-            bool coalToParent = false;
-            if (real_spr->coal_node == sib) {
-                if (model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
-                                       real_spr->recomb_time, real_spr->coal_time)) {
-                    coalToSib = true;
-                    if (tree->nodes[sib].age < minage)
-                        minage = tree->nodes[sib].age;
-                }
-            } else if (real_spr->coal_node == parent) {
-                int path = model->consistent_path(tree->nodes[node].pop_path,
-                                                  tree->nodes[parent].pop_path,
-                                                  tree->nodes[node].age,
-                                                  tree->nodes[parent].age,
-                                                  real_spr->coal_time);
-                if (model->paths_equal(path, real_spr->pop_path,
-                                       real_spr->recomb_time, real_spr->coal_time)) {
-                    coalToParent = true;
-                    if (tree->nodes[sib].age < minage)
-                        minage = tree->nodes[sib].age;
-                }
-            }
-
-            calc_coal_rates_spr(model, tree,
-                                Spr(node, minage, real_spr->coal_node,
-                                    real_spr->coal_time, target_path),
-                                lineages, coal_rates);
-            int this_max_age = min(max_age,
-                                   model->max_matching_path(tree->nodes[node].pop_path,
-                                                            target_path, tree->nodes[node].age));
-            for (int age=tree->nodes[node].age; age <= this_max_age; age++) {
-                Spr spr(node, age, real_spr->coal_node, real_spr->coal_time,
-                        target_path);
-                double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                   treelen, num_coal, num_nocoal,
-                                                   age == real_spr->recomb_time
-                                                   ? 1.0 : 0.0, true, coal_rates));
-                recomb_sum += val;
-            }
-            if (coalToSib) {
-                if (! model->paths_equal(target_path, tree->nodes[sib].pop_path,
-                                 tree->nodes[sib].age, real_spr->coal_time)) {
-                    calc_coal_rates_spr(model, tree,
-                                        Spr(sib, tree->nodes[sib].age,
-                                            node, real_spr->coal_time,
-                                            tree->nodes[sib].pop_path),
-                                        lineages, coal_rates);
-                }
-                for (int age=tree->nodes[sib].age; age <= max_age; age++) {
-                    Spr spr(sib, age, node, real_spr->coal_time,
-                            tree->nodes[sib].pop_path);
-                    double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                       treelen, num_coal, num_nocoal,
-                                                       0, true, coal_rates));
-                    recomb_sum += val;
-                }
-            } else if (coalToParent) {
-                int path = model->consistent_path(tree->nodes[sib].pop_path,
-                                                  tree->nodes[parent].pop_path,
-                                                  tree->nodes[sib].age,
-                                                  tree->nodes[parent].age,
-                                                  real_spr->coal_time);
-                if (! model->paths_equal(path, tree->nodes[sib].pop_path,
-                                 tree->nodes[sib].age, real_spr->coal_time)) {
-                    calc_coal_rates_spr(model, tree,
-                                        Spr(sib, tree->nodes[sib].age,
-                                            parent, real_spr->coal_time, path),
-                                        lineages, coal_rates);
-                }
-                for (int age=tree->nodes[sib].age; age <= max_age; age++) {
-                    Spr spr(sib, age, parent, real_spr->coal_time, path);
-                    recomb_sum += exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                        treelen, num_coal, num_nocoal,
-                                                        0, true, coal_rates));
-                }
-            }
-            lnl += log(pr_recomb * recomb_sum);
-	    if (isinf(lnl))
-		assert(0);
-        } else {
-            ++it;
-        }
+        ++it;
+        const Spr *real_spr = (end < end_coord ? &it->spr : NULL);
+        lnl += calc_block_prior_recomb_integrate(
+            model, tree, real_spr, lineages, blocklen,
+            model->get_local_rho(trees->start_coord, &rho_idx),
+            num_coal, num_nocoal);
     }
     assert(!isnan(lnl));
     assert(!isinf(lnl));
@@ -773,6 +942,223 @@ double calc_arg_prior_recomb_integrate(const ArgModel *model,
 
 
 // calculate the probability of the sequences given an ARG
+//=============================================================================
+// per-block cache of ARG probabilities
+
+static inline bool same_spr(const Spr &spr, const Spr &spr2)
+{
+    return spr.recomb_node == spr2.recomb_node &&
+        spr.recomb_time == spr2.recomb_time &&
+        spr.coal_node == spr2.coal_node &&
+        spr.coal_time == spr2.coal_time &&
+        spr.pop_path == spr2.pop_path;
+}
+
+
+bool ArgProbCache::Block::matches(int end2, const LocalTree *tree,
+                                  const Spr *spr2, const int *invis_pos2,
+                                  const Spr *invis2, int ninvis) const
+{
+    if (end != end2 || int(nodes.size()) != 3 * tree->nnodes ||
+        int(invis.size()) != ninvis)
+        return false;
+    if (spr2 == NULL ? !spr.is_null() : !same_spr(spr, *spr2))
+        return false;
+    for (int i=0; i<ninvis; i++) {
+        if (invis_pos[i] != invis_pos2[i] || !same_spr(invis[i], invis2[i]))
+            return false;
+    }
+    for (int i=0; i<tree->nnodes; i++) {
+        if (nodes[3*i] != tree->nodes[i].parent ||
+            nodes[3*i+1] != tree->nodes[i].age ||
+            nodes[3*i+2] != tree->nodes[i].pop_path)
+            return false;
+    }
+    return true;
+}
+
+
+void ArgProbCache::Block::set(int end2, const LocalTree *tree,
+                              const Spr *spr2, const int *invis_pos2,
+                              const Spr *invis2, int ninvis)
+{
+    end = end2;
+    if (spr2)
+        spr = *spr2;
+    else
+        spr.set_null();
+    invis_pos.assign(invis_pos2, invis_pos2 + ninvis);
+    invis.assign(invis2, invis2 + ninvis);
+    nodes.resize(3 * tree->nnodes);
+    for (int i=0; i<tree->nnodes; i++) {
+        nodes[3*i] = tree->nodes[i].parent;
+        nodes[3*i+1] = tree->nodes[i].age;
+        nodes[3*i+2] = tree->nodes[i].pop_path;
+    }
+}
+
+
+void ArgProbCache::calc(const ArgModel *model, const Sequences *sequences,
+                        const LocalTrees *trees,
+                        const SitesMapping *sites_mapping,
+                        const TrackNullValue *maskmap_uncompressed,
+                        double *prior, double *prior2, double *likelihood,
+                        const vector<int> &invisible_recomb_pos,
+                        const vector<Spr> &invisible_recombs)
+{
+    const int ninvis = invisible_recombs.size();
+    assert(ninvis == (int) invisible_recomb_pos.size());
+
+    // special case for trunk genealogies
+    if (trees->nnodes < 3) {
+        *prior = calc_arg_prior(model, trees, NULL, NULL, -1, -1,
+                                invisible_recomb_pos, invisible_recombs);
+        *prior2 = calc_arg_prior_recomb_integrate(model, trees, NULL, NULL,
+                                                  NULL);
+        if (likelihood)
+            *likelihood = calc_arg_likelihood(model, sequences, trees,
+                                              sites_mapping,
+                                              maskmap_uncompressed);
+        return;
+    }
+
+    // model parameters that the terms depend on
+    vector<double> params2;
+    params2.push_back(model->rho);
+    params2.push_back(model->mu);
+    for (int pop=0; pop < model->num_pops(); pop++)
+        for (int i=0; i < 2*model->ntimes-1; i++)
+            params2.push_back(model->popsizes[pop][i]);
+    if (model->pop_tree) {
+        const vector<MigMatrix> &mig = model->pop_tree->mig_matrix;
+        for (unsigned int i=0; i<mig.size(); i++)
+            params2.insert(params2.end(), mig[i].mat,
+                           mig[i].mat + mig[i].npop * mig[i].npop);
+    }
+    const int nseqs = sequences->get_num_seqs();
+    char *seqs2[nseqs];
+    for (int j=0; j<nseqs; j++)
+        seqs2[j] = sequences->seqs[trees->seqids[j]];
+
+    if (params2 != params || trees->seqids != seqids ||
+        sequences != this->sequences ||
+        sequences->generation != generation ||
+        (likelihood && !have_likelihood)) {
+        blocks.clear();
+        params.swap(params2);
+        seqids = trees->seqids;
+        this->sequences = sequences;
+        generation = sequences->generation;
+        have_likelihood = (likelihood != NULL);
+    }
+    vector<vector<BaseProbs> > base_probs;
+    if (sites_mapping && sequences->base_probs.size() > 0)
+        base_probs.resize(nseqs);
+
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    double lnl_prior = calc_log_tree_prior(model, trees->front().tree,
+                                           lineages);
+    double lnl_prior2 = lnl_prior;
+    double lnl = 0.0;
+
+    unordered_map<int, Block> blocks2;
+    int end = trees->start_coord;
+    int mu_idx = 0, rho_idx = 0, rho_idx2 = 0, mask_pos = 0;
+    int invis_start = 0;
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
+        const int start = end;
+        end += it->blocklen;
+        LocalTree *tree = it->tree;
+        ++it;
+        const Spr *spr = (it != trees->end() ? &it->spr : NULL);
+
+        // invisible recombinations within the block
+        int invis_end = invis_start;
+        while (invis_end < ninvis && invisible_recomb_pos[invis_end] < end)
+            invis_end++;
+        const int *invis_pos = invisible_recomb_pos.data() + invis_start;
+        const Spr *invis = invisible_recombs.data() + invis_start;
+        const int nblock_invis = invis_end - invis_start;
+        invis_start = invis_end;
+
+        Block &block = blocks2[start];
+        unordered_map<int, Block>::iterator cached = blocks.find(start);
+        if (cached != blocks.end() &&
+            cached->second.matches(end, tree, spr, invis_pos, invis,
+                                   nblock_invis)) {
+            swap(block, cached->second);
+            nhits++;
+        } else {
+            block.set(end, tree, spr, invis_pos, invis, nblock_invis);
+            nmisses++;
+
+            ArgModel local_model;
+            model->get_local_model((start+end)/2, local_model,
+                                   &mu_idx, &rho_idx);
+            double treelen = get_treelen(tree, model->times, model->ntimes,
+                                         false);
+            lineages.count(tree, model->pop_tree);
+            lineages.nrecombs[tree->nodes[tree->root].age]--;
+
+            // prior terms in the order of calc_arg_prior
+            double recomb_rate = max(local_model.rho * treelen,
+                                     local_model.rho);
+            int last_pos = start;
+            block.invis_prior.clear();
+            for (int i=0; i<nblock_invis; i++) {
+                block.invis_prior.push_back(
+                    log(recomb_rate) - recomb_rate * (invis_pos[i] - last_pos));
+                last_pos = invis_pos[i];
+                block.invis_prior.push_back(calc_log_spr_prob(
+                    &local_model, tree, invis[i], lineages, treelen,
+                    NULL, NULL, 1.0, true));
+            }
+            block.prior = calc_block_prior(&local_model, tree, spr, lineages,
+                                           treelen, end - last_pos,
+                                           NULL, NULL);
+            block.prior2 = calc_block_prior_recomb_integrate(
+                model, tree, spr, lineages, end - start,
+                model->get_local_rho(trees->start_coord, &rho_idx2),
+                NULL, NULL);
+            if (!likelihood)
+                block.likelihood = 0.0;
+            else if (sites_mapping)
+                block.likelihood = calc_block_likelihood(
+                    &local_model, sequences, tree, &trees->seqids[0],
+                    start, end, sites_mapping, maskmap_uncompressed,
+                    &mask_pos, base_probs);
+            else
+                block.likelihood = likelihood_tree(
+                    tree, &local_model, seqs2, sequences->base_probs, nseqs,
+                    start, end);
+        }
+
+        for (unsigned int i=0; i<block.invis_prior.size(); i++)
+            lnl_prior += block.invis_prior[i];
+        lnl_prior += block.prior;
+        lnl_prior2 += block.prior2;
+        lnl += block.likelihood;
+    }
+    blocks.swap(blocks2);
+
+    *prior = lnl_prior;
+    *prior2 = lnl_prior2;
+    if (likelihood)
+        *likelihood = lnl;
+
+#ifdef DEBUG
+    assert(*prior == calc_arg_prior(model, trees, NULL, NULL, -1, -1,
+                                    invisible_recomb_pos, invisible_recombs));
+    assert(*prior2 == calc_arg_prior_recomb_integrate(model, trees, NULL,
+                                                      NULL, NULL));
+    assert(!likelihood ||
+           *likelihood == calc_arg_likelihood(model, sequences, trees,
+                                              sites_mapping,
+                                              maskmap_uncompressed));
+#endif
+}
+
+
 double calc_arg_joint_prob(const ArgModel *model, const Sequences *sequences,
                            const LocalTrees *trees)
 {
@@ -1,6 +1,12 @@
 #ifndef ARGWEAVER_TOTAL_PROB_H
 #define ARGWEAVER_TOTAL_PROB_H
 
+// c++ includes
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include "local_tree.h"
 #include "model.h"
 
@@ -45,6 +51,127 @@ double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
                       int start_coord = -1, int end_coord = -1,
                       const vector<int> &invisible_recomb_pos=vector<int>(),
                       const vector<Spr> &invisible_recombs=vector<Spr>());
+
+
+// Sufficient statistics of an ARG for its prior (calc_arg_prior) as a
+// function of the population sizes.  Only the coalescent terms of the prior
+// depend on the population sizes: the tree prior of the first tree and, for
+// every SPR, the probability of not coalescing before the re-coalescence
+// interval and of coalescing within it.  Once collected, the prior for new
+// model->popsizes is recomputed without walking the trees, as long as the
+// ARG and the other model parameters stay the same.
+class ArgPriorStats
+{
+public:
+    ArgPriorStats() : ntimes(0), npops(0), base(0.0) {}
+
+    // Collect statistics for an ARG and return its prior under the
+    // current population sizes
+    double collect(const ArgModel *model, const LocalTrees *trees);
+
+    // Returns the prior of the collected ARG under model->popsizes
+    double calc_log_prior(const ArgModel *model) const {
+        return base + calc_coal_terms(model);
+    }
+
+    // Returns whether calc_log_prior agrees with a full recomputation of
+    // the prior by calc_arg_prior within relative tolerance 'tol'
+    bool check(const ArgModel *model, const LocalTrees *trees,
+               double tol=1e-8) const;
+
+protected:
+    // log probability of the popsize-dependent terms of the prior
+    double calc_coal_terms(const ArgModel *model) const;
+
+    // Re-coalescence of an SPR in time interval 'time' of population 'pop'.
+    // nbranches and nbranches_below are the numbers of branches available
+    // in the half intervals 2*time and 2*time-1 (-1 if the SPR starts at
+    // 'time').
+    struct RecoalEvent {
+        int pop, time, nbranches, nbranches_below;
+
+        bool operator<(const RecoalEvent &other) const {
+            if (pop != other.pop) return pop < other.pop;
+            if (time != other.time) return time < other.time;
+            if (nbranches != other.nbranches)
+                return nbranches < other.nbranches;
+            return nbranches_below < other.nbranches_below;
+        }
+    };
+
+    int ntimes;
+    int npops;
+    double base;                 // prior minus popsize-dependent terms
+    vector<int> first_a;         // [npops][ntimes] lineages of the first
+    vector<int> first_b;         // tree entering and leaving each interval
+    vector<double> nocoal_lens;  // [npops][2*ntimes] branch length summed
+                                 // over non-coalescing SPR intervals
+    map<RecoalEvent, int> recoals; // number of SPRs with each re-coalescence
+};
+
+
+// Per-block cache of the prior and likelihood terms of an ARG.  The terms
+// of a block are reused as long as its coordinates, local tree, SPR to the
+// next block and invisible recombinations are unchanged, so only the blocks
+// touched by resampling since the last call are recomputed.  A change of model parameters or of
+// sequences (a new Sequences::generation, e.g. after sampling phase)
+// clears the cache.  Totals are summed in the same order as
+// calc_arg_prior, calc_arg_prior_recomb_integrate and calc_arg_likelihood,
+// and are identical to them.
+// NOTE: trees should be uncompressed and sequences compressed
+class ArgProbCache
+{
+public:
+    ArgProbCache() :
+        sequences(NULL), generation(0), have_likelihood(false),
+        nhits(0), nmisses(0)
+    {}
+
+    // Compute the prior (calc_arg_prior with the given invisible
+    // recombinations), the prior with recombinations integrated out and the
+    // likelihood of an ARG.  If likelihood is NULL, it is not computed.
+    void calc(const ArgModel *model, const Sequences *sequences,
+              const LocalTrees *trees, const SitesMapping *sites_mapping,
+              const TrackNullValue *maskmap_uncompressed,
+              double *prior, double *prior2, double *likelihood,
+              const vector<int> &invisible_recomb_pos=vector<int>(),
+              const vector<Spr> &invisible_recombs=vector<Spr>());
+
+    void clear() { blocks.clear(); }
+
+protected:
+    // terms of one block
+    struct Block {
+        bool matches(int end, const LocalTree *tree, const Spr *spr,
+                     const int *invis_pos, const Spr *invis,
+                     int ninvis) const;
+        void set(int end, const LocalTree *tree, const Spr *spr,
+                 const int *invis_pos, const Spr *invis, int ninvis);
+
+        int end;
+        Spr spr;             // SPR to the next block (null for last block)
+        vector<int> nodes;   // parent, age and pop_path of each node
+        vector<int> invis_pos;  // invisible recombinations within the block
+        vector<Spr> invis;
+        vector<double> invis_prior;  // their prior terms, in order
+        double prior;
+        double prior2;
+        double likelihood;
+    };
+
+    unordered_map<int, Block> blocks;  // blocks by start coordinate
+    vector<double> params;   // model parameters of the cached terms
+    vector<int> seqids;      // sequence IDs of the cached terms
+    const Sequences *sequences;  // sequences of the cached terms
+    int generation;          // generation of the cached sequences
+    bool have_likelihood;    // whether blocks have likelihoods
+
+public:
+    int nhits;
+    int nmisses;
+};
+
+
 double calc_arg_joint_prob(const ArgModel *model, const Sequences *sequences,
                            const LocalTrees *trees);
 
@@ -15,7 +15,8 @@ void TransMatrix::initialize(const ArgModel *model, int nstates)
     npaths = model->num_pop_paths();
     smc_prime = model->smc_prime;
     pop_tree = model->pop_tree;
-    int data_len=0;
+    root_age_index = -1;
+    data_len = 0;
     if (smc_prime) {
         data_len = npaths * ntimes + 2 * ntimes;
     } else {
@@ -85,11 +86,55 @@ void TransMatrix::initialize(const ArgModel *model, int nstates)
     assert(idx == data_len);
 }
 
+
+void TransMatrix::copy(const TransMatrix &other)
+{
+    assert(smc_prime == other.smc_prime && data_len == other.data_len);
+    assert(!smc_prime || nstates == other.nstates);
+    nstates = other.nstates;
+    internal = other.internal;
+    minage = other.minage;
+    root_age_index = other.root_age_index;
+    lineage_counts = other.lineage_counts;
+    last_pop_paths = other.last_pop_paths;
+    for (int i=0; i<data_len; i++)
+        data_alloc[i] = other.data_alloc[i];
+
+    C1_prime->copy(*other.C1_prime);
+    Q1_prime->copy(*other.Q1_prime);
+    if (smc_prime) {
+        C0_prime->copy(*other.C0_prime);
+        Q0_prime->copy(*other.Q0_prime);
+        B0_prime->copy(*other.B0_prime);
+        B1_prime->copy(*other.B1_prime);
+        B2_prime->copy(*other.B2_prime);
+        G0_prime->copy(*other.G0_prime);
+        G1_prime->copy(*other.G1_prime);
+        G2_prime->copy(*other.G2_prime);
+        E0_prime->copy(*other.E0_prime);
+        E1_prime->copy(*other.E1_prime);
+        E2_prime->copy(*other.E2_prime);
+        F0_prime->copy(*other.F0_prime);
+        F1_prime->copy(*other.F1_prime);
+        F2_prime->copy(*other.F2_prime);
+        L0_prime->copy(*other.L0_prime);
+        L1_prime->copy(*other.L1_prime);
+        L2_prime->copy(*other.L2_prime);
+        K0_prime->copy(*other.K0_prime);
+        K1_prime->copy(*other.K1_prime);
+        K2_prime->copy(*other.K2_prime);
+        RK0_prime->copy(*other.RK0_prime);
+        RK2_prime->copy(*other.RK2_prime);
+        for (int i=0; i<nstates; i++)
+            self_recomb[i] = other.self_recomb[i];
+    }
+}
+
 void calc_coal_rates_partial_tree(const ArgModel *model, const LocalTree *tree,
                                   const LineageCounts *lineages,
                                   MultiArray *coal_rates,
                                   MultiArray *coal_rates_noprime,
-                                  bool *do_path, int minage)
+                                  bool *do_path, int minage, int start=0)
 {
     if (model->smc_prime) {
         for (int path=0; path < model->num_pop_paths(); path++) {
@@ -122,7 +167,7 @@ void calc_coal_rates_partial_tree(const ArgModel *model, const LocalTree *tree,
             if (do_path != NULL && do_path[path] == false) continue;
             for (int path2=0; path2 < model->num_pop_paths(); path2++) {
                 if (do_path != NULL && do_path[path2] == false) continue;
-                for (int i=0; i<2*model->ntimes-1; i++) {
+                for (int i=start; i<2*model->ntimes-1; i++) {
                     int pop = model->get_pop(path, (i+1)/2);
                     int pop2 = model->get_pop(path2, (i+1)/2);
                     int nbranch = lineages->nbranches_pop[pop][i];
@@ -219,8 +264,8 @@ double TransMatrix::selfRecombDiffTimeProb(int min_k, int max_k,
                                            int max_d, int path_d,
                                            int a, int path_a) const {
     if (min_k > max_k) return -INFINITY;
-    static int count=0;
-    static int total_count=0;
+    static thread_local int count=0;
+    static thread_local int total_count=0;
     total_count++;
     assert(max_k < max_d);
     double kstar = get_k_term(max_d, path_d, a, path_a);   // not log space
@@ -259,7 +304,9 @@ inline double TransMatrix::self_recomb_prob(int a, int path_a,
     //    use state_time : 1 = branch_start, 2=branch_start+1, ...,
     //        1 + branch_end -branch_start = branch_end,
     //        2 + branch_end - branch_start for > branch_end
-    static MultiArray branchProbs(5, npaths, ntimes, ntimes, npaths, ntimes);
+    // one table per thread, since matrices may be computed concurrently
+    static thread_local MultiArray branchProbs(5, npaths, ntimes, ntimes,
+                                               npaths, ntimes);
     if (path_a == -1 && path_d == -1)
         branchProbs.set_all(-1.0);
     int age_idx = ( a > max_d ? max_d - min_d + 2 :
@@ -774,9 +821,93 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
                                        internal0, minage0);
         return;
     }
+    calc_transition_probs_smc(tree, model, states, lineages,
+                              internal0, minage0, false);
+}
+
+
+// Update a transition matrix holding the terms of another block (usually
+// the previous one) to a new block.
+void TransMatrix::update_transition_probs(const LocalTree *tree,
+                                          const ArgModel *model,
+                                          const States &states,
+                                          const LineageCounts *lineages,
+                                          bool internal0, int minage0)
+{
+    if (model->smc_prime) {
+        calc_transition_probs_smcPrime(tree, model, states, lineages,
+                                       internal0, minage0);
+        return;
+    }
+    calc_transition_probs_smc(tree, model, states, lineages,
+                              internal0, minage0, true);
+}
+
+
+// Pack lineage counts for comparing them between blocks
+static void pack_lineage_counts(const LineageCounts *lineages,
+                                vector<int> &counts)
+{
+    const int ntimes = lineages->ntimes;
+    counts.clear();
+    counts.insert(counts.end(), lineages->nbranches,
+                  lineages->nbranches + ntimes);
+    counts.insert(counts.end(), lineages->nrecombs,
+                  lineages->nrecombs + ntimes);
+    for (int i=0; i<lineages->npops; i++)
+        counts.insert(counts.end(), lineages->ncoals_pop[i],
+                      lineages->ncoals_pop[i] + ntimes);
+    for (int i=0; i<lineages->npops; i++)
+        counts.insert(counts.end(), lineages->nbranches_pop[i],
+                      lineages->nbranches_pop[i] + 2*ntimes);
+}
+
+
+// Returns the first time index whose terms differ between matrices built
+// from the lineage counts counts1 and counts2 (see pack_lineage_counts)
+static int first_changed_time(const vector<int> &counts1,
+                              const vector<int> &counts2,
+                              int ntimes, int npops)
+{
+    int start = ntimes;
+
+    // per time counts: nbranches, nrecombs, ncoals_pop
+    const int ntime_counts = (2 + npops) * ntimes;
+    for (int i=0; i<ntime_counts; i++)
+        if (counts1[i] != counts2[i])
+            start = min(start, i % ntimes);
+
+    // half time counts: nbranches_pop change the coalescent rates, which
+    // enter the terms of time b through half times 2b-2 and above
+    for (int i=ntime_counts; i<int(counts1.size()); i++) {
+        if (counts1[i] != counts2[i]) {
+            const int h = (i - ntime_counts) % (2*ntimes);
+            start = min(start, (h + 1) / 2);
+        }
+    }
+
+    return start;
+}
+
+
+// Calculate transition probabilities for SMC.  If update is true, the
+// matrix holds the terms of another block and only the terms at or above
+// the first time whose inputs changed are recomputed.  Cumulative terms
+// below that time are unchanged.
+void TransMatrix::calc_transition_probs_smc(const LocalTree *tree,
+                                            const ArgModel *model,
+                                            const States &states,
+                                            const LineageCounts *lineages,
+                                            bool internal0, int minage0,
+                                            bool update)
+{
     assert(!model->smc_prime);
+    const bool last_internal = internal;
+    const int last_minage = minage;
+    const int last_root_age_index = root_age_index;
     internal = internal0;
     minage = minage0;
+    nstates = states.size();
     // get model parameters
     const int ntimes = model->ntimes;
     const double *times = model->times;
@@ -801,7 +932,6 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
     } else have_pop_path[0] = true;
 
     // determine tree information: root, root age, tree length
-    int root_age_index;
     double root_age;
     double treelen;
     if (internal) {
@@ -817,15 +947,33 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
         treelen = get_treelen(tree, times, ntimes, false);
     }
 
+    // find the first time whose terms change
+    vector<int> counts;
+    pack_lineage_counts(lineages, counts);
+    int start = 0;
+    if (update && last_internal == internal && last_minage == minage &&
+        lineage_counts.size() == counts.size() &&
+        int(last_pop_paths.size()) == num_paths &&
+        equal(have_pop_path, have_pop_path + num_paths,
+              last_pop_paths.begin())) {
+        start = first_changed_time(lineage_counts, counts, ntimes,
+                                   lineages->npops);
+        if (last_root_age_index != root_age_index)
+            start = min(start, min(last_root_age_index, root_age_index));
+    }
+    const int half_start = max(2*start - 2, 0);
+    lineage_counts.swap(counts);
+    last_pop_paths.assign(have_pop_path, have_pop_path + num_paths);
+
     calc_coal_rates_partial_tree(model, tree, lineages,
                                  Q1_prime, Q0_prime,
-                                 have_pop_path, minage);
+                                 have_pop_path, minage, half_start);
 
     // compute cumulative coalescent rates
     for (int i=0; i < num_paths; i++) {
         for (int j=0; j < num_paths; j++) {
             if (have_pop_path[i] && have_pop_path[j]) {
-                for (int b=0; b < 2*ntimes - 1; b++)
+                for (int b=half_start; b < 2*ntimes - 1; b++)
                     C1_prime->set(C1_prime->get(i, j, b-1)
                                   + Q1_prime->get(i, j, b),
                                   i, j, b);
@@ -854,7 +1002,7 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
 
     for (int path=0; path < num_paths; path++) {
         if (! have_pop_path[path]) continue;
-        for (int b=0; b < ntimes-1; b++) {
+        for (int b=start; b < ntimes-1; b++) {
             double curr_path_prob = model->path_prob(path, 0, b);
             path_prob[path][b] = curr_path_prob;
             int pop = model->get_pop(path, b);
@@ -906,6 +1054,166 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
     }
 }
 
+//=============================================================================
+// transition matrix memo
+
+// append the raw bytes of values to a memo key
+template <class T>
+static inline void append_key(string &key, const T *values, int n)
+{
+    key.append((const char*) values, n * sizeof(T));
+}
+
+
+// Returns the memo key of a transition matrix, i.e. all inputs of
+// TransMatrix::calc_transition_probs that can differ between blocks
+static string transmat_key(const LocalTree *tree, const ArgModel *model,
+                           const States &states,
+                           const LineageCounts *lineages,
+                           bool internal, int minage)
+{
+    const int ntimes = model->ntimes;
+    const double *times = model->times;
+    const LocalNode *nodes = tree->nodes;
+    const int subtree_root = internal ? nodes[tree->root].child[0] : -1;
+
+    // determine tree information: root age, tree length
+    int root_age_index;
+    double treelen;
+    if (internal) {
+        const int maintree_root = nodes[tree->root].child[1];
+        root_age_index = nodes[maintree_root].age;
+        treelen = get_treelen_internal(tree, times, ntimes) -
+            times[nodes[subtree_root].age];
+        minage = max(minage, nodes[subtree_root].age);
+    } else {
+        root_age_index = nodes[tree->root].age;
+        treelen = get_treelen(tree, times, ntimes, false);
+    }
+
+    string key;
+    const int header[] = {model->smc_prime, internal, minage,
+                          int(states.size()), root_age_index,
+                          ntimes, lineages->npops};
+    append_key(key, header, 7);
+    append_key(key, &model->rho, 1);
+    append_key(key, &treelen, 1);
+
+    // lineage counts
+    append_key(key, lineages->nbranches, ntimes);
+    append_key(key, lineages->nrecombs, ntimes);
+    for (int i=0; i<lineages->npops; i++) {
+        append_key(key, lineages->ncoals_pop[i], ntimes);
+        append_key(key, lineages->nbranches_pop[i], 2*ntimes);
+    }
+
+    // population paths in use
+    const int num_paths = model->num_pop_paths();
+    if (num_paths > 1) {
+        vector<char> have_pop_path(num_paths, 0);
+        for (unsigned int i=0; i < states.size(); i++)
+            have_pop_path[states[i].pop_path] = 1;
+        for (int i=0; i < tree->nnodes; i++) {
+            if (i != subtree_root)
+                have_pop_path[nodes[i].pop_path] = 1;
+        }
+        append_key(key, &have_pop_path[0], num_paths);
+    }
+
+    // self recombination probabilities of SMC' depend on every branch
+    // and state
+    if (model->smc_prime) {
+        append_key(key, &tree->root, 1);
+        for (int i=0; i < tree->nnodes; i++) {
+            const int node[] = {nodes[i].parent, nodes[i].age,
+                                nodes[i].pop_path};
+            append_key(key, node, 3);
+        }
+        for (unsigned int i=0; i < states.size(); i++) {
+            const int state[] = {states[i].node, states[i].time,
+                                 states[i].pop_path};
+            append_key(key, state, 3);
+        }
+    }
+
+    return key;
+}
+
+
+TransMatrix *TransMatrixMemo::calc_transition_probs(
+    const LocalTree *tree, const ArgModel *model, const States &states,
+    const LineageCounts *lineages, bool internal, int minage)
+{
+    const string key = transmat_key(tree, model, states, lineages,
+                                    internal, minage);
+    TransMatrix *matrix = new TransMatrix(model, states.size());
+    bool update = false;
+    {
+        unique_lock<mutex> guard(lock);
+        unordered_map<string, TransMatrix*>::iterator it = entries.find(key);
+        if (it != entries.end()) {
+            nhits++;
+            matrix->copy(*it->second);
+            return matrix;
+        }
+        nmisses++;
+
+        // start from the last matrix, which usually belongs to the
+        // previous block
+        if (last && !model->smc_prime) {
+            matrix->copy(*last);
+            update = true;
+            nupdates++;
+        }
+    }
+
+    if (update) {
+        matrix->update_transition_probs(tree, model, states, lineages,
+                                        internal, minage);
+#ifdef DEBUG
+        // an update must agree with a full rebuild
+        TransMatrix full(model, states.size());
+        full.calc_transition_probs(tree, model, states, lineages,
+                                   internal, minage);
+        for (unsigned int i=0; i<states.size(); i++)
+            for (unsigned int j=0; j<states.size(); j++)
+                assert(full.get(tree, states, i, j) ==
+                       matrix->get(tree, states, i, j));
+#endif
+    } else {
+        matrix->calc_transition_probs(tree, model, states, lineages,
+                                      internal, minage);
+    }
+    TransMatrix *entry = new TransMatrix(model, states.size());
+    entry->copy(*matrix);
+
+    unique_lock<mutex> guard(lock);
+    if (int(entries.size()) >= max_entries) {
+        for (unordered_map<string, TransMatrix*>::iterator it =
+                 entries.begin(); it != entries.end(); ++it)
+            delete it->second;
+        entries.clear();
+        last = NULL;
+    }
+    if (entries.insert(make_pair(key, entry)).second)
+        last = entry;
+    else
+        delete entry;
+    return matrix;
+}
+
+
+void TransMatrixMemo::clear()
+{
+    unique_lock<mutex> guard(lock);
+    for (unordered_map<string, TransMatrix*>::iterator it = entries.begin();
+         it != entries.end(); ++it)
+        delete it->second;
+    entries.clear();
+    last = NULL;
+}
+
+
     /*inline double TransMatrix::get_time(int a, int b, int c,
                              int path_a, int path_b, int path_c,
                              int minage, bool same_node, int state_a) const
@@ -966,7 +1274,7 @@ void get_deterministic_transitions(
     // recomb_node in tree and last_tree
     // coal_node in last_tree
 #ifdef DEBUG
-    static int count=0;
+    static thread_local int count=0;
     count++;
 #endif
 
@@ -1619,8 +1927,78 @@ double calc_recomb_recoal(
 }
 
 
-// Calculate the switch transition matrix.
-void calc_transition_probs_switch(
+void TransMatrixSwitch::compress()
+{
+    // if state space is size zero, we still treat it as size 1
+    const int n1 = max(nstates1, 1);
+    const int n2 = max(nstates2, 1);
+
+    row_state.clear();
+    row_start.clear();
+    row_cols.clear();
+    row_vals.clear();
+
+    // deterministic transitions
+    for (int j=0; j<n1; j++) {
+        const int k = determ[j];
+        if (k != -1 && recombsrc[j] < 0 && recoalsrc[j] < 0 &&
+            determprob[j] != 0.0) {
+            row_state.push_back(j);
+            row_start.push_back(row_cols.size());
+            row_cols.push_back(k);
+            row_vals.push_back(determprob[j]);
+        }
+    }
+
+    // recombination and then recoalescence sources
+    for (int src=0; src<2; src++) {
+        for (int j=0; j<n1; j++) {
+            if ((src == 0 ? recombsrc[j] : recoalsrc[j]) < 0)
+                continue;
+            row_state.push_back(j);
+            row_start.push_back(row_cols.size());
+            for (int k=0; k<n2; k++) {
+                const double val = get(j, k);
+                if (val > 0) {
+                    row_cols.push_back(k);
+                    row_vals.push_back(val);
+                }
+            }
+        }
+    }
+    row_start.push_back(row_cols.size());
+
+    // transpose, visiting source states in increasing order
+    const int nrows = row_state.size();
+    vector<int> state_row(n1, -1);
+    for (int r=0; r<nrows; r++)
+        state_row[row_state[r]] = r;
+
+    col_start.assign(n2 + 1, 0);
+    for (unsigned int e=0; e<row_cols.size(); e++)
+        col_start[row_cols[e] + 1]++;
+    for (int k=0; k<n2; k++)
+        col_start[k + 1] += col_start[k];
+
+    vector<int> fill(col_start.begin(), col_start.end() - 1);
+    col_rows.resize(row_cols.size());
+    col_vals.resize(row_vals.size());
+    for (int j=0; j<n1; j++) {
+        const int r = state_row[j];
+        if (r == -1)
+            continue;
+        for (int e=row_start[r]; e<row_start[r + 1]; e++) {
+            const int i = fill[row_cols[e]]++;
+            col_rows[i] = j;
+            col_vals[i] = row_vals[e];
+        }
+    }
+}
+
+
+// Fill in the deterministic transitions and the recombination and
+// recoalescence source rows of the switch transition matrix.
+static void calc_transition_probs_switch_rows(
     const LocalTree *tree, const LocalTree *last_tree,
     const Spr &spr, const int *mapping,
     const States &states1, const States &states2,
@@ -1641,7 +2019,7 @@ void calc_transition_probs_switch(
     const int last_subtree_root = internal ? last_nodes[last_root].child[0] : -1;
     const int minage1 = internal ? last_nodes[last_subtree_root].age : 0;
     const int minage2 = internal ?  nodes[subtree_root].age : 0;
-    static int count=0;
+    static thread_local int count=0;
     count++;
 
     //    printf("calc_transition_probs_switch internal=%i\n", internal);
@@ -2048,6 +2426,21 @@ void calc_transition_probs_switch(
 }
 
 
+// Calculate the switch transition matrix.
+void calc_transition_probs_switch(
+    const LocalTree *tree, const LocalTree *last_tree,
+    const Spr &spr, const int *mapping,
+    const States &states1, const States &states2,
+    const ArgModel *model, const LineageCounts *lineages,
+    TransMatrixSwitch *transmat_switch, bool internal)
+{
+    calc_transition_probs_switch_rows(tree, last_tree, spr, mapping,
+                                      states1, states2, model, lineages,
+                                      transmat_switch, internal);
+    transmat_switch->compress();
+}
+
+
 void calc_transition_probs_switch_internal(
     const LocalTree *tree, const LocalTree *last_tree,
     const Spr &spr, const int *mapping,
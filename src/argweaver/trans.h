@@ -4,6 +4,11 @@
 #ifndef ARGWEAVER_TRANS_H
 #define ARGWEAVER_TRANS_H
 
+// c++ includes
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
 #include "common.h"
 #include "local_tree.h"
 #include "model.h"
@@ -79,6 +84,10 @@ public:
     // and initialize paths_equal matrix
     void initialize(const ArgModel *model, int nstates);
 
+    // Copy all terms from a matrix computed for the same model and number
+    // of states.
+    void copy(const TransMatrix &other);
+
     // Probability of transition from state i to state j.
     inline double get(
         const LocalTree *tree, const States &states, int i, int j) const
@@ -343,6 +352,18 @@ public:
                                bool internal0=false,
                                int minage0=0);
 
+    // Same as calc_transition_probs, but the matrix must already hold the
+    // terms of another block of the same model (e.g. copied from the
+    // previous block).  For SMC, only the terms at or above the first time
+    // where the lineage counts or root age differ are recomputed, since
+    // the cumulative terms below it are unchanged.
+    void update_transition_probs(const LocalTree *tree,
+                                 const ArgModel *model,
+                                 const States &states,
+                                 const LineageCounts *lineages,
+                                 bool internal0=false,
+                                 int minage0=0);
+
 
     int ntimes;
     int nstates;
@@ -352,8 +373,14 @@ public:
                     // an internal branch).
 
     bool smc_prime;
+    int root_age_index;  // Age of the root (of the main tree if internal)
 
     double *data_alloc;
+    int data_len;
+
+    // inputs of the last calculation, for update_transition_probs
+    vector<int> lineage_counts;
+    vector<bool> last_pop_paths;
 
     // Intermediate terms in calculating entries in the full transition matrix
 
@@ -414,10 +441,62 @@ public:
                             int path_d) const;
     void calc_self_recomb_probs_smcPrime(const LocalTree *tree,
                                          const States &states);
+    void calc_transition_probs_smc(const LocalTree *tree,
+                                   const ArgModel *model,
+                                   const States &states,
+                                   const LineageCounts *lineages,
+                                   bool internal0, int minage0,
+                                   bool update);
 
 };
 
 
+// Memo of computed transition matrices, keyed on everything that
+// TransMatrix::calc_transition_probs depends on: rho, the lineage counts,
+// the root age and tree length, internal/minage, the population paths in
+// use and, for SMC', the tree and states themselves.  Consecutive blocks
+// often have the same key once the thread being resampled is removed, so
+// their matrices are copied instead of recomputed.  On a miss, the last
+// computed matrix is updated to the new block (see
+// TransMatrix::update_transition_probs).  All matrices in one memo must
+// come from the same model apart from mu and rho.  The memo may be shared
+// between threads.
+class TransMatrixMemo
+{
+public:
+    TransMatrixMemo(int max_entries=256) :
+        max_entries(max_entries),
+        nhits(0),
+        nmisses(0),
+        nupdates(0),
+        last(NULL)
+    {}
+
+    ~TransMatrixMemo()
+    {
+        clear();
+    }
+
+    // Returns a new transition matrix for a block, which the caller owns
+    TransMatrix *calc_transition_probs(
+        const LocalTree *tree, const ArgModel *model, const States &states,
+        const LineageCounts *lineages, bool internal=false, int minage=0);
+
+    // free all matrices
+    void clear();
+
+    int max_entries;  // the memo is cleared once it holds more matrices
+    int nhits;
+    int nmisses;
+    int nupdates;  // misses computed by updating the last matrix
+
+protected:
+    unordered_map<string, TransMatrix*> entries;
+    TransMatrix *last;  // last matrix added
+    mutex lock;
+};
+
+
 // A compressed representation of the switch transition matrix.
 //
 // This transition matrix is used in the chromosome threading HMM to go between
@@ -499,6 +578,10 @@ public:
         }
     }
 
+    // Build the compressed sparse form of the non-zero transitions once
+    // all transitions have been set.
+    void compress();
+
 
     int nstates1;   // Number of states in beginning block
     int nstates2;   // Number of states in the ending block
@@ -518,6 +601,21 @@ public:
                          // transition (i -> determ[i])
     double *recoalrow;   // Transition probabilities for row recoalsrc
     double *recombrow;   // Transition probabilities for row recombsrc
+
+    // Compressed sparse rows of the non-zero transitions, built by
+    // compress().  Rows are ordered as the forward algorithm accumulates
+    // them: deterministic rows, then recombination sources and then
+    // recoalescence sources.
+    vector<int> row_state;   // [nrows] source state of each row
+    vector<int> row_start;   // [nrows+1] offset of each row in row_cols
+    vector<int> row_cols;    // destination state of each entry
+    vector<double> row_vals; // transition probability of each entry
+
+    // The same transitions as compressed sparse columns, with source
+    // states in increasing order within each column.
+    vector<int> col_start;   // [nstates2+1] offset of each column
+    vector<int> col_rows;    // source state of each entry
+    vector<double> col_vals; // transition probability of each entry
 };
 
 
@@ -0,0 +1,141 @@
+#include "getopt.h"
+#include <string.h>
+
+// argweaver includes
+#include "argweaver/local_tree.h"
+#include "argweaver/compress.h"
+#include "argweaver/logging.h"
+#include "argweaver/model.h"
+#include "argweaver/smc_binary.h"
+
+using namespace argweaver;
+
+void print_usage() {
+    printf("smc-convert: This program converts an smc file between the text\n"
+           "  format and the indexed binary format.  Binary smc files load\n"
+           "  much faster and can be read by position (see smc2bed\n"
+           "  --region); every program that reads smc files accepts both\n"
+           "  formats.  The conversion is lossless.\n\n");
+    printf("Usage: ./smc-convert [OPTIONS] <in-file> <out-file>\n"
+           "  in-file may be text or binary, and may be gzipped.\n"
+           "  out-file is written binary if it ends with .smcb (or .smcb.gz)\n"
+           "  and as text otherwise (gzipped if it ends with .gz)\n"
+           " OPTIONS:\n"
+           " --log-file <file.log>\n"
+           "   Log file from arg-sample run; this is used as input to read model"
+           "   parameters. If not provided, smc-convert will look for log file"
+           "   in directory with smc file.\n");
+}
+
+
+bool ends_with(const char *str, const char *suffix) {
+    int len = strlen(str), len2 = strlen(suffix);
+    return len >= len2 && strcmp(&str[len-len2], suffix) == 0;
+}
+
+
+bool guess_log_file(const char *smc_file, char *log_file) {
+    const char *suffixes[] = {".smc.gz", ".smc", ".smcb.gz", ".smcb", NULL};
+    int len = strlen(smc_file);
+    strcpy(log_file, smc_file);
+    for (int i=0; suffixes[i]; i++) {
+        if (ends_with(smc_file, suffixes[i])) {
+            int pos = len - strlen(suffixes[i]) - 1;
+            while (pos >= 0 && smc_file[pos] != '.') pos--;
+            if (pos < 0) return false;
+            strcpy(&log_file[pos], ".log");
+            return true;
+        }
+    }
+    return false;
+}
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    char *log_file = NULL;
+    int opt_idx;
+    struct option long_opts[] = {
+        {"log-file", 1, 0, 'l'},
+        {"help", 0, 0, 'h'},
+        {0,0,0,0}};
+    while ((c = (char)getopt_long(argc, argv, "l:h", long_opts, &opt_idx))
+           != -1) {
+        switch (c) {
+        case 'l':
+            log_file = optarg;
+            break;
+        case 'h':
+            print_usage();
+            return 0;
+        case '?':
+            fprintf(stderr, "unknown option. Try --help\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Bad arguments. Try --help\n");
+        return 1;
+    }
+    const char *in_file = argv[optind];
+    const char *out_file = argv[optind + 1];
+    Logger *logger = new Logger(stderr, LOG_HIGH);
+    g_logger.setChain(logger);
+
+    if (log_file == NULL) {
+        log_file = (char*)malloc((strlen(in_file)+10)*sizeof(char));
+        if (!guess_log_file(in_file, log_file)) {
+            fprintf(stderr, "Could not guess log file name, provide with -l\n");
+            return 1;
+        }
+    }
+    ArgModel *model = new ArgModel(log_file);
+    const bool pop_model = (model->pop_tree != NULL);
+
+    // read text or binary
+    CompressStream instream(in_file, "r");
+    if (!instream.stream) {
+        fprintf(stderr, "Could not open %s\n", in_file);
+        return 1;
+    }
+    LocalTrees trees;
+    vector<string> seqnames;
+    vector<int> invisible_recomb_pos;
+    vector<Spr> invisible_recombs;
+    if (!read_local_trees(instream.stream, model->times, model->ntimes,
+                          &trees, seqnames, &invisible_recomb_pos,
+                          &invisible_recombs)) {
+        fprintf(stderr, "Error parsing SMC file\n");
+        return 1;
+    }
+    instream.close();
+
+    vector<const char*> names(seqnames.size());
+    for (unsigned int i=0; i<seqnames.size(); i++)
+        names[i] = seqnames[i].c_str();
+
+    CompressStream outstream(out_file, "w");
+    if (!outstream.stream) {
+        fprintf(stderr, "Could not write %s\n", out_file);
+        return 1;
+    }
+    if (ends_with(out_file, ".smcb") || ends_with(out_file, ".smcb.gz")) {
+        if (!write_local_trees_binary(outstream.stream, &trees,
+                                      names.empty() ? NULL : &names[0],
+                                      model->times, model->ntimes, pop_model,
+                                      invisible_recomb_pos,
+                                      invisible_recombs)) {
+            fprintf(stderr, "Error writing %s\n", out_file);
+            return 1;
+        }
+    } else {
+        write_local_trees(outstream.stream, &trees,
+                          names.empty() ? NULL : &names[0], model->times,
+                          pop_model, invisible_recomb_pos, invisible_recombs);
+    }
+    if (outstream.close() != 0) {
+        fprintf(stderr, "Error writing %s\n", out_file);
+        return 1;
+    }
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include "argweaver/compress.h"
 #include "argweaver/parsing.h"
 #include "argweaver/model.h"
+#include "argweaver/smc_binary.h"
 
 //using namespace spidir;
 using namespace argweaver;
@@ -23,7 +24,7 @@ void print_usage() {
            "  run smc2bed on each file, piping the results to sort-bed, then\n"
            "  bgzip. The resulting file can be indexed using tabix.\n\n");
     printf("Usage: ./smc2bed [OPTIONS] <smc-file>\n"
-           "  smc-file can be gzipped\n"
+           "  smc-file can be gzipped or binary (see smc-convert)\n"
            " OPTIONS:\n"
            " --region START-END\n"
            "   Process only these coordinates (1-based)\n"
@@ -40,8 +41,13 @@ void print_usage() {
 bool guess_log_file(char *smc_file, char *log_file) {
     int len = strlen(smc_file);
     strcpy(log_file, smc_file);
-    if (strcmp(&smc_file[len-7], ".smc.gz")==0) {
-        int pos=len-8;
+    int suffix = 0;
+    if (len >= 7 && strcmp(&smc_file[len-7], ".smc.gz")==0)
+        suffix = 7;
+    else if (len >= 5 && strcmp(&smc_file[len-5], ".smcb")==0)
+        suffix = 5;
+    if (suffix > 0) {
+        int pos=len-suffix-1;
         while (pos >= 0 && smc_file[pos] != '.') pos--;
         if (pos < 0) return false;
         log_file[pos]='\0';
@@ -109,24 +115,16 @@ int main(int argc, char *argv[]) {
         model = new ArgModel(log_file);
     }
 
-    CompressStream instream(argv[optind], "r");
     vector<string> seqnames;
 
+    // binary smc files are read through their index
     trees = new LocalTrees();
-    if (!read_local_trees(instream.stream, model->times, model->ntimes,
-                          trees, seqnames)) {
+    if (!read_local_trees_region(argv[optind], model->times, model->ntimes,
+                                 region[0], region[1], trees, seqnames)) {
         fprintf(stderr, "Error parsing SMC file\n");
         return 1;
     }
-    if (region[0] != -1) {
-        LocalTrees *trees2 = partition_local_trees(trees, region[0], true);
-        delete trees;
-        trees = trees2;
-    }
-    if (region[1] != -1)
-        partition_local_trees(trees, region[1], true);
     write_local_trees_as_bed(stdout, trees, seqnames,
                              model, sample);
-    instream.close();
     return 0;
 }
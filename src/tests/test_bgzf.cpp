@@ -0,0 +1,74 @@
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include "argweaver/bgzf.h"
+#include "argweaver/compress.h"
+
+
+namespace argweaver {
+
+// BGZF files written on worker threads should read back through the
+// reader, through stdio and from any virtual offset, and plain gzip files
+// should still be readable.
+TEST(BgzfTest, test_bgzf)
+{
+    const string filename = testing::TempDir() + "argweaver_bgzf_test.gz";
+    string data;
+    vector<int64_t> offsets;
+    vector<string> lines;
+    BgzfWriter writer(2);
+    ASSERT_TRUE(writer.open(filename.c_str()));
+    for (int i=0; i<20000; i++) {
+        char line[100];
+        snprintf(line, sizeof(line), "line %d %d\n", i, i * 7919 % 10007);
+        if (i % 1000 == 999) {
+            offsets.push_back(writer.tell());
+            lines.push_back(line);
+        }
+        ASSERT_EQ(writer.write(line, strlen(line)), long(strlen(line)));
+        data += line;
+    }
+    ASSERT_EQ(writer.close(), 0);
+    ASSERT_GT(data.size(), 3u * BGZF_BLOCK_SIZE);
+
+    BgzfReader reader(2);
+    ASSERT_TRUE(reader.open(filename.c_str()));
+    EXPECT_TRUE(reader.seekable());
+    string data2(data.size() + 1, '\0');
+    EXPECT_EQ(reader.read(&data2[0], data2.size()), long(data.size()));
+    data2.resize(data.size());
+    EXPECT_EQ(data2, data);
+    for (int i=offsets.size() - 1; i>=0; i--) {
+        ASSERT_TRUE(reader.seek(offsets[i]));
+        EXPECT_EQ(reader.tell(), offsets[i]);
+        char line[100];
+        ASSERT_EQ(reader.read(line, lines[i].size()), long(lines[i].size()));
+        EXPECT_EQ(string(line, lines[i].size()), lines[i]);
+    }
+    reader.close();
+
+    CompressStream stream(filename.c_str(), "r");
+    char line[100];
+    ASSERT_TRUE(fgets(line, sizeof(line), stream.stream) != NULL);
+    EXPECT_STREQ(line, "line 0 0\n");
+    EXPECT_EQ(stream.close(), 0);
+
+    // a gzip file with two members
+    gzFile out = gzopen(filename.c_str(), "w");
+    gzputs(out, "first\n");
+    gzclose(out);
+    out = gzopen(filename.c_str(), "a");
+    gzputs(out, "second\n");
+    gzclose(out);
+    ASSERT_TRUE(reader.open(filename.c_str()));
+    EXPECT_FALSE(reader.seekable());
+    EXPECT_EQ(reader.read(line, sizeof(line)), 13);
+    EXPECT_EQ(string(line, 13), "first\nsecond\n");
+    reader.close();
+    unlink(filename.c_str());
+}
+
+
+}  // namespace
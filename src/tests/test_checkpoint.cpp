@@ -0,0 +1,138 @@
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+
+#include "argweaver/checkpoint.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sequences.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+// A checkpoint should restore the local trees, the sampled model parameters
+// and the sampler state exactly, and a truncated checkpoint should be
+// rejected.
+TEST(CheckpointTest, test_checkpoint)
+{
+    TestArg arg;
+    LocalTrees trees;
+    arg.make_trees(&trees, true);
+    Sequences sequences(100);
+
+    SamplerState state;
+    state.iter = 30;
+    state.rand_state = 0x123456789ULL;
+    state.have_rand_norm_spare = true;
+    state.rand_norm_spare = 0.25;
+    state.invisible_recomb_pos.push_back(70);
+    state.invisible_recombs.push_back(Spr(0, 0, 0, 1, 0));
+
+    vector<char> data;
+    save_checkpoint(data, &trees, &arg.model, &sequences, NULL, state);
+    const string filename = testing::TempDir() + "argweaver_checkpoint_test";
+    FILE *out = fopen(filename.c_str(), "w");
+    ASSERT_TRUE(out != NULL);
+    fwrite(&data[0], 1, data.size(), out);
+    fclose(out);
+
+    TestArg arg2;
+    ArgModel &model2 = arg2.model;
+    model2.set_popsizes(2e4);
+    LocalTrees trees2;
+    SamplerState state2;
+    ASSERT_TRUE(read_checkpoint(filename.c_str(), &trees2, &model2,
+                                &sequences, NULL, &state2));
+    EXPECT_EQ(model2.popsizes[0][3], 1e4);
+    EXPECT_EQ(state2.iter, 30);
+    EXPECT_EQ(state2.rand_state, state.rand_state);
+    EXPECT_TRUE(state2.have_rand_norm_spare);
+    EXPECT_EQ(state2.rand_norm_spare, 0.25);
+    EXPECT_EQ(state2.invisible_recomb_pos, state.invisible_recomb_pos);
+    ASSERT_EQ(state2.invisible_recombs.size(), 1u);
+    EXPECT_EQ(state2.invisible_recombs[0].coal_time, 1);
+
+    ASSERT_EQ(trees2.get_num_trees(), 2);
+    EXPECT_EQ(trees2.seqids, trees.seqids);
+    LocalTrees::iterator it = trees.begin(), it2 = trees2.begin();
+    for (; it != trees.end(); ++it, ++it2) {
+        EXPECT_EQ(it2->blocklen, it->blocklen);
+        EXPECT_EQ(it2->spr.recomb_node, it->spr.recomb_node);
+        EXPECT_EQ(it2->spr.coal_time, it->spr.coal_time);
+        EXPECT_EQ(it2->tree->root, it->tree->root);
+        for (int i=0; i<it->tree->nnodes; i++) {
+            EXPECT_EQ(it2->tree->nodes[i].parent, it->tree->nodes[i].parent);
+            EXPECT_EQ(it2->tree->nodes[i].age, it->tree->nodes[i].age);
+        }
+        EXPECT_EQ(it2->mapping != NULL, it->mapping != NULL);
+    }
+
+    out = fopen(filename.c_str(), "w");
+    fwrite(&data[0], 1, data.size() - 1, out);
+    fclose(out);
+    EXPECT_FALSE(read_checkpoint(filename.c_str(), &trees2, &model2,
+                                 &sequences, NULL, &state2));
+    unlink(filename.c_str());
+}
+
+
+// Returns whether a checkpoint of 'trees' can be read back
+static bool read_saved_checkpoint(const string &filename, TestArg &arg,
+                                  const LocalTrees &trees)
+{
+    Sequences sequences(100);
+    SamplerState state;
+    vector<char> data;
+    save_checkpoint(data, &trees, &arg.model, &sequences, NULL, state);
+    FILE *out = fopen(filename.c_str(), "w");
+    if (out == NULL)
+        return false;
+    fwrite(&data[0], 1, data.size(), out);
+    fclose(out);
+
+    LocalTrees trees2;
+    bool ok = read_checkpoint(filename.c_str(), &trees2, &arg.model,
+                              &sequences, NULL, &state);
+    unlink(filename.c_str());
+    return ok;
+}
+
+
+// A checkpoint with node indices out of range of its trees should be
+// rejected when it is read.
+TEST(CheckpointTest, test_checkpoint_bad_nodes)
+{
+    TestArg arg;
+    LocalTrees trees;
+    arg.make_trees(&trees, true);
+    const string filename = testing::TempDir() + "argweaver_checkpoint_test";
+    LocalTreeSpr &last = trees.trees.back();
+    const int nnodes = trees.nnodes;
+    ASSERT_TRUE(last.mapping != NULL);
+    ASSERT_TRUE(read_saved_checkpoint(filename, arg, trees));
+
+    int *fields[] = {
+        &last.tree->root, &last.tree->nodes[0].parent,
+        &last.tree->nodes[nnodes-1].child[1], &last.spr.recomb_node,
+        &last.spr.coal_node, &last.mapping[2]
+    };
+    for (unsigned int i=0; i<sizeof(fields) / sizeof(fields[0]); i++) {
+        const int value = *fields[i];
+        *fields[i] = nnodes;
+        EXPECT_FALSE(read_saved_checkpoint(filename, arg, trees)) << i;
+        *fields[i] = -2;
+        EXPECT_FALSE(read_saved_checkpoint(filename, arg, trees)) << i;
+        *fields[i] = value;
+    }
+    EXPECT_TRUE(read_saved_checkpoint(filename, arg, trees));
+
+    // every tree must have the number of nodes of the ARG
+    trees.nnodes++;
+    EXPECT_FALSE(read_saved_checkpoint(filename, arg, trees));
+    trees.nnodes--;
+}
+
+
+}  // namespace
@@ -0,0 +1,28 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+
+
+namespace argweaver {
+
+// A thread's random stream should replace rand() for that thread only and
+// give the same draws for the same seed.
+TEST(CommonTest, test_rand_stream)
+{
+    RandStream stream(7), stream2(7);
+    set_thread_rand_stream(&stream);
+    const int first = rand_int();
+    double draw = frand();
+    set_thread_rand_stream(NULL);
+
+    EXPECT_EQ(first, stream2.next());
+    EXPECT_EQ(draw, stream2.next() / double(RAND_MAX));
+
+    srand(1);
+    const int r = rand();
+    srand(1);
+    EXPECT_EQ(rand_int(), r);
+}
+
+
+}  // namespace
@@ -0,0 +1,36 @@
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+#include <string>
+
+#include "argweaver/compress.h"
+
+
+namespace argweaver {
+
+// Files written in the background should appear complete after a flush,
+// with queued writes kept in order.
+TEST(CompressTest, test_async_file_writer)
+{
+    const std::string filename =
+        testing::TempDir() + "argweaver_async_test.gz";
+    AsyncFileWriter writer(1);
+    for (int i=0; i<3; i++) {
+        writer.write(filename, [i](FILE *out) {
+                fprintf(out, "sample %d\n", i);
+                return true;
+            });
+    }
+    EXPECT_TRUE(writer.flush());
+
+    CompressStream stream(filename.c_str(), "r");
+    char line[100];
+    ASSERT_TRUE(fgets(line, sizeof(line), stream.stream) != NULL);
+    EXPECT_STREQ(line, "sample 2\n");
+    stream.close();
+    EXPECT_NE(access((filename + ".part").c_str(), F_OK), 0);
+    unlink(filename.c_str());
+}
+
+
+}  // namespace
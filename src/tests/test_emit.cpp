@@ -0,0 +1,129 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/emit.h"
+#include "argweaver/emit_simd.h"
+#include "argweaver/forward_simd.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/states.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+// Masked and invariant sites, and variant sites with the same pattern,
+// should share emission rows.
+TEST(EmitTest, test_sparse_emissions)
+{
+    TestArg arg;
+    LocalTree tree;
+    arg.parse_tree("((0,1)3[&&NHX:age=10],2)4[&&NHX:age=20]", &tree);
+    States states;
+    get_coal_states(&tree, arg.ntimes, states);
+    const int nstates = states.size();
+
+    // sites: invariant, masked, variant, invariant, variant, variant
+    const char *seqs[] = {"ANAAAC", "ANAAAA", "ANCACA", "ANAAAA"};
+    const int seqlen = 6;
+    vector<vector<BaseProbs> > base_probs;
+    EmissionTable emit;
+    calc_emissions_external(states, &tree, seqs, base_probs, 4, seqlen,
+                            &arg.model, &emit, NULL);
+
+    EXPECT_EQ(emit.npatterns, 2);
+    EXPECT_EQ(emit.rows[0], emit.invariant_row());
+    EXPECT_EQ(emit.rows[1], emit.masked_row());
+    EXPECT_EQ(emit.rows[2], emit.pattern_row(0));
+    EXPECT_EQ(emit.rows[3], emit.invariant_row());
+    EXPECT_EQ(emit.rows[4], emit.pattern_row(0));
+    EXPECT_EQ(emit.rows[5], emit.pattern_row(1));
+    for (int j=0; j<nstates; j++) {
+        EXPECT_EQ(emit.rows[1][j], 1.0);
+        EXPECT_GT(emit.rows[0][j], emit.rows[2][j]);
+    }
+
+    // dense matrices should agree
+    double **dense = new_matrix<double>(seqlen, nstates);
+    calc_emissions_external(states, &tree, seqs, base_probs, 4, seqlen,
+                            &arg.model, dense, NULL);
+    for (int i=0; i<seqlen; i++)
+        for (int j=0; j<nstates; j++)
+            EXPECT_EQ(dense[i][j], emit.rows[i][j]);
+    delete_matrix<double>(dense, seqlen);
+
+    // later blocks should reuse the likelihood table arena
+    const int nallocs = get_likelihood_arena().nallocs;
+    calc_emissions_external(states, &tree, seqs, base_probs, 4, seqlen,
+                            &arg.model, &emit, NULL);
+    EXPECT_EQ(get_likelihood_arena().nallocs, nallocs);
+}
+
+
+// A likelihood arena should hand out aligned memory and merge its slabs
+// on reset.
+TEST(EmitTest, test_likelihood_arena)
+{
+    LikelihoodArena arena;
+    for (int i=1; i<=10; i++) {
+        double *ptr = arena.alloc(i * 100);
+        EXPECT_EQ((size_t) ptr % 64, 0u);
+    }
+    const int nallocs = arena.nallocs;
+    EXPECT_GT(nallocs, 1);
+
+    arena.reset();
+    EXPECT_EQ(arena.nallocs, nallocs + 1);
+    for (int i=1; i<=10; i++)
+        arena.alloc(i * 100);
+    arena.reset();
+    EXPECT_EQ(arena.nallocs, nallocs + 1);
+}
+
+
+// Vectorized pruning kernels should reproduce the scalar kernels exactly.
+TEST(EmitTest, test_prune_kernels)
+{
+    const int nsites = 7, nnodes = 5, nstates = 6;
+    const int stride = 4 * nnodes;
+    double inner[nsites * stride], outer[nsites * stride];
+    for (int i=0; i<nsites * stride; i++) {
+        inner[i] = frand();
+        outer[i] = frand();
+    }
+    const int nodes[nstates] = {0, 1, 2, 3, 4, 4};
+    double muts[nstates][3], nomuts[nstates][3];
+    for (int j=0; j<nstates; j++) {
+        for (int k=0; k<3; k++) {
+            muts[j][k] = .25 * frand();
+            nomuts[j][k] = 1.0 - 3 * muts[j][k];
+        }
+    }
+
+    const ForwardKernel kernels[] = {
+        FORWARD_KERNEL_SCALAR, FORWARD_KERNEL_SSE2, FORWARD_KERNEL_AVX2};
+    const int nkernels = 3;
+    double pruned[nkernels][nsites * stride];
+    double emit[nkernels][nstates];
+    for (int n=0; n<nkernels; n++) {
+        set_forward_kernel(kernels[n]);
+        fill(pruned[n], pruned[n] + nsites * stride, 0.0);
+        prune_branches(nsites, stride, &inner[0], .1, .7, &outer[4], .05, .85,
+                       &pruned[n][8]);
+        prune_branches(nsites, stride, &inner[4], .1, .7, NULL, 0, 0,
+                       &pruned[n][12]);
+        calc_emit_row(nstates, &inner[0], &inner[0], &outer[0], nodes, 4,
+                      muts, nomuts, emit[n]);
+    }
+    set_forward_kernel(FORWARD_KERNEL_AUTO);
+
+    for (int n=1; n<nkernels; n++) {
+        for (int i=0; i<nsites * stride; i++)
+            EXPECT_EQ(pruned[0][i], pruned[n][i]);
+        for (int j=0; j<nstates; j++)
+            EXPECT_EQ(emit[0][j], emit[n][j]);
+    }
+}
+
+
+}  // namespace
@@ -0,0 +1,325 @@
+#include "gtest/gtest.h"
+
+#include <set>
+
+#include "argweaver/forward_simd.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sample_thread.h"
+#include "argweaver/sequences.h"
+#include "argweaver/states.h"
+#include "argweaver/trans.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+// Run one forward block with the given kernel.
+static void run_forward_block(ForwardKernel kernel, const ArgModel *model,
+                              const LocalTree *tree, const States &states,
+                              const LineageCounts &lineages,
+                              const TransMatrix *matrix,
+                              double **emit, int blocklen, double **fw)
+{
+    set_forward_kernel(kernel);
+    if (kernel == FORWARD_KERNEL_AUTO)
+        arghmm_forward_block_slow(tree, model->ntimes, blocklen, states,
+                                  lineages, matrix, emit, fw);
+    else
+        arghmm_forward_block(model, tree, blocklen, states, lineages,
+                             matrix, emit, fw);
+    set_forward_kernel(FORWARD_KERNEL_AUTO);
+}
+
+
+// All forward kernels should agree with the slow literal forward algorithm
+// and the vectorized kernels should reproduce the scalar kernel exactly.
+TEST(ForwardTest, test_forward_kernels)
+{
+    TestArg arg;
+    const ArgModel &model = arg.model;
+    const LocalTree &tree = arg.tree;
+
+    // Setup states and transition matrix.
+    States states;
+    get_coal_states_external(&tree, model.ntimes, states);
+    const int nstates = states.size();
+    LineageCounts lineages(model.ntimes, 1);
+    lineages.count(&tree, NULL);
+    TransMatrix matrix(&model, nstates);
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+
+    // Random emissions.
+    const int blocklen = 50;
+    double **emit = new_matrix<double>(blocklen, nstates);
+    for (int i=0; i<blocklen; i++)
+        for (int k=0; k<nstates; k++)
+            emit[i][k] = .01 + frand();
+
+    const ForwardKernel kernels[] = {
+        FORWARD_KERNEL_AUTO, FORWARD_KERNEL_SCALAR,
+        FORWARD_KERNEL_SSE2, FORWARD_KERNEL_AVX2};
+    const int nkernels = 4;
+    double **fw[nkernels];
+    for (int n=0; n<nkernels; n++) {
+        fw[n] = new_matrix<double>(blocklen, nstates);
+        for (int k=0; k<nstates; k++)
+            fw[n][0][k] = 1.0 / nstates;
+        run_forward_block(kernels[n], &model, &tree, states, lineages,
+                          &matrix, emit, blocklen, fw[n]);
+    }
+
+    for (int i=0; i<blocklen; i++) {
+        for (int k=0; k<nstates; k++) {
+            // slow forward algorithm
+            EXPECT_NEAR(fw[1][i][k], fw[0][i][k], 1e-12 * fw[0][i][k]);
+
+            // vectorized kernels
+            EXPECT_EQ(fw[1][i][k], fw[2][i][k]);
+            EXPECT_EQ(fw[1][i][k], fw[3][i][k]);
+        }
+    }
+
+    for (int n=0; n<nkernels; n++)
+        delete_matrix<double>(fw[n], blocklen);
+    delete_matrix<double>(emit, blocklen);
+}
+
+
+// A checkpointed forward table should store every k-th column of the
+// sequence regardless of where blocks start, plus the first and last column
+// of each block, and share its scratch columns between blocks.
+TEST(ForwardTest, test_forward_table_checkpoint)
+{
+    const int start_coord = 3, seqlen = 100, interval = 10;
+    ArgHmmForwardTableCheckpoint forward(start_coord, seqlen, interval);
+    const int starts[] = {3, 10, 26, 103};
+    const int nstates[] = {8, 5, 6};
+    for (int b=0; b<3; b++)
+        forward.new_block(starts[b], starts[b+1], nstates[b]);
+    double **fw = forward.get_table();
+
+    // stored columns have their own memory and the others alternate
+    // between two scratch columns
+    const int stored[] = {3, 9, 10, 13, 23, 25, 26, 33, 43, 53, 63, 73, 83,
+                          93, 102};
+    set<double*> columns;
+    int nstored = 0;
+    for (int b=0; b<3; b++) {
+        for (int i=starts[b]; i<starts[b+1]; i++) {
+            bool expected = (i == stored[nstored]);
+            EXPECT_EQ(forward.is_checkpoint(starts[b], starts[b+1], i),
+                      expected) << i;
+            if (expected) {
+                nstored++;
+                columns.insert(fw[i]);
+            } else {
+                EXPECT_EQ(fw[i], fw[4] + (i % 2) * nstates[b]) << i;
+            }
+        }
+    }
+    EXPECT_EQ(nstored, int(sizeof(stored) / sizeof(stored[0])));
+    EXPECT_EQ(int(columns.size()), nstored);
+
+    // segments are recomputed from the previous stored column
+    EXPECT_EQ(forward.prev_checkpoint(3, 9), 3);
+    EXPECT_EQ(forward.prev_checkpoint(10, 13), 10);
+    EXPECT_EQ(forward.prev_checkpoint(10, 14), 13);
+    EXPECT_EQ(forward.prev_checkpoint(10, 23), 13);
+    EXPECT_EQ(forward.prev_checkpoint(10, 25), 23);
+    EXPECT_EQ(forward.prev_checkpoint(26, 33), 26);
+    EXPECT_EQ(forward.prev_checkpoint(26, 102), 93);
+}
+
+
+// Jumping over runs of columns that share one emission row should give the
+// columns of the column by column forward algorithm.
+TEST(ForwardTest, test_forward_runs)
+{
+    TestArg arg;
+    const ArgModel &model = arg.model;
+    const LocalTree &tree = arg.tree;
+
+    States states;
+    get_coal_states_external(&tree, model.ntimes, states);
+    const int nstates = states.size();
+    LineageCounts lineages(model.ntimes, 1);
+    lineages.count(&tree, NULL);
+    TransMatrix matrix(&model, nstates);
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+
+    // long runs of two rows broken up by a few variant columns
+    const int blocklen = 2000;
+    double **rows = new_matrix<double>(blocklen, nstates);
+    for (int i=0; i<blocklen; i++)
+        for (int k=0; k<nstates; k++)
+            rows[i][k] = .01 + frand();
+    double *emit[blocklen];
+    for (int i=0; i<blocklen; i++)
+        emit[i] = (i % 97 == 5) ? rows[i] : rows[(i / 500) % 2];
+
+    double **fw = new_matrix<double>(blocklen, nstates);
+    ArgHmmForwardTable forward(0, blocklen);
+    forward.new_block(0, blocklen, nstates);
+    double **fw2 = forward.get_table();
+    for (int k=0; k<nstates; k++)
+        fw[0][k] = fw2[0][k] = 1.0 / nstates;
+    arghmm_forward_block(&model, &tree, blocklen, states, lineages,
+                         &matrix, emit, fw);
+    arghmm_forward_block_runs(&model, &tree, blocklen, states, lineages,
+                              &matrix, emit, fw2, &forward, 0, 0);
+
+    // compare the columns that were computed
+    vector<bool> jumped(blocklen, false);
+    int njumped = 0;
+    for (unsigned int j=0; j<forward.jumps.size(); j++) {
+        const ForwardJump &jump = forward.jumps[j];
+        for (int i=jump.start+1; i<jump.start+jump.nsteps; i++)
+            jumped[i] = true;
+        njumped += jump.nsteps - 1;
+    }
+    EXPECT_GT(njumped, blocklen / 2);
+    for (int i=0; i<blocklen; i++)
+        for (int k=0; !jumped[i] && k<nstates; k++)
+            EXPECT_NEAR(fw2[i][k], fw[i][k], 1e-9 * fw[i][k]);
+
+    delete_matrix<double>(fw, blocklen);
+    delete_matrix<double>(rows, blocklen);
+}
+
+
+// Paths sampled within a jumped run should follow the same distribution as
+// paths sampled column by column.
+TEST(ForwardTest, test_forward_runs_traceback)
+{
+    TestArg arg;
+    ArgModel &model = arg.model;
+    const LocalTree &tree = arg.tree;
+    model.rho = 0.005;
+
+    States states;
+    get_coal_states_external(&tree, model.ntimes, states);
+    const int nstates = states.size();
+    LineageCounts lineages(model.ntimes, 1);
+    lineages.count(&tree, NULL);
+    TransMatrix matrix(&model, nstates);
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+
+    // one run of 16 columns, recorded as a jump over a full forward table
+    const int nsteps = 16, blocklen = nsteps + 1;
+    double row[nstates];
+    for (int k=0; k<nstates; k++)
+        row[k] = 1.0 / (1 + k % 3);
+    const double *emit[blocklen];
+    for (int i=0; i<blocklen; i++)
+        emit[i] = row;
+    ArgHmmForwardTable forward(0, blocklen);
+    forward.new_block(0, blocklen, nstates);
+    double **fw = forward.get_table();
+    for (int k=0; k<nstates; k++)
+        fw[0][k] = 1.0 / nstates;
+    arghmm_forward_block(&model, &tree, blocklen, states, lineages,
+                         &matrix, emit, fw);
+    forward.jumps.push_back(
+        ForwardJump(0, nsteps, forward.add_jump_row(row, nstates)));
+
+    // count states at a few columns, paths that stay in one state and
+    // changes of state
+    const int nsamples = 20000;
+    const int cols[] = {0, 3, 8, 15};
+    const int ncols = 4;
+    vector<double> counts[2];
+    double nstay[2] = {0, 0}, nchanges[2] = {0, 0};
+    int path[blocklen];
+    for (int m=0; m<2; m++) {
+        counts[m].assign(ncols * nstates, 0.0);
+        for (int n=0; n<nsamples; n++) {
+            path[blocklen - 1] = states.size() / 2;
+            if (m == 0)
+                sample_hmm_posterior(blocklen, &tree, states, &matrix,
+                                     fw, path);
+            else
+                sample_hmm_posterior_runs(blocklen, &tree, states, &matrix,
+                                          &forward, 0, fw, path);
+            for (int c=0; c<ncols; c++)
+                counts[m][c * nstates + path[cols[c]]] += 1.0 / nsamples;
+            int changes = 0;
+            for (int i=1; i<blocklen; i++)
+                changes += (path[i] != path[i-1]);
+            nstay[m] += (changes == 0) / double(nsamples);
+            nchanges[m] += changes / double(nsamples);
+        }
+    }
+
+    EXPECT_GT(nstay[0], .1);
+    EXPECT_LT(nstay[0], .9);
+    EXPECT_NEAR(nstay[0], nstay[1], .02);
+    EXPECT_NEAR(nchanges[0], nchanges[1], .05);
+    for (int i=0; i<ncols * nstates; i++)
+        EXPECT_NEAR(counts[0][i], counts[1][i], .02);
+}
+
+
+// Describe the blocks and trees of an ARG.
+static string describe_arg(const LocalTrees &trees)
+{
+    string desc;
+    for (LocalTrees::const_iterator it=trees.begin(); it != trees.end();
+         ++it) {
+        char buf[30];
+        snprintf(buf, sizeof(buf), "%d:", it->blocklen);
+        desc += buf;
+        for (int i=0; i<it->tree->nnodes; i++) {
+            snprintf(buf, sizeof(buf), " %d,%d", it->tree->nodes[i].parent,
+                     it->tree->nodes[i].age);
+            desc += buf;
+        }
+        desc += "\n";
+    }
+    return desc;
+}
+
+
+// Checkpointed forward tables should sample the same threads as the full
+// table for a given seed, with and without jumping over runs of columns.
+TEST(ForwardTest, test_forward_checkpoint_threads)
+{
+    TestArg arg;
+    ArgModel model(arg.model);
+    model.rho = 1e-8;
+
+    // long invariant runs between a few variant sites
+    const int nseqs = 5, seqlen = 5000;
+    char data[nseqs][seqlen + 1];
+    char *seqs[nseqs];
+    for (int j=0; j<nseqs; j++) {
+        for (int i=0; i<seqlen; i++)
+            data[j][i] = (i % 613 == 7 && (i / 613 + j) % 3 == 0) ? 'C' : 'A';
+        data[j][seqlen] = '\0';
+        seqs[j] = data[j];
+    }
+
+    string expected[2];
+    for (int runs=0; runs<2; runs++) {
+        const int intervals[] = {0, 1, 7, -1};
+        for (int c=0; c<4; c++) {
+            model.hmm_options.forward_runs = runs;
+            model.hmm_options.forward_checkpoint = intervals[c];
+            Sequences sequences(seqs, nseqs, seqlen);
+            LocalTrees trees;
+            srand(3);
+            sample_arg_seq(&model, &sequences, &trees);
+            const string desc = describe_arg(trees);
+            if (c == 0)
+                expected[runs] = desc;
+            else
+                EXPECT_EQ(desc, expected[runs]) << intervals[c];
+        }
+    }
+    EXPECT_NE(expected[0], expected[1]);
+}
+
+
+}  // namespace
@@ -1,7 +1,12 @@
 #include "gtest/gtest.h"
 
+#include <algorithm>
+
+#include "argweaver/common.h"
 #include "argweaver/local_tree.h"
 
+#include "test_util.h"
+
 
 namespace argweaver {
 
@@ -80,4 +85,167 @@ TEST(LocalTreeTest, parse_local_tree_extra_meta_data)
 }
 
 
+
+// Restoring a snapshot should undo changes to the trees, and snapshots
+// should reuse the trees of rejected proposals.
+TEST(LocalTreeTest, local_trees_snapshot)
+{
+    const char *newick = "((0[&&NHX:age=0],1[&&NHX:age=0])3[&&NHX:age=10],2[&&NHX:age=0])4[&&NHX:age=20]";
+    TestArg arg;
+
+    LocalTrees trees(0, 20, 5);
+    for (int i=0; i<2; i++) {
+        LocalTree *tree = new LocalTree();
+        arg.parse_tree(newick, tree);
+        int *mapping = (i == 0 ? NULL : new int [5]);
+        for (int j=0; i>0 && j<5; j++)
+            mapping[j] = j;
+        trees.trees.push_back(LocalTreeSpr(tree, Spr(-1, -1, -1, -1, -1),
+                                           10, mapping));
+    }
+
+    LocalTreesSnapshot snapshot;
+    for (int rep=0; rep<2; rep++) {
+        snapshot.save(trees);
+        trees.back().tree->nodes[3].age = 0;
+        trees.back().mapping[2] = -1;
+        trees.back().blocklen = 5;
+        trees.end_coord = 15;
+        snapshot.restore(&trees);
+
+        EXPECT_EQ(trees.get_num_trees(), 2);
+        EXPECT_EQ(trees.end_coord, 20);
+        EXPECT_EQ(trees.back().blocklen, 10);
+        EXPECT_EQ(trees.back().tree->nodes[3].age, 1);
+        EXPECT_EQ(trees.back().mapping[2], 2);
+        EXPECT_TRUE(trees.front().mapping == NULL);
+    }
+}
+
+
+// age of the most recent common ancestor of two nodes
+static int mrca_age(const LocalTree *tree, int a, int b)
+{
+    while (a != b) {
+        if (tree->nodes[a].age <= tree->nodes[b].age)
+            a = tree->nodes[a].parent;
+        else
+            b = tree->nodes[b].parent;
+    }
+    return tree->nodes[a].age;
+}
+
+
+// Applying the SPRs of a path between two trees should give the second
+// tree's topology, with at most one SPR per leaf.
+TEST(LocalTreeTest, find_spr_path)
+{
+    TestArg arg;
+    LocalTree tree1, tree2;
+    arg.parse_tree_pair(&tree1, &tree2);
+
+    vector<Spr> sprs;
+    find_spr_path(&tree1, &tree2, sprs);
+    EXPECT_LE(int(sprs.size()), tree1.get_num_leaves() - 1);
+
+    LocalTree tree(tree1);
+    for (unsigned int i=0; i<sprs.size(); i++) {
+        EXPECT_LT(sprs[i].recomb_node, tree.get_num_leaves());
+        apply_spr(&tree, sprs[i]);
+    }
+    for (int a=0; a<tree.get_num_leaves(); a++)
+        for (int b=a+1; b<tree.get_num_leaves(); b++)
+            EXPECT_EQ(mrca_age(&tree, a, b), mrca_age(&tree2, a, b));
+
+    find_spr_path(&tree2, &tree2, sprs);
+    EXPECT_EQ(sprs.size(), 0u);
+}
+
+
+// Make a random tree of 'nleaves' leaves whose coalescences happen at
+// times 1..ntimes-1, with ties.
+static void make_random_tree(int nleaves, int ntimes, LocalTree *tree)
+{
+    const int nnodes = 2 * nleaves - 1;
+    int ptree[nnodes], ages[nnodes], lineages[nleaves];
+    for (int i=0; i<nleaves; i++) {
+        ages[i] = 0;
+        lineages[i] = i;
+    }
+    for (int i=nleaves; i<nnodes; i++)
+        ages[i] = irand(1, ntimes);
+    sort(ages + nleaves, ages + nnodes);
+
+    // join two random lineages at each coalescence, oldest last
+    int nlineages = nleaves;
+    for (int i=nleaves; i<nnodes; i++) {
+        for (int j=0; j<2; j++) {
+            const int k = irand(nlineages);
+            ptree[lineages[k]] = i;
+            lineages[k] = lineages[--nlineages];
+        }
+        lineages[nlineages++] = i;
+    }
+    ptree[nnodes - 1] = -1;
+    tree->set_ptree(ptree, nnodes, ages);
+}
+
+
+// The clades of a tree as sorted (leaf set, age) pairs.  Two trees are
+// congruent if they have the same clades.
+static vector<pair<int, int> > get_clades(const LocalTree *tree)
+{
+    const int nleaves = tree->get_num_leaves();
+    int order[tree->nnodes];
+    int leaves[tree->nnodes];
+    tree->get_postorder(order);
+
+    vector<pair<int, int> > clades;
+    for (int i=0; i<tree->nnodes; i++) {
+        const int j = order[i];
+        const LocalNode &node = tree->nodes[j];
+        if (j < nleaves) {
+            leaves[j] = 1 << j;
+        } else {
+            leaves[j] = leaves[node.child[0]] | leaves[node.child[1]];
+            clades.push_back(make_pair(leaves[j], node.age));
+        }
+    }
+    sort(clades.begin(), clades.end());
+    return clades;
+}
+
+
+// Applying the SPRs of a path between random trees should always give a
+// tree congruent to the target.
+TEST(LocalTreeTest, find_spr_path_random)
+{
+    const int ntimes = 5;
+    RandStream stream(1);
+    set_thread_rand_stream(&stream);
+
+    for (int rep=0; rep<500; rep++) {
+        const int nleaves = 2 + rep % 11;
+        LocalTree tree1, tree2;
+        make_random_tree(nleaves, ntimes, &tree1);
+        make_random_tree(nleaves, ntimes, &tree2);
+
+        vector<Spr> sprs;
+        find_spr_path(&tree1, &tree2, sprs);
+        EXPECT_LE(int(sprs.size()), nleaves - 1);
+
+        LocalTree tree(tree1);
+        for (unsigned int i=0; i<sprs.size(); i++) {
+            EXPECT_LT(sprs[i].recomb_node, nleaves);
+            EXPECT_GE(sprs[i].coal_time, sprs[i].recomb_time);
+            apply_spr(&tree, sprs[i]);
+            EXPECT_TRUE(assert_tree(&tree));
+        }
+        EXPECT_EQ(get_clades(&tree), get_clades(&tree2));
+    }
+
+    set_thread_rand_stream(NULL);
+}
+
+
 }  // namespace
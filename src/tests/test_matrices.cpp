@@ -0,0 +1,119 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/local_tree.h"
+#include "argweaver/matrices.h"
+#include "argweaver/model.h"
+#include "argweaver/sequences.h"
+#include "argweaver/states.h"
+#include "argweaver/trans.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+// The transition matrix cache should evict least recently used blocks
+// once it exceeds its memory budget.
+TEST(MatricesTest, test_matrix_cache)
+{
+    TestArg arg;
+    const int nstates = 10;
+
+    // find the size of one block
+    ArgHmmMatrixCache sizer(1 << 30);
+    ArgHmmMatrices mat(nstates, nstates, 1,
+                       new TransMatrix(&arg.model, nstates), NULL, NULL);
+    sizer.insert(0, mat);
+    mat.detach();
+    const size_t block_bytes = sizer.nbytes;
+
+    // room for two blocks
+    ArgHmmMatrixCache cache(2 * block_bytes);
+    for (int i=0; i<3; i++) {
+        ArgHmmMatrices mat(nstates, nstates, 1,
+                           new TransMatrix(&arg.model, nstates), NULL, NULL);
+        cache.insert(i, mat);
+        mat.detach();
+
+        // touch block 0 so that block 1 is evicted instead
+        if (i == 1) {
+            ArgHmmMatrices mat2;
+            EXPECT_TRUE(cache.lookup(0, &mat2));
+            mat2.detach();
+        }
+    }
+    EXPECT_EQ(cache.nbytes, 2 * block_bytes);
+
+    ArgHmmMatrices mat2;
+    EXPECT_TRUE(cache.lookup(0, &mat2));
+    EXPECT_FALSE(cache.lookup(1, &mat2));
+    EXPECT_TRUE(cache.lookup(2, &mat2));
+    mat2.detach();
+    EXPECT_EQ(cache.nhits, 3);
+    EXPECT_EQ(cache.nmisses, 1);
+}
+
+
+// Matrices computed ahead on background threads should match those
+// computed synchronously, and iterating backward should still work.
+TEST(MatricesTest, test_matrix_lookahead)
+{
+    TestArg arg;
+    ArgModel &model = arg.model;
+
+    // one tree split into many blocks by the mutation and recombination maps
+    const int seqlen = 60, maplen = 5;
+    for (int i=0; i<seqlen; i+=maplen) {
+        model.mutmap.append("chr", i, i + maplen, 2.5e-9 * (1 + i % 3));
+        model.recombmap.append("chr", i, i + maplen, 1e-9);
+    }
+    LocalTrees trees;
+    trees.make_trunk(0, seqlen, 0, 0);
+
+    char seq1[seqlen + 1], seq2[seqlen + 1];
+    for (int i=0; i<seqlen; i++) {
+        seq1[i] = "ACGT"[i % 4];
+        seq2[i] = "ACGT"[(i / 3) % 4];
+    }
+    char *seqs[] = {seq1, seq2};
+    Sequences sequences(seqs, 2, seqlen);
+
+    ArgHmmMatrixIter sync_iter(&model, &sequences, &trees, 1);
+    ArgHmmMatrixIter iter(&model, &sequences, &trees, 1);
+    iter.set_lookahead(3, 2);
+
+    for (int pass=0; pass<2; pass++) {
+        int nblocks = 0;
+        for (iter.begin(), sync_iter.begin(); iter.more();
+             iter.next(), sync_iter.next()) {
+            ArgHmmMatrices &mat = iter.ref_matrices();
+            ArgHmmMatrices &mat2 = sync_iter.ref_matrices();
+            ASSERT_EQ(mat.blocklen, mat2.blocklen);
+            ASSERT_EQ(mat.nstates2, mat2.nstates2);
+            for (int i=0; i<mat.blocklen; i++)
+                for (int j=0; j<mat.nstates2; j++)
+                    EXPECT_EQ(mat.emit->rows[i][j], mat2.emit->rows[i][j]);
+            States states;
+            iter.get_coal_states(states);
+            const LocalTree *tree = iter.get_tree_spr()->tree;
+            for (int j=0; j<mat.nstates2; j++)
+                for (int k=0; k<mat.nstates2; k++)
+                    EXPECT_EQ(mat.transmat->get(tree, states, j, k),
+                              mat2.transmat->get(tree, states, j, k));
+            nblocks++;
+        }
+        EXPECT_EQ(nblocks, seqlen / maplen);
+
+        // backward iteration computes matrices synchronously
+        int nback = 0;
+        for (iter.rbegin(); iter.more(); iter.prev()) {
+            ArgHmmMatrices &mat = iter.ref_matrices();
+            EXPECT_EQ(mat.blocklen, maplen);
+            nback++;
+        }
+        EXPECT_EQ(nback, nblocks);
+    }
+}
+
+
+}  // namespace
@@ -0,0 +1,45 @@
+#include "gtest/gtest.h"
+
+#include <thread>
+
+#include "argweaver/mcmcmc.h"
+
+
+namespace argweaver {
+
+// Chains exchanging heats from threads should always hold distinct groups
+// and follow the same exchanges regardless of thread timing.
+TEST(McmcmcTest, test_replica_exchange)
+{
+    const int nchains = 3, niters = 50;
+    vector<int> groups[2];
+    for (int run=0; run<2; run++) {
+        ReplicaExchange exchange(nchains, 0.1, 5);
+        vector<vector<int> > seen(nchains);
+        auto run_chain = [&](int i) {
+            for (int j=0; j<niters; j++) {
+                exchange.exchange(i, -10.0 * (i + 1) - j % 7);
+                seen[i].push_back(exchange.get_group(i));
+            }
+        };
+        vector<thread> threads;
+        for (int i=1; i<nchains; i++)
+            threads.push_back(thread(run_chain, i));
+        run_chain(0);
+        for (unsigned int i=0; i<threads.size(); i++)
+            threads[i].join();
+
+        for (int j=0; j<niters; j++) {
+            int mask = 0;
+            for (int i=0; i<nchains; i++) {
+                mask |= 1 << seen[i][j];
+                groups[run].push_back(seen[i][j]);
+            }
+            EXPECT_EQ(mask, (1 << nchains) - 1);
+        }
+    }
+    EXPECT_EQ(groups[0], groups[1]);
+}
+
+
+}  // namespace
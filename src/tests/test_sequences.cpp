@@ -0,0 +1,370 @@
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+
+#include "argweaver/sequences.h"
+
+
+namespace argweaver {
+
+// Parsing the records of a VCF file on several threads should give the
+// same sites as parsing them in order.
+TEST(SequencesTest, test_read_vcf)
+{
+    const string filename = testing::TempDir() + "argweaver_vcf_test.vcf";
+    const char *bases = "ACGT";
+    FILE *out = fopen(filename.c_str(), "w");
+    ASSERT_TRUE(out != NULL);
+    fprintf(out, "##fileformat=VCFv4.2\n"
+            "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT"
+            "\ts0\ts1\ts2\n");
+    for (int i=0; i<5000; i++) {
+        fprintf(out, "chr\t%d\t.\t%c\t%c\t%d\t.\t.\tGT:GQ:PL",
+                10 * i + 1, bases[i % 4], bases[(i + 1 + i / 4) % 4],
+                i % 50);
+        for (int j=0; j<3; j++)
+            fprintf(out, "\t%d|%d:%d:0,%d,%d", (i + j) % 2, (i * j) % 3 / 2,
+                    (i * 7 + j) % 40, i % 30, (i + j) % 90);
+        fprintf(out, i < 4999 ? "\n" : "");
+    }
+    fclose(out);
+
+    Sites sites[2];
+    for (int k=0; k<2; k++) {
+        set_vcf_threads(k == 0 ? 0 : 3);
+        FILE *infile = fopen(filename.c_str(), "r");
+        ASSERT_TRUE(infile != NULL);
+        EXPECT_TRUE(read_vcf(infile, &sites[k], 10, "GQ<5", true, 0.5));
+        fclose(infile);
+    }
+    set_vcf_threads(-1);
+
+    ASSERT_EQ(sites[0].names.size(), 6u);
+    EXPECT_EQ(sites[0].names[5], "s2_2");
+    ASSERT_EQ(sites[0].get_num_sites(), 5000);
+    ASSERT_EQ(sites[1].get_num_sites(), 5000);
+    EXPECT_EQ(sites[0].names, sites[1].names);
+    for (int i=0; i<5000; i++) {
+        EXPECT_EQ(sites[0].positions[i], 10 * i);
+        EXPECT_EQ(sites[1].positions[i], 10 * i);
+        EXPECT_STREQ(sites[0].cols[i], sites[1].cols[i]);
+        for (int j=0; j<6; j++)
+            EXPECT_TRUE(sites[0].base_probs[i][j].is_equal(
+                            sites[1].base_probs[i][j], 0.0));
+    }
+
+    // only the listed individuals are kept
+    set<string> keep_inds;
+    keep_inds.insert("s0");
+    keep_inds.insert("s2");
+    Sites sites2;
+    FILE *infile = fopen(filename.c_str(), "r");
+    ASSERT_TRUE(infile != NULL);
+    EXPECT_TRUE(read_vcf(infile, &sites2, 10, "GQ<5", false, 0.5, false,
+                         keep_inds));
+    fclose(infile);
+    ASSERT_EQ(sites2.names.size(), 4u);
+    EXPECT_EQ(sites2.names[2], "s2_1");
+    for (int i=0; i<5000; i++) {
+        const char *col = sites[0].cols[i];
+        EXPECT_EQ(string(sites2.cols[i]),
+                  string(col, 2) + string(col + 4, 2));
+    }
+    unlink(filename.c_str());
+}
+
+
+// A small VCF file with masked, filtered and skipped records, and haploid
+// and diploid samples
+static const char *SMALL_VCF =
+    "##fileformat=VCFv4.2\n"
+    "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT"
+    "\ts0\ts1\ts2\n"
+    "chr\t11\t.\tA\tC\t40\t.\t.\tGT:GQ:PL\t0|1:30:10,0,20"
+    "\t0:30:0,10,40\t1/1:40:30,20,0\n"
+    "chr\t21\t.\tAT\tA\t40\t.\t.\tGT:GQ:PL\t0|1:30:10,0,20"
+    "\t0:30:0,10,40\t1/1:40:30,20,0\n"
+    "chr\t31\t.\tG\tT\t3\t.\t.\tGT:GQ:PL\t0|1:30:10,0,20\t1:30:40,10,0"
+    "\t0/1:40:20,0,20\n"
+    "chr\t41\t.\tC\tA,G\t50\t.\t.\tGT:GQ:PL\t0|1:30:10,0,20"
+    "\t1:30:40,10,0\t0/2:40:20,0,20\n"
+    "chr\t51\t.\tT\tC\t50\t.\t.\tGT:GQ:PL\t1|1:2:50,30,0\t1:30:40,10,0"
+    "\t0|0:40:0,30,50\n"
+    "chr\t61\t.\tA\tG\t50\t.\t.\tGT:GQ:PL\t1|0:20:20,0,30"
+    "\t0:30:0,10,40\t./.\n"
+    "chr\t71\t.\tC\tT\t50\t.\t.\tGT:GQ:PL\t.|1:30:0,0,0\t1:30:40,10,0"
+    "\t0|1:40:15,0,25\n"
+    "chr\t81\t.\tG\tA\t50\t.\t.\tGT:GQ:PL\t0|1:30:3,0,3\t1:30:40,10,0"
+    "\t1|1:9:40,12,0\n"
+    "chr\t91\t.\tA\tAC\t50\t.\t.\tGT:GQ:PL\t0|1:30:3,0,3\t1:30:40,10,0"
+    "\t1|1:9:40,12,0\n"
+    "chr\t101\t.\tT\tG\t50\t.\t.\tGT:GQ:PP"
+    "\t0|1:30:12,0,18,30,40,50,60,70,80,90"
+    "\t1:30:30,6,0,20,40,50,60,70,80,90"
+    "\t0|0:8:0,20,60,30,40,50,60,70,80,90\n"
+    "chr\t111\t.\tC\t.\t50\t.\t.\tGT:GQ\t0|0:30\t0:30\t0/0:40\n";
+
+
+// Returns the names, positions, columns and (optionally) base probabilities
+// of sites, one site per line
+static string describe_sites(const Sites &sites, bool probs)
+{
+    string text;
+    for (unsigned int i=0; i<sites.names.size(); i++)
+        text += (i > 0 ? " " : "") + sites.names[i];
+    text += "\n";
+    for (int i=0; i<sites.get_num_sites(); i++) {
+        char buf[100];
+        snprintf(buf, sizeof(buf), "%d %s", sites.positions[i],
+                 sites.cols[i]);
+        text += buf;
+        for (unsigned int j=0; probs && j<sites.base_probs.at(i).size(); j++) {
+            const double *p = sites.base_probs[i][j].prob;
+            snprintf(buf, sizeof(buf), " %g,%g,%g,%g", p[0], p[1], p[2], p[3]);
+            text += buf;
+        }
+        text += "\n";
+    }
+    return text;
+}
+
+
+// Writes 'text' to a VCF file and reads it back into 'sites'
+static bool read_vcf_text(const char *text, Sites *sites, bool probs,
+                          bool add_ref,
+                          const set<string> &keep_inds=set<string>())
+{
+    const string filename = testing::TempDir() + "argweaver_vcf_test.vcf";
+    FILE *out = fopen(filename.c_str(), "w");
+    if (out == NULL)
+        return false;
+    fputs(text, out);
+    fclose(out);
+
+    FILE *infile = fopen(filename.c_str(), "r");
+    bool ok = read_vcf(infile, sites, 10, "GQ<5", probs, 0.8, add_ref,
+                       keep_inds);
+    fclose(infile);
+    unlink(filename.c_str());
+    return ok;
+}
+
+
+// The VCF parser should give the same sites, base probabilities and errors
+// as the parser that split each record into strings, whose output is
+// listed here.
+TEST(SequencesTest, test_read_vcf_expected)
+{
+    const string expected_probs =
+        "s0_1 s0_2 s1 s2_1 s2_2\n"
+        "10 ACACC 0.990991,0.00900901,0,0 0.0900901,0.90991,0,0"
+        " 0.999909,9.09008e-05,0,0 0.0108803,0.98912,0,0"
+        " 0.00098912,0.999011,0,0\n"
+        "30 NNNNN 1,1,1,1 1,1,1,1 1,1,1,1 1,1,1,1 1,1,1,1\n"
+        "40 NNNNN 1,1,1,1 1,1,1,1 1,1,1,1 1,1,1,1 1,1,1,1\n"
+        "50 NNCTT 1,1,1,1 1,1,1,1 0,0.909008,0,0.0909917"
+        " 0,9.98991e-06,0,0.99999 0,0.00100898,0,0.998991\n"
+        "60 GAANN 0.999011,0,0.00098912,0 0.0098912,0,0.990109,0"
+        " 0.999909,0,9.09008e-05,0 1,1,1,1 1,1,1,1\n"
+        "70 NNTCT 1,1,1,1 1,1,1,1 0,0.0909917,0,0.909008"
+        " 0,0.996944,0,0.00305598 0,0.0305598,0,0.96944\n"
+        "80 NNAAA 1,1,1,1 1,1,1,1 0.909008,0,0.0909917,0"
+        " 0.940561,0,0.0594394,0 0.999906,0,9.40561e-05,0\n"
+        "100 TGNTT 0.0585217,0.925878,0.0146742,0.000925878"
+        " 0.058419,0.925971,0.0146835,0.000926814 1,1,1,1"
+        " 0.98912,0.00989021,9.89999e-07,0.00098901"
+        " 0.98901,0.009989,1.0978e-05,0.00099001\n"
+        "110 CCCCC 0,1,0,0 0,1,0,0 0,1,0,0 0,1,0,0 0,1,0,0\n";
+    const string expected_ref =
+        "s0_1 s0_2 s1 s2_1 s2_2 REF\n"
+        "10 ACACCA\n"
+        "30 NNNNNG\n"
+        "40 NNNNNC\n"
+        "50 NNCTTT\n"
+        "60 GAANNA\n"
+        "70 NNTCTC\n"
+        "80 NNAAAG\n"
+        "100 TGNTTT\n"
+        "110 CCCCCC\n";
+    const string expected_no_probs =
+        "s0_1 s0_2 s1 s2_1 s2_2\n"
+        "10 ACACC\n"
+        "30 NNNNN\n"
+        "40 NNNNN\n"
+        "50 NNCTT\n"
+        "60 GAANN\n"
+        "70 NTTCT\n"
+        "80 GAAAA\n"
+        "100 TGGTT\n"
+        "110 CCCCC\n";
+    const string expected_keep =
+        "s0_1 s0_2 s2_1 s2_2 REF\n"
+        "10 ACCCA\n"
+        "30 NNNNG\n"
+        "40 NNNNC\n"
+        "50 NNTTT\n"
+        "60 GANNA\n"
+        "70 NTCTC\n"
+        "80 GAAAG\n"
+        "100 TGTTT\n"
+        "110 CCCCC\n";
+
+    set<string> keep_inds;
+    keep_inds.insert("s0");
+    keep_inds.insert("s2");
+    for (int k=0; k<2; k++) {
+        set_vcf_threads(k == 0 ? 0 : 3);
+        Sites sites, sites_ref, sites_no_probs, sites_keep;
+        ASSERT_TRUE(read_vcf_text(SMALL_VCF, &sites, true, false));
+        EXPECT_EQ(describe_sites(sites, true), expected_probs);
+
+        // the reference is added as a certain base
+        ASSERT_TRUE(read_vcf_text(SMALL_VCF, &sites_ref, true, true));
+        EXPECT_EQ(describe_sites(sites_ref, false), expected_ref);
+        for (int i=0; i<sites_ref.get_num_sites(); i++) {
+            for (int j=0; j<5; j++)
+                EXPECT_TRUE(sites_ref.base_probs[i][j].is_equal(
+                                sites.base_probs[i][j], 0.0));
+            EXPECT_TRUE(sites_ref.base_probs[i][5].is_equal(
+                            BaseProbs(sites_ref.cols[i][5]), 0.0));
+        }
+
+        // without base probabilities nothing is masked by min_base_prob
+        ASSERT_TRUE(read_vcf_text(SMALL_VCF, &sites_no_probs, false, false));
+        EXPECT_EQ(describe_sites(sites_no_probs, false), expected_no_probs);
+        EXPECT_EQ(sites_no_probs.base_probs.size(), 0u);
+
+        ASSERT_TRUE(read_vcf_text(SMALL_VCF, &sites_keep, false, true,
+                                  keep_inds));
+        EXPECT_EQ(describe_sites(sites_keep, false), expected_keep);
+    }
+    set_vcf_threads(-1);
+
+    // Keeping only the first of three individuals.  The old parser
+    // misaligned its keep flags once two individuals were excluded and so
+    // also kept s2.
+    keep_inds.clear();
+    keep_inds.insert("s0");
+    Sites sites_keep;
+    ASSERT_TRUE(read_vcf_text(SMALL_VCF, &sites_keep, false, false,
+                              keep_inds));
+    EXPECT_EQ(describe_sites(sites_keep, false),
+              "s0_1 s0_2\n"
+              "10 AC\n"
+              "30 NN\n"
+              "40 NN\n"
+              "50 NN\n"
+              "60 GA\n"
+              "70 NT\n"
+              "80 GA\n"
+              "100 TG\n"
+              "110 CC\n");
+
+    // malformed records are rejected after the sites before them are read
+    const char *bad_records[][2] = {
+        {
+            "chr\t21\t.\tC\tT\t50\t.\t.\tGT:GQ:PL\t0|1:30:10,0,20"
+            "\t0:30:0,10,40\n",
+         "Not enough fields in line 5 of VCF file"},
+        {
+            "chr2\t21\t.\tC\tT\t50\t.\t.\tGT:GQ:PL\t0|1:30:10,0,20"
+            "\t0:30:0,10,40\t1/1:40:30,20,0\n",
+         "VCF file contains multiple chromosomes"},
+        {
+            "chr\tx21\t.\tC\tT\t50\t.\t.\tGT:GQ:PL\t0|1:30:10,0,20"
+            "\t0:30:0,10,40\t1/1:40:30,20,0\n",
+         "Error parsing position field in VCF"},
+        {
+            "chr\t21\t.\tC\tT\t50\t.\t.\tGQ:PL\t30:10,0,20\t30:0,10,40"
+            "\t40:30,20,0\n",
+         "Did not find GT in format field in VCF file line 5"},
+        {
+            "chr\t21\t.\tC\tT\t50\t.\t.\tGT:GQ:PL\t0|2:30:10,0,20"
+            "\t0:30:0,10,40\t1/1:40:30,20,0\n",
+         "Bad GT in field 10,line 5 of VCF"},
+        {
+            "chr\t21\t.\tC\tT\t50\t.\t.\tGT:GQ:PL\t0-1:30:10,0,20"
+            "\t0:30:0,10,40\t1/1:40:30,20,0\n",
+         "genotype middle character not '|' or '/' on line 5"},
+        {
+            "chr\t21\t.\tC\tT\t50\t.\t.\tGT:GQ:PL\t0|1:30:10,0,20"
+            "\t0|1:30:0,10,40\t1/1:40:30,20,0\n",
+         "genotype not length one on line 5 of VCF for haploid sample"},
+        {
+            "chr\t21\t.\tC\tT\t50\t.\t.\tGT:GQ:PL\t0|1:30\t0:30:0,10,40"
+            "\t1/1:40:30,20,0\n",
+         "Field 10 does not match format string on line 5 of VCF file"}
+    };
+    const int nbad = sizeof(bad_records) / sizeof(bad_records[0]);
+    const string header(SMALL_VCF, strstr(SMALL_VCF, "chr\t21") - SMALL_VCF);
+    for (int i=0; i<nbad; i++) {
+        Sites sites;
+        testing::internal::CaptureStderr();
+        EXPECT_FALSE(read_vcf_text((header + bad_records[i][0]).c_str(),
+                                   &sites, true, false)) << i;
+        const string errors = testing::internal::GetCapturedStderr();
+        EXPECT_NE(errors.find(bad_records[i][1]), string::npos) << errors;
+        EXPECT_EQ(sites.get_num_sites(), 1) << i;
+    }
+}
+
+
+// Sites converted to sequences and back should be unchanged, with each
+// alignment kept in one block of memory.
+TEST(SequencesTest, test_site_columns)
+{
+    const int nseqs = 150, seqlen = 20000;
+    Sites sites("chr", 0, seqlen);
+    for (int i=0; i<nseqs; i++) {
+        char name[20];
+        snprintf(name, sizeof(name), "n%d", i);
+        sites.names.push_back(name);
+    }
+    for (int pos=3; pos<seqlen; pos += 7 + pos % 5) {
+        char *col = sites.append(pos);
+        for (int i=0; i<nseqs; i++)
+            col[i] = "ACGTN"[(pos * 31 + i * (pos % 3)) % 5];
+        col[0] = 'C';
+    }
+    const int nsites = sites.get_num_sites();
+    ASSERT_GT(nsites, 2 * 64);
+    EXPECT_EQ(sites.cols[1] - sites.cols[0], nseqs + 1);
+    EXPECT_EQ(int(strlen(sites.cols[nsites - 1])), nseqs);
+
+    Sequences sequences;
+    make_sequences_from_sites(&sites, &sequences, 'A');
+    ASSERT_EQ(sequences.get_num_seqs(), nseqs);
+    EXPECT_EQ(sequences.length(), seqlen);
+    EXPECT_EQ(sequences.seqs[1] - sequences.seqs[0], seqlen + 1);
+    EXPECT_EQ(sequences.names[nseqs - 1], "n149");
+    EXPECT_EQ(sequences.seqs[5][sites.positions[7]], sites.cols[7][5]);
+    EXPECT_EQ(sequences.seqs[5][sites.positions[7] + 1], 'A');
+
+    Sites sites2;
+    make_sites_from_sequences(&sequences, &sites2);
+    ASSERT_EQ(sites2.get_num_sites(), nsites);
+    for (int i=0; i<nsites; i++) {
+        EXPECT_EQ(sites2.positions[i], sites.positions[i]);
+        EXPECT_STREQ(sites2.cols[i], sites.cols[i]);
+    }
+
+    // keeping a subset of sequences drops the sites that become invariant
+    vector<int> keep;
+    keep.push_back(0);
+    keep.push_back(3);
+    sites2.subset(keep);
+    EXPECT_EQ(sites2.get_num_seqs(), 2);
+    for (int i=0; i<sites2.get_num_sites(); i++) {
+        EXPECT_EQ(int(strlen(sites2.cols[i])), 2);
+        EXPECT_TRUE(sites2.cols[i][0] != sites2.cols[i][1] ||
+                    sites2.cols[i][1] == 'N');
+    }
+
+    // column offsets of large alignments should not overflow an int
+    SiteColumns cols;
+    cols.set_width(4999);
+    EXPECT_EQ(cols.offset(1000000), (size_t) 5000000000LL);
+}
+
+
+}  // namespace
@@ -0,0 +1,132 @@
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+
+#include "argweaver/local_tree.h"
+#include "argweaver/smc_binary.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+static bool same_tree(const LocalTree *tree1, const LocalTree *tree2)
+{
+    if (tree1->nnodes != tree2->nnodes || tree1->root != tree2->root)
+        return false;
+    for (int i=0; i<tree1->nnodes; i++) {
+        const LocalNode &a = tree1->nodes[i], &b = tree2->nodes[i];
+        if (a.parent != b.parent || a.child[0] != b.child[0] ||
+            a.child[1] != b.child[1] || a.age != b.age)
+            return false;
+    }
+    return true;
+}
+
+
+// Binary local trees should read back as they were written, whole or by
+// region through the index.
+TEST(SmcBinaryTest, test_smc_binary)
+{
+    TestArg arg;
+    LocalTree tree1, tree2;
+    arg.parse_tree_pair(&tree1, &tree2);
+
+    // a chain of trees from tree1 to tree2 and back
+    vector<Spr> sprs, sprs2;
+    find_spr_path(&tree1, &tree2, sprs);
+    find_spr_path(&tree2, &tree1, sprs2);
+    sprs.insert(sprs.end(), sprs2.begin(), sprs2.end());
+
+    LocalTrees trees;
+    trees.chrom = "chr";
+    trees.start_coord = 100;
+    trees.nnodes = tree1.nnodes;
+    trees.trees.push_back(LocalTreeSpr(new LocalTree(tree1),
+                                       Spr(-1, -1, -1, -1, -1), 10));
+    trees.end_coord = trees.start_coord + 10;
+    for (unsigned int i=0; i<sprs.size(); i++) {
+        const LocalTree *last_tree = trees.back().tree;
+        LocalTree *tree = new LocalTree(*last_tree);
+        apply_spr(tree, sprs[i]);
+        int *mapping = new int [tree->nnodes];
+        for (int j=0; j<tree->nnodes; j++)
+            mapping[j] = j;
+        mapping[last_tree->nodes[sprs[i].recomb_node].parent] = -1;
+        trees.trees.push_back(LocalTreeSpr(tree, sprs[i], 10 + i, mapping));
+        trees.end_coord += 10 + i;
+    }
+    trees.set_default_seqids();
+    ASSERT_TRUE(assert_trees(&trees));
+
+    const char *names[] = {"a", "b", "c", "d", "e"};
+    vector<int> invisible_pos(1, 115);
+    vector<Spr> invisible(1, Spr(2, 0, 2, 1, 0));
+    vector<char> data;
+    write_local_trees_binary(data, &trees, names, arg.times, arg.ntimes,
+                             false, invisible_pos, invisible, 2);
+
+    // read back through a stream
+    const string filename = testing::TempDir() + "argweaver_smc_test.smcb";
+    FILE *out = fopen(filename.c_str(), "w");
+    ASSERT_TRUE(out != NULL);
+    fwrite(&data[0], 1, data.size(), out);
+    fclose(out);
+    LocalTrees trees2;
+    vector<string> seqnames;
+    vector<int> invisible_pos2;
+    vector<Spr> invisible2;
+    FILE *in = fopen(filename.c_str(), "r");
+    ASSERT_TRUE(read_local_trees(in, arg.times, arg.ntimes, &trees2,
+                                 seqnames, &invisible_pos2, &invisible2));
+    fclose(in);
+    EXPECT_EQ(seqnames.size(), 5u);
+    EXPECT_EQ(seqnames[4], "e");
+    EXPECT_EQ(trees2.chrom, "chr");
+    EXPECT_EQ(trees2.start_coord, trees.start_coord);
+    EXPECT_EQ(trees2.end_coord, trees.end_coord);
+    EXPECT_EQ(invisible_pos2, invisible_pos);
+    ASSERT_EQ(invisible2.size(), 1u);
+    EXPECT_EQ(invisible2[0].coal_time, 1);
+    ASSERT_EQ(trees2.get_num_trees(), trees.get_num_trees());
+    for (LocalTrees::iterator it=trees.begin(), it2=trees2.begin();
+         it != trees.end(); ++it, ++it2) {
+        EXPECT_EQ(it2->blocklen, it->blocklen);
+        EXPECT_EQ(it2->spr.recomb_node, it->spr.recomb_node);
+        EXPECT_EQ(it2->spr.coal_node, it->spr.coal_node);
+        EXPECT_EQ(it2->spr.recomb_time, it->spr.recomb_time);
+        EXPECT_TRUE(same_tree(it2->tree, it->tree));
+    }
+    EXPECT_TRUE(assert_trees(&trees2));
+
+    // every region matches the trees it overlaps
+    for (int start=trees.start_coord; start<trees.end_coord; start += 7) {
+        for (int end=start+1; end<=trees.end_coord; end += 11) {
+            LocalTrees region;
+            ASSERT_TRUE(read_local_trees_region(filename.c_str(), arg.times,
+                                                arg.ntimes, start, end,
+                                                &region, seqnames));
+            EXPECT_EQ(region.start_coord, start);
+            EXPECT_EQ(region.end_coord, end);
+            EXPECT_TRUE(region.front().spr.is_null());
+            EXPECT_TRUE(assert_trees(&region));
+            int pos = start;
+            for (LocalTrees::iterator it=region.begin(); it != region.end();
+                 ++it) {
+                int block_start, block_end;
+                LocalTrees::iterator it2 = trees.get_block(
+                    pos, block_start, block_end);
+                EXPECT_TRUE(same_tree(it->tree, it2->tree));
+                pos += it->blocklen;
+            }
+        }
+    }
+
+    EXPECT_FALSE(read_local_trees_binary(&data[0], data.size() - 1,
+                                         arg.times, arg.ntimes, &trees2,
+                                         seqnames));
+    unlink(filename.c_str());
+}
+
+
+}  // namespace
@@ -0,0 +1,304 @@
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include "argweaver/bgzf.h"
+#include "argweaver/tabix.h"
+
+
+namespace argweaver {
+
+// Regions of an indexed file should be served, one after another, from a
+// single reader.
+TEST(TabixTest, test_tabix)
+{
+    const string filename = testing::TempDir() + "argweaver_tabix_test.bed.gz";
+    const char *records[] = {
+        "chr1\t0\t100\ta\n", "chr1\t50\t60\tb\n", "chr1\t150\t300\tc\n",
+        "chr2\t10\t20\td\n"};
+    BgzfWriter writer(0);
+    ASSERT_TRUE(writer.open(filename.c_str()));
+    writer.write("#header\n", 8);
+    const int64_t start = writer.tell();
+    for (int i=0; i<4; i++)
+        writer.write(records[i], strlen(records[i]));
+    const int64_t end = writer.tell();
+    ASSERT_EQ(writer.close(), 0);
+
+    // a minimal index: every record of a sequence in bin 0
+    string index("TBI\1", 4);
+    const int32_t header[] = {2, 0x10000, 1, 2, 3, '#', 0, 10};
+    index.append((const char *) header, sizeof(header));
+    index.append("chr1\0chr2\0", 10);
+    for (int i=0; i<2; i++) {
+        const int32_t bin[] = {1, 0, 1};
+        const int64_t chunk[] = {start, end};
+        const int32_t nintervals = 0;
+        index.append((const char *) bin, sizeof(bin));
+        index.append((const char *) chunk, sizeof(chunk));
+        index.append((const char *) &nintervals, sizeof(nintervals));
+    }
+    gzFile out = gzopen((filename + ".tbi").c_str(), "w");
+    gzwrite(out, index.data(), index.size());
+    gzclose(out);
+
+    TabixReader reader;
+    ASSERT_TRUE(reader.open(filename.c_str()));
+    const char *regions[] = {"chr1:55-60", "chr1:101-150", "chr2", "chr3:1-10"};
+    const char *expected[] = {"#header a b", "#header", "#header d",
+                              "#header"};
+    for (int i=0; i<4; i++) {
+        ASSERT_TRUE(reader.set_region(regions[i]));
+        string line, names;
+        while (reader.read_line(line))
+            names += (names.empty() ? "" : " ") +
+                (line[0] == '#' ? line : line.substr(line.rfind('\t') + 1));
+        EXPECT_EQ(names, expected[i]);
+    }
+
+    TabixStream stream(&reader, filename, "chr1:151-151", "");
+    char line[100];
+    ASSERT_TRUE(fgets(line, sizeof(line), stream.stream) != NULL);
+    ASSERT_TRUE(fgets(line, sizeof(line), stream.stream) != NULL);
+    EXPECT_STREQ(line, records[2]);
+    EXPECT_TRUE(fgets(line, sizeof(line), stream.stream) == NULL);
+    stream.close();
+
+    string chrom;
+    int64_t beg, stop;
+    EXPECT_TRUE(parse_tabix_region("chr1:1,001-2,000", &chrom, &beg, &stop));
+    EXPECT_EQ(chrom, "chr1");
+    EXPECT_EQ(beg, 1000);
+    EXPECT_EQ(stop, 2000);
+    EXPECT_FALSE(parse_tabix_region("chr1:20-10", &chrom, &beg, &stop));
+
+    unlink(filename.c_str());
+    unlink((filename + ".tbi").c_str());
+}
+
+
+// Bin of a 0-based half-open region in the default binning scheme
+// (min_shift 14, depth 5), as in the SAM/tabix specifications
+static unsigned int reg2bin(int64_t beg, int64_t end)
+{
+    end--;
+    int shift = 14;
+    unsigned int first = ((1 << 15) - 1) / 7;
+    for (int level=5; level>0; level--) {
+        if (beg >> shift == end >> shift)
+            return first + (beg >> shift);
+        shift += 3;
+        first -= 1 << (3 * (level - 1));
+    }
+    return 0;
+}
+
+
+// Index of one sequence's records, built as tabix does
+struct TestIndexRef {
+    map<unsigned int, vector<TabixIndex::Chunk> > bins;
+    vector<int64_t> linear;
+
+    void add(int64_t beg, int64_t end, int64_t offset, int64_t offset_end)
+    {
+        vector<TabixIndex::Chunk> &chunks = bins[reg2bin(beg, end)];
+        if (chunks.size() > 0 && chunks.back().second == offset)
+            chunks.back().second = offset_end;
+        else
+            chunks.push_back(TabixIndex::Chunk(offset, offset_end));
+        if (int64_t(linear.size()) <= (end - 1) >> 14)
+            linear.resize(((end - 1) >> 14) + 1, -1);
+        for (int64_t i=(beg >> 14); i<=((end - 1) >> 14); i++)
+            if (linear[i] < 0)
+                linear[i] = offset;
+    }
+
+    void finish()
+    {
+        for (unsigned int i=1; i<linear.size(); i++)
+            if (linear[i] < 0)
+                linear[i] = linear[i-1];
+    }
+
+    // smallest offset of records overlapping the first window of a bin
+    int64_t loffset(unsigned int bin) const
+    {
+        int level = 0;
+        unsigned int first = 0;
+        while (first + (1u << (3 * level)) <= bin)
+            first += 1 << (3 * level++);
+        size_t window = size_t(bin - first) << (3 * (5 - level));
+        return linear[min(window, linear.size() - 1)];
+    }
+};
+
+
+// Write a .tbi or .csi index for a VCF file with the given sequences
+static void write_test_index(const string &filename, bool csi,
+                             const vector<TestIndexRef> &refs)
+{
+    string aux;
+    const int32_t header[] = {2, 1, 2, 0, '#', 0, 10};
+    aux.append((const char *) header, sizeof(header));
+    aux.append("chr1\0chr2\0", 10);
+
+    string index;
+    if (csi) {
+        const int32_t csi_header[] = {14, 5, int32_t(aux.size())};
+        index.append("CSI\1", 4);
+        index.append((const char *) csi_header, sizeof(csi_header));
+        index.append(aux);
+    } else {
+        index.append("TBI\1", 4);
+    }
+    const int32_t nrefs = refs.size();
+    index.append((const char *) &nrefs, sizeof(nrefs));
+    if (!csi)
+        index.append(aux);
+
+    for (unsigned int i=0; i<refs.size(); i++) {
+        const TestIndexRef &ref = refs[i];
+        const int32_t nbins = ref.bins.size();
+        index.append((const char *) &nbins, sizeof(nbins));
+        for (map<unsigned int, vector<TabixIndex::Chunk> >::const_iterator
+                 it=ref.bins.begin(); it != ref.bins.end(); ++it) {
+            const uint32_t bin = it->first;
+            index.append((const char *) &bin, sizeof(bin));
+            if (csi) {
+                const int64_t loffset = ref.loffset(bin);
+                index.append((const char *) &loffset, sizeof(loffset));
+            }
+            const int32_t nchunks = it->second.size();
+            index.append((const char *) &nchunks, sizeof(nchunks));
+            for (int j=0; j<nchunks; j++) {
+                const int64_t chunk[] = {it->second[j].first,
+                                         it->second[j].second};
+                index.append((const char *) chunk, sizeof(chunk));
+            }
+        }
+        if (!csi) {
+            const int32_t nintervals = ref.linear.size();
+            index.append((const char *) &nintervals, sizeof(nintervals));
+            index.append((const char *) &ref.linear[0],
+                         nintervals * sizeof(int64_t));
+        }
+    }
+
+    gzFile out = gzopen((filename + (csi ? ".csi" : ".tbi")).c_str(), "w");
+    gzwrite(out, index.data(), index.size());
+    gzclose(out);
+}
+
+
+// Records of a VCF file over several windows and bins should be found
+// through a full binning index, both as tabix (.tbi, with a linear index)
+// and as CSI (with the smallest offset of each bin).
+TEST(TabixTest, test_tabix_bins)
+{
+    const string filename = testing::TempDir() + "argweaver_tabix_bins.vcf.gz";
+
+    // SNPs every 997 bases, a REF that crosses the window boundary at
+    // 16384 and a long REF in a 128 kb bin, in many BGZF blocks
+    vector<int> positions, ref_lens;
+    for (int pos=1; pos<300000; pos += 997) {
+        if (pos > 16380 && positions.back() < 16380) {
+            positions.push_back(16380);
+            ref_lens.push_back(10);
+        }
+        if (pos > 200001 && positions.back() < 200001) {
+            positions.push_back(200001);
+            ref_lens.push_back(20000);
+        }
+        positions.push_back(pos);
+        ref_lens.push_back(1);
+    }
+    const int nrecords = positions.size();
+
+    BgzfWriter writer(0);
+    ASSERT_TRUE(writer.open(filename.c_str()));
+    writer.write("#CHROM\tPOS\tID\tREF\tALT\n", 24);
+    vector<TestIndexRef> refs(2);
+    vector<int64_t> offsets;
+    for (int i=0; i<nrecords + 2; i++) {
+        const bool chr2 = (i >= nrecords);
+        const int pos = chr2 ? 100 * (i - nrecords + 1) : positions[i];
+        const int ref_len = chr2 ? 1 : ref_lens[i];
+        char prefix[100];
+        snprintf(prefix, sizeof(prefix), "chr%d\t%d\tr%d\t",
+                 chr2 ? 2 : 1, pos, i);
+        const string line = prefix + string(ref_len, 'A') + "\tC\n";
+
+        if (i % 10 == 0) {
+            ASSERT_TRUE(writer.flush_block());
+        }
+        const int64_t offset = writer.tell();
+        writer.write(line.data(), line.size());
+        offsets.push_back(offset);
+        refs[chr2].add(pos - 1, pos - 1 + ref_len, offset, writer.tell());
+    }
+    ASSERT_EQ(writer.close(), 0);
+    refs[0].finish();
+    refs[1].finish();
+    ASSERT_GT(refs[0].bins.size(), 10u);
+    ASSERT_EQ(refs[0].bins.count(reg2bin(16379, 16389)), 1u);
+    ASSERT_EQ(refs[0].bins.count(reg2bin(200000, 220000)), 1u);
+
+    const char *regions[] = {
+        "chr1:16388-16388", "chr1:16385-17000", "chr1:1-1", "chr1:215001-215001",
+        "chr1:150000-150100", "chr1:131000-140000", "chr1:299000-400000",
+        "chr2:150-200", "chr2:300-400"};
+    const int nregions = sizeof(regions) / sizeof(regions[0]);
+
+    for (int csi=0; csi<2; csi++) {
+        write_test_index(filename, csi, refs);
+
+        TabixReader reader;
+        ASSERT_TRUE(reader.open(filename.c_str()));
+        TabixIndex index;
+        ASSERT_TRUE(index.read(filename.c_str()));
+        for (int r=0; r<nregions; r++) {
+            string chrom;
+            int64_t beg, end;
+            ASSERT_TRUE(parse_tabix_region(regions[r], &chrom, &beg, &end));
+
+            // records overlapping the region
+            string expected;
+            for (int i=0; i<nrecords + 2; i++) {
+                const bool chr2 = (i >= nrecords);
+                const int64_t rbeg = chr2 ? 100 * (i - nrecords + 1) - 1 :
+                    positions[i] - 1;
+                const int64_t rend = rbeg + (chr2 ? 1 : ref_lens[i]);
+                if (chrom == (chr2 ? "chr2" : "chr1") &&
+                    rbeg < end && rend > beg)
+                    expected += " r" + to_string(i);
+            }
+
+            ASSERT_TRUE(reader.set_region(regions[r], false));
+            string line, names;
+            while (reader.read_line(line)) {
+                size_t start = line.find('\t', line.find('\t') + 1) + 1;
+                names += " " + line.substr(start, line.find('\t', start) -
+                                           start);
+            }
+            EXPECT_EQ(names, expected) << regions[r] << " csi=" << csi;
+
+            // only the records near the region are read
+            vector<TabixIndex::Chunk> chunks;
+            index.query(chrom, beg, end, chunks);
+            int nread = 0;
+            for (int i=0; i<nrecords + 2; i++)
+                for (unsigned int j=0; j<chunks.size(); j++)
+                    if (offsets[i] >= chunks[j].first &&
+                        offsets[i] < chunks[j].second)
+                        nread++;
+            EXPECT_LT(nread, 40) << regions[r] << " csi=" << csi;
+        }
+        unlink((filename + (csi ? ".csi" : ".tbi")).c_str());
+    }
+
+    unlink(filename.c_str());
+}
+
+
+}  // namespace
@@ -0,0 +1,92 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sequences.h"
+#include "argweaver/total_prob.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+// The ARG prior computed from cached coalescent statistics should follow
+// a full recomputation when population sizes change, and the consistency
+// check should notice when the ARG changes under the statistics.
+TEST(TotalProbTest, test_arg_prior_stats)
+{
+    TestArg arg;
+    ArgModel &model = arg.model;
+    LocalTrees trees;
+    arg.make_trees(&trees);
+
+    ArgPriorStats stats;
+    EXPECT_EQ(stats.collect(&model, &trees), calc_arg_prior(&model, &trees));
+
+    for (int i=0; i<2*model.ntimes-1; i++)
+        model.popsizes[0][i] = 5e3 * (1 + i % 3);
+    const double full = calc_arg_prior(&model, &trees);
+    EXPECT_NEAR(stats.calc_log_prior(&model), full, 1e-9 * fabs(full));
+    EXPECT_TRUE(stats.check(&model, &trees));
+
+    // statistics of a different ARG fail the consistency check
+    trees.front().blocklen += 100000;
+    trees.end_coord += 100000;
+    EXPECT_FALSE(stats.check(&model, &trees));
+}
+
+
+// The ARG probability cache should give the same totals as the full
+// functions, reuse unchanged blocks and notice switched alleles and
+// invisible recombinations.
+TEST(TotalProbTest, test_arg_prob_cache)
+{
+    TestArg arg;
+    const ArgModel &model = arg.model;
+    LocalTrees trees;
+    arg.make_trees(&trees);
+
+    const int nseqs = 5, seqlen = 100;
+    char data[nseqs][seqlen];
+    char *seqs[nseqs];
+    for (int j=0; j<nseqs; j++) {
+        for (int i=0; i<seqlen; i++)
+            data[j][i] = "ACGT"[(i % 7 == 0) ? (i + j) % 4 : 0];
+        seqs[j] = data[j];
+    }
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    ArgProbCache cache;
+    double prior, prior2, lnl;
+    cache.calc(&model, &sequences, &trees, NULL, NULL, &prior, &prior2, &lnl);
+    EXPECT_EQ(prior, calc_arg_prior(&model, &trees));
+    EXPECT_EQ(prior2, calc_arg_prior_recomb_integrate(&model, &trees, NULL,
+                                                      NULL, NULL));
+    EXPECT_EQ(lnl, calc_arg_likelihood(&model, &sequences, &trees));
+    EXPECT_EQ(cache.nmisses, 2);
+
+    double lnl2;
+    cache.calc(&model, &sequences, &trees, NULL, NULL, &prior, &prior2, &lnl2);
+    EXPECT_EQ(cache.nhits, 2);
+    EXPECT_EQ(lnl2, lnl);
+
+    sequences.switch_alleles(7, 0, 2);
+    cache.calc(&model, &sequences, &trees, NULL, NULL, &prior, &prior2, &lnl2);
+    EXPECT_EQ(cache.nmisses, 4);
+    EXPECT_EQ(lnl2, calc_arg_likelihood(&model, &sequences, &trees));
+    EXPECT_NE(lnl2, lnl);
+
+    // invisible recombinations only change the prior of their block
+    vector<int> invis_pos(1, 70);
+    vector<Spr> invis(1, Spr(0, 0, 0, 1, 0));
+    cache.calc(&model, &sequences, &trees, NULL, NULL, &prior, &prior2, &lnl2,
+               invis_pos, invis);
+    EXPECT_EQ(prior, calc_arg_prior(&model, &trees, NULL, NULL, -1, -1,
+                                    invis_pos, invis));
+    EXPECT_NE(prior, calc_arg_prior(&model, &trees));
+    EXPECT_EQ(cache.nhits, 3);
+    EXPECT_EQ(cache.nmisses, 5);
+}
+
+
+}  // namespace
@@ -0,0 +1,128 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/states.h"
+#include "argweaver/trans.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+// The compressed switch matrix should hold exactly the non-zero
+// transitions, with deterministic rows before source rows.
+TEST(TransTest, test_switch_compress)
+{
+    const int nstates1 = 5, nstates2 = 3;
+    TransMatrixSwitch matrix(nstates1, nstates2, 1);
+    for (int i=0; i<nstates1; i++)
+        matrix.recombsrc[i] = matrix.recoalsrc[i] = -1;
+    matrix.init_probs();
+    const int determ[nstates1] = {1, -1, 0, -1, 2};
+    for (int i=0; i<nstates1; i++) {
+        matrix.determ[i] = determ[i];
+        matrix.determprob[i] = .1 * (i + 1);
+    }
+    matrix.recoalsrc[1] = 0;
+    matrix.recombsrc[3] = 0;
+    matrix.set(1, 0, .3);
+    matrix.set(1, 2, .6);
+    matrix.set(3, 1, .9);
+    matrix.compress();
+
+    const int row_state[] = {0, 2, 4, 3, 1};
+    ASSERT_EQ(matrix.row_state.size(), 5u);
+    for (int r=0; r<5; r++)
+        EXPECT_EQ(matrix.row_state[r], row_state[r]);
+    EXPECT_EQ(matrix.row_cols.size(), 6u);
+
+    for (int k=0; k<nstates2; k++) {
+        int j = 0;
+        for (int e=matrix.col_start[k]; e<matrix.col_start[k+1]; e++) {
+            const int src = matrix.col_rows[e];
+            for (; j < src; j++)
+                EXPECT_EQ(matrix.get(j, k), 0.0);
+            EXPECT_EQ(matrix.get(j, k), matrix.col_vals[e]);
+            j++;
+        }
+        for (; j < nstates1; j++)
+            EXPECT_EQ(matrix.get(j, k), 0.0);
+    }
+}
+
+
+// Memoized transition matrices should equal freshly computed ones, for
+// both SMC and SMC'.
+TEST(TransTest, test_transmat_memo)
+{
+    for (int smc_prime=0; smc_prime<2; smc_prime++) {
+        TestArg arg;
+        ArgModel &model = arg.model;
+        const LocalTree &tree = arg.tree;
+        model.smc_prime = smc_prime;
+
+        States states;
+        get_coal_states(&tree, model.ntimes, states);
+        const int nstates = states.size();
+        LineageCounts lineages(model.ntimes, 1);
+        lineages.count(&tree, NULL);
+
+        TransMatrix matrix(&model, nstates);
+        matrix.calc_transition_probs(&tree, &model, states, &lineages);
+
+        TransMatrixMemo memo;
+        for (int i=0; i<2; i++) {
+            TransMatrix *matrix2 = memo.calc_transition_probs(
+                &tree, &model, states, &lineages);
+            for (int j=0; j<nstates; j++)
+                for (int k=0; k<nstates; k++)
+                    EXPECT_EQ(matrix.get(&tree, states, j, k),
+                              matrix2->get(&tree, states, j, k));
+            delete matrix2;
+        }
+        EXPECT_EQ(memo.nhits, 1);
+        EXPECT_EQ(memo.nmisses, 1);
+
+        // a different recombination rate needs a new matrix
+        model.rho *= 2;
+        delete memo.calc_transition_probs(&tree, &model, states, &lineages);
+        EXPECT_EQ(memo.nmisses, 2);
+    }
+}
+
+
+// Updating the transition matrix of one tree to the tree after an SPR
+// should give the same matrix as a full rebuild.
+TEST(TransTest, test_transmat_update)
+{
+    TestArg arg;
+    const ArgModel &model = arg.model;
+    const LocalTree &tree = arg.tree;
+    LocalTree tree2(tree);
+    apply_spr(&tree2, arg.spr);
+
+    States states, states2;
+    get_coal_states(&tree, model.ntimes, states);
+    get_coal_states(&tree2, model.ntimes, states2);
+    LineageCounts lineages(model.ntimes, 1), lineages2(model.ntimes, 1);
+    lineages.count(&tree, NULL);
+    lineages2.count(&tree2, NULL);
+
+    TransMatrix matrix(&model, states.size());
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+    TransMatrix full(&model, states2.size());
+    full.calc_transition_probs(&tree2, &model, states2, &lineages2);
+
+    TransMatrix updated(&model, states2.size());
+    updated.copy(matrix);
+    updated.update_transition_probs(&tree2, &model, states2, &lineages2);
+
+    for (unsigned int i=0; i<states2.size(); i++)
+        for (unsigned int j=0; j<states2.size(); j++)
+            EXPECT_EQ(full.get(&tree2, states2, i, j),
+                      updated.get(&tree2, states2, i, j));
+}
+
+
+}  // namespace
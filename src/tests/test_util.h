@@ -0,0 +1,72 @@
+#ifndef ARGWEAVER_TEST_UTIL_H
+#define ARGWEAVER_TEST_UTIL_H
+
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+
+
+namespace argweaver {
+
+// A small ARG shared by the unit tests: a model on five time points, a tree
+// with five leaves and an SPR on that tree.
+class TestArg
+{
+public:
+    TestArg() :
+        times{0, 10, 20, 30, 40},
+        model(ntimes, times, NULL, 1e-9, 2.5e-9),
+        spr(4, 1, 5, 2, 0)
+    {
+        model.set_popsizes(1e4);
+        parse_tree("((0,1)5[&&NHX:age=10],((2,3)6[&&NHX:age=20],4)7"
+                   "[&&NHX:age=20])8[&&NHX:age=30]", &tree);
+    }
+
+    // Parse a tree in newick format on the test time points.
+    void parse_tree(const char *newick, LocalTree *tree2) const
+    {
+        parse_local_tree(newick, tree2, times, ntimes);
+    }
+
+    // Parse two trees of the same leaves that are several SPRs apart.
+    void parse_tree_pair(LocalTree *tree1, LocalTree *tree2) const
+    {
+        parse_tree("((0,1)5[&&NHX:age=10],((2,3)6[&&NHX:age=20],4)7"
+                   "[&&NHX:age=30])8[&&NHX:age=40]", tree1);
+        parse_tree("(((0,4)5[&&NHX:age=10],2)6[&&NHX:age=30],(1,3)7"
+                   "[&&NHX:age=20])8[&&NHX:age=40]", tree2);
+    }
+
+    // Make an ARG of two 50 base blocks: 'tree', then the tree after 'spr'.
+    // The second block gets an identity node mapping if 'mapping' is true.
+    void make_trees(LocalTrees *trees, bool mapping=false) const
+    {
+        LocalTree *tree1 = new LocalTree(tree);
+        LocalTree *tree2 = new LocalTree(tree);
+        apply_spr(tree2, spr);
+        int *node_mapping = NULL;
+        if (mapping) {
+            node_mapping = new int [tree.capacity];
+            for (int i=0; i<tree.nnodes; i++)
+                node_mapping[i] = i;
+        }
+
+        trees->start_coord = 0;
+        trees->end_coord = 100;
+        trees->nnodes = tree.nnodes;
+        trees->trees.push_back(
+            LocalTreeSpr(tree1, Spr(-1, -1, -1, -1, -1), 50));
+        trees->trees.push_back(LocalTreeSpr(tree2, spr, 50, node_mapping));
+        trees->set_default_seqids();
+    }
+
+    static const int ntimes = 5;
+    double times[ntimes];
+    ArgModel model;
+    LocalTree tree;
+    Spr spr;
+};
+
+}  // namespace argweaver
+
+#endif // ARGWEAVER_TEST_UTIL_H